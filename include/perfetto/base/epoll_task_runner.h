@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_PERFETTO_BASE_EPOLL_TASK_RUNNER_H_
+#define INCLUDE_PERFETTO_BASE_EPOLL_TASK_RUNNER_H_
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/event.h"
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/base/task_runner.h"
+#include "perfetto/base/thread_checker.h"
+#include "perfetto/base/time.h"
+#include "perfetto/base/timer_wheel.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace perfetto {
+namespace base {
+
+// Runs a task runner on the current thread, like UnixTaskRunner, but uses
+// epoll(7) (Linux and Android only) to watch file descriptors, so that adding,
+// removing and dispatching a watch costs O(1) regardless of how many fds are
+// being watched. Meant for processes that watch many fds, e.g. the tracing
+// service with one socket per connected producer.
+// Other differences from UnixTaskRunner:
+// - Immediate tasks are kept in a ring buffer that is reused once grown, rather
+//   than a std::deque, which allocates and frees blocks as tasks come and go.
+// - Each turn runs all the immediate tasks that were pending when it started,
+//   instead of only one, with a single epoll_wait() in between turns. File
+//   descriptor watches are still interleaved with tasks and are not starved.
+// - A watch must be removed before its fd is closed. epoll only drops a closed
+//   fd on its own if no other fd refers to the same file, and would otherwise
+//   keep reporting it, possibly under the number of a newer fd.
+class EpollTaskRunner : public TaskRunner {
+ public:
+  EpollTaskRunner();
+  ~EpollTaskRunner() override;
+
+  // Start executing tasks. Doesn't return until Quit() is called. Run() may be
+  // called multiple times on the same task runner.
+  void Run();
+  void Quit();
+
+  // Checks whether there are any pending immediate tasks to run. Note that
+  // delayed tasks don't count even if they are due to run.
+  bool IsIdleForTesting();
+
+  // TaskRunner implementation:
+  void PostTask(std::function<void()>) override;
+  void PostDelayedTask(std::function<void()>, uint32_t delay_ms) override;
+  DelayedTaskId PostCancelableDelayedTask(std::function<void()>,
+                                          uint32_t delay_ms) override;
+  void CancelDelayedTask(DelayedTaskId) override;
+  void AddFileDescriptorWatch(int fd, std::function<void()>) override;
+  void RemoveFileDescriptorWatch(int fd) override;
+
+ private:
+  // A FIFO of tasks backed by a power-of-two ring buffer. Pushing and popping
+  // don't allocate, except for growing the buffer when it is full.
+  class TaskQueue {
+   public:
+    TaskQueue();
+    ~TaskQueue();
+
+    bool empty() const { return begin_ == end_; }
+    size_t size() const { return end_ - begin_; }
+    void push_back(std::function<void()>);
+    std::function<void()> pop_front();
+
+   private:
+    void Grow();
+
+    std::unique_ptr<std::function<void()>[]> tasks_;
+    size_t capacity_ = 0;  // Always a power of two.
+    size_t begin_ = 0;     // Free running, wraps with & (capacity_ - 1).
+    size_t end_ = 0;
+  };
+
+  void WakeUp();
+
+  int GetDelayMsToNextTaskLocked() const;
+  void RunImmediateAndDelayedTasks();
+  void PostFileDescriptorWatches(const struct epoll_event*, int num_events);
+  void RunFileDescriptorWatch(int fd);
+
+  ThreadChecker thread_checker_;
+
+  ScopedFile epoll_fd_;
+
+  // An eventfd(2) used to waking up the task runner when a new task is posted.
+  Event event_;
+
+  // --- Begin lock-protected members ---
+
+  std::mutex lock_;
+
+  TaskQueue immediate_tasks_;
+  TimerWheel delayed_tasks_;
+  bool quit_ = false;
+
+  // True while Run() is (about to be) blocked in epoll_wait(). Tasks posted
+  // at any other time are picked up by the next turn without waking it up.
+  bool polling_ = false;
+
+  // Shared so that RunFileDescriptorWatch() can hold on to the callback, even
+  // if the watch is removed while running it, without copying it.
+  std::unordered_map<int, std::shared_ptr<std::function<void()>>> watch_tasks_;
+
+  // --- End lock-protected members ---
+};
+
+}  // namespace base
+}  // namespace perfetto
+
+#endif  // INCLUDE_PERFETTO_BASE_EPOLL_TASK_RUNNER_H_
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_PERFETTO_BASE_FLAT_HASH_MAP_H_
+#define INCLUDE_PERFETTO_BASE_FLAT_HASH_MAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "perfetto/base/logging.h"
+
+namespace perfetto {
+namespace base {
+
+// Hash map that stores the keys and values in a single array, with open
+// addressing and linear probing. Compared to std::map and std::unordered_map,
+// this saves a heap allocation and the pointers of a node per entry, and
+// lookups touch fewer cache lines.
+//
+// The values move when the map grows, so pointers to them are only valid up to
+// the next Emplace. Store a std::unique_ptr as the value where the address of
+// the value needs to be stable.
+template <typename Key,
+          typename Value,
+          typename Hasher = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>>
+class FlatHashMap {
+ public:
+  FlatHashMap() = default;
+  ~FlatHashMap() { Clear(); }
+
+  FlatHashMap(const FlatHashMap&) = delete;
+  FlatHashMap& operator=(const FlatHashMap&) = delete;
+
+  FlatHashMap(FlatHashMap&& other) noexcept { *this = std::move(other); }
+  FlatHashMap& operator=(FlatHashMap&& other) noexcept {
+    Clear();
+    tags_ = std::move(other.tags_);
+    slots_ = std::move(other.slots_);
+    capacity_ = other.capacity_;
+    size_ = other.size_;
+    tombstones_ = other.tombstones_;
+    shift_ = other.shift_;
+    other.capacity_ = other.size_ = other.tombstones_ = 0;
+    return *this;
+  }
+
+  Value* Find(const Key& key) {
+    size_t idx = FindIndex(key);
+    return idx == capacity_ ? nullptr : &slot(idx)->value;
+  }
+
+  const Value* Find(const Key& key) const {
+    return const_cast<FlatHashMap*>(this)->Find(key);
+  }
+
+  // Constructs the value from |args| if |key| is not in the map yet. Returns
+  // the value for |key|, and whether it was inserted.
+  template <typename... Args>
+  std::pair<Value*, bool> Emplace(const Key& key, Args&&... args) {
+    size_t idx = FindIndex(key);
+    if (idx != capacity_)
+      return {&slot(idx)->value, false};
+
+    // Grows the map if it is more than 3/4 full. If it is mostly tombstones,
+    // rehashing them away is enough.
+    if ((size_ + tombstones_ + 1) * 4 > capacity_ * 3)
+      Rehash((size_ + 1) * 8 > capacity_ * 5 ? capacity_ * 2 : capacity_);
+
+    for (idx = Bucket(key);; idx = (idx + 1) & (capacity_ - 1)) {
+      if (tags_[idx] != kOccupied)
+        break;
+    }
+    if (tags_[idx] == kTombstone)
+      tombstones_--;
+    tags_[idx] = kOccupied;
+    size_++;
+    Slot* s = new (&slots_[idx]) Slot(key, std::forward<Args>(args)...);
+    return {&s->value, true};
+  }
+
+  bool Erase(const Key& key) {
+    size_t idx = FindIndex(key);
+    if (idx == capacity_)
+      return false;
+    slot(idx)->~Slot();
+    size_--;
+    // A probe sequence that reaches this slot would stop at the next one if it
+    // is free, so this one does not need to be kept as a tombstone.
+    if (tags_[(idx + 1) & (capacity_ - 1)] == kFree) {
+      tags_[idx] = kFree;
+    } else {
+      tags_[idx] = kTombstone;
+      tombstones_++;
+    }
+    return true;
+  }
+
+  void Clear() {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (tags_[i] == kOccupied)
+        slot(i)->~Slot();
+      tags_[i] = kFree;
+    }
+    size_ = 0;
+    tombstones_ = 0;
+  }
+
+  // Calls |fn(const Key&, Value&)| for every entry, in no particular order.
+  // |fn| must not modify the map.
+  template <typename Fn>
+  void ForEach(Fn fn) {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (tags_[i] == kOccupied)
+        fn(static_cast<const Key&>(slot(i)->key), slot(i)->value);
+    }
+  }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+
+ private:
+  static constexpr size_t kMinCapacity = 16;
+
+  enum Tag : uint8_t { kFree = 0, kTombstone, kOccupied };
+
+  struct Slot {
+    template <typename... Args>
+    Slot(const Key& k, Args&&... args)
+        : key(k), value(std::forward<Args>(args)...) {}
+
+    Key key;
+    Value value;
+  };
+  using SlotStorage =
+      typename std::aligned_storage<sizeof(Slot), alignof(Slot)>::type;
+
+  Slot* slot(size_t idx) { return reinterpret_cast<Slot*>(&slots_[idx]); }
+
+  // Fibonacci hashing, so that hashes that only differ in the high bits (e.g.
+  // std::hash of aligned pointers) still spread over the whole table.
+  size_t Bucket(const Key& key) const {
+    uint64_t hash = static_cast<uint64_t>(Hasher()(key));
+    return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> shift_);
+  }
+
+  // Returns |capacity_| if |key| is not in the map.
+  size_t FindIndex(const Key& key) {
+    if (capacity_ == 0)
+      return capacity_;
+    for (size_t idx = Bucket(key);; idx = (idx + 1) & (capacity_ - 1)) {
+      if (tags_[idx] == kFree)
+        return capacity_;
+      if (tags_[idx] == kOccupied && KeyEqual()(slot(idx)->key, key))
+        return idx;
+    }
+  }
+
+  void Rehash(size_t new_capacity) {
+    if (new_capacity < kMinCapacity)
+      new_capacity = kMinCapacity;
+    PERFETTO_DCHECK((new_capacity & (new_capacity - 1)) == 0);
+    std::unique_ptr<uint8_t[]> old_tags = std::move(tags_);
+    std::unique_ptr<SlotStorage[]> old_slots = std::move(slots_);
+    const size_t old_capacity = capacity_;
+
+    tags_.reset(new uint8_t[new_capacity]());
+    slots_.reset(new SlotStorage[new_capacity]);
+    capacity_ = new_capacity;
+    tombstones_ = 0;
+    shift_ = 64;
+    for (size_t c = new_capacity; c > 1; c >>= 1)
+      shift_--;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_tags[i] != kOccupied)
+        continue;
+      Slot* old_slot = reinterpret_cast<Slot*>(&old_slots[i]);
+      size_t idx = Bucket(old_slot->key);
+      while (tags_[idx] == kOccupied)
+        idx = (idx + 1) & (capacity_ - 1);
+      tags_[idx] = kOccupied;
+      new (&slots_[idx]) Slot(std::move(*old_slot));
+      old_slot->~Slot();
+    }
+  }
+
+  std::unique_ptr<uint8_t[]> tags_;
+  std::unique_ptr<SlotStorage[]> slots_;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  size_t tombstones_ = 0;
+  uint32_t shift_ = 64;
+};
+
+}  // namespace base
+}  // namespace perfetto
+
+#endif  // INCLUDE_PERFETTO_BASE_FLAT_HASH_MAP_H_
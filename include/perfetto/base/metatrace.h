@@ -17,51 +17,132 @@
 #ifndef INCLUDE_PERFETTO_BASE_METATRACE_H_
 #define INCLUDE_PERFETTO_BASE_METATRACE_H_
 
-#include <string.h>
+#include <stdint.h>
 
-#include <string>
+#include <atomic>
+#include <vector>
 
-#include "perfetto/base/logging.h"
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/time.h"
 #include "perfetto/base/utils.h"
 
+// Self-tracing of traced and traced_probes. Events are fixed-size records
+// written into a per-thread ring buffer, without locks or allocations. The
+// rings are drained periodically into the trace (as PerfettoMetatrace packets)
+// by the "perfetto.metatrace" data source. When that is not enabled the cost of
+// an event is a relaxed load and a branch.
+//
+// The names of the events are interned: the records only store the EventId,
+// the names come from the table below, which the trace processor shares.
+// Add new events at the end, the ids must stay stable across releases.
+#define PERFETTO_METATRACE_EVENTS(X)                                           \
+  X(FTRACE_CPU_READER_READ_NONBLOCK, "ftrace_cpu_reader_read_nonblock")        \
+  X(FTRACE_CPU_READER_READ_BLOCK, "ftrace_cpu_reader_read_block")              \
+  X(FTRACE_CPU_READER_SPLICE_NONBLOCK, "ftrace_cpu_reader_splice_nonblock")    \
+  X(FTRACE_CPU_READER_SPLICE_BLOCK, "ftrace_cpu_reader_splice_block")          \
+  X(FTRACE_CPU_READER_WAIT_CMD, "ftrace_cpu_reader_wait_cmd")                  \
+  X(FTRACE_CPU_READER_RUN_CYCLE, "ftrace_cpu_reader_run_cycle")                \
+  X(FTRACE_CPU_READER_FLUSH, "ftrace_cpu_reader_flush")                        \
+  X(FTRACE_CPU_READER_DRAIN, "ftrace_cpu_reader_drain")                        \
+  X(FTRACE_ON_CPU_READER_READ, "ftrace_on_cpu_reader_read")                    \
+  X(FTRACE_DRAIN_CPUS, "ftrace_drain_cpus")                                    \
+  X(FTRACE_UNBLOCK_READERS, "ftrace_unblock_readers")                          \
+  X(PS_WRITE_ALL_PROCESSES, "ps_write_all_processes")                          \
+  X(PS_ON_PIDS, "ps_on_pids")                                                  \
+  X(PS_WRITE_ALL_PROCESS_STATS, "ps_write_all_process_stats")                  \
+  X(SYS_STATS_READ, "sys_stats_read")                                          \
+  X(TRACING_SERVICE_COMMIT_DATA, "tracing_service_commit_data")                \
+  X(TRACING_SERVICE_READ_BUFFERS, "tracing_service_read_buffers")
+
 namespace perfetto {
 namespace base {
+namespace metatrace {
+
+enum EventId : uint16_t {
+#define PERFETTO_METATRACE_EVENT_ID(id, name) id,
+  PERFETTO_METATRACE_EVENTS(PERFETTO_METATRACE_EVENT_ID)
+#undef PERFETTO_METATRACE_EVENT_ID
+      EVENTS_MAX
+};
+
+struct Record {
+  uint64_t timestamp_ns;  // CLOCK_BOOTTIME, at the begin of the event.
+  uint32_t duration_ns;
+  uint32_t thread_id;
+  uint32_t arg;
+  uint16_t event_id;
+};
+
+// Records are written only while this is set, see Enable().
+extern std::atomic<bool> g_enabled;
+
+inline bool IsEnabled() {
+  return g_enabled.load(std::memory_order_relaxed);
+}
+
+// Enables the recording of the events for the calling tracing session. Calls
+// nest, recording stops on the Disable() matching the first Enable(). The
+// events recorded before the first Enable() are discarded.
+void Enable();
+void Disable();
+
+// Moves the events recorded by all the threads since the previous call into
+// |records|, in no particular order. Returns the number of events that were
+// overwritten before they could be read, because a ring was full.
+uint64_t ReadEvents(std::vector<Record>* records);
+
+// Returns the name of the event, nullptr if |event_id| is unknown.
+const char* GetEventName(uint32_t event_id);
 
-class MetaTrace {
+// Appends an event, that began at |begin_ns| and ends now, to the ring of the
+// calling thread. Lock-free, it can be called on any thread.
+void WriteEvent(EventId, uint32_t arg, uint64_t begin_ns);
+
+// Records an event for its lifetime.
+class ScopedEvent {
  public:
-  MetaTrace(const char* evt_name, size_t cpu) : evt_name_(evt_name), cpu_(cpu) {
-    WriteEvent('B', evt_name, cpu);
+  ScopedEvent(EventId event_id, uint32_t arg) : event_id_(event_id), arg_(arg) {
+    if (PERFETTO_LIKELY(!IsEnabled()))
+      return;
+    begin_ns_ = static_cast<uint64_t>(GetBootTimeNs().count());
   }
 
-  MetaTrace(const std::string& str, size_t cpu)
-      : str_copy_(str), evt_name_(str_copy_.c_str()), cpu_(cpu) {
-    WriteEvent('B', evt_name_, cpu);
+  ~ScopedEvent() {
+    if (PERFETTO_UNLIKELY(begin_ns_))
+      WriteEvent(event_id_, arg_, begin_ns_);
   }
 
-  ~MetaTrace() { WriteEvent('E', evt_name_, cpu_); }
-
  private:
-  MetaTrace(const MetaTrace&) = delete;
-  MetaTrace& operator=(const MetaTrace&) = delete;
-
-  void WriteEvent(char type, const char* evt_name, size_t cpu);
+  ScopedEvent(const ScopedEvent&) = delete;
+  ScopedEvent& operator=(const ScopedEvent&) = delete;
 
-  std::string str_copy_;
-  const char* const evt_name_;
-  const size_t cpu_;
+  const EventId event_id_;
+  const uint32_t arg_;
+  uint64_t begin_ns_ = 0;  // 0 if not recording.
 };
 
+}  // namespace metatrace
+}  // namespace base
+}  // namespace perfetto
+
 #define PERFETTO_METATRACE_UID2(a, b) a##b
 #define PERFETTO_METATRACE_UID(x) PERFETTO_METATRACE_UID2(metatrace_, x)
-#if PERFETTO_DCHECK_IS_ON() && !PERFETTO_BUILDFLAG(PERFETTO_CHROMIUM_BUILD)
 
-#define PERFETTO_METATRACE(...) \
-  ::perfetto::base::MetaTrace PERFETTO_METATRACE_UID(__COUNTER__)(__VA_ARGS__)
+// Usage: PERFETTO_METATRACE(FTRACE_DRAIN_CPUS, cpu). Use
+// PERFETTO_METATRACE_DYNAMIC() when the EventId is computed at runtime.
+#if !PERFETTO_BUILDFLAG(PERFETTO_CHROMIUM_BUILD)
+#define PERFETTO_METATRACE(event_id, arg)                                \
+  ::perfetto::base::metatrace::ScopedEvent PERFETTO_METATRACE_UID(       \
+      __COUNTER__)(::perfetto::base::metatrace::event_id,                \
+                   static_cast<uint32_t>(arg))
+#define PERFETTO_METATRACE_DYNAMIC(event_id_expr, arg)             \
+  ::perfetto::base::metatrace::ScopedEvent PERFETTO_METATRACE_UID( \
+      __COUNTER__)(event_id_expr, static_cast<uint32_t>(arg))
 #else
-#define PERFETTO_METATRACE(...) ::perfetto::base::ignore_result(__VA_ARGS__)
+#define PERFETTO_METATRACE(event_id, arg) \
+  ::perfetto::base::ignore_result(arg)
+#define PERFETTO_METATRACE_DYNAMIC(event_id_expr, arg) \
+  ::perfetto::base::ignore_result(event_id_expr, arg)
 #endif
 
-}  // namespace base
-}  // namespace perfetto
-
 #endif  // INCLUDE_PERFETTO_BASE_METATRACE_H_
@@ -17,7 +17,10 @@
 #ifndef INCLUDE_PERFETTO_BASE_TASK_RUNNER_H_
 #define INCLUDE_PERFETTO_BASE_TASK_RUNNER_H_
 
+#include <stdint.h>
+
 #include <functional>
+#include <utility>
 
 #include "perfetto/base/build_config.h"
 #include "perfetto/base/export.h"
@@ -54,6 +57,26 @@ class PERFETTO_EXPORT TaskRunner {
   // called from any thread.
   virtual void PostDelayedTask(std::function<void()>, uint32_t delay_ms) = 0;
 
+  // Identifies a task posted with PostCancelableDelayedTask(). 0 is returned
+  // by the task runners that don't support cancellation.
+  using DelayedTaskId = uint64_t;
+
+  // Like PostDelayedTask(), but the task can be cancelled with
+  // CancelDelayedTask() until it runs, e.g. for a timeout that is no longer
+  // needed. Cancellation is best effort: by default tasks can't be cancelled
+  // and run anyway, so they still have to cope with being stale. Can be called
+  // from any thread.
+  virtual DelayedTaskId PostCancelableDelayedTask(std::function<void()> task,
+                                                  uint32_t delay_ms) {
+    PostDelayedTask(std::move(task), delay_ms);
+    return 0;
+  }
+
+  // Drops a task posted with PostCancelableDelayedTask(), if it hasn't run (or
+  // been cancelled) yet. Can be called from any thread, but only on the target
+  // thread of this TaskRunner it guarantees that the task won't run.
+  virtual void CancelDelayedTask(DelayedTaskId) {}
+
   // Schedule a task to run when |fd| becomes readable. The same |fd| can only
   // be monitored by one function. Note that this function only needs to be
   // implemented on platforms where the built-in ipc framework is used. Can be
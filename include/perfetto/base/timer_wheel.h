@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_PERFETTO_BASE_TIMER_WHEEL_H_
+#define INCLUDE_PERFETTO_BASE_TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+#include "perfetto/base/time.h"
+
+namespace perfetto {
+namespace base {
+
+// The queue of delayed tasks of the task runners: a hierarchical timer wheel
+// with a resolution of 1 ms. Adding, cancelling and expiring a timer cost O(1)
+// regardless of how many are pending, unlike a std::multimap or a heap, which
+// cost O(log n) and, for the former, an allocation per timer.
+//
+// Level 0 has one slot per millisecond of the current 64 ms window. Each of the
+// following levels has one slot per window of the level below, e.g. level 1
+// has one slot per 64 ms in the current 4096 ms. A timer goes into the finest
+// level that covers its deadline and moves down ("cascades") one level at a
+// time as the time of the wheel approaches it. The timers are kept in a pool
+// and linked into the slots by index, so that adding and removing them doesn't
+// allocate once the pool has grown to the peak number of timers.
+//
+// Timers with the same deadline expire in the order they were added.
+// Not thread safe.
+class TimerWheel {
+ public:
+  // Identifies a pending timer, never 0.
+  using TimerId = uint64_t;
+
+  TimerWheel();
+  ~TimerWheel();
+
+  // Adds a timer that expires at |deadline|. A deadline in the past expires on
+  // the next call to PopExpired().
+  TimerId Add(TimeMillis deadline, std::function<void()> task);
+
+  // Removes the timer and destroys its task. Returns false if the timer has
+  // already expired (i.e. its task was returned by PopExpired()) or was
+  // cancelled.
+  bool Cancel(TimerId);
+
+  // Returns the task of the earliest timer that expired by |now| and removes
+  // the timer, or an empty function if none has. |now| must not go backwards.
+  std::function<void()> PopExpired(TimeMillis now);
+
+  // Returns a lower bound of the deadline of the earliest timer, to be used as
+  // the timeout of poll(). It is the exact deadline for the timers that are
+  // less than 64 ms away from the last PopExpired(). Further ones are reported
+  // at the start of their slot: the PopExpired() at that time returns nothing
+  // but cascades the timers, after which the bound gets tighter. Must not be
+  // called when empty().
+  TimeMillis NextDeadline() const;
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+ private:
+  static constexpr uint32_t kBitsPerLevel = 6;
+  static constexpr uint32_t kSlotsPerLevel = 1 << kBitsPerLevel;
+  // Enough to cover the whole range of the (non-negative) times.
+  static constexpr uint32_t kNumLevels = 11;
+  static constexpr uint32_t kNumSlots = kNumLevels * kSlotsPerLevel;
+  // The list of the timers that expired and are waiting for PopExpired().
+  static constexpr uint32_t kExpiredList = kNumSlots;
+  static constexpr uint32_t kNone = UINT32_MAX;  // Index of a null timer.
+
+  struct Timer {
+    uint64_t deadline = 0;
+    std::function<void()> task;
+    uint32_t generation = 1;  // Bumped on release to invalidate TimerId(s).
+    uint32_t list = kNone;    // Slot (or kExpiredList), kNone if free.
+    uint32_t prev = kNone;
+    uint32_t next = kNone;  // Also links the free list.
+  };
+
+  struct List {
+    uint32_t head = kNone;
+    uint32_t tail = kNone;
+  };
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Links the timer into the slot that covers its deadline.
+  void Place(uint32_t timer);
+  void Append(uint32_t list, uint32_t timer);
+  void Unlink(uint32_t timer);
+  void Release(uint32_t timer);
+
+  // Moves the expired timers into the expired list, cascading the timers of
+  // the higher levels along the way.
+  void Advance(uint64_t now);
+
+  // Sets |time_| and cascades the slots that start at it.
+  void SetTime(uint64_t time);
+
+  // Returns the start time of the earliest non-empty slot, UINT64_MAX if none.
+  uint64_t NextSlotTime() const;
+
+  std::vector<Timer> timers_;
+  uint32_t free_timers_ = kNone;
+  size_t size_ = 0;
+
+  // All the timers with a deadline < |time_| have expired.
+  uint64_t time_ = 0;
+
+  List lists_[kNumSlots + 1];  // One per slot, plus the expired list.
+  uint64_t occupied_slots_[kNumLevels] = {};  // One bit per non-empty slot.
+};
+
+}  // namespace base
+}  // namespace perfetto
+
+#endif  // INCLUDE_PERFETTO_BASE_TIMER_WHEEL_H_
@@ -22,6 +22,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "perfetto/base/logging.h"
 #include "perfetto/base/scoped_file.h"
@@ -29,6 +30,7 @@
 #include "perfetto/base/weak_ptr.h"
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 namespace perfetto {
@@ -42,6 +44,15 @@ ssize_t SockSend(int fd,
                  const int* send_fds,
                  size_t num_fds);
 
+// Like the above, but gathers the message from |iov_count| buffers. At most
+// kMaxSendIovecs buffers can be passed.
+constexpr size_t kMaxSendIovecs = 64;
+ssize_t SockSend(int fd,
+                 const struct iovec* iov,
+                 size_t iov_count,
+                 const int* send_fds,
+                 size_t num_fds);
+
 ssize_t SockReceive(int fd,
                     void* msg,
                     size_t len,
@@ -167,6 +178,8 @@ class UnixSocket {
   // This class gives the hard guarantee that no callback is called on the
   // passed EventListener immediately after the object has been destroyed.
   // Any queued callback will be silently dropped.
+  // The messages queued by QueueSend() are sent as far as they fit in the
+  // socket buffer, the rest is dropped: the destructor never blocks.
   ~UnixSocket();
 
   // Shuts down the current connection, if any. If the socket was Listen()-ing,
@@ -194,6 +207,40 @@ class UnixSocket {
   bool Send(const std::string& msg,
             BlockingMode blockimg = BlockingMode::kNonBlocking);
 
+  // Like the above, but gathers the message from |iov_count| (at most
+  // kMaxSendIovecs) buffers, without having to copy them into a contiguous
+  // one first.
+  bool Send(const struct iovec* iov,
+            size_t iov_count,
+            const int* send_fds,
+            size_t num_fds,
+            BlockingMode blocking = BlockingMode::kNonBlocking);
+
+  // Appends the message to the outbound queue of the socket rather than
+  // sending it straight away. The queue is flushed by a task posted on the
+  // TaskRunner, so that all the messages queued until then (e.g. the replies
+  // to a burst of requests) are sent with a single sendmsg(). Only a message
+  // that carries a file descriptor, which is dup()-ed, starts a new one.
+  // If the socket buffer is full the rest of the queue is kept and retried
+  // later, rather than blocking, backing off while the peer is not reading.
+  // In kBlocking mode, if the queue grows beyond kMaxSendQueueSize
+  // nonetheless, it is flushed blocking, which throttles the caller. In
+  // kNonBlocking mode the queue is never flushed blocking and can grow
+  // without limits: the caller must bound it, checking send_queue_size().
+  // Messages sent with Send() are sent after the ones queued before them.
+  // Returns false if the socket is not connected or an error happened, in
+  // which case the socket is shut down as in Send().
+  static constexpr size_t kMaxSendQueueSize = 256 * 1024;
+  bool QueueSend(const void* msg,
+                 size_t len,
+                 int send_fd = -1,
+                 BlockingMode blocking = BlockingMode::kBlocking);
+
+  // Number of bytes queued by QueueSend() that have not been sent yet.
+  size_t send_queue_size() const {
+    return send_queue_.size() - send_queue_offset_;
+  }
+
   // Returns the number of bytes (<= |len|) written in |msg| or 0 if there
   // is no data in the buffer to read or an error occurs (in which case a
   // EventListener::OnDisconnect() will follow).
@@ -252,6 +299,19 @@ class UnixSocket {
   void OnEvent();
   void NotifyConnectionState(bool success);
 
+  // Sends the messages queued by QueueSend(). In non-blocking mode, stops when
+  // the socket buffer is full and posts a task to retry. Returns false if the
+  // socket was shut down because of an error.
+  bool FlushSendQueue(BlockingMode);
+  void PostFlushSendQueue(uint32_t delay_ms);
+  void ClearSendQueue();
+
+  // A file descriptor queued by QueueSend().
+  struct QueuedFd {
+    size_t offset;  // Of the first byte of its message in |send_queue_|.
+    base::ScopedFile fd;
+  };
+
   base::ScopedFile fd_;
   State state_ = State::kDisconnected;
   int last_error_ = 0;
@@ -262,7 +322,21 @@ class UnixSocket {
 #endif
   EventListener* event_listener_;
   base::TaskRunner* task_runner_;
-  base::WeakPtrFactory<UnixSocket> weak_ptr_factory_;
+
+  // The messages queued by QueueSend(). The bytes before |send_queue_offset_|
+  // have been sent already. The buffer is reused once it has been flushed, so
+  // that queueing doesn't allocate in the steady state.
+  std::vector<uint8_t> send_queue_;
+  size_t send_queue_offset_ = 0;
+  std::vector<QueuedFd> send_queue_fds_;  // Sorted by offset.
+  bool send_queue_flush_posted_ = false;
+
+  // Delay of the next retry of a non-blocking flush that found the socket
+  // buffer full. Doubles at each retry that sends nothing and is reset as soon
+  // as the peer reads again.
+  uint32_t send_queue_retry_delay_ms_ = 0;
+
+  base::WeakPtrFactory<UnixSocket> weak_ptr_factory_;  // Keep last.
 };
 
 }  // namespace base
@@ -23,6 +23,7 @@
 #include "perfetto/base/task_runner.h"
 #include "perfetto/base/thread_checker.h"
 #include "perfetto/base/time.h"
+#include "perfetto/base/timer_wheel.h"
 
 #include <poll.h>
 #include <chrono>
@@ -52,6 +53,9 @@ class UnixTaskRunner : public TaskRunner {
   // TaskRunner implementation:
   void PostTask(std::function<void()>) override;
   void PostDelayedTask(std::function<void()>, uint32_t delay_ms) override;
+  DelayedTaskId PostCancelableDelayedTask(std::function<void()>,
+                                          uint32_t delay_ms) override;
+  void CancelDelayedTask(DelayedTaskId) override;
   void AddFileDescriptorWatch(int fd, std::function<void()>) override;
   void RemoveFileDescriptorWatch(int fd) override;
 
@@ -78,7 +82,7 @@ class UnixTaskRunner : public TaskRunner {
   std::mutex lock_;
 
   std::deque<std::function<void()>> immediate_tasks_;
-  std::multimap<TimeMillis, std::function<void()>> delayed_tasks_;
+  TimerWheel delayed_tasks_;
   bool quit_ = false;
 
   struct WatchTask {
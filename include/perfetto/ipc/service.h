@@ -24,6 +24,7 @@
 namespace perfetto {
 namespace ipc {
 
+class HostImpl;
 class ServiceDescriptor;
 
 // The base class for all the autogenerated host-side service interfaces.
@@ -46,6 +47,12 @@ class Service {
     return client_info_;
   }
 
+  // Returns the number of bytes of the replies to |client_id| that are still
+  // queued because the client is not reading them as fast as they are sent.
+  // Services that stream large replies (e.g. the trace data) can use this to
+  // pace themselves. Clients that let too much pile up are disconnected.
+  size_t GetClientSendQueueSize(ClientID client_id) const;
+
   base::ScopedFile TakeReceivedFD() {
     if (received_fd_)
       return std::move(*received_fd_);
@@ -54,6 +61,7 @@ class Service {
 
  private:
   friend class HostImpl;
+  HostImpl* host_ = nullptr;
   ClientInfo client_info_;
   // This is a pointer because the received fd needs to remain owned by the
   // ClientConnection, as we will provide it to all method invocations
@@ -56,6 +56,12 @@ class PERFETTO_EXPORT Consumer {
   // TracePacket(s). Upon the last call, |has_more| is set to true (i.e.
   // |has_more| is a !EOF).
   virtual void OnTraceData(std::vector<TracePacket>, bool has_more) = 0;
+
+  // Called by the Service before reading each batch of packets passed to
+  // OnTraceData(). Returning false makes the Service retry a bit later, e.g.
+  // while the transport layer is still sending the previous batches to a slow
+  // remote consumer. The default implementation never delays the reads.
+  virtual bool IsReadyForTraceData() { return true; }
 };
 
 }  // namespace perfetto
@@ -49,6 +49,7 @@ namespace perfetto {
 namespace protos {
 class DataSourceConfig;
 class FtraceConfig;
+class FtraceConfig_KernelFilter;
 class ChromeConfig;
 class InodeFileConfig;
 class InodeFileConfig_MountPointMappingEntry;
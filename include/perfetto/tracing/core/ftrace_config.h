@@ -39,6 +39,7 @@
 namespace perfetto {
 namespace protos {
 class FtraceConfig;
+class FtraceConfig_KernelFilter;
 }
 }  // namespace perfetto
 
@@ -46,6 +47,34 @@ namespace perfetto {
 
 class PERFETTO_EXPORT FtraceConfig {
  public:
+  class PERFETTO_EXPORT KernelFilter {
+   public:
+    KernelFilter();
+    ~KernelFilter();
+    KernelFilter(KernelFilter&&) noexcept;
+    KernelFilter& operator=(KernelFilter&&);
+    KernelFilter(const KernelFilter&);
+    KernelFilter& operator=(const KernelFilter&);
+
+    // Conversion methods from/to the corresponding protobuf types.
+    void FromProto(const perfetto::protos::FtraceConfig_KernelFilter&);
+    void ToProto(perfetto::protos::FtraceConfig_KernelFilter*) const;
+
+    const std::string& event() const { return event_; }
+    void set_event(const std::string& value) { event_ = value; }
+
+    const std::string& filter() const { return filter_; }
+    void set_filter(const std::string& value) { filter_ = value; }
+
+   private:
+    std::string event_ = {};
+    std::string filter_ = {};
+
+    // Allows to preserve unknown protobuf fields for compatibility
+    // with future versions of .proto files.
+    std::string unknown_fields_;
+  };
+
   FtraceConfig();
   ~FtraceConfig();
   FtraceConfig(FtraceConfig&&) noexcept;
@@ -92,12 +121,24 @@ class PERFETTO_EXPORT FtraceConfig {
   uint32_t drain_period_ms() const { return drain_period_ms_; }
   void set_drain_period_ms(uint32_t value) { drain_period_ms_ = value; }
 
+  int kernel_filters_size() const {
+    return static_cast<int>(kernel_filters_.size());
+  }
+  const std::vector<KernelFilter>& kernel_filters() const {
+    return kernel_filters_;
+  }
+  KernelFilter* add_kernel_filters() {
+    kernel_filters_.emplace_back();
+    return &kernel_filters_.back();
+  }
+
  private:
   std::vector<std::string> ftrace_events_;
   std::vector<std::string> atrace_categories_;
   std::vector<std::string> atrace_apps_;
   uint32_t buffer_size_kb_ = {};
   uint32_t drain_period_ms_ = {};
+  std::vector<KernelFilter> kernel_filters_;
 
   // Allows to preserve unknown protobuf fields for compatibility
   // with future versions of .proto files.
@@ -120,12 +120,48 @@ class PERFETTO_EXPORT HeapprofdConfig {
     return &continuous_dump_config_;
   }
 
+  uint64_t shmem_size_bytes() const { return shmem_size_bytes_; }
+  void set_shmem_size_bytes(uint64_t value) { shmem_size_bytes_ = value; }
+
+  bool block_client() const { return block_client_; }
+  void set_block_client(bool value) { block_client_ = value; }
+
+  bool frame_pointer_unwinding() const { return frame_pointer_unwinding_; }
+  void set_frame_pointer_unwinding(bool value) {
+    frame_pointer_unwinding_ = value;
+  }
+
+  uint32_t unwinder_threads() const { return unwinder_threads_; }
+  void set_unwinder_threads(uint32_t value) { unwinder_threads_ = value; }
+
+  uint32_t bookkeeping_threads() const { return bookkeeping_threads_; }
+  void set_bookkeeping_threads(uint32_t value) { bookkeeping_threads_ = value; }
+
+  bool incremental_dumps() const { return incremental_dumps_; }
+  void set_incremental_dumps(bool value) { incremental_dumps_ = value; }
+
+  uint64_t max_stack_size_bytes() const { return max_stack_size_bytes_; }
+  void set_max_stack_size_bytes(uint64_t value) {
+    max_stack_size_bytes_ = value;
+  }
+
+  bool stack_deltas() const { return stack_deltas_; }
+  void set_stack_deltas(bool value) { stack_deltas_ = value; }
+
  private:
   uint64_t sampling_interval_bytes_ = {};
   std::vector<std::string> process_cmdline_;
   std::vector<uint64_t> pid_;
   bool all_ = {};
   ContinuousDumpConfig continuous_dump_config_ = {};
+  uint64_t shmem_size_bytes_ = {};
+  bool block_client_ = {};
+  bool frame_pointer_unwinding_ = {};
+  uint32_t unwinder_threads_ = {};
+  uint32_t bookkeeping_threads_ = {};
+  bool incremental_dumps_ = {};
+  uint64_t max_stack_size_bytes_ = {};
+  bool stack_deltas_ = {};
 
   // Allows to preserve unknown protobuf fields for compatibility
   // with future versions of .proto files.
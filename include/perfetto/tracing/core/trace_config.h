@@ -45,6 +45,7 @@ class TraceConfig_BufferConfig;
 class TraceConfig_DataSource;
 class DataSourceConfig;
 class FtraceConfig;
+class FtraceConfig_KernelFilter;
 class ChromeConfig;
 class InodeFileConfig;
 class InodeFileConfig_MountPointMappingEntry;
@@ -88,9 +89,19 @@ class PERFETTO_EXPORT TraceConfig {
     FillPolicy fill_policy() const { return fill_policy_; }
     void set_fill_policy(FillPolicy value) { fill_policy_ = value; }
 
+    bool transparent_huge_pages() const { return transparent_huge_pages_; }
+    void set_transparent_huge_pages(bool value) {
+      transparent_huge_pages_ = value;
+    }
+
+    bool prefault() const { return prefault_; }
+    void set_prefault(bool value) { prefault_ = value; }
+
    private:
     uint32_t size_kb_ = {};
     FillPolicy fill_policy_ = {};
+    bool transparent_huge_pages_ = {};
+    bool prefault_ = {};
 
     // Allows to preserve unknown protobuf fields for compatibility
     // with future versions of .proto files.
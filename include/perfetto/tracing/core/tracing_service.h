@@ -17,6 +17,7 @@
 #ifndef INCLUDE_PERFETTO_TRACING_CORE_TRACING_SERVICE_H_
 #define INCLUDE_PERFETTO_TRACING_CORE_TRACING_SERVICE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <functional>
@@ -86,6 +87,8 @@ class PERFETTO_EXPORT TracingService {
 
     // Called by the Producer to signal that some pages in the shared memory
     // buffer (shared between Service and Producer) have changed.
+    // The callback is invoked once the chunks have been copied, either within
+    // the call or later if the service copies them on a commit thread.
     using CommitDataCallback = std::function<void()>;
     virtual void CommitData(const CommitDataRequest&,
                             CommitDataCallback callback = {}) = 0;
@@ -156,15 +159,35 @@ class PERFETTO_EXPORT TracingService {
     virtual void Flush(uint32_t timeout_ms, FlushCallback) = 0;
 
     // Tracing data will be delivered invoking Consumer::OnTraceData().
-    virtual void ReadBuffers() = 0;
+    // If a file descriptor is passed, the service writes the packets straight
+    // into it instead (in the same format used by TraceConfig.write_into_file)
+    // and invokes OnTraceData() only once, with no packets and
+    // |has_more| == false, after all the buffers have been written. The file
+    // descriptor must refer to a regular file, otherwise it is ignored and the
+    // packets are sent back through OnTraceData() as usual.
+    virtual void ReadBuffers(base::ScopedFile = base::ScopedFile()) = 0;
 
     virtual void FreeBuffers() = 0;
   };  // class ConsumerEndpoint.
 
+  // Options for CreateInstance().
+  struct InitOpts {
+    // Number of threads, other than the one of the TaskRunner passed to
+    // CreateInstance(), that copy the chunks committed by the producers into
+    // the trace buffers. Producers are sharded across them, so that the copies
+    // of busy producers run in parallel. When 0, all the work happens on the
+    // TaskRunner thread.
+    size_t num_commit_threads = 0;
+  };
+
   // Implemented in src/core/tracing_service_impl.cc .
   static std::unique_ptr<TracingService> CreateInstance(
       std::unique_ptr<SharedMemory::Factory>,
       base::TaskRunner*);
+  static std::unique_ptr<TracingService> CreateInstance(
+      std::unique_ptr<SharedMemory::Factory>,
+      base::TaskRunner*,
+      const InitOpts&);
 
   virtual ~TracingService();
 
@@ -21,14 +21,13 @@
 
 #include "perfetto/base/scoped_file.h"
 #include "perfetto/tracing/core/basic_types.h"
+#include "perfetto/tracing/core/tracing_service.h"
 
 namespace perfetto {
 namespace base {
 class TaskRunner;
 }  // namespace base.
 
-class TracingService;
-
 // Creates an instance of the service (business logic + UNIX socket transport).
 // Exposed to:
 //   The code in the tracing client that will host the service e.g., traced.
@@ -37,6 +36,9 @@ class TracingService;
 class ServiceIPCHost {
  public:
   static std::unique_ptr<ServiceIPCHost> CreateInstance(base::TaskRunner*);
+  static std::unique_ptr<ServiceIPCHost> CreateInstance(
+      base::TaskRunner*,
+      const TracingService::InitOpts&);
   virtual ~ServiceIPCHost();
 
   // Start listening on the Producer & Consumer ports. Returns false in case of
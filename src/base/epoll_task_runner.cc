@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/base/epoll_task_runner.h"
+
+#include <errno.h>
+
+#include <algorithm>
+
+#include "perfetto/base/logging.h"
+#include "perfetto/base/utils.h"
+
+namespace perfetto {
+namespace base {
+
+namespace {
+
+// Max number of fd events harvested by each epoll_wait(). The others, if any,
+// are reported by the next one.
+constexpr int kMaxEventsPerWait = 64;
+
+constexpr size_t kInitialTaskQueueCapacity = 64;
+
+// The task queue memory is released when the queue drains if a burst of
+// tasks made it grow beyond this.
+constexpr size_t kMaxRetainedTaskQueueCapacity = 4096;
+
+// Watches are one-shot: once an fd is reported, epoll ignores it until
+// RunFileDescriptorWatch() re-arms it, so that its callback is not posted
+// again while it is still pending.
+bool SetWatch(int epoll_fd, int op, int fd) {
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.fd = fd;
+  return epoll_ctl(epoll_fd, op, fd, &ev) == 0;
+}
+
+}  // namespace
+
+EpollTaskRunner::TaskQueue::TaskQueue() = default;
+EpollTaskRunner::TaskQueue::~TaskQueue() = default;
+
+void EpollTaskRunner::TaskQueue::push_back(std::function<void()> task) {
+  if (size() == capacity_)
+    Grow();
+  tasks_[end_++ & (capacity_ - 1)] = std::move(task);
+}
+
+std::function<void()> EpollTaskRunner::TaskQueue::pop_front() {
+  PERFETTO_DCHECK(!empty());
+  std::function<void()>& slot = tasks_[begin_++ & (capacity_ - 1)];
+  std::function<void()> task = std::move(slot);
+  slot = nullptr;  // Don't keep the bound arguments alive.
+  if (empty() && capacity_ > kMaxRetainedTaskQueueCapacity) {
+    tasks_.reset();
+    capacity_ = begin_ = end_ = 0;
+  }
+  return task;
+}
+
+void EpollTaskRunner::TaskQueue::Grow() {
+  const size_t new_capacity =
+      capacity_ ? capacity_ * 2 : kInitialTaskQueueCapacity;
+  std::unique_ptr<std::function<void()>[]> new_tasks(
+      new std::function<void()>[new_capacity]);
+  const size_t num_tasks = size();
+  for (size_t i = 0; i < num_tasks; i++)
+    new_tasks[i] = std::move(tasks_[(begin_ + i) & (capacity_ - 1)]);
+  tasks_ = std::move(new_tasks);
+  capacity_ = new_capacity;
+  begin_ = 0;
+  end_ = num_tasks;
+}
+
+EpollTaskRunner::EpollTaskRunner() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {
+  PERFETTO_CHECK(epoll_fd_);
+  // The wake-up event is level-triggered and is never disarmed, see
+  // PostFileDescriptorWatches().
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = event_.fd();
+  PERFETTO_CHECK(epoll_ctl(*epoll_fd_, EPOLL_CTL_ADD, event_.fd(), &ev) == 0);
+}
+
+EpollTaskRunner::~EpollTaskRunner() = default;
+
+void EpollTaskRunner::WakeUp() {
+  event_.Notify();
+}
+
+void EpollTaskRunner::Run() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    quit_ = false;
+  }
+  struct epoll_event events[kMaxEventsPerWait];
+  for (;;) {
+    int timeout_ms;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (quit_)
+        return;
+      timeout_ms = GetDelayMsToNextTaskLocked();
+      polling_ = true;
+    }
+    int num_events = PERFETTO_EINTR(
+        epoll_wait(*epoll_fd_, events, kMaxEventsPerWait, timeout_ms));
+    PERFETTO_CHECK(num_events >= 0);
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      polling_ = false;
+    }
+
+    // To avoid starvation we always interleave all types of tasks -- immediate,
+    // delayed and file descriptor watches.
+    PostFileDescriptorWatches(events, num_events);
+    RunImmediateAndDelayedTasks();
+  }
+}
+
+void EpollTaskRunner::Quit() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    quit_ = true;
+  }
+  WakeUp();
+}
+
+bool EpollTaskRunner::IsIdleForTesting() {
+  std::lock_guard<std::mutex> lock(lock_);
+  return immediate_tasks_.empty();
+}
+
+void EpollTaskRunner::RunImmediateAndDelayedTasks() {
+  // Run only the tasks that are pending now and not the ones that they post,
+  // so that a task which keeps re-posting itself can't starve the fd watches.
+  size_t num_immediate_tasks;
+  size_t max_delayed_tasks;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    num_immediate_tasks = immediate_tasks_.size();
+    max_delayed_tasks = delayed_tasks_.size();
+  }
+  for (size_t i = 0; i < num_immediate_tasks; i++) {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (quit_)
+        return;
+      task = immediate_tasks_.pop_front();
+    }
+    errno = 0;
+    RunTask(task);
+  }
+
+  TimeMillis now = GetWallTimeMs();
+  for (size_t i = 0; i < max_delayed_tasks; i++) {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (quit_ || delayed_tasks_.empty())
+        return;
+      task = delayed_tasks_.PopExpired(now);
+    }
+    if (!task)
+      return;
+    errno = 0;
+    RunTask(task);
+  }
+}
+
+void EpollTaskRunner::PostFileDescriptorWatches(
+    const struct epoll_event* events,
+    int num_events) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  for (int i = 0; i < num_events; i++) {
+    const int fd = events[i].data.fd;
+
+    // The wake-up event is handled inline to avoid an infinite recursion of
+    // posted tasks.
+    if (fd == event_.fd()) {
+      event_.Clear();
+      continue;
+    }
+
+    // Binding to |this| is safe since we are the only object executing the
+    // task.
+    PostTask([this, fd] { RunFileDescriptorWatch(fd); });
+  }
+}
+
+void EpollTaskRunner::RunFileDescriptorWatch(int fd) {
+  std::shared_ptr<std::function<void()>> task;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = watch_tasks_.find(fd);
+    if (it == watch_tasks_.end())
+      return;
+    // Make epoll pay attention to the fd again.
+    if (!SetWatch(*epoll_fd_, EPOLL_CTL_MOD, fd))
+      PERFETTO_DPLOG("epoll_ctl(EPOLL_CTL_MOD, %d)", fd);
+    task = it->second;
+  }
+  errno = 0;
+  RunTask(*task);
+}
+
+int EpollTaskRunner::GetDelayMsToNextTaskLocked() const {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (!immediate_tasks_.empty())
+    return 0;
+  if (!delayed_tasks_.empty()) {
+    TimeMillis diff = delayed_tasks_.NextDeadline() - GetWallTimeMs();
+    return std::max(0, static_cast<int>(diff.count()));
+  }
+  return -1;
+}
+
+void EpollTaskRunner::PostTask(std::function<void()> task) {
+  bool wake_up;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    wake_up = polling_ && immediate_tasks_.empty();
+    immediate_tasks_.push_back(std::move(task));
+  }
+  if (wake_up)
+    WakeUp();
+}
+
+void EpollTaskRunner::PostDelayedTask(std::function<void()> task,
+                                      uint32_t delay_ms) {
+  PostCancelableDelayedTask(std::move(task), delay_ms);
+}
+
+TaskRunner::DelayedTaskId EpollTaskRunner::PostCancelableDelayedTask(
+    std::function<void()> task,
+    uint32_t delay_ms) {
+  TimeMillis run_time = GetWallTimeMs() + TimeMillis(delay_ms);
+  DelayedTaskId id;
+  bool wake_up;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    // Only a task due before the current timeout of epoll_wait() changes it.
+    wake_up = polling_ && (delayed_tasks_.empty() ||
+                           run_time < delayed_tasks_.NextDeadline());
+    id = delayed_tasks_.Add(run_time, std::move(task));
+  }
+  if (wake_up)
+    WakeUp();
+  return id;
+}
+
+void EpollTaskRunner::CancelDelayedTask(DelayedTaskId id) {
+  std::lock_guard<std::mutex> lock(lock_);
+  delayed_tasks_.Cancel(id);
+  // No need to wake up: at worst epoll_wait() times out for nothing.
+}
+
+void EpollTaskRunner::AddFileDescriptorWatch(int fd,
+                                             std::function<void()> task) {
+  PERFETTO_DCHECK(fd >= 0);
+  std::lock_guard<std::mutex> lock(lock_);
+  PERFETTO_DCHECK(!watch_tasks_.count(fd));
+  watch_tasks_[fd] = std::make_shared<std::function<void()>>(std::move(task));
+  // No need to wake up: epoll_wait() reports the fd even if it was added while
+  // already waiting.
+  PERFETTO_CHECK(SetWatch(*epoll_fd_, EPOLL_CTL_ADD, fd));
+}
+
+void EpollTaskRunner::RemoveFileDescriptorWatch(int fd) {
+  PERFETTO_DCHECK(fd >= 0);
+  std::lock_guard<std::mutex> lock(lock_);
+  PERFETTO_DCHECK(watch_tasks_.count(fd));
+  watch_tasks_.erase(fd);
+  // epoll watches the open file description rather than the fd, and drops it
+  // on close() only if no other fd refers to it, e.g. after a dup() or fork().
+  // So watches must be removed before the fd is closed: EBADF and ENOENT here
+  // mean that it was closed first, and epoll might still report its events.
+  if (epoll_ctl(*epoll_fd_, EPOLL_CTL_DEL, fd, nullptr) == -1 &&
+      errno != EBADF && errno != ENOENT) {
+    PERFETTO_DPLOG("epoll_ctl(EPOLL_CTL_DEL, %d)", fd);
+  }
+}
+
+}  // namespace base
+}  // namespace perfetto
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/base/flat_hash_map.h"
+
+#include <map>
+#include <random>
+
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace base {
+namespace {
+
+// All the keys end up in the same bucket, so every operation probes.
+struct CollidingHash {
+  size_t operator()(uint64_t) const { return 0; }
+};
+
+// Counts the live instances, to check that the map destroys what it
+// constructs.
+class Counted {
+ public:
+  explicit Counted(int* live, int value = 0) : live_(live), value_(value) {
+    (*live_)++;
+  }
+  Counted(Counted&& other) noexcept : live_(other.live_), value_(other.value_) {
+    (*live_)++;
+  }
+  ~Counted() { (*live_)--; }
+
+  int value() const { return value_; }
+
+ private:
+  int* live_;
+  int value_;
+};
+
+TEST(FlatHashMapTest, EmplaceFindErase) {
+  FlatHashMap<uint64_t, int> map;
+  EXPECT_EQ(map.Find(1), nullptr);
+  EXPECT_FALSE(map.Erase(1));
+
+  auto it_and_inserted = map.Emplace(1, 10);
+  EXPECT_TRUE(it_and_inserted.second);
+  EXPECT_EQ(*it_and_inserted.first, 10);
+  it_and_inserted = map.Emplace(1, 20);
+  EXPECT_FALSE(it_and_inserted.second);
+  EXPECT_EQ(*it_and_inserted.first, 10);
+  EXPECT_EQ(map.size(), 1u);
+
+  ASSERT_NE(map.Find(1), nullptr);
+  EXPECT_EQ(*map.Find(1), 10);
+  EXPECT_TRUE(map.Erase(1));
+  EXPECT_EQ(map.Find(1), nullptr);
+  EXPECT_EQ(map.size(), 0u);
+}
+
+TEST(FlatHashMapTest, Grows) {
+  FlatHashMap<uint64_t, uint64_t> map;
+  for (uint64_t i = 0; i < 10000; ++i)
+    map.Emplace(i * 16, i);
+  EXPECT_EQ(map.size(), 10000u);
+  EXPECT_GE(map.capacity() * 3, map.size() * 4);
+  for (uint64_t i = 0; i < 10000; ++i) {
+    ASSERT_NE(map.Find(i * 16), nullptr);
+    EXPECT_EQ(*map.Find(i * 16), i);
+  }
+  EXPECT_EQ(map.Find(8), nullptr);
+}
+
+TEST(FlatHashMapTest, Collisions) {
+  FlatHashMap<uint64_t, uint64_t, CollidingHash> map;
+  for (uint64_t i = 0; i < 10; ++i)
+    map.Emplace(i, i);
+  // Removes from the middle of the probe sequence.
+  EXPECT_TRUE(map.Erase(3));
+  EXPECT_TRUE(map.Erase(4));
+  for (uint64_t i = 0; i < 10; ++i) {
+    if (i == 3 || i == 4)
+      EXPECT_EQ(map.Find(i), nullptr);
+    else
+      EXPECT_NE(map.Find(i), nullptr);
+  }
+  EXPECT_TRUE(map.Emplace(4, 4).second);
+  EXPECT_FALSE(map.Emplace(9, 9).second);
+  EXPECT_EQ(map.size(), 9u);
+}
+
+// Inserts and removes many more entries than the map ever holds at once, which
+// leaves tombstones behind.
+TEST(FlatHashMapTest, MatchesStdMap) {
+  std::minstd_rand rnd(0);
+  FlatHashMap<uint64_t, uint64_t> map;
+  std::map<uint64_t, uint64_t> expected;
+  for (int i = 0; i < 100000; ++i) {
+    uint64_t key = rnd() % 512;
+    if (rnd() % 2) {
+      bool inserted = expected.emplace(key, i).second;
+      EXPECT_EQ(map.Emplace(key, static_cast<uint64_t>(i)).second, inserted);
+    } else {
+      EXPECT_EQ(map.Erase(key), expected.erase(key) == 1);
+    }
+  }
+  EXPECT_EQ(map.size(), expected.size());
+  size_t seen = 0;
+  map.ForEach([&expected, &seen](const uint64_t& key, uint64_t& value) {
+    seen++;
+    auto it = expected.find(key);
+    ASSERT_NE(it, expected.end());
+    EXPECT_EQ(it->second, value);
+  });
+  EXPECT_EQ(seen, expected.size());
+}
+
+TEST(FlatHashMapTest, DestroysValues) {
+  int live = 0;
+  {
+    FlatHashMap<uint64_t, Counted> map;
+    for (uint64_t i = 0; i < 100; ++i)
+      map.Emplace(i, &live, static_cast<int>(i));
+    EXPECT_EQ(live, 100);
+    EXPECT_EQ(map.Find(42)->value(), 42);
+    map.Erase(42);
+    EXPECT_EQ(live, 99);
+
+    FlatHashMap<uint64_t, Counted> other = std::move(map);
+    EXPECT_EQ(live, 99);
+    EXPECT_EQ(map.size(), 0u);
+    EXPECT_EQ(other.size(), 99u);
+    EXPECT_EQ(other.Find(43)->value(), 43);
+  }
+  EXPECT_EQ(live, 0);
+}
+
+}  // namespace
+}  // namespace base
+}  // namespace perfetto
@@ -16,46 +16,205 @@
 
 #include "perfetto/base/metatrace.h"
 
-#include <fcntl.h>
-#include <stdlib.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
 
-#include "perfetto/base/build_config.h"
-#include "perfetto/base/file_utils.h"
-#include "perfetto/base/time.h"
-
-#if PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
-#include <corecrt_io.h>
-#endif
+#include "perfetto/base/logging.h"
+#include "perfetto/base/thread_utils.h"
 
 namespace perfetto {
 namespace base {
+namespace metatrace {
+
+std::atomic<bool> g_enabled{false};
 
 namespace {
-int MaybeOpenTraceFile() {
-  static const char* tracing_path = getenv("PERFETTO_METATRACE_FILE");
-  if (tracing_path == nullptr)
-    return -1;
-  static int fd = open(tracing_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-  return fd;
+
+// Records per thread. Enough for the ~1s between two reads of the busiest
+// threads (the ftrace CpuReader(s)), which write a handful of events per
+// wakeup.
+constexpr uint64_t kRingSize = 1024;
+static_assert((kRingSize & (kRingSize - 1)) == 0, "Must be a power of two");
+
+// The ring of a thread. Only the owner thread writes into it, ReadEvents()
+// reads it concurrently from another thread. The writes are made visible
+// seqlock-style: |write_begin| is bumped before overwriting a slot and
+// |write_end| after, so the reader can tell which of the slots it copied might
+// have been overwritten meanwhile. The slots are atomic words so that racy
+// copies are well defined, the relaxed stores and loads are plain moves.
+struct Ring {
+  struct Slot {
+    std::atomic<uint64_t> timestamp_ns;
+    std::atomic<uint64_t> duration_and_arg;
+    std::atomic<uint64_t> event_id_and_tid;
+  };
+
+  Slot slots[kRingSize];
+  std::atomic<uint64_t> write_begin{0};
+  std::atomic<uint64_t> write_end{0};
+
+  // The fields below are protected by Registry::mutex, except for |thread_id|
+  // that is also read by the owner thread.
+  uint64_t read_pos = 0;
+  uint32_t thread_id = 0;
+  bool in_use = false;
+};
+
+// The rings of all the threads. The rings of the threads that exit are reused
+// by the new ones, so that a process that spawns threads all the time doesn't
+// leak.
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Ring>> rings;
+  int enable_count = 0;
+};
+
+Registry* GetRegistry() {
+  static Registry* registry = new Registry();  // Leaked, see ~RingReleaser().
+  return registry;
+}
+
+uint32_t GetCurrentThreadIdForRecords() {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+  return 0;
+#else
+  return static_cast<uint32_t>(GetThreadId());
+#endif
+}
+
+// Trivially destructible, so that accessing it is just a TLS load.
+thread_local Ring* g_thread_ring = nullptr;
+
+// Returns the ring of the thread to the registry when the thread exits.
+struct RingReleaser {
+  ~RingReleaser() {
+    Registry* registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    ring->in_use = false;
+    g_thread_ring = nullptr;
+  }
+  Ring* ring = nullptr;
+};
+
+Ring* AcquireRing() {
+  Registry* registry = GetRegistry();
+  Ring* ring = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (const auto& free_ring : registry->rings) {
+      if (!free_ring->in_use) {
+        ring = free_ring.get();
+        break;
+      }
+    }
+    if (!ring) {
+      registry->rings.emplace_back(new Ring());
+      ring = registry->rings.back().get();
+    }
+    ring->in_use = true;
+    ring->thread_id = GetCurrentThreadIdForRecords();
+  }
+  thread_local RingReleaser releaser;
+  releaser.ring = ring;
+  g_thread_ring = ring;
+  return ring;
 }
+
 }  // namespace
 
-void MetaTrace::WriteEvent(char type, const char* evt_name, size_t cpu) {
-  int fd = MaybeOpenTraceFile();
-  if (fd == -1)
+void Enable() {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  if (registry->enable_count++ > 0)
     return;
+  for (const auto& ring : registry->rings)
+    ring->read_pos = ring->write_end.load(std::memory_order_acquire);
+  g_enabled.store(true, std::memory_order_relaxed);
+}
+
+void Disable() {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  PERFETTO_DCHECK(registry->enable_count > 0);
+  if (--registry->enable_count == 0)
+    g_enabled.store(false, std::memory_order_relaxed);
+}
+
+void WriteEvent(EventId event_id, uint32_t arg, uint64_t begin_ns) {
+  const uint64_t end_ns = static_cast<uint64_t>(GetBootTimeNs().count());
+  Ring* ring = g_thread_ring;
+  if (PERFETTO_UNLIKELY(!ring))
+    ring = AcquireRing();
+  const uint64_t duration_ns =
+      std::min(end_ns - begin_ns, static_cast<uint64_t>(UINT32_MAX));
+
+  const uint64_t pos = ring->write_end.load(std::memory_order_relaxed);
+  Ring::Slot& slot = ring->slots[pos & (kRingSize - 1)];
+  ring->write_begin.store(pos + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.timestamp_ns.store(begin_ns, std::memory_order_relaxed);
+  slot.duration_and_arg.store(duration_ns | static_cast<uint64_t>(arg) << 32,
+                              std::memory_order_relaxed);
+  slot.event_id_and_tid.store(
+      event_id | static_cast<uint64_t>(ring->thread_id) << 32,
+      std::memory_order_relaxed);
+  ring->write_end.store(pos + 1, std::memory_order_release);
+}
+
+uint64_t ReadEvents(std::vector<Record>* records) {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  uint64_t overruns = 0;
+  for (const auto& ring : registry->rings) {
+    const uint64_t end = ring->write_end.load(std::memory_order_acquire);
+    uint64_t first = std::max(ring->read_pos, end - std::min(end, kRingSize));
+    const size_t first_record = records->size();
+    for (uint64_t pos = first; pos < end; pos++) {
+      const Ring::Slot& slot = ring->slots[pos & (kRingSize - 1)];
+      const uint64_t duration_and_arg =
+          slot.duration_and_arg.load(std::memory_order_relaxed);
+      const uint64_t event_id_and_tid =
+          slot.event_id_and_tid.load(std::memory_order_relaxed);
+      Record record;
+      record.timestamp_ns = slot.timestamp_ns.load(std::memory_order_relaxed);
+      record.duration_ns = static_cast<uint32_t>(duration_and_arg);
+      record.arg = static_cast<uint32_t>(duration_and_arg >> 32);
+      record.event_id = static_cast<uint16_t>(event_id_and_tid);
+      record.thread_id = static_cast<uint32_t>(event_id_and_tid >> 32);
+      records->push_back(record);
+    }
+
+    // Drop the records whose slots the writer started to overwrite while they
+    // were being copied.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t begin = ring->write_begin.load(std::memory_order_relaxed);
+    const uint64_t valid_from =
+        std::min(begin - std::min(begin, kRingSize), end);
+    if (valid_from > first) {
+      records->erase(records->begin() + static_cast<ptrdiff_t>(first_record),
+                     records->begin() +
+                         static_cast<ptrdiff_t>(first_record + valid_from -
+                                                first));
+      first = valid_from;
+    }
+    overruns += first - ring->read_pos;
+    ring->read_pos = end;
+  }
+  return overruns;
+}
 
-  // The JSON event format expects both "pid" and "tid" fields to create
-  // per-process tracks. Here what we really want to achieve is having one track
-  // per cpu. So we just pretend that each CPU is its own process with
-  // pid == tid == cpu.
-  char json[256];
-  int len = sprintf(json,
-                    "{\"ts\": %f, \"cat\": \"PERF\", \"ph\": \"%c\", \"name\": "
-                    "\"%s\", \"pid\": %zu, \"tid\": %zu},\n",
-                    GetWallTimeNs().count() / 1000.0, type, evt_name, cpu, cpu);
-  ignore_result(WriteAll(fd, json, static_cast<size_t>(len)));
+const char* GetEventName(uint32_t event_id) {
+  static const char* const kEventNames[] = {
+#define PERFETTO_METATRACE_EVENT_NAME(id, name) name,
+      PERFETTO_METATRACE_EVENTS(PERFETTO_METATRACE_EVENT_NAME)
+#undef PERFETTO_METATRACE_EVENT_NAME
+  };
+  static_assert(sizeof(kEventNames) / sizeof(kEventNames[0]) == EVENTS_MAX,
+                "The names must match the ids");
+  return event_id < EVENTS_MAX ? kEventNames[event_id] : nullptr;
 }
 
+}  // namespace metatrace
 }  // namespace base
 }  // namespace perfetto
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/base/metatrace.h"
+
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "perfetto/base/thread_utils.h"
+
+namespace perfetto {
+namespace base {
+namespace metatrace {
+namespace {
+
+class MetatraceTest : public ::testing::Test {
+ public:
+  void SetUp() override { Enable(); }
+  void TearDown() override { Disable(); }
+};
+
+TEST_F(MetatraceTest, RecordsScopedEvents) {
+  const uint64_t begin_ns = static_cast<uint64_t>(GetBootTimeNs().count());
+  { PERFETTO_METATRACE(FTRACE_DRAIN_CPUS, 42); }
+  { PERFETTO_METATRACE_DYNAMIC(SYS_STATS_READ, 0); }
+
+  std::vector<Record> records;
+  EXPECT_EQ(0u, ReadEvents(&records));
+  ASSERT_EQ(2u, records.size());
+  EXPECT_EQ(FTRACE_DRAIN_CPUS, records[0].event_id);
+  EXPECT_EQ(42u, records[0].arg);
+  EXPECT_EQ(static_cast<uint32_t>(GetThreadId()), records[0].thread_id);
+  EXPECT_GE(records[0].timestamp_ns, begin_ns);
+  EXPECT_LE(records[0].timestamp_ns, records[1].timestamp_ns);
+  EXPECT_EQ(SYS_STATS_READ, records[1].event_id);
+
+  // Each event is read only once.
+  records.clear();
+  EXPECT_EQ(0u, ReadEvents(&records));
+  EXPECT_TRUE(records.empty());
+}
+
+TEST_F(MetatraceTest, DisabledRecordsNothing) {
+  Disable();
+  { PERFETTO_METATRACE(FTRACE_DRAIN_CPUS, 1); }
+  Enable();
+  // Also the events that began before Enable() are dropped.
+  std::vector<Record> records;
+  EXPECT_EQ(0u, ReadEvents(&records));
+  EXPECT_TRUE(records.empty());
+}
+
+TEST_F(MetatraceTest, Overruns) {
+  for (uint32_t i = 0; i < 3000; i++)
+    WriteEvent(PS_ON_PIDS, i, static_cast<uint64_t>(GetBootTimeNs().count()));
+  std::vector<Record> records;
+  const uint64_t overruns = ReadEvents(&records);
+  EXPECT_GT(overruns, 0u);
+  EXPECT_EQ(3000u, records.size() + overruns);
+  // The most recent events are kept.
+  EXPECT_EQ(2999u, records.back().arg);
+  EXPECT_EQ(static_cast<uint32_t>(overruns), records.front().arg);
+}
+
+TEST_F(MetatraceTest, ConcurrentWritersAndReader) {
+  static constexpr int kThreads = 4;
+  static constexpr uint32_t kEventsPerThread = 20000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([] {
+      for (uint32_t i = 0; i < kEventsPerThread; i++) {
+        WriteEvent(PS_WRITE_ALL_PROCESSES, i,
+                   static_cast<uint64_t>(GetBootTimeNs().count()));
+      }
+    });
+  }
+
+  // Read while the threads write. The records must not be torn, i.e. each
+  // (thread, arg) must come up at most once, and none must be lost without
+  // being counted as an overrun.
+  std::vector<Record> records;
+  uint64_t overruns = 0;
+  auto read_and_check = [&records, &overruns] {
+    const size_t prev_size = records.size();
+    overruns += ReadEvents(&records);
+    for (size_t i = prev_size; i < records.size(); i++) {
+      ASSERT_EQ(PS_WRITE_ALL_PROCESSES, records[i].event_id);
+      ASSERT_LT(records[i].arg, kEventsPerThread);
+    }
+  };
+  for (int i = 0; i < 100; i++)
+    read_and_check();
+  for (auto& thread : threads)
+    thread.join();
+  read_and_check();
+
+  std::set<std::pair<uint32_t, uint32_t>> tid_and_args;
+  for (const Record& record : records)
+    tid_and_args.emplace(record.thread_id, record.arg);
+  EXPECT_EQ(records.size(), tid_and_args.size());
+  EXPECT_EQ(kThreads * kEventsPerThread, records.size() + overruns);
+}
+
+TEST(MetatraceEventsTest, GetEventName) {
+  EXPECT_STREQ("ftrace_drain_cpus", GetEventName(FTRACE_DRAIN_CPUS));
+  EXPECT_STREQ("tracing_service_read_buffers",
+               GetEventName(TRACING_SERVICE_READ_BUFFERS));
+  EXPECT_EQ(nullptr, GetEventName(EVENTS_MAX));
+}
+
+}  // namespace
+}  // namespace metatrace
+}  // namespace base
+}  // namespace perfetto
@@ -39,8 +39,25 @@ constexpr size_t kGuardSize = kPageSize;
 constexpr size_t kCommitChunkSize = kPageSize * 1024;  // 4mB
 #endif  // TRACK_COMMITTED_SIZE()
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+// Huge pages are worth it only if the memory spans at least one of them.
+bool UseHugePages(size_t size, int flags) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  return (flags & PagedMemory::kHugePages) &&
+         size >= PagedMemory::kHugePageSize;
+#else
+  base::ignore_result(size, flags);
+  return false;
+#endif
+}
+#endif  // !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+
 }  // namespace
 
+// static
+constexpr size_t PagedMemory::kHugePageSize;
+
 // static
 PagedMemory PagedMemory::Allocate(size_t size, int flags) {
   PERFETTO_DCHECK(size % kPageSize == 0);
@@ -52,21 +69,60 @@ PagedMemory PagedMemory::Allocate(size_t size, int flags) {
   PERFETTO_CHECK(ptr);
   char* usable_region = reinterpret_cast<char*>(ptr) + kGuardSize;
 #else   // PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
-  void* ptr = mmap(nullptr, outer_size, PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  const bool huge_pages = UseHugePages(size, flags);
+  // To align the usable region to a huge page, reserve a huge page more and
+  // unmap the excess on both sides below.
+  const size_t reserved_size = outer_size + (huge_pages ? kHugePageSize : 0);
+  int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_POPULATE)
+  // With huge pages the memory is populated after the madvise() below instead,
+  // or it would be faulted in with small pages.
+  if ((flags & kPopulate) && !huge_pages)
+    mmap_flags |= MAP_POPULATE;
+#endif
+  void* ptr =
+      mmap(nullptr, reserved_size, PROT_READ | PROT_WRITE, mmap_flags, 0, 0);
   if (ptr == MAP_FAILED && (flags & kMayFail))
     return PagedMemory();
   PERFETTO_CHECK(ptr && ptr != MAP_FAILED);
   char* usable_region = reinterpret_cast<char*>(ptr) + kGuardSize;
+  if (huge_pages) {
+    char* reserved_end = reinterpret_cast<char*>(ptr) + reserved_size;
+    usable_region = reinterpret_cast<char*>(
+        AlignUp<kHugePageSize>(reinterpret_cast<uintptr_t>(usable_region)));
+    char* start = usable_region - kGuardSize;
+    char* end = usable_region + size + kGuardSize;
+    int res = 0;
+    if (start != ptr)
+      res |= munmap(ptr, static_cast<size_t>(start - static_cast<char*>(ptr)));
+    if (end != reserved_end)
+      res |= munmap(end, static_cast<size_t>(reserved_end - end));
+    PERFETTO_CHECK(res == 0);
+    ptr = start;
+  }
   int res = mprotect(ptr, kGuardSize, PROT_NONE);
   res |= mprotect(usable_region + size, kGuardSize, PROT_NONE);
   PERFETTO_CHECK(res == 0);
+#if defined(MADV_HUGEPAGE)
+  // Best effort, this fails if the kernel is built without THP support.
+  if (huge_pages)
+    madvise(usable_region, size, MADV_HUGEPAGE);
+#endif
+  bool needs_populate = (flags & kPopulate) && huge_pages;
+#if !defined(MAP_POPULATE)
+  needs_populate = (flags & kPopulate) != 0;
+#endif
+  if (needs_populate) {
+    // The memory is zeroed, writing zeros keeps it so and faults it in.
+    for (size_t off = 0; off < size; off += kPageSize)
+      *reinterpret_cast<volatile char*>(usable_region + off) = 0;
+  }
 #endif  // PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
 
   auto memory = PagedMemory(usable_region, size);
 #if TRACK_COMMITTED_SIZE()
   size_t initial_commit = size;
-  if (flags & kDontCommit)
+  if ((flags & kDontCommit) && !(flags & kPopulate))
     initial_commit = std::min(initial_commit, kCommitChunkSize);
   memory.EnsureCommitted(initial_commit);
 #endif  // TRACK_COMMITTED_SIZE()
@@ -135,6 +135,46 @@ TEST(PagedMemoryTest, GuardRegions) {
   EXPECT_DEATH({ raw[kSize] = 'x'; }, ".*");
 }
 
+TEST(PagedMemoryTest, Populate) {
+  constexpr size_t kSize = 4096 * 256;
+  PagedMemory mem = PagedMemory::Allocate(
+      kSize, PagedMemory::kDontCommit | PagedMemory::kPopulate);
+  ASSERT_TRUE(mem.IsValid());
+  // Mapped before any access.
+  ASSERT_TRUE(vm_test_utils::IsMapped(mem.Get(), kSize));
+  for (size_t i = 0; i < kSize / sizeof(uint64_t); i++)
+    ASSERT_EQ(0u, *(reinterpret_cast<uint64_t*>(mem.Get()) + i));
+}
+
+TEST(PagedMemoryTest, HugePages) {
+  constexpr size_t kSize = PagedMemory::kHugePageSize * 2 + 4096;
+  for (int flags : {PagedMemory::kHugePages | 0,
+                    PagedMemory::kHugePages | PagedMemory::kPopulate}) {
+    void* ptr_raw = nullptr;
+    {
+      PagedMemory mem = PagedMemory::Allocate(kSize, flags);
+      ASSERT_TRUE(mem.IsValid());
+      ptr_raw = mem.Get();
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+      ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(ptr_raw) %
+                        PagedMemory::kHugePageSize);
+#endif
+      if (flags & PagedMemory::kPopulate)
+        ASSERT_TRUE(vm_test_utils::IsMapped(ptr_raw, kSize));
+      for (size_t i = 0; i < kSize / sizeof(uint64_t); i++)
+        ASSERT_EQ(0u, *(reinterpret_cast<uint64_t*>(ptr_raw) + i));
+
+      // The guard regions are still in place around the aligned memory.
+      volatile char* raw = reinterpret_cast<char*>(ptr_raw);
+      EXPECT_DEATH({ raw[-1] = 'x'; }, ".*");
+      EXPECT_DEATH({ raw[kSize] = 'x'; }, ".*");
+    }
+    // The excess reserved for the alignment is not leaked.
+    ASSERT_FALSE(vm_test_utils::IsMapped(ptr_raw, kSize));
+  }
+}
+
 // Disable this on:
 // MacOS: because it doesn't seem to have an equivalent rlimit to bound mmap().
 // Sanitizers: they seem to try to shadow mmaped memory and fail due to OOMs.
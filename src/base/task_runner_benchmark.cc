@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/base/epoll_task_runner.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/pipe.h"
+#include "perfetto/base/timer_wheel.h"
+#include "perfetto/base/unix_task_runner.h"
+
+namespace {
+
+using perfetto::base::EpollTaskRunner;
+using perfetto::base::Pipe;
+using perfetto::base::TimeMillis;
+using perfetto::base::TimerWheel;
+using perfetto::base::UnixTaskRunner;
+
+constexpr int kTasksPerRun = 1000;
+
+template <typename TaskRunner>
+void ChainedTask(TaskRunner* task_runner, int* tasks_left) {
+  if (!--(*tasks_left)) {
+    task_runner->Quit();
+    return;
+  }
+  task_runner->PostTask(
+      std::bind(&ChainedTask<TaskRunner>, task_runner, tasks_left));
+}
+
+// The queue of delayed tasks that the task runners used before TimerWheel, with
+// the same interface. Can't cancel: timers run anyway, as no-ops.
+class MultimapTimers {
+ public:
+  using TimerId = uint64_t;
+
+  TimerId Add(TimeMillis deadline, std::function<void()> task) {
+    timers_.emplace(deadline, std::move(task));
+    return 0;
+  }
+
+  bool Cancel(TimerId) { return false; }
+
+  std::function<void()> PopExpired(TimeMillis now) {
+    if (timers_.empty() || timers_.begin()->first > now)
+      return nullptr;
+    std::function<void()> task = std::move(timers_.begin()->second);
+    timers_.erase(timers_.begin());
+    return task;
+  }
+
+ private:
+  std::multimap<TimeMillis, std::function<void()>> timers_;
+};
+
+// Adds a timer per millisecond, with delays averaging |pending| ms so that
+// about |pending| timers are pending at any time, then runs the expired ones.
+// If |cancel|, each timer is cancelled halfway through its delay, like the
+// flush timeouts of the service when the producers ack in time.
+template <typename Timers>
+void RunTimers(benchmark::State& state, bool cancel) {
+  const uint32_t pending = static_cast<uint32_t>(state.range(0));
+  std::minstd_rand rnd;
+  Timers timers;
+  std::deque<std::pair<int64_t, typename Timers::TimerId>> to_cancel;
+  int64_t now = 0;
+  uint64_t num_run = 0;
+  std::function<void()> task = [&num_run] { num_run++; };
+  while (state.KeepRunning()) {
+    now++;
+    const int64_t delay = rnd() % (2 * pending);
+    auto id = timers.Add(TimeMillis(now + delay), task);
+    if (cancel) {
+      to_cancel.emplace_back(now + delay / 2, id);
+      while (to_cancel.front().first <= now) {
+        timers.Cancel(to_cancel.front().second);
+        to_cancel.pop_front();
+      }
+    }
+    while (std::function<void()> expired = timers.PopExpired(TimeMillis(now)))
+      expired();
+  }
+  state.counters["run"] = static_cast<double>(num_run);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+}  // namespace
+
+// Cost of adding and running a delayed task with state.range(0) pending ones.
+template <typename Timers>
+static void BM_DelayedTasks(benchmark::State& state) {
+  RunTimers<Timers>(state, /*cancel=*/false);
+}
+BENCHMARK_TEMPLATE(BM_DelayedTasks, MultimapTimers)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Arg(10000);
+BENCHMARK_TEMPLATE(BM_DelayedTasks, TimerWheel)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Arg(10000);
+
+// Same, but the tasks are timeouts that are cancelled before they are due.
+// MultimapTimers can't cancel them and runs them, like the task runners did
+// before, guarding the task with a WeakPtr or a check of the state.
+template <typename Timers>
+static void BM_DelayedTasksCancel(benchmark::State& state) {
+  RunTimers<Timers>(state, /*cancel=*/true);
+}
+BENCHMARK_TEMPLATE(BM_DelayedTasksCancel, MultimapTimers)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Arg(10000);
+BENCHMARK_TEMPLATE(BM_DelayedTasksCancel, TimerWheel)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Arg(10000);
+
+// Dispatch rate of immediate tasks, posted all at once before Run().
+template <typename TaskRunner>
+static void BM_TaskRunnerPostTask(benchmark::State& state) {
+  TaskRunner task_runner;
+  int counter = 0;
+  while (state.KeepRunning()) {
+    for (int i = 0; i < kTasksPerRun; i++)
+      task_runner.PostTask([&counter] { counter++; });
+    task_runner.PostTask([&task_runner] { task_runner.Quit(); });
+    task_runner.Run();
+  }
+  PERFETTO_CHECK(counter == kTasksPerRun * state.iterations());
+  state.SetItemsProcessed(state.iterations() * kTasksPerRun);
+}
+BENCHMARK_TEMPLATE(BM_TaskRunnerPostTask, UnixTaskRunner);
+BENCHMARK_TEMPLATE(BM_TaskRunnerPostTask, EpollTaskRunner);
+
+// Dispatch rate of immediate tasks, each posting the next one from the task
+// runner thread.
+template <typename TaskRunner>
+static void BM_TaskRunnerChainedTasks(benchmark::State& state) {
+  TaskRunner task_runner;
+  while (state.KeepRunning()) {
+    int tasks_left = kTasksPerRun;
+    task_runner.PostTask(
+        std::bind(&ChainedTask<TaskRunner>, &task_runner, &tasks_left));
+    task_runner.Run();
+  }
+  state.SetItemsProcessed(state.iterations() * kTasksPerRun);
+}
+BENCHMARK_TEMPLATE(BM_TaskRunnerChainedTasks, UnixTaskRunner);
+BENCHMARK_TEMPLATE(BM_TaskRunnerChainedTasks, EpollTaskRunner);
+
+// Latency from an fd becoming readable to its watch running, while
+// state.range(0) other idle fds are being watched as well (e.g. the sockets of
+// the producers connected to the tracing service).
+template <typename TaskRunner>
+static void BM_TaskRunnerFdEvent(benchmark::State& state) {
+  TaskRunner task_runner;
+  std::vector<Pipe> idle_pipes;
+  for (int64_t i = 0; i < state.range(0); i++) {
+    idle_pipes.emplace_back(Pipe::Create());
+    task_runner.AddFileDescriptorWatch(*idle_pipes.back().rd,
+                                       [] { PERFETTO_FATAL("Unexpected"); });
+  }
+  Pipe pipe = Pipe::Create();
+  task_runner.AddFileDescriptorWatch(*pipe.rd, [&task_runner, &pipe] {
+    char c;
+    PERFETTO_CHECK(read(*pipe.rd, &c, 1) == 1);
+    task_runner.Quit();
+  });
+  while (state.KeepRunning()) {
+    PERFETTO_CHECK(write(*pipe.wr, "x", 1) == 1);
+    task_runner.Run();
+  }
+  task_runner.RemoveFileDescriptorWatch(*pipe.rd);
+  for (const Pipe& idle_pipe : idle_pipes)
+    task_runner.RemoveFileDescriptorWatch(*idle_pipe.rd);
+}
+BENCHMARK_TEMPLATE(BM_TaskRunnerFdEvent, UnixTaskRunner)
+    ->Arg(1)
+    ->Arg(64)
+    ->Arg(512);
+BENCHMARK_TEMPLATE(BM_TaskRunnerFdEvent, EpollTaskRunner)
+    ->Arg(1)
+    ->Arg(64)
+    ->Arg(512);
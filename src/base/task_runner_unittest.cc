@@ -25,7 +25,14 @@
 #include "perfetto/base/android_task_runner.h"
 #endif
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#include "perfetto/base/epoll_task_runner.h"
+#endif
+
+#include <memory>
 #include <thread>
+#include <vector>
 
 #include "perfetto/base/file_utils.h"
 #include "perfetto/base/pipe.h"
@@ -42,7 +49,11 @@ class TaskRunnerTest : public ::testing::Test {
 
 #if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID) && \
     !PERFETTO_BUILDFLAG(PERFETTO_CHROMIUM_BUILD)
-using TaskRunnerTypes = ::testing::Types<AndroidTaskRunner, UnixTaskRunner>;
+using TaskRunnerTypes =
+    ::testing::Types<AndroidTaskRunner, UnixTaskRunner, EpollTaskRunner>;
+#elif PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+using TaskRunnerTypes = ::testing::Types<UnixTaskRunner, EpollTaskRunner>;
 #else
 using TaskRunnerTypes = ::testing::Types<UnixTaskRunner>;
 #endif
@@ -77,6 +88,18 @@ TYPED_TEST(TaskRunnerTest, PostImmediateTask) {
   EXPECT_EQ(0x1234, counter);
 }
 
+TYPED_TEST(TaskRunnerTest, PostManyImmediateTasks) {
+  auto& task_runner = this->task_runner;
+  std::vector<int> order;
+  for (int i = 0; i < 1000; i++)
+    task_runner.PostTask([&order, i] { order.push_back(i); });
+  task_runner.PostTask([&task_runner] { task_runner.Quit(); });
+  task_runner.Run();
+  ASSERT_EQ(1000u, order.size());
+  for (int i = 0; i < 1000; i++)
+    ASSERT_EQ(i, order[static_cast<size_t>(i)]);
+}
+
 TYPED_TEST(TaskRunnerTest, PostDelayedTask) {
   auto& task_runner = this->task_runner;
   int counter = 0;
@@ -89,6 +112,30 @@ TYPED_TEST(TaskRunnerTest, PostDelayedTask) {
   EXPECT_EQ(0x1234, counter);
 }
 
+TYPED_TEST(TaskRunnerTest, CancelDelayedTask) {
+  auto& task_runner = this->task_runner;
+  int counter = 0;
+  auto id1 = task_runner.PostCancelableDelayedTask(
+      [&counter] { counter = (counter << 4) | 1; }, 5);
+  auto id2 = task_runner.PostCancelableDelayedTask(
+      [&counter] { counter = (counter << 4) | 2; }, 10);
+  if (!id1)
+    return;  // This task runner doesn't support cancellation.
+  EXPECT_NE(id1, id2);
+  task_runner.PostDelayedTask(
+      [&task_runner, &counter, id1, id2] {
+        // Cancelling a task that already ran is a no-op.
+        task_runner.CancelDelayedTask(id1);
+        task_runner.CancelDelayedTask(id2);
+        counter = (counter << 4) | 3;
+      },
+      5);
+  task_runner.CancelDelayedTask(id2);
+  task_runner.PostDelayedTask([&task_runner] { task_runner.Quit(); }, 20);
+  task_runner.Run();
+  EXPECT_EQ(0x13, counter);
+}
+
 TYPED_TEST(TaskRunnerTest, PostImmediateTaskFromTask) {
   auto& task_runner = this->task_runner;
   task_runner.PostTask([&task_runner] {
@@ -271,6 +318,25 @@ TYPED_TEST(TaskRunnerTest, PostManyDelayedTasks) {
   task_runner.Run();
 }
 
+TYPED_TEST(TaskRunnerTest, ManyFileDescriptorWatches) {
+  auto& task_runner = this->task_runner;
+  std::vector<std::unique_ptr<TestPipe>> pipes;
+  int watches_left = 200;
+  for (int i = 0; i < 200; i++) {
+    pipes.emplace_back(new TestPipe());
+    TestPipe* pipe = pipes.back().get();
+    task_runner.AddFileDescriptorWatch(
+        pipe->rd.get(), [&task_runner, &watches_left, pipe] {
+          pipe->Read();
+          task_runner.RemoveFileDescriptorWatch(pipe->rd.get());
+          if (!--watches_left)
+            task_runner.Quit();
+        });
+  }
+  task_runner.Run();
+  EXPECT_EQ(0, watches_left);
+}
+
 TYPED_TEST(TaskRunnerTest, RunAgain) {
   auto& task_runner = this->task_runner;
   int counter = 0;
@@ -101,6 +101,16 @@ void TestTaskRunner::PostDelayedTask(std::function<void()> closure,
   task_runner_.PostDelayedTask(std::move(closure), delay_ms);
 }
 
+TaskRunner::DelayedTaskId TestTaskRunner::PostCancelableDelayedTask(
+    std::function<void()> closure,
+    uint32_t delay_ms) {
+  return task_runner_.PostCancelableDelayedTask(std::move(closure), delay_ms);
+}
+
+void TestTaskRunner::CancelDelayedTask(DelayedTaskId id) {
+  task_runner_.CancelDelayedTask(id);
+}
+
 void TestTaskRunner::AddFileDescriptorWatch(int fd,
                                             std::function<void()> callback) {
   task_runner_.AddFileDescriptorWatch(fd, std::move(callback));
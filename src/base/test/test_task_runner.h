@@ -58,6 +58,9 @@ class TestTaskRunner : public TaskRunner {
   // TaskRunner implementation.
   void PostTask(std::function<void()> closure) override;
   void PostDelayedTask(std::function<void()>, uint32_t delay_ms) override;
+  DelayedTaskId PostCancelableDelayedTask(std::function<void()>,
+                                          uint32_t delay_ms) override;
+  void CancelDelayedTask(DelayedTaskId) override;
   void AddFileDescriptorWatch(int fd, std::function<void()> callback) override;
   void RemoveFileDescriptorWatch(int fd) override;
 
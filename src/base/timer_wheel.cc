@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/base/timer_wheel.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "perfetto/base/logging.h"
+
+namespace perfetto {
+namespace base {
+
+namespace {
+
+inline uint64_t Bit(uint32_t slot) {
+  return uint64_t(1) << slot;
+}
+
+}  // namespace
+
+constexpr uint32_t TimerWheel::kBitsPerLevel;
+constexpr uint32_t TimerWheel::kSlotsPerLevel;
+constexpr uint32_t TimerWheel::kNumLevels;
+constexpr uint32_t TimerWheel::kNumSlots;
+constexpr uint32_t TimerWheel::kExpiredList;
+constexpr uint32_t TimerWheel::kNone;
+
+TimerWheel::TimerWheel() = default;
+TimerWheel::~TimerWheel() = default;
+
+TimerWheel::TimerId TimerWheel::Add(TimeMillis deadline,
+                                    std::function<void()> task) {
+  uint32_t timer = free_timers_;
+  if (timer != kNone) {
+    free_timers_ = timers_[timer].next;
+  } else {
+    PERFETTO_CHECK(timers_.size() < kNone);
+    timer = static_cast<uint32_t>(timers_.size());
+    timers_.emplace_back();
+  }
+  Timer& t = timers_[timer];
+  t.deadline = static_cast<uint64_t>(std::max(deadline.count(), int64_t(0)));
+  t.task = std::move(task);
+  size_++;
+  Place(timer);
+  return (static_cast<TimerId>(t.generation) << 32) | timer;
+}
+
+bool TimerWheel::Cancel(TimerId id) {
+  const uint32_t timer = static_cast<uint32_t>(id);
+  if (timer >= timers_.size())
+    return false;
+  const Timer& t = timers_[timer];
+  if (t.generation != static_cast<uint32_t>(id >> 32) || t.list == kNone)
+    return false;
+  Unlink(timer);
+  Release(timer);
+  return true;
+}
+
+std::function<void()> TimerWheel::PopExpired(TimeMillis now) {
+  // The expired list holds the timers < |time_|, so only once it is drained
+  // can the later ones be appended in order.
+  if (lists_[kExpiredList].head == kNone)
+    Advance(static_cast<uint64_t>(std::max(now.count(), int64_t(0))));
+  const uint32_t timer = lists_[kExpiredList].head;
+  if (timer == kNone)
+    return nullptr;
+  std::function<void()> task = std::move(timers_[timer].task);
+  Unlink(timer);
+  Release(timer);
+  return task;
+}
+
+TimeMillis TimerWheel::NextDeadline() const {
+  PERFETTO_DCHECK(!empty());
+  const uint32_t expired = lists_[kExpiredList].head;
+  if (expired != kNone)
+    return TimeMillis(static_cast<int64_t>(timers_[expired].deadline));
+  const uint64_t slot_time = NextSlotTime();
+  PERFETTO_DCHECK(slot_time != UINT64_MAX);
+  return TimeMillis(static_cast<int64_t>(slot_time));
+}
+
+void TimerWheel::Place(uint32_t timer) {
+  const uint64_t deadline = timers_[timer].deadline;
+  if (deadline < time_) {
+    Append(kExpiredList, timer);  // Added with a deadline in the past.
+    return;
+  }
+  // The finest level whose current window contains the deadline, i.e. the
+  // first one above the highest bit that differs from |time_|.
+  const uint64_t diff = deadline ^ time_;
+  const uint32_t level =
+      diff ? static_cast<uint32_t>(63 - __builtin_clzll(diff)) / kBitsPerLevel
+           : 0;
+  const uint32_t slot =
+      static_cast<uint32_t>(deadline >> (level * kBitsPerLevel)) &
+      (kSlotsPerLevel - 1);
+  Append(level * kSlotsPerLevel + slot, timer);
+  occupied_slots_[level] |= Bit(slot);
+}
+
+void TimerWheel::Append(uint32_t list, uint32_t timer) {
+  Timer& t = timers_[timer];
+  List& l = lists_[list];
+  t.list = list;
+  t.prev = l.tail;
+  t.next = kNone;
+  if (l.tail != kNone)
+    timers_[l.tail].next = timer;
+  else
+    l.head = timer;
+  l.tail = timer;
+}
+
+void TimerWheel::Unlink(uint32_t timer) {
+  Timer& t = timers_[timer];
+  List& l = lists_[t.list];
+  if (t.prev != kNone)
+    timers_[t.prev].next = t.next;
+  else
+    l.head = t.next;
+  if (t.next != kNone)
+    timers_[t.next].prev = t.prev;
+  else
+    l.tail = t.prev;
+  if (l.head == kNone && t.list != kExpiredList) {
+    occupied_slots_[t.list / kSlotsPerLevel] &=
+        ~Bit(t.list % kSlotsPerLevel);
+  }
+  t.list = kNone;
+}
+
+void TimerWheel::Release(uint32_t timer) {
+  Timer& t = timers_[timer];
+  t.task = nullptr;
+  if (++t.generation == 0)
+    t.generation = 1;
+  t.next = free_timers_;
+  free_timers_ = timer;
+  size_--;
+}
+
+void TimerWheel::Advance(uint64_t now) {
+  const uint64_t end = now + 1;
+  while (time_ < end) {
+    // Jump straight to the next non-empty slot, rather than ticking through
+    // the empty ones.
+    const uint64_t slot_time = NextSlotTime();
+    if (slot_time >= end) {
+      SetTime(end);
+      return;
+    }
+    SetTime(slot_time);
+    // If |slot_time| was the start of a slot of a higher level, SetTime()
+    // cascaded it and the level 0 slot might still be empty.
+    const uint32_t slot = static_cast<uint32_t>(time_) & (kSlotsPerLevel - 1);
+    if (!(occupied_slots_[0] & Bit(slot)))
+      continue;
+    List list = lists_[slot];
+    lists_[slot] = List();
+    occupied_slots_[0] &= ~Bit(slot);
+    for (uint32_t timer = list.head; timer != kNone;) {
+      const uint32_t next = timers_[timer].next;
+      Append(kExpiredList, timer);
+      timer = next;
+    }
+    SetTime(time_ + 1);
+  }
+}
+
+void TimerWheel::SetTime(uint64_t time) {
+  time_ = time;
+  // The slots of the higher levels that start at |time| move down. Go from the
+  // highest, as its timers might land in a slot of a lower level that also
+  // starts at |time|.
+  for (uint32_t level = kNumLevels - 1; level > 0; level--) {
+    const uint32_t shift = level * kBitsPerLevel;
+    if (time & ((uint64_t(1) << shift) - 1))
+      continue;
+    const uint32_t slot =
+        static_cast<uint32_t>(time >> shift) & (kSlotsPerLevel - 1);
+    if (!(occupied_slots_[level] & Bit(slot)))
+      continue;
+    List& l = lists_[level * kSlotsPerLevel + slot];
+    const uint32_t head = l.head;
+    l = List();
+    occupied_slots_[level] &= ~Bit(slot);
+    for (uint32_t timer = head; timer != kNone;) {
+      const uint32_t next = timers_[timer].next;
+      Place(timer);
+      timer = next;
+    }
+  }
+}
+
+uint64_t TimerWheel::NextSlotTime() const {
+  // The slots of a level cover times past the ones of all the levels below it,
+  // so the first level with a slot ahead of |time_| has the earliest one.
+  for (uint32_t level = 0; level < kNumLevels; level++) {
+    const uint32_t shift = level * kBitsPerLevel;
+    const uint32_t cur =
+        static_cast<uint32_t>(time_ >> shift) & (kSlotsPerLevel - 1);
+    // On level 0 the current slot holds the timers of the current millisecond,
+    // on the others it has been cascaded already.
+    const uint32_t first = level == 0 ? cur : cur + 1;
+    uint64_t slots = first < kSlotsPerLevel
+                         ? occupied_slots_[level] & (~uint64_t(0) << first)
+                         : 0;
+    if (!slots)
+      continue;
+    const uint32_t slot = static_cast<uint32_t>(__builtin_ctzll(slots));
+    const uint32_t window_shift = shift + kBitsPerLevel;
+    const uint64_t window_start =
+        window_shift < 64 ? (time_ >> window_shift) << window_shift : 0;
+    return window_start + (uint64_t(slot) << shift);
+  }
+  return UINT64_MAX;
+}
+
+}  // namespace base
+}  // namespace perfetto
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/base/timer_wheel.h"
+
+#include <map>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace base {
+namespace {
+
+// Runs the tasks of all the timers expired by |now|.
+void PopAll(TimerWheel* wheel, int64_t now) {
+  for (;;) {
+    std::function<void()> task = wheel->PopExpired(TimeMillis(now));
+    if (!task)
+      return;
+    task();
+  }
+}
+
+TEST(TimerWheelTest, ExpiresAtDeadline) {
+  TimerWheel wheel;
+  std::vector<int> ids;
+  EXPECT_TRUE(wheel.empty());
+  EXPECT_FALSE(wheel.PopExpired(TimeMillis(1000)));
+  wheel.Add(TimeMillis(1010), [&ids] { ids.push_back(1); });
+  wheel.Add(TimeMillis(1005), [&ids] { ids.push_back(2); });
+  EXPECT_EQ(2u, wheel.size());
+  EXPECT_EQ(TimeMillis(1005), wheel.NextDeadline());
+
+  PopAll(&wheel, 1004);
+  EXPECT_TRUE(ids.empty());
+  PopAll(&wheel, 1005);
+  EXPECT_EQ(std::vector<int>({2}), ids);
+  EXPECT_EQ(TimeMillis(1010), wheel.NextDeadline());
+  PopAll(&wheel, 2000);
+  EXPECT_EQ(std::vector<int>({2, 1}), ids);
+  EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheelTest, PastDeadlineExpiresImmediately) {
+  TimerWheel wheel;
+  std::vector<int> ids;
+  PopAll(&wheel, 5000);
+  wheel.Add(TimeMillis(4000), [&ids] { ids.push_back(1); });
+  EXPECT_EQ(TimeMillis(4000), wheel.NextDeadline());
+  PopAll(&wheel, 5000);
+  EXPECT_EQ(std::vector<int>({1}), ids);
+}
+
+TEST(TimerWheelTest, NextDeadlineIsLowerBound) {
+  TimerWheel wheel;
+  std::vector<int> ids;
+  PopAll(&wheel, 0);
+  const int64_t kDeadline = 123456789;
+  wheel.Add(TimeMillis(kDeadline), [&ids] { ids.push_back(1); });
+  // Each wake up at the reported deadline cascades the timer down one level,
+  // until the deadline is exact.
+  int wake_ups = 0;
+  for (;;) {
+    const int64_t next = wheel.NextDeadline().count();
+    ASSERT_LE(next, kDeadline);
+    PopAll(&wheel, next);
+    wake_ups++;
+    if (next == kDeadline)
+      break;
+  }
+  EXPECT_EQ(std::vector<int>({1}), ids);
+  EXPECT_LE(wake_ups, 5);
+}
+
+TEST(TimerWheelTest, Cancel) {
+  TimerWheel wheel;
+  std::vector<int> ids;
+  auto captured = std::make_shared<int>(0);
+  TimerWheel::TimerId id1 = wheel.Add(TimeMillis(100), [captured] {});
+  TimerWheel::TimerId id2 =
+      wheel.Add(TimeMillis(100000), [&ids] { ids.push_back(2); });
+  TimerWheel::TimerId id3 = wheel.Add(TimeMillis(100), [&ids] {
+    ids.push_back(3);
+  });
+  EXPECT_NE(0u, id1);
+  EXPECT_EQ(2, captured.use_count());
+
+  // Cancelling destroys the task straight away.
+  EXPECT_TRUE(wheel.Cancel(id1));
+  EXPECT_EQ(1, captured.use_count());
+  EXPECT_FALSE(wheel.Cancel(id1));
+  EXPECT_EQ(2u, wheel.size());
+
+  PopAll(&wheel, 200);
+  EXPECT_EQ(std::vector<int>({3}), ids);
+  EXPECT_FALSE(wheel.Cancel(id3));
+
+  // The slot of |id3| is reused, its stale id must not cancel the new timer.
+  TimerWheel::TimerId id4 =
+      wheel.Add(TimeMillis(300), [&ids] { ids.push_back(4); });
+  EXPECT_FALSE(wheel.Cancel(id3));
+  EXPECT_NE(id3, id4);
+
+  EXPECT_TRUE(wheel.Cancel(id2));
+  PopAll(&wheel, 1000000);
+  EXPECT_EQ(std::vector<int>({3, 4}), ids);
+  EXPECT_TRUE(wheel.empty());
+}
+
+// Checks the wheel against a std::multimap, which is what the task runners
+// used before, with timers spread over all the levels and cancellations.
+TEST(TimerWheelTest, MatchesMultimap) {
+  using Multimap = std::multimap<int64_t, int>;
+  std::minstd_rand rnd(42);
+  TimerWheel wheel;
+  Multimap expected_timers;
+  std::map<int, Multimap::iterator> expected_pending;
+  std::vector<std::pair<int, TimerWheel::TimerId>> added;
+  std::vector<int> ids;
+  std::vector<int> expected_ids;
+  int64_t now = 1000;
+  for (int i = 0; i < 20000; i++) {
+    switch (rnd() % 4) {
+      case 0:
+      case 1: {
+        // Short and long delays, with many ties.
+        static const uint32_t kMaxDelays[] = {1, 64, 5000, 300000, 100000000};
+        const int64_t deadline = now + rnd() % (kMaxDelays[rnd() % 5] + 1);
+        const int id = static_cast<int>(added.size());
+        expected_pending[id] = expected_timers.emplace(deadline, id);
+        added.emplace_back(id, wheel.Add(TimeMillis(deadline), [&ids, id] {
+          ids.push_back(id);
+        }));
+        break;
+      }
+      case 2: {
+        if (added.empty())
+          break;
+        // Cancel a random timer, which might have expired or been cancelled.
+        const auto& id_and_timer = added[rnd() % added.size()];
+        auto it = expected_pending.find(id_and_timer.first);
+        const bool pending = it != expected_pending.end();
+        if (pending) {
+          expected_timers.erase(it->second);
+          expected_pending.erase(it);
+        }
+        ASSERT_EQ(pending, wheel.Cancel(id_and_timer.second));
+        break;
+      }
+      case 3: {
+        static const uint32_t kMaxSteps[] = {1, 100, 10000, 1000000};
+        now += rnd() % (kMaxSteps[rnd() % 4] + 1);
+        PopAll(&wheel, now);
+        while (!expected_timers.empty() &&
+               expected_timers.begin()->first <= now) {
+          expected_ids.push_back(expected_timers.begin()->second);
+          expected_pending.erase(expected_timers.begin()->second);
+          expected_timers.erase(expected_timers.begin());
+        }
+        ASSERT_EQ(expected_ids, ids);
+        ASSERT_EQ(expected_timers.size(), wheel.size());
+        if (!wheel.empty()) {
+          ASSERT_LE(wheel.NextDeadline().count(),
+                    expected_timers.begin()->first);
+        }
+        break;
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace base
+}  // namespace perfetto
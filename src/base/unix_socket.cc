@@ -56,6 +56,13 @@ using CBufLenType = size_t;
 #else
 using CBufLenType = socklen_t;
 #endif
+
+// How long to wait before retrying to flush the queue of QueueSend() when the
+// socket buffer is full. There is no way to watch for the socket becoming
+// writable through the TaskRunner, so this polls, backing off exponentially
+// while the peer is not reading.
+constexpr uint32_t kSendQueueMinRetryDelayMs = 1;
+constexpr uint32_t kSendQueueMaxRetryDelayMs = 128;
 }
 
 // The CMSG_* macros use NULL instead of nullptr.
@@ -119,10 +126,30 @@ ssize_t SockSend(int fd,
                  size_t len,
                  const int* send_fds,
                  size_t num_fds) {
-  msghdr msg_hdr = {};
   iovec iov = {const_cast<void*>(msg), len};
-  msg_hdr.msg_iov = &iov;
-  msg_hdr.msg_iovlen = 1;
+  return SockSend(fd, &iov, 1, send_fds, num_fds);
+}
+
+namespace {
+
+// Sends |iov| with sendmsg(). If |send_all| is true the socket must be
+// blocking and sendmsg() is re-entered until everything has been sent (see
+// SendMsgAll()). Otherwise this returns after the first sendmsg(), which can
+// send only a part of |iov| if the socket buffer is full.
+ssize_t SockSendInternal(int fd,
+                         const struct iovec* iov,
+                         size_t iov_count,
+                         const int* send_fds,
+                         size_t num_fds,
+                         bool send_all) {
+  // SendMsgAll() updates the iovecs as it goes, so they need to be copied.
+  PERFETTO_CHECK(iov_count <= kMaxSendIovecs);
+  iovec iov_copy[kMaxSendIovecs];
+  std::copy(iov, iov + iov_count, iov_copy);
+
+  msghdr msg_hdr = {};
+  msg_hdr.msg_iov = iov_copy;
+  msg_hdr.msg_iovlen = static_cast<decltype(msg_hdr.msg_iovlen)>(iov_count);
   alignas(cmsghdr) char control_buf[256];
 
   if (num_fds > 0) {
@@ -142,7 +169,20 @@ ssize_t SockSend(int fd,
     // msg_hdr.msg_controllen would need to be adjusted, see "man 3 cmsg".
   }
 
-  return SendMsgAll(fd, &msg_hdr, kNoSigPipe);
+  if (send_all)
+    return SendMsgAll(fd, &msg_hdr, kNoSigPipe);
+  return PERFETTO_EINTR(sendmsg(fd, &msg_hdr, kNoSigPipe));
+}
+
+}  // namespace
+
+ssize_t SockSend(int fd,
+                 const struct iovec* iov,
+                 size_t iov_count,
+                 const int* send_fds,
+                 size_t num_fds) {
+  return SockSendInternal(fd, iov, iov_count, send_fds, num_fds,
+                          /*send_all=*/true);
 }
 
 ssize_t SockReceive(int fd,
@@ -227,6 +267,9 @@ ScopedFile CreateSocket() {
 
 // TODO(primiano): Add ThreadChecker to methods of this class.
 
+// static
+constexpr size_t UnixSocket::kMaxSendQueueSize;
+
 // static
 ScopedFile UnixSocket::CreateAndBind(const std::string& socket_name) {
   ScopedFile fd = CreateSocket();
@@ -343,6 +386,11 @@ UnixSocket::UnixSocket(EventListener* event_listener,
 }
 
 UnixSocket::~UnixSocket() {
+  // Send what fits in the socket buffer of the messages queued by QueueSend(),
+  // e.g. the last replies before the connection is closed. The rest is
+  // dropped: this must not block on a peer that doesn't read.
+  if (is_connected() && send_queue_size())
+    FlushSendQueue(BlockingMode::kNonBlocking);
   // The implicit dtor of |weak_ptr_factory_| will no-op pending callbacks.
   Shutdown(true);
 }
@@ -466,8 +514,17 @@ bool UnixSocket::Send(const void* msg,
                       const int* send_fds,
                       size_t num_fds,
                       BlockingMode blocking_mode) {
+  iovec iov = {const_cast<void*>(msg), len};
+  return Send(&iov, 1, send_fds, num_fds, blocking_mode);
+}
+
+bool UnixSocket::Send(const struct iovec* iov,
+                      size_t iov_count,
+                      const int* send_fds,
+                      size_t num_fds,
+                      BlockingMode blocking_mode) {
   // TODO(b/117139237): Non-blocking sends are broken because we do not
-  // properly handle partial sends.
+  // properly handle partial sends. Use QueueSend() instead.
   PERFETTO_DCHECK(blocking_mode == BlockingMode::kBlocking);
 
   if (state_ != State::kConnected) {
@@ -475,9 +532,17 @@ bool UnixSocket::Send(const void* msg,
     return false;
   }
 
+  // Preserve the ordering with the messages queued before.
+  if (send_queue_size() && !FlushSendQueue(BlockingMode::kBlocking))
+    return false;
+
+  size_t len = 0;
+  for (size_t i = 0; i < iov_count; i++)
+    len += iov[i].iov_len;
+
   if (blocking_mode == BlockingMode::kBlocking)
     SetBlockingIO(true);
-  const ssize_t sz = SockSend(*fd_, msg, len, send_fds, num_fds);
+  const ssize_t sz = SockSend(*fd_, iov, iov_count, send_fds, num_fds);
   if (blocking_mode == BlockingMode::kBlocking)
     SetBlockingIO(false);
 
@@ -506,6 +571,148 @@ bool UnixSocket::Send(const void* msg,
   return false;
 }
 
+bool UnixSocket::QueueSend(const void* msg,
+                           size_t len,
+                           int send_fd,
+                           BlockingMode blocking_mode) {
+  if (state_ != State::kConnected) {
+    errno = last_error_ = ENOTCONN;
+    return false;
+  }
+
+  if (send_fd != -1) {
+    // The caller is free to close |send_fd| as soon as this returns.
+    ScopedFile dup_fd(dup(send_fd));
+    if (!dup_fd) {
+      last_error_ = errno;
+      PERFETTO_DPLOG("dup()");
+      return false;
+    }
+    send_queue_fds_.push_back({send_queue_.size(), std::move(dup_fd)});
+  }
+  const uint8_t* bytes = static_cast<const uint8_t*>(msg);
+  send_queue_.insert(send_queue_.end(), bytes, bytes + len);
+
+  if (blocking_mode == BlockingMode::kBlocking &&
+      send_queue_size() >= kMaxSendQueueSize) {
+    return FlushSendQueue(BlockingMode::kBlocking);
+  }
+  PostFlushSendQueue(0);
+  return true;
+}
+
+bool UnixSocket::FlushSendQueue(BlockingMode blocking_mode) {
+  PERFETTO_DCHECK(state_ == State::kConnected);
+  const bool blocking = blocking_mode == BlockingMode::kBlocking;
+  if (blocking)
+    SetBlockingIO(true);
+  bool socket_buffer_full = false;
+  bool send_failed = false;
+  int send_errno = 0;
+  const size_t initial_queue_size = send_queue_size();
+  while (send_queue_size() && !socket_buffer_full) {
+    // A file descriptor is received together with the first bytes of the
+    // sendmsg() that carries it, so a message with a file descriptor always
+    // starts a new sendmsg() and the ones before it are not coalesced with it.
+    int send_fd = -1;
+    size_t next_fd_index = 0;
+    if (!send_queue_fds_.empty() &&
+        send_queue_fds_.front().offset == send_queue_offset_) {
+      send_fd = *send_queue_fds_.front().fd;
+      next_fd_index = 1;
+    }
+    size_t end = send_queue_.size();
+    if (next_fd_index < send_queue_fds_.size())
+      end = send_queue_fds_[next_fd_index].offset;
+    const size_t len = end - send_queue_offset_;
+
+    iovec iov = {&send_queue_[send_queue_offset_], len};
+    const ssize_t sz =
+        SockSendInternal(*fd_, &iov, 1, send_fd == -1 ? nullptr : &send_fd,
+                         send_fd == -1 ? 0 : 1, /*send_all=*/blocking);
+    if (sz > 0) {
+      send_queue_offset_ += static_cast<size_t>(sz);
+      if (send_fd != -1)
+        send_queue_fds_.erase(send_queue_fds_.begin());
+    }
+    if (sz == static_cast<ssize_t>(len))
+      continue;
+
+    // A partial non-blocking send means that the socket buffer is full. A
+    // partial blocking send means that the peer disconnected, as in Send().
+    if (!blocking && (sz >= 0 || errno == EAGAIN || errno == EWOULDBLOCK)) {
+      socket_buffer_full = true;
+      continue;
+    }
+    send_failed = true;
+    send_errno = errno;
+    break;
+  }
+  if (blocking)
+    SetBlockingIO(false);
+  if (send_failed) {
+    // SetBlockingIO() might have changed errno.
+    errno = last_error_ = send_errno;
+    PERFETTO_DPLOG("sendmsg() failed");
+    Shutdown(true);
+    return false;
+  }
+
+  if (!send_queue_size()) {
+    // clear() keeps the capacity, to reuse it for the next messages.
+    send_queue_.clear();
+    send_queue_offset_ = 0;
+    send_queue_retry_delay_ms_ = 0;
+    return true;
+  }
+
+  if (send_queue_size() < initial_queue_size) {
+    send_queue_retry_delay_ms_ = kSendQueueMinRetryDelayMs;
+  } else {
+    send_queue_retry_delay_ms_ =
+        std::min(std::max(send_queue_retry_delay_ms_ * 2,
+                          kSendQueueMinRetryDelayMs),
+                 kSendQueueMaxRetryDelayMs);
+  }
+
+  // Move the bytes left to the front, so that the buffer doesn't grow while
+  // the peer is slow, and retry later.
+  send_queue_.erase(send_queue_.begin(),
+                    send_queue_.begin() +
+                        static_cast<ptrdiff_t>(send_queue_offset_));
+  for (QueuedFd& queued_fd : send_queue_fds_)
+    queued_fd.offset -= send_queue_offset_;
+  send_queue_offset_ = 0;
+  PostFlushSendQueue(send_queue_retry_delay_ms_);
+  return true;
+}
+
+void UnixSocket::PostFlushSendQueue(uint32_t delay_ms) {
+  if (send_queue_flush_posted_)
+    return;
+  send_queue_flush_posted_ = true;
+  WeakPtr<UnixSocket> weak_ptr = weak_ptr_factory_.GetWeakPtr();
+  auto flush_task = [weak_ptr] {
+    if (!weak_ptr)
+      return;
+    weak_ptr->send_queue_flush_posted_ = false;
+    if (weak_ptr->is_connected() && weak_ptr->send_queue_size())
+      weak_ptr->FlushSendQueue(BlockingMode::kNonBlocking);
+  };
+  if (delay_ms) {
+    task_runner_->PostDelayedTask(flush_task, delay_ms);
+  } else {
+    task_runner_->PostTask(flush_task);
+  }
+}
+
+void UnixSocket::ClearSendQueue() {
+  send_queue_.clear();
+  send_queue_offset_ = 0;
+  send_queue_retry_delay_ms_ = 0;
+  send_queue_fds_.clear();
+}
+
 void UnixSocket::Shutdown(bool notify) {
   WeakPtr<UnixSocket> weak_ptr = weak_ptr_factory_.GetWeakPtr();
   if (notify) {
@@ -527,6 +734,7 @@ void UnixSocket::Shutdown(bool notify) {
     task_runner_->RemoveFileDescriptorWatch(*fd_);
     fd_.reset();
   }
+  ClearSendQueue();
   state_ = State::kDisconnected;
 }
 
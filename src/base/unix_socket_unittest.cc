@@ -551,6 +551,174 @@ TEST_F(UnixSocketTest, ReceiverDisconnectsDuringSend) {
   tx_thread.join();
 }
 
+// Messages queued within the same task are sent with a single sendmsg() once
+// the task runner gets to the flush task.
+TEST_F(UnixSocketTest, QueueSendCoalescesMessages) {
+  auto srv = UnixSocket::Listen(kSocketName, &event_listener_, &task_runner_);
+  ASSERT_TRUE(srv->is_listening());
+
+  auto cli = UnixSocket::Connect(kSocketName, &event_listener_, &task_runner_);
+  EXPECT_CALL(event_listener_, OnConnect(cli.get(), true));
+  auto cli_connected = task_runner_.CreateCheckpoint("cli_connected");
+  EXPECT_CALL(event_listener_, OnNewIncomingConnection(srv.get(), _))
+      .WillOnce(InvokeWithoutArgs(cli_connected));
+  task_runner_.RunUntilCheckpoint("cli_connected");
+  auto srv_conn = event_listener_.GetIncomingConnection();
+  ASSERT_TRUE(srv_conn);
+
+  ASSERT_TRUE(cli->QueueSend("msg1", 4));
+  ASSERT_TRUE(cli->QueueSend("msg2", 4));
+  ASSERT_TRUE(cli->QueueSend("msg3", 4));
+  EXPECT_EQ(12u, cli->send_queue_size());
+  char buf[32];
+  ASSERT_EQ(0u, srv_conn->Receive(buf, sizeof(buf)));
+
+  auto srv_did_recv = task_runner_.CreateCheckpoint("srv_did_recv");
+  EXPECT_CALL(event_listener_, OnDataAvailable(srv_conn.get()))
+      .WillRepeatedly(Invoke([srv_did_recv](UnixSocket* s) {
+        char recv_buf[32];
+        size_t res = s->Receive(recv_buf, sizeof(recv_buf));
+        if (!res)
+          return;
+        ASSERT_EQ("msg1msg2msg3", std::string(recv_buf, res));
+        srv_did_recv();
+      }));
+  task_runner_.RunUntilCheckpoint("srv_did_recv");
+  EXPECT_EQ(0u, cli->send_queue_size());
+}
+
+// A queued file descriptor is received together with the bytes of its message
+// and the messages are received in order, also when mixed with Send().
+TEST_F(UnixSocketTest, QueueSendWithFds) {
+  auto srv = UnixSocket::Listen(kSocketName, &event_listener_, &task_runner_);
+  ASSERT_TRUE(srv->is_listening());
+
+  auto cli = UnixSocket::Connect(kSocketName, &event_listener_, &task_runner_);
+  EXPECT_CALL(event_listener_, OnConnect(cli.get(), true));
+  auto cli_connected = task_runner_.CreateCheckpoint("cli_connected");
+  EXPECT_CALL(event_listener_, OnNewIncomingConnection(srv.get(), _))
+      .WillOnce(InvokeWithoutArgs(cli_connected));
+  task_runner_.RunUntilCheckpoint("cli_connected");
+  auto srv_conn = event_listener_.GetIncomingConnection();
+  ASSERT_TRUE(srv_conn);
+
+  {
+    ScopedFile zero_fd(base::OpenFile("/dev/zero", O_RDONLY));
+    ASSERT_TRUE(cli->QueueSend("msg1", 4));
+    ASSERT_TRUE(cli->QueueSend("msg2", 4, *zero_fd));
+    ASSERT_TRUE(cli->QueueSend("msg3", 4));
+    // The fd is dup()-ed by QueueSend(), so it can be closed here.
+  }
+  ASSERT_TRUE(cli->Send("msg4", 4, -1, kBlocking));
+
+  std::string received;
+  ScopedFile received_fd;
+  auto srv_did_recv = task_runner_.CreateCheckpoint("srv_did_recv");
+  EXPECT_CALL(event_listener_, OnDataAvailable(srv_conn.get()))
+      .WillRepeatedly(
+          Invoke([&received, &received_fd, srv_did_recv](UnixSocket* s) {
+            char buf[32];
+            ScopedFile fd;
+            size_t res = s->Receive(buf, sizeof(buf), &fd);
+            if (fd) {
+              // The fd comes along the bytes of its message.
+              ASSERT_FALSE(received_fd);
+              ASSERT_GE(received.size() + res, 8u);
+              received_fd = std::move(fd);
+            }
+            received.append(buf, res);
+            if (received.size() == 16)
+              srv_did_recv();
+          }));
+  task_runner_.RunUntilCheckpoint("srv_did_recv");
+  EXPECT_EQ("msg1msg2msg3msg4", received);
+  ASSERT_TRUE(received_fd);
+  char c = 1;
+  ASSERT_EQ(1, read(*received_fd, &c, 1));
+  ASSERT_EQ(0, c);
+}
+
+// QueueSend() doesn't block if the socket buffer is full: the rest of the
+// queue is sent once the peer starts reading.
+TEST_F(UnixSocketTest, QueueSendWithSlowPeer) {
+  auto srv = UnixSocket::Listen(kSocketName, &event_listener_, &task_runner_);
+  ASSERT_TRUE(srv->is_listening());
+
+  auto cli = UnixSocket::Connect(kSocketName, &event_listener_, &task_runner_);
+  EXPECT_CALL(event_listener_, OnConnect(cli.get(), true));
+  auto cli_connected = task_runner_.CreateCheckpoint("cli_connected");
+  EXPECT_CALL(event_listener_, OnNewIncomingConnection(srv.get(), _))
+      .WillOnce(InvokeWithoutArgs(cli_connected));
+  task_runner_.RunUntilCheckpoint("cli_connected");
+  auto srv_conn = event_listener_.GetIncomingConnection();
+  ASSERT_TRUE(srv_conn);
+
+  int sndbuf = 4096;
+  ASSERT_EQ(0, setsockopt(cli->fd(), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                          sizeof(sndbuf)));
+
+  // Stay below kMaxSendQueueSize, which would make QueueSend() block.
+  constexpr size_t kMsgSize = 1024;
+  constexpr size_t kNumMsgs = UnixSocket::kMaxSendQueueSize / kMsgSize / 2;
+  for (size_t i = 0; i < kNumMsgs; i++) {
+    char msg[kMsgSize];
+    memset(msg, static_cast<int>(i), sizeof(msg));
+    ASSERT_TRUE(cli->QueueSend(msg, sizeof(msg)));
+  }
+
+  std::string received;
+  auto srv_did_recv = task_runner_.CreateCheckpoint("srv_did_recv");
+  EXPECT_CALL(event_listener_, OnDataAvailable(srv_conn.get()))
+      .WillRepeatedly(Invoke([&received, srv_did_recv](UnixSocket* s) {
+        char buf[kMsgSize];
+        received.append(buf, s->Receive(buf, sizeof(buf)));
+        if (received.size() == kNumMsgs * kMsgSize)
+          srv_did_recv();
+      }));
+  task_runner_.RunUntilCheckpoint("srv_did_recv");
+  for (size_t i = 0; i < kNumMsgs * kMsgSize; i++)
+    ASSERT_EQ(static_cast<char>(i / kMsgSize), received[i]);
+  EXPECT_EQ(0u, cli->send_queue_size());
+}
+
+// Destroying a socket with a queue that doesn't fit in the socket buffer
+// doesn't block on the peer, the rest of the queue is dropped.
+TEST_F(UnixSocketTest, DestroyWithSlowPeerDoesNotBlock) {
+  auto srv = UnixSocket::Listen(kSocketName, &event_listener_, &task_runner_);
+  ASSERT_TRUE(srv->is_listening());
+
+  auto cli = UnixSocket::Connect(kSocketName, &event_listener_, &task_runner_);
+  EXPECT_CALL(event_listener_, OnConnect(cli.get(), true));
+  auto cli_connected = task_runner_.CreateCheckpoint("cli_connected");
+  EXPECT_CALL(event_listener_, OnNewIncomingConnection(srv.get(), _))
+      .WillOnce(InvokeWithoutArgs(cli_connected));
+  task_runner_.RunUntilCheckpoint("cli_connected");
+  auto srv_conn = event_listener_.GetIncomingConnection();
+  ASSERT_TRUE(srv_conn);
+
+  int sndbuf = 4096;
+  ASSERT_EQ(0, setsockopt(cli->fd(), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                          sizeof(sndbuf)));
+  char msg[1024] = {};
+  for (size_t i = 0; i < UnixSocket::kMaxSendQueueSize / sizeof(msg) / 2; i++)
+    ASSERT_TRUE(cli->QueueSend(msg, sizeof(msg)));
+  cli.reset();
+
+  // The peer gets what fit in the socket buffers, then the disconnection.
+  std::string received;
+  auto srv_disconnected = task_runner_.CreateCheckpoint("srv_disconnected");
+  EXPECT_CALL(event_listener_, OnDataAvailable(srv_conn.get()))
+      .WillRepeatedly(Invoke([&received](UnixSocket* s) {
+        char buf[1024];
+        received.append(buf, s->Receive(buf, sizeof(buf)));
+      }));
+  EXPECT_CALL(event_listener_, OnDisconnect(srv_conn.get()))
+      .WillOnce(InvokeWithoutArgs(srv_disconnected));
+  task_runner_.RunUntilCheckpoint("srv_disconnected");
+  EXPECT_GT(received.size(), 0u);
+  EXPECT_LT(received.size(), UnixSocket::kMaxSendQueueSize / 2);
+}
+
 TEST_F(UnixSocketTest, ShiftMsgHdrSendPartialFirst) {
   // Send a part of the first iov, then send the rest.
   struct iovec iov[2] = {};
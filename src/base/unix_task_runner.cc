@@ -99,13 +99,8 @@ void UnixTaskRunner::RunImmediateAndDelayedTask() {
       immediate_task = std::move(immediate_tasks_.front());
       immediate_tasks_.pop_front();
     }
-    if (!delayed_tasks_.empty()) {
-      auto it = delayed_tasks_.begin();
-      if (now >= it->first) {
-        delayed_task = std::move(it->second);
-        delayed_tasks_.erase(it);
-      }
-    }
+    if (!delayed_tasks_.empty())
+      delayed_task = delayed_tasks_.PopExpired(now);
   }
 
   errno = 0;
@@ -167,7 +162,7 @@ int UnixTaskRunner::GetDelayMsToNextTaskLocked() const {
   if (!immediate_tasks_.empty())
     return 0;
   if (!delayed_tasks_.empty()) {
-    TimeMillis diff = delayed_tasks_.begin()->first - GetWallTimeMs();
+    TimeMillis diff = delayed_tasks_.NextDeadline() - GetWallTimeMs();
     return std::max(0, static_cast<int>(diff.count()));
   }
   return -1;
@@ -186,12 +181,26 @@ void UnixTaskRunner::PostTask(std::function<void()> task) {
 
 void UnixTaskRunner::PostDelayedTask(std::function<void()> task,
                                      uint32_t delay_ms) {
+  PostCancelableDelayedTask(std::move(task), delay_ms);
+}
+
+TaskRunner::DelayedTaskId UnixTaskRunner::PostCancelableDelayedTask(
+    std::function<void()> task,
+    uint32_t delay_ms) {
   TimeMillis runtime = GetWallTimeMs() + TimeMillis(delay_ms);
+  DelayedTaskId id;
   {
     std::lock_guard<std::mutex> lock(lock_);
-    delayed_tasks_.insert(std::make_pair(runtime, std::move(task)));
+    id = delayed_tasks_.Add(runtime, std::move(task));
   }
   WakeUp();
+  return id;
+}
+
+void UnixTaskRunner::CancelDelayedTask(DelayedTaskId id) {
+  std::lock_guard<std::mutex> lock(lock_);
+  delayed_tasks_.Cancel(id);
+  // No need to wake up: at worst poll() times out for nothing.
 }
 
 void UnixTaskRunner::AddFileDescriptorWatch(int fd,
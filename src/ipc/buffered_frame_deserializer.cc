@@ -25,6 +25,8 @@
 #include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "perfetto/base/logging.h"
 #include "perfetto/base/utils.h"
+#include "perfetto/protozero/proto_decoder.h"
+#include "perfetto/protozero/proto_utils.h"
 
 #include "src/ipc/wire_protocol.pb.h"
 
@@ -33,8 +35,144 @@ namespace ipc {
 
 namespace {
 
+using protozero::ProtoDecoder;
+using protozero::proto_utils::kMessageLengthFieldSize;
+using protozero::proto_utils::ProtoWireType;
+using protozero::proto_utils::MakeTagLengthDelimited;
+using protozero::proto_utils::MakeTagVarInt;
+using protozero::proto_utils::WriteRedundantVarInt;
+using protozero::proto_utils::WriteVarInt;
+
 // The header is just the number of bytes of the Frame protobuf message.
 constexpr size_t kHeaderSize = sizeof(uint32_t);
+
+// Upper bound for the InvokeMethod(Reply) frames, on top of the size of the
+// args / reply message: the header, the request_id field, the tag and the
+// redundant length of the nested message and at most four fields within it.
+constexpr size_t kMaxInvokeFrameOverhead = 64;
+
+// Grows |buf| so that it can hold at least |size| bytes and returns a pointer
+// to the beginning of the frame. The header is backfilled by FinalizeFrame().
+uint8_t* BeginFrame(size_t size, std::vector<uint8_t>* buf) {
+  if (buf->size() < size)
+    buf->resize(size);
+  return buf->data();
+}
+
+// Backfills the size header of the frame [begin, end) and returns its size.
+size_t FinalizeFrame(uint8_t* begin, uint8_t* end) {
+  const size_t frame_size = static_cast<size_t>(end - begin);
+  const uint32_t payload_size = static_cast<uint32_t>(frame_size - kHeaderSize);
+  // Don't send messages larger than what the receiver can handle.
+  PERFETTO_DCHECK(frame_size <= kIPCBufferSize);
+  memcpy(begin, base::AssumeLittleEndian(&payload_size), kHeaderSize);
+  return frame_size;
+}
+
+// Writes the request_id and the preamble of the nested |msg_field_id| message.
+// Returns the pointer to its length field, to be backfilled by
+// EndNestedMessage() once its fields have been written from |*wptr| onwards.
+uint8_t* BeginNestedMessage(RequestID request_id,
+                            uint32_t msg_field_id,
+                            uint8_t** wptr) {
+  uint8_t* ptr = *wptr;
+  ptr = WriteVarInt(MakeTagVarInt(Frame::kRequestIdFieldNumber), ptr);
+  ptr = WriteVarInt(request_id, ptr);
+  ptr = WriteVarInt(MakeTagLengthDelimited(msg_field_id), ptr);
+  *wptr = ptr + kMessageLengthFieldSize;
+  return ptr;
+}
+
+void EndNestedMessage(uint8_t* size_field, uint8_t* end) {
+  const uint8_t* msg_begin = size_field + kMessageLengthFieldSize;
+  WriteRedundantVarInt(static_cast<uint32_t>(end - msg_begin), size_field);
+}
+
+// Writes a length-delimited |field_id| containing the serialized |msg|.
+// ByteSize() must have been called on |msg| beforehand.
+uint8_t* WriteMessageField(uint32_t field_id,
+                           const ProtoMessage& msg,
+                           uint8_t* ptr) {
+  ptr = WriteVarInt(MakeTagLengthDelimited(field_id), ptr);
+  ptr = WriteVarInt(static_cast<uint32_t>(msg.GetCachedSize()), ptr);
+  return msg.SerializeWithCachedSizesToArray(ptr);
+}
+
+bool IsVarInt(const ProtoDecoder::Field& field) {
+  return field.type == ProtoWireType::kVarInt;
+}
+
+bool IsLengthDelimited(const ProtoDecoder::Field& field) {
+  return field.type == ProtoWireType::kLengthDelimited;
+}
+
+bool DecodeInvokeMethod(const ProtoDecoder::Field& msg,
+                        Frame::InvokeMethod* req) {
+  using InvokeMethod = Frame::InvokeMethod;
+  ProtoDecoder decoder(msg.data(), msg.size());
+  for (auto f = decoder.ReadField(); f.id != 0; f = decoder.ReadField()) {
+    if (f.id == InvokeMethod::kServiceIdFieldNumber && IsVarInt(f)) {
+      req->set_service_id(f.as_uint32());
+    } else if (f.id == InvokeMethod::kMethodIdFieldNumber && IsVarInt(f)) {
+      req->set_method_id(f.as_uint32());
+    } else if (f.id == InvokeMethod::kArgsProtoFieldNumber &&
+               IsLengthDelimited(f)) {
+      req->set_args_proto(f.data(), f.size());
+    } else if (f.id == InvokeMethod::kDropReplyFieldNumber && IsVarInt(f)) {
+      req->set_drop_reply(f.int_value != 0);
+    } else {
+      return false;
+    }
+  }
+  return decoder.IsEndOfBuffer();
+}
+
+bool DecodeInvokeMethodReply(const ProtoDecoder::Field& msg,
+                             Frame::InvokeMethodReply* reply) {
+  using InvokeMethodReply = Frame::InvokeMethodReply;
+  ProtoDecoder decoder(msg.data(), msg.size());
+  for (auto f = decoder.ReadField(); f.id != 0; f = decoder.ReadField()) {
+    if (f.id == InvokeMethodReply::kSuccessFieldNumber && IsVarInt(f)) {
+      reply->set_success(f.int_value != 0);
+    } else if (f.id == InvokeMethodReply::kHasMoreFieldNumber && IsVarInt(f)) {
+      reply->set_has_more(f.int_value != 0);
+    } else if (f.id == InvokeMethodReply::kReplyProtoFieldNumber &&
+               IsLengthDelimited(f)) {
+      reply->set_reply_proto(f.data(), f.size());
+    } else {
+      return false;
+    }
+  }
+  return decoder.IsEndOfBuffer();
+}
+
+// Decodes the InvokeMethod and InvokeMethodReply frames, the ones exchanged on
+// each RPC, with ProtoDecoder, which is cheaper than the generic libprotobuf
+// parser. Returns false for any other (or malformed) frame, which is then left
+// to libprotobuf.
+bool DecodeInvokeFrame(const char* data, size_t size, Frame* frame) {
+  ProtoDecoder decoder(reinterpret_cast<const uint8_t*>(data), size);
+  for (auto f = decoder.ReadField(); f.id != 0; f = decoder.ReadField()) {
+    bool decoded = false;
+    if (f.id == Frame::kRequestIdFieldNumber && IsVarInt(f)) {
+      frame->set_request_id(f.as_uint64());
+      decoded = true;
+    } else if (f.id == Frame::kMsgInvokeMethodFieldNumber &&
+               IsLengthDelimited(f)) {
+      decoded = DecodeInvokeMethod(f, frame->mutable_msg_invoke_method());
+    } else if (f.id == Frame::kMsgInvokeMethodReplyFieldNumber &&
+               IsLengthDelimited(f)) {
+      decoded =
+          DecodeInvokeMethodReply(f, frame->mutable_msg_invoke_method_reply());
+    }
+    if (!decoded)
+      return false;
+  }
+  return decoder.IsEndOfBuffer() &&
+         (frame->msg_case() == Frame::kMsgInvokeMethod ||
+          frame->msg_case() == Frame::kMsgInvokeMethodReply);
+}
+
 }  // namespace
 
 BufferedFrameDeserializer::BufferedFrameDeserializer(size_t max_capacity)
@@ -167,6 +305,11 @@ void BufferedFrameDeserializer::DecodeFrame(const char* data, size_t size) {
   if (size == 0)
     return;
   std::unique_ptr<Frame> frame(new Frame);
+  if (DecodeInvokeFrame(data, size, frame.get())) {
+    decoded_frames_.push_back(std::move(frame));
+    return;
+  }
+  frame->Clear();
   const int sz = static_cast<int>(size);
   ::google::protobuf::io::ArrayInputStream stream(data, sz);
   if (frame->ParseFromBoundedZeroCopyStream(&stream, sz))
@@ -189,5 +332,73 @@ std::string BufferedFrameDeserializer::Serialize(const Frame& frame) {
   return buf;
 }
 
+// static
+size_t BufferedFrameDeserializer::Serialize(const Frame& frame,
+                                            std::vector<uint8_t>* buf) {
+  const size_t payload_size = static_cast<size_t>(frame.ByteSize());
+  uint8_t* begin = BeginFrame(kHeaderSize + payload_size, buf);
+  uint8_t* end = frame.SerializeWithCachedSizesToArray(begin + kHeaderSize);
+  return FinalizeFrame(begin, end);
+}
+
+// static
+size_t BufferedFrameDeserializer::SerializeInvokeMethod(
+    RequestID request_id,
+    ServiceID service_id,
+    MethodID method_id,
+    bool drop_reply,
+    const ProtoMessage& args,
+    std::vector<uint8_t>* buf) {
+  using InvokeMethod = Frame::InvokeMethod;
+  if (!args.IsInitialized())
+    return 0;
+  const size_t args_size = static_cast<size_t>(args.ByteSize());
+  uint8_t* begin = BeginFrame(kMaxInvokeFrameOverhead + args_size, buf);
+  uint8_t* wptr = begin + kHeaderSize;
+  uint8_t* size_field = BeginNestedMessage(
+      request_id, Frame::kMsgInvokeMethodFieldNumber, &wptr);
+  wptr = WriteVarInt(MakeTagVarInt(InvokeMethod::kServiceIdFieldNumber), wptr);
+  wptr = WriteVarInt(service_id, wptr);
+  wptr = WriteVarInt(MakeTagVarInt(InvokeMethod::kMethodIdFieldNumber), wptr);
+  wptr = WriteVarInt(method_id, wptr);
+  wptr = WriteMessageField(InvokeMethod::kArgsProtoFieldNumber, args, wptr);
+  wptr = WriteVarInt(MakeTagVarInt(InvokeMethod::kDropReplyFieldNumber), wptr);
+  wptr = WriteVarInt(drop_reply ? 1u : 0u, wptr);
+  EndNestedMessage(size_field, wptr);
+  PERFETTO_DCHECK(static_cast<size_t>(wptr - begin) <=
+                  kMaxInvokeFrameOverhead + args_size);
+  return FinalizeFrame(begin, wptr);
+}
+
+// static
+size_t BufferedFrameDeserializer::SerializeInvokeMethodReply(
+    RequestID request_id,
+    bool has_more,
+    const ProtoMessage* reply,
+    std::vector<uint8_t>* buf) {
+  using InvokeMethodReply = Frame::InvokeMethodReply;
+  const bool success = reply && reply->IsInitialized();
+  const size_t reply_size =
+      success ? static_cast<size_t>(reply->ByteSize()) : 0;
+  uint8_t* begin = BeginFrame(kMaxInvokeFrameOverhead + reply_size, buf);
+  uint8_t* wptr = begin + kHeaderSize;
+  uint8_t* size_field = BeginNestedMessage(
+      request_id, Frame::kMsgInvokeMethodReplyFieldNumber, &wptr);
+  wptr = WriteVarInt(MakeTagVarInt(InvokeMethodReply::kSuccessFieldNumber),
+                     wptr);
+  wptr = WriteVarInt(success ? 1u : 0u, wptr);
+  wptr = WriteVarInt(MakeTagVarInt(InvokeMethodReply::kHasMoreFieldNumber),
+                     wptr);
+  wptr = WriteVarInt(has_more ? 1u : 0u, wptr);
+  if (success) {
+    wptr = WriteMessageField(InvokeMethodReply::kReplyProtoFieldNumber, *reply,
+                             wptr);
+  }
+  EndNestedMessage(size_field, wptr);
+  PERFETTO_DCHECK(static_cast<size_t>(wptr - begin) <=
+                  kMaxInvokeFrameOverhead + reply_size);
+  return FinalizeFrame(begin, wptr);
+}
+
 }  // namespace ipc
 }  // namespace perfetto
@@ -21,6 +21,7 @@
 
 #include <list>
 #include <memory>
+#include <vector>
 
 #include <sys/mman.h>
 
@@ -92,6 +93,30 @@ class BufferedFrameDeserializer {
   // in common that doesn't justify having its own class.
   static std::string Serialize(const Frame&);
 
+  // Like the above, but serializes the frame (including its size header) into
+  // |buf| and returns the number of bytes written. |buf| is grown as needed
+  // and never shrunk, so the caller can keep one around per connection and
+  // avoid allocating on each send. Frames are bounded by kIPCBufferSize, and
+  // so is |buf|.
+  static size_t Serialize(const Frame&, std::vector<uint8_t>* buf);
+
+  // Fast paths for the two frames sent on each RPC. They encode the Frame
+  // envelope with protozero without building a Frame, and serialize |args| /
+  // |reply| in place, so the method arguments are copied only once, straight
+  // into |buf|. SerializeInvokeMethod() returns 0 if |args| is not fully
+  // initialized. SerializeInvokeMethodReply() replies with success = false if
+  // |reply| is null or not fully initialized.
+  static size_t SerializeInvokeMethod(RequestID,
+                                      ServiceID,
+                                      MethodID,
+                                      bool drop_reply,
+                                      const ProtoMessage& args,
+                                      std::vector<uint8_t>* buf);
+  static size_t SerializeInvokeMethodReply(RequestID,
+                                           bool has_more,
+                                           const ProtoMessage* reply,
+                                           std::vector<uint8_t>* buf);
+
   // Returns a buffer that can be passed to recv(). The buffer is deliberately
   // not initialized.
   ReceiveBuffer BeginReceive();
@@ -379,6 +379,67 @@ TEST(BufferedFrameDeserializerTest, FillCapacity) {
   }
 }
 
+// Checks that the frames encoded by the InvokeMethod(Reply) fast paths, into a
+// reused buffer, are decoded as if they were serialized from a Frame.
+TEST(BufferedFrameDeserializerTest, SerializeInvokeMethodIntoReusedBuffer) {
+  BufferedFrameDeserializer bfd;
+  std::vector<uint8_t> buf;
+
+  // Any message will do as method argument.
+  Frame::BindServiceReply args;
+  args.set_service_id(42);
+  for (uint32_t i = 0; i < 100; i++) {
+    auto* method = args.add_methods();
+    method->set_id(i);
+    method->set_name("method_" + std::to_string(i));
+  }
+  size_t size = BufferedFrameDeserializer::SerializeInvokeMethod(
+      1ull << 40, 3, 300, true, args, &buf);
+  ASSERT_GT(size, static_cast<size_t>(args.ByteSize()));
+  BufferedFrameDeserializer::ReceiveBuffer rbuf = bfd.BeginReceive();
+  memcpy(rbuf.data, buf.data(), size);
+  ASSERT_TRUE(bfd.EndReceive(size));
+  std::unique_ptr<Frame> frame = bfd.PopNextFrame();
+  ASSERT_TRUE(frame);
+  ASSERT_EQ(1ull << 40, frame->request_id());
+  ASSERT_EQ(Frame::kMsgInvokeMethod, frame->msg_case());
+  ASSERT_EQ(3u, frame->msg_invoke_method().service_id());
+  ASSERT_EQ(300u, frame->msg_invoke_method().method_id());
+  ASSERT_TRUE(frame->msg_invoke_method().drop_reply());
+  ASSERT_EQ(args.SerializeAsString(), frame->msg_invoke_method().args_proto());
+
+  // A smaller reply must not be affected by the leftovers of the frame above.
+  const size_t buf_size = buf.size();
+  args.mutable_methods()->Clear();
+  size = BufferedFrameDeserializer::SerializeInvokeMethodReply(2, true, &args,
+                                                               &buf);
+  ASSERT_EQ(buf_size, buf.size());
+  rbuf = bfd.BeginReceive();
+  memcpy(rbuf.data, buf.data(), size);
+  ASSERT_TRUE(bfd.EndReceive(size));
+  frame = bfd.PopNextFrame();
+  ASSERT_TRUE(frame);
+  ASSERT_EQ(2u, frame->request_id());
+  ASSERT_EQ(Frame::kMsgInvokeMethodReply, frame->msg_case());
+  ASSERT_TRUE(frame->msg_invoke_method_reply().success());
+  ASSERT_TRUE(frame->msg_invoke_method_reply().has_more());
+  ASSERT_EQ(args.SerializeAsString(),
+            frame->msg_invoke_method_reply().reply_proto());
+
+  // A null reply is a failure.
+  size = BufferedFrameDeserializer::SerializeInvokeMethodReply(3, false,
+                                                               nullptr, &buf);
+  rbuf = bfd.BeginReceive();
+  memcpy(rbuf.data, buf.data(), size);
+  ASSERT_TRUE(bfd.EndReceive(size));
+  frame = bfd.PopNextFrame();
+  ASSERT_TRUE(frame);
+  ASSERT_EQ(3u, frame->request_id());
+  ASSERT_FALSE(frame->msg_invoke_method_reply().success());
+  ASSERT_FALSE(frame->msg_invoke_method_reply().has_reply_proto());
+  ASSERT_FALSE(bfd.PopNextFrame());
+}
+
 }  // namespace
 }  // namespace ipc
 }  // namespace perfetto
@@ -89,17 +89,11 @@ RequestID ClientImpl::BeginInvoke(ServiceID service_id,
                                   bool drop_reply,
                                   base::WeakPtr<ServiceProxy> service_proxy,
                                   int fd) {
-  std::string args_proto;
   RequestID request_id = ++last_request_id_;
-  Frame frame;
-  frame.set_request_id(request_id);
-  Frame::InvokeMethod* req = frame.mutable_msg_invoke_method();
-  req->set_service_id(service_id);
-  req->set_method_id(remote_method_id);
-  req->set_drop_reply(drop_reply);
-  bool did_serialize = method_args.SerializeToString(&args_proto);
-  req->set_args_proto(args_proto);
-  if (!did_serialize || !SendFrame(frame, fd)) {
+  size_t size = BufferedFrameDeserializer::SerializeInvokeMethod(
+      request_id, service_id, remote_method_id, drop_reply, method_args,
+      &send_buf_);
+  if (!size || !SendSerializedFrame(size, fd)) {
     PERFETTO_DLOG("BeginInvoke() failed while sending the frame");
     return 0;
   }
@@ -116,13 +110,19 @@ RequestID ClientImpl::BeginInvoke(ServiceID service_id,
 
 bool ClientImpl::SendFrame(const Frame& frame, int fd) {
   // Serialize the frame into protobuf, add the size header, and send it.
-  std::string buf = BufferedFrameDeserializer::Serialize(frame);
+  size_t size = BufferedFrameDeserializer::Serialize(frame, &send_buf_);
+  return SendSerializedFrame(size, fd);
+}
 
+bool ClientImpl::SendSerializedFrame(size_t size, int fd) {
   // TODO(primiano): this should do non-blocking I/O. But then what if the
   // socket buffer is full? We might want to either drop the request or throttle
   // the send and PostTask the reply later? Right now we are making Send()
   // blocking as a workaround. Propagate bakpressure to the caller instead.
-  bool res = sock_->Send(buf.data(), buf.size(), fd,
+  // This can't use QueueSend() either: when the SharedMemoryArbiter runs out of
+  // chunks it sends a CommitData request and stalls the thread, without
+  // returning to the task runner, until the service has consumed the chunks.
+  bool res = sock_->Send(send_buf_.data(), size, fd,
                          base::UnixSocket::BlockingMode::kBlocking);
   PERFETTO_CHECK(res || !sock_->is_connected());
   return res;
@@ -28,6 +28,7 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <vector>
 
 namespace perfetto {
 
@@ -77,6 +78,9 @@ class ClientImpl : public Client, public base::UnixSocket::EventListener {
   ClientImpl& operator=(const ClientImpl&) = delete;
 
   bool SendFrame(const Frame&, int fd = -1);
+
+  // Sends the first |size| bytes of |send_buf_|, which must contain a frame.
+  bool SendSerializedFrame(size_t size, int fd);
   void OnFrameReceived(const Frame&);
   void OnBindServiceReply(QueuedRequest, const Frame::BindServiceReply&);
   void OnInvokeMethodReply(QueuedRequest, const Frame::InvokeMethodReply&);
@@ -86,6 +90,9 @@ class ClientImpl : public Client, public base::UnixSocket::EventListener {
   base::TaskRunner* const task_runner_;
   RequestID last_request_id_ = 0;
   BufferedFrameDeserializer frame_deserializer_;
+
+  // Reused across frames to serialize them without allocating on each send.
+  std::vector<uint8_t> send_buf_;
   base::ScopedFile received_fd_;
   std::map<RequestID, QueuedRequest> queued_requests_;
   std::map<ServiceID, base::WeakPtr<ServiceProxy>> service_bindings_;
@@ -75,6 +75,7 @@ bool HostImpl::ExposeService(std::unique_ptr<Service> service) {
     PERFETTO_DLOG("Duplicate ExposeService(): %s", service_name.c_str());
     return false;
   }
+  service->host_ = this;
   ServiceID sid = ++last_service_id_;
   ExposedService exposed_service(sid, service_name, std::move(service));
   services_.emplace(sid, std::move(exposed_service));
@@ -211,35 +212,51 @@ void HostImpl::ReplyToMethodInvocation(ClientID client_id,
     return;  // client has disconnected by the time we got the async reply.
 
   ClientConnection* client = client_iter->second.get();
-  Frame reply_frame;
-  reply_frame.set_request_id(request_id);
 
   // TODO(fmayer): add a test to guarantee that the reply is consumed within the
   // same call stack and not kept around. ConsumerIPCService::OnTraceData()
   // relies on this behavior.
-  auto* reply_frame_data = reply_frame.mutable_msg_invoke_method_reply();
-  reply_frame_data->set_has_more(reply.has_more());
-  if (reply.success()) {
-    std::string reply_proto;
-    if (reply->SerializeToString(&reply_proto)) {
-      reply_frame_data->set_reply_proto(reply_proto);
-      reply_frame_data->set_success(true);
-    }
-  }
-  SendFrame(client, reply_frame, reply.fd());
+  size_t size = BufferedFrameDeserializer::SerializeInvokeMethodReply(
+      request_id, reply.has_more(), reply.success() ? &*reply : nullptr,
+      &client->send_buf);
+  SendSerializedFrame(client, size, reply.fd());
 }
 
 // static
 void HostImpl::SendFrame(ClientConnection* client, const Frame& frame, int fd) {
-  std::string buf = BufferedFrameDeserializer::Serialize(frame);
-
-  // TODO(primiano): this should do non-blocking I/O. But then what if the
-  // socket buffer is full? We might want to either drop the request or throttle
-  // the send and PostTask the reply later? Right now we are making Send()
-  // blocking as a workaround. Propagate bakpressure to the caller instead.
-  bool res = client->sock->Send(buf.data(), buf.size(), fd,
-                                base::UnixSocket::BlockingMode::kBlocking);
-  PERFETTO_CHECK(res || !client->sock->is_connected());
+  size_t size = BufferedFrameDeserializer::Serialize(frame, &client->send_buf);
+  SendSerializedFrame(client, size, fd);
+}
+
+// static
+void HostImpl::SendSerializedFrame(ClientConnection* client,
+                                   size_t size,
+                                   int fd) {
+  // The frames sent within the same task (e.g. the replies to a batch of
+  // requests) are coalesced into a single sendmsg(). The host thread never
+  // blocks on a client: what doesn't fit in the socket buffer is queued and
+  // drained in the background, so that a stuck consumer can't stall the
+  // producers. The queue is bounded by disconnecting the client instead.
+  base::UnixSocket* sock = client->sock.get();
+  bool res = sock->QueueSend(client->send_buf.data(), size, fd,
+                             base::UnixSocket::BlockingMode::kNonBlocking);
+  PERFETTO_CHECK(res || !sock->is_connected());
+  if (sock->send_queue_size() > kMaxClientSendQueueSize) {
+    PERFETTO_ELOG("IPC client %" PRIu64
+                  " is not reading its replies (%zu bytes queued), "
+                  "disconnecting it",
+                  client->id, sock->send_queue_size());
+    // This drops the queue. OnDisconnect() will follow.
+    sock->Shutdown(/*notify=*/true);
+  }
+}
+
+size_t HostImpl::GetClientSendQueueSize(ClientID client_id) const {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  auto it = clients_.find(client_id);
+  if (it == clients_.end())
+    return 0;
+  return it->second->sock->send_queue_size();
 }
 
 void HostImpl::OnDisconnect(base::UnixSocket* sock) {
@@ -285,5 +302,11 @@ HostImpl::ExposedService::~ExposedService() = default;
 
 HostImpl::ClientConnection::~ClientConnection() = default;
 
+constexpr size_t HostImpl::kMaxClientSendQueueSize;
+
+size_t Service::GetClientSendQueueSize(ClientID client_id) const {
+  return host_ ? host_->GetClientSendQueueSize(client_id) : 0;
+}
+
 }  // namespace ipc
 }  // namespace perfetto
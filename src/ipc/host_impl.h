@@ -51,13 +51,23 @@ class HostImpl : public Host, public base::UnixSocket::EventListener {
 
   const base::UnixSocket* sock() const { return sock_.get(); }
 
+  // Replies and events are queued without ever blocking the host thread, see
+  // SendSerializedFrame(). A client that lets more than this pile up, because
+  // it is stuck or too slow, is disconnected.
+  static constexpr size_t kMaxClientSendQueueSize = 16 * 1024 * 1024;
+
+  // Returns 0 if the client is not connected (anymore).
+  size_t GetClientSendQueueSize(ClientID) const;
+
  private:
-  // Owns the per-client receive buffer (BufferedFrameDeserializer).
+  // Owns the per-client receive buffer (BufferedFrameDeserializer) and the
+  // send buffer, reused across the frames sent to the client.
   struct ClientConnection {
     ~ClientConnection();
     ClientID id;
     std::unique_ptr<base::UnixSocket> sock;
     BufferedFrameDeserializer frame_deserializer;
+    std::vector<uint8_t> send_buf;
     base::ScopedFile received_fd;
   };
   struct ExposedService {
@@ -83,6 +93,9 @@ class HostImpl : public Host, public base::UnixSocket::EventListener {
 
   static void SendFrame(ClientConnection*, const Frame&, int fd = -1);
 
+  // Sends the first |size| bytes of |client->send_buf|.
+  static void SendSerializedFrame(ClientConnection*, size_t size, int fd);
+
   base::TaskRunner* const task_runner_;
   std::map<ServiceID, ExposedService> services_;
   std::unique_ptr<base::UnixSocket> sock_;  // The listening socket.
@@ -50,6 +50,7 @@ constexpr char kSockName[] = TEST_SOCK_NAME("host_impl_unittest.sock");
 class FakeService : public Service {
  public:
   MOCK_METHOD2(OnFakeMethod1, void(const RequestProto&, DeferredBase*));
+  MOCK_METHOD0(OnClientDisconnected, void());
 
   static void Invoker(Service* service,
                       const ProtoMessage& req,
@@ -470,6 +471,60 @@ TEST_F(HostImplTest, MoveReplyObjectAndReplyAsynchronously) {
   task_runner_->RunUntilCheckpoint("on_reply_received");
 }
 
+// A client that stops reading its replies, e.g. a wedged consumer, must not
+// block the host, which keeps serving the other clients (e.g. the producers
+// committing data), nor make it queue replies without limits.
+TEST_F(HostImplTest, ClientNotReadingDoesNotBlockOtherClients) {
+  FakeService* fake_service = new FakeService("FakeService");
+  ASSERT_TRUE(host_->ExposeService(std::unique_ptr<Service>(fake_service)));
+  EXPECT_CALL(*fake_service, OnFakeMethod1(_, _))
+      .WillRepeatedly(Invoke([](const RequestProto& req, DeferredBase* reply) {
+        std::unique_ptr<ReplyProto> reply_args(new ReplyProto());
+        if (req.data() == "large_reply")
+          reply_args->set_data(std::string(kIPCBufferSize - 1024, 'x'));
+        reply->Resolve(AsyncResult<ProtoMessage>(
+            std::unique_ptr<ProtoMessage>(reply_args.release())));
+      }));
+
+  // The stuck client has its own task runner, which stops running once the
+  // client has connected and bound the service.
+  base::TestTaskRunner stuck_task_runner;
+  FakeClient stuck_cli(&stuck_task_runner);
+  auto on_stuck_connect = stuck_task_runner.CreateCheckpoint("on_connect");
+  EXPECT_CALL(stuck_cli, OnConnect()).WillOnce(Invoke(on_stuck_connect));
+  stuck_task_runner.RunUntilCheckpoint("on_connect");
+  stuck_cli.BindService("FakeService");
+  task_runner_->RunUntilIdle();
+  auto on_stuck_bind = stuck_task_runner.CreateCheckpoint("on_bind");
+  EXPECT_CALL(stuck_cli, OnServiceBound(_))
+      .WillOnce(InvokeWithoutArgs(on_stuck_bind));
+  stuck_task_runner.RunUntilCheckpoint("on_bind");
+
+  auto on_bind = task_runner_->CreateCheckpoint("on_bind");
+  cli_->BindService("FakeService");
+  EXPECT_CALL(*cli_, OnServiceBound(_)).WillOnce(InvokeWithoutArgs(on_bind));
+  task_runner_->RunUntilCheckpoint("on_bind");
+
+  // Ask for more replies than the host is willing to queue.
+  RequestProto req_args;
+  req_args.set_data("large_reply");
+  const size_t num_requests =
+      HostImpl::kMaxClientSendQueueSize / kIPCBufferSize + 16;
+  for (size_t i = 0; i < num_requests; i++)
+    stuck_cli.InvokeMethod(stuck_cli.last_bound_service_id_, 1, req_args);
+
+  // The other client still gets its reply and the stuck one is disconnected.
+  auto on_reply_received = task_runner_->CreateCheckpoint("on_reply_received");
+  EXPECT_CALL(*cli_, OnInvokeMethodReply(_))
+      .WillOnce(InvokeWithoutArgs(on_reply_received));
+  auto on_stuck_disconnect = task_runner_->CreateCheckpoint("on_disconnect");
+  EXPECT_CALL(*fake_service, OnClientDisconnected())
+      .WillOnce(InvokeWithoutArgs(on_stuck_disconnect));
+  cli_->InvokeMethod(cli_->last_bound_service_id_, 1, RequestProto());
+  task_runner_->RunUntilCheckpoint("on_reply_received");
+  task_runner_->RunUntilCheckpoint("on_disconnect");
+}
+
 // TODO(primiano): add the tests below in next CLs.
 // TEST(HostImplTest, ManyClients) {}
 // TEST(HostImplTest, OverlappingRequstsOutOfOrder) {}
@@ -18,6 +18,7 @@
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -34,7 +35,6 @@
 #include "perfetto/base/string_view.h"
 #include "perfetto/base/time.h"
 #include "perfetto/base/utils.h"
-#include "perfetto/protozero/proto_utils.h"
 #include "perfetto/traced/traced.h"
 #include "perfetto/tracing/core/data_source_config.h"
 #include "perfetto/tracing/core/data_source_descriptor.h"
@@ -126,9 +126,6 @@ bool ParseTraceConfigPbtxt(const std::string& file_name,
 // created by the system by setting setprop persist.traced.enable=1.
 const char* kTempDropBoxTraceDir = "/data/misc/perfetto-traces";
 
-using protozero::proto_utils::WriteVarInt;
-using protozero::proto_utils::MakeTagLengthDelimited;
-
 int PerfettoCmd::PrintUsage(const char* argv0) {
   PERFETTO_ELOG(R"(
 Usage: %s
@@ -138,6 +135,8 @@ Usage: %s
   --dropbox           TAG : Upload trace into DropBox using tag TAG
   --no-guardrails         : Ignore guardrails triggered when using --dropbox (for testing).
   --txt                   : Parse config as pbtxt. Not a stable API. Not for production use.
+  --compress              : Gzip the trace on the fly (not with --dropbox or write_into_file).
+  --preallocate           : Reserve the disk space for the whole trace upfront.
   --reset-guardrails      : Resets the state of the guardails and exits (for testing).
   --help           -h
 
@@ -170,6 +169,8 @@ int PerfettoCmd::Main(int argc, char** argv) {
     OPT_DROPBOX,
     OPT_ATRACE_APP,
     OPT_IGNORE_GUARDRAILS,
+    OPT_COMPRESS,
+    OPT_PREALLOCATE,
   };
   static const struct option long_options[] = {
       // |option_index| relies on the order of options, don't reshuffle them.
@@ -188,6 +189,8 @@ int PerfettoCmd::Main(int argc, char** argv) {
       {"config-uid", required_argument, nullptr, OPT_CONFIG_UID},
       {"reset-guardrails", no_argument, nullptr, OPT_RESET_GUARDRAILS},
       {"app", required_argument, nullptr, OPT_ATRACE_APP},
+      {"compress", no_argument, nullptr, OPT_COMPRESS},
+      {"preallocate", no_argument, nullptr, OPT_PREALLOCATE},
       {nullptr, 0, nullptr, 0}};
 
   int option_index = 0;
@@ -284,6 +287,20 @@ int PerfettoCmd::Main(int argc, char** argv) {
       continue;
     }
 
+    if (option == OPT_COMPRESS) {
+      if (!TraceFileWriter::IsCompressionSupported()) {
+        PERFETTO_ELOG("--compress requires a build with zlib");
+        return 1;
+      }
+      compress_ = true;
+      continue;
+    }
+
+    if (option == OPT_PREALLOCATE) {
+      preallocate_ = true;
+      continue;
+    }
+
     if (option == OPT_RESET_GUARDRAILS) {
       PERFETTO_CHECK(limiter.ClearState());
       PERFETTO_ILOG("Guardrail state cleared");
@@ -330,6 +347,12 @@ int PerfettoCmd::Main(int argc, char** argv) {
     return PrintUsage(argv[0]);
   }
 
+  // DropBox would get a gzip stream it doesn't know is compressed.
+  if (compress_ && !dropbox_tag_.empty()) {
+    PERFETTO_ELOG("--compress is not supported with --dropbox");
+    return 1;
+  }
+
   perfetto::protos::TraceConfig trace_config_proto;
 
   bool parsed;
@@ -366,8 +389,15 @@ int PerfettoCmd::Main(int argc, char** argv) {
   trace_config_->FromProto(trace_config_proto);
   trace_config_raw.clear();
 
+  if (compress_ && trace_config_->write_into_file()) {
+    PERFETTO_ELOG("--compress is not supported with write_into_file");
+    return 1;
+  }
+
   if (!OpenOutputFile())
     return 1;
+  if (preallocate_)
+    PreallocateOutputFile();
 
   if (background) {
     pid_t pid;
@@ -444,25 +474,32 @@ void PerfettoCmd::OnTimeout() {
 }
 
 void PerfettoCmd::OnTraceData(std::vector<TracePacket> packets, bool has_more) {
-  for (TracePacket& packet : packets) {
-    uint8_t preamble[16];
-    uint8_t* pos = preamble;
-    // ID of the |packet| field in trace.proto. Hardcoded as this we not depend
-    // on protos/trace:lite for binary size saving reasons.
-    static constexpr uint32_t kPacketFieldNumber = 1;
-    pos = WriteVarInt(MakeTagLengthDelimited(kPacketFieldNumber), pos);
-    pos = WriteVarInt(static_cast<uint32_t>(packet.size()), pos);
-    bytes_written_ +=
-        fwrite(reinterpret_cast<const char*>(preamble), 1,
-               static_cast<size_t>(pos - preamble), trace_out_stream_.get());
-    for (const Slice& slice : packet.slices()) {
-      bytes_written_ += fwrite(reinterpret_cast<const char*>(slice.start), 1,
-                               slice.size, trace_out_stream_.get());
+  // The packets are written on the |file_writer_| thread, so that this returns
+  // (and the next ones are received) without waiting for the disk.
+  if (!packets.empty()) {
+    if (!file_writer_) {
+      fflush(*trace_out_stream_);
+      file_writer_.reset(new TraceFileWriter(
+          base::ScopedFile(dup(fileno(*trace_out_stream_))), compress_));
     }
+    file_writer_->WritePackets(std::move(packets));
   }
 
-  if (!has_more)
+  if (!has_more) {
+    if (file_writer_ && !file_writer_->Finalize())
+      PERFETTO_ELOG("Failed to write the trace into the output file");
+    // The trace was written either by |file_writer_|, or by the service
+    // straight into the file (see OnTracingDisabled()) through a duplicate of
+    // the file descriptor, which shares the offset with it.
+    if (file_writer_) {
+      bytes_written_ = file_writer_->bytes_written();
+    } else {
+      off_t file_size = lseek(fileno(*trace_out_stream_), 0, SEEK_CUR);
+      if (file_size > 0)
+        bytes_written_ = static_cast<uint64_t>(file_size);
+    }
     FinalizeTraceAndExit();  // Reached end of trace.
+  }
 }
 
 void PerfettoCmd::OnTracingDisabled() {
@@ -471,13 +508,40 @@ void PerfettoCmd::OnTracingDisabled() {
     // already all the packets.
     return FinalizeTraceAndExit();
   }
-  // This will cause a bunch of OnTraceData callbacks. The last one will
-  // save the file and exit.
-  consumer_endpoint_->ReadBuffers();
+  fflush(*trace_out_stream_);
+  if (compress_) {
+    // The packets have to go through |file_writer_| to be compressed. Create it
+    // upfront, so that the gzip stream is written even if the trace is empty.
+    file_writer_.reset(new TraceFileWriter(
+        base::ScopedFile(dup(fileno(*trace_out_stream_))), /*compress=*/true));
+    consumer_endpoint_->ReadBuffers();
+    return;
+  }
+  // The service only writes into regular files: the output can also be a
+  // pipe, e.g. with -o -, and then the packets come over the IPC channel.
+  struct stat out_stat;
+  if (fstat(fileno(*trace_out_stream_), &out_stat) != 0 ||
+      !S_ISREG(out_stat.st_mode)) {
+    consumer_endpoint_->ReadBuffers();
+    return;
+  }
+  // Ask the service to write the buffers straight into the output file, which
+  // avoids copying the trace over the IPC channel. This will cause one
+  // OnTraceData callback, which will save the file and exit. Older versions of
+  // the service ignore the file and send back the packets instead, causing a
+  // bunch of OnTraceData callbacks.
+  consumer_endpoint_->ReadBuffers(
+      base::ScopedFile(dup(fileno(*trace_out_stream_))));
 }
 
 void PerfettoCmd::FinalizeTraceAndExit() {
   fflush(*trace_out_stream_);
+  if (preallocate_) {
+    // Give back the space reserved beyond the end of the trace.
+    off_t file_size = lseek(fileno(*trace_out_stream_), 0, SEEK_CUR);
+    if (file_size > 0)
+      base::ignore_result(ftruncate(fileno(*trace_out_stream_), file_size));
+  }
   if (dropbox_tag_.empty()) {
     trace_out_stream_.reset();
     did_process_full_trace_ = true;
@@ -545,6 +609,23 @@ bool PerfettoCmd::OpenOutputFile() {
   return true;
 }
 
+void PerfettoCmd::PreallocateOutputFile() {
+  // The trace can't be larger than the buffers, except when the service
+  // periodically writes their content into the file. Then it is bounded only
+  // by max_file_size_bytes, if set.
+  uint64_t size = 0;
+  if (trace_config_->write_into_file()) {
+    size = trace_config_->max_file_size_bytes();
+  } else {
+    for (const TraceConfig::BufferConfig& buffer : trace_config_->buffers())
+      size += static_cast<uint64_t>(buffer.size_kb()) * 1024;
+  }
+  if (!size)
+    return;
+  if (!TraceFileWriter::Preallocate(fileno(*trace_out_stream_), size))
+    PERFETTO_DPLOG("Could not preallocate %" PRIu64 " bytes", size);
+}
+
 void PerfettoCmd::SetupCtrlCSignalHandler() {
   // Setup signal handler.
   struct sigaction sa {};
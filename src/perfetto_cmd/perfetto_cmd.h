@@ -30,6 +30,7 @@
 #include "perfetto/tracing/core/consumer.h"
 #include "perfetto/tracing/ipc/consumer_ipc_client.h"
 #include "src/perfetto_cmd/rate_limiter.h"
+#include "src/perfetto_cmd/trace_file_writer.h"
 
 #include "src/perfetto_cmd/perfetto_cmd_state.pb.h"
 
@@ -63,6 +64,7 @@ class PerfettoCmd : public Consumer {
 
  private:
   bool OpenOutputFile();
+  void PreallocateOutputFile();
   void SetupCtrlCSignalHandler();
   void FinalizeTraceAndExit();
   int PrintUsage(const char* argv0);
@@ -76,6 +78,12 @@ class PerfettoCmd : public Consumer {
   std::string trace_out_path_;
   base::Event ctrl_c_evt_;
   std::string dropbox_tag_;
+  bool compress_ = false;
+  bool preallocate_ = false;
+
+  // Writes the packets received by OnTraceData(), when the service doesn't
+  // write the trace into the output file by itself.
+  std::unique_ptr<TraceFileWriter> file_writer_;
   bool did_process_full_trace_ = false;
   uint64_t bytes_written_ = 0;
 };
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/perfetto_cmd/trace_file_writer.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/file_utils.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/utils.h"
+
+#if defined(PERFETTO_ENABLE_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace perfetto {
+
+#if defined(PERFETTO_ENABLE_ZLIB)
+
+namespace {
+
+// Size of the buffer that accumulates the compressed output between writes.
+constexpr size_t kCompressedBufferSize = 256 * 1024;
+
+}  // namespace
+
+// Deflates the trace into a gzip stream. Uses the fastest compression level,
+// so that compressing keeps up with the readout of the buffers. Traces are
+// very redundant, higher levels shrink them only marginally more.
+class TraceFileWriter::Compressor {
+ public:
+  explicit Compressor(TraceFileWriter* writer)
+      : writer_(writer), buf_(new uint8_t[kCompressedBufferSize]) {
+    // 15 + 16: the largest window, with a gzip header and trailer.
+    PERFETTO_CHECK(deflateInit2(&stream_, Z_BEST_SPEED, Z_DEFLATED, 15 + 16,
+                                8, Z_DEFAULT_STRATEGY) == Z_OK);
+    ResetOutput();
+  }
+
+  ~Compressor() { deflateEnd(&stream_); }
+
+  bool Write(const void* data, size_t size) {
+    stream_.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+    stream_.avail_in = static_cast<uInt>(size);
+    while (stream_.avail_in) {
+      PERFETTO_CHECK(deflate(&stream_, Z_NO_FLUSH) == Z_OK);
+      if (!stream_.avail_out && !FlushOutput())
+        return false;
+    }
+    return true;
+  }
+
+  // Compresses whatever is left and writes the gzip trailer.
+  bool Finish() {
+    for (;;) {
+      int res = deflate(&stream_, Z_FINISH);
+      PERFETTO_CHECK(res == Z_OK || res == Z_STREAM_END);
+      if (!FlushOutput())
+        return false;
+      if (res == Z_STREAM_END)
+        return true;
+    }
+  }
+
+ private:
+  bool FlushOutput() {
+    size_t size = kCompressedBufferSize - stream_.avail_out;
+    ResetOutput();
+    return !size || writer_->WriteToFile(buf_.get(), size);
+  }
+
+  void ResetOutput() {
+    stream_.next_out = buf_.get();
+    stream_.avail_out = static_cast<uInt>(kCompressedBufferSize);
+  }
+
+  TraceFileWriter* const writer_;
+  std::unique_ptr<uint8_t[]> buf_;
+  z_stream stream_{};
+};
+
+// static
+bool TraceFileWriter::IsCompressionSupported() {
+  return true;
+}
+
+#else  // PERFETTO_ENABLE_ZLIB
+
+class TraceFileWriter::Compressor {
+ public:
+  explicit Compressor(TraceFileWriter*) { PERFETTO_FATAL("Not supported"); }
+  bool Write(const void*, size_t) { return false; }
+  bool Finish() { return false; }
+};
+
+// static
+bool TraceFileWriter::IsCompressionSupported() {
+  return false;
+}
+
+#endif  // PERFETTO_ENABLE_ZLIB
+
+constexpr size_t TraceFileWriter::kMaxPendingBatches;
+
+// static
+bool TraceFileWriter::Preallocate(int fd, uint64_t size) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // FALLOC_FL_KEEP_SIZE: the file doesn't look bigger than what was written,
+  // even if the trace ends up smaller than |size|.
+  return fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0;
+#else
+  base::ignore_result(fd, size);
+  return false;
+#endif
+}
+
+TraceFileWriter::TraceFileWriter(base::ScopedFile fd, bool compress)
+    : fd_(std::move(fd)),
+      compressor_(compress ? new Compressor(this) : nullptr),
+      thread_(&TraceFileWriter::Run, this) {}
+
+TraceFileWriter::~TraceFileWriter() {
+  Finalize();
+}
+
+void TraceFileWriter::WritePackets(std::vector<TracePacket> packets) {
+  PERFETTO_DCHECK(!finalized_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  batch_written_.wait(
+      lock, [this] { return pending_batches_.size() < kMaxPendingBatches; });
+  pending_batches_.emplace_back(std::move(packets));
+  lock.unlock();
+  batch_queued_.notify_one();
+}
+
+bool TraceFileWriter::Finalize() {
+  if (!finalized_) {
+    finalized_ = true;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    batch_queued_.notify_one();
+    thread_.join();
+  }
+  return !failed_;
+}
+
+void TraceFileWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    batch_queued_.wait(lock,
+                       [this] { return quit_ || !pending_batches_.empty(); });
+    if (pending_batches_.empty())
+      break;  // |quit_| is set and all the batches have been written.
+    std::vector<TracePacket> batch = std::move(pending_batches_.front());
+    pending_batches_.pop_front();
+    lock.unlock();
+    // Keep draining the queue after a failure, so that WritePackets() doesn't
+    // block forever, but don't write anything else.
+    if (!failed_ && !WriteBatch(&batch))
+      failed_ = true;
+    batch.clear();  // Free the packets before taking the next batch.
+    lock.lock();
+    batch_written_.notify_one();
+  }
+  lock.unlock();
+  if (!failed_ && compressor_ && !compressor_->Finish())
+    failed_ = true;
+}
+
+bool TraceFileWriter::WriteBatch(std::vector<TracePacket>* packets) {
+  char* preamble;
+  size_t preamble_size;
+  if (compressor_) {
+    for (TracePacket& packet : *packets) {
+      std::tie(preamble, preamble_size) = packet.GetProtoPreamble();
+      if (!compressor_->Write(preamble, preamble_size))
+        return false;
+      uncompressed_bytes_ += preamble_size;
+      for (const Slice& slice : packet.slices()) {
+        if (!compressor_->Write(slice.start, slice.size))
+          return false;
+        uncompressed_bytes_ += slice.size;
+      }
+    }
+    return true;
+  }
+
+  // Point writev() straight at the slices, as the service does when it writes
+  // the trace into a file, to avoid copying them.
+  std::vector<struct iovec> iovecs;
+  for (TracePacket& packet : *packets) {
+    std::tie(preamble, preamble_size) = packet.GetProtoPreamble();
+    iovecs.push_back({preamble, preamble_size});
+    for (const Slice& slice : packet.slices())
+      iovecs.push_back({const_cast<void*>(slice.start), slice.size});
+  }
+  for (size_t i = 0; i < iovecs.size(); i += IOV_MAX) {
+    const size_t num_iovecs =
+        std::min(iovecs.size() - i, static_cast<size_t>(IOV_MAX));
+    size_t size = 0;
+    for (size_t j = i; j < i + num_iovecs; j++)
+      size += iovecs[j].iov_len;
+    ssize_t wr_size = PERFETTO_EINTR(
+        writev(*fd_, &iovecs[i], static_cast<int>(num_iovecs)));
+    if (wr_size != static_cast<ssize_t>(size)) {
+      PERFETTO_PLOG("writev() failed");
+      return false;
+    }
+    bytes_written_ += size;
+    uncompressed_bytes_ += size;
+  }
+  return true;
+}
+
+bool TraceFileWriter::WriteToFile(const void* data, size_t size) {
+  if (base::WriteAll(*fd_, data, size) != static_cast<ssize_t>(size)) {
+    PERFETTO_PLOG("write() failed");
+    return false;
+  }
+  bytes_written_ += size;
+  return true;
+}
+
+}  // namespace perfetto
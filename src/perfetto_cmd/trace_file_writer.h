@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_PERFETTO_CMD_TRACE_FILE_WRITER_H_
+#define SRC_PERFETTO_CMD_TRACE_FILE_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/tracing/core/trace_packet.h"
+
+namespace perfetto {
+
+// Writes the packets received through Consumer::OnTraceData() into the trace
+// file on a dedicated thread, so that the disk latency doesn't throttle the
+// readout of the trace buffers. Batches of packets are queued up to
+// kMaxPendingBatches, beyond which WritePackets() blocks until the thread
+// catches up, keeping the memory bounded when the disk is slower than the
+// service.
+// Optionally, the trace is compressed with deflate as it is written, in the
+// gzip format (i.e. the output can be decompressed with gunzip). This is
+// available only if built with zlib, see IsCompressionSupported().
+class TraceFileWriter {
+ public:
+  static constexpr size_t kMaxPendingBatches = 16;
+
+  static bool IsCompressionSupported();
+
+  // Reserves |size| bytes for the file, without changing its size, so that
+  // appending to a large trace doesn't have to allocate blocks as it goes and
+  // the file ends up less fragmented. Best effort: returns false if the
+  // file system (or the platform) doesn't support it.
+  static bool Preallocate(int fd, uint64_t size);
+
+  // Writes into |fd| starting from its current offset. |compress| must be
+  // false unless IsCompressionSupported().
+  TraceFileWriter(base::ScopedFile fd, bool compress);
+
+  // Waits for the batches still pending to be written, see Finalize().
+  ~TraceFileWriter();
+
+  // Queues the packets to be appended to the file, each one preceded by the
+  // preamble that makes it a perfetto.protos.Trace.packet field.
+  void WritePackets(std::vector<TracePacket>);
+
+  // Writes the batches still pending, terminates the compressed stream and
+  // joins the thread. Returns false if any write failed. No more packets can
+  // be written after this.
+  bool Finalize();
+
+  // Bytes written into the file, compressed if enabled. Valid after
+  // Finalize().
+  uint64_t bytes_written() const { return bytes_written_; }
+
+  // Size of the trace before compression. Valid after Finalize().
+  uint64_t uncompressed_bytes() const { return uncompressed_bytes_; }
+
+ private:
+  class Compressor;
+
+  TraceFileWriter(const TraceFileWriter&) = delete;
+  TraceFileWriter& operator=(const TraceFileWriter&) = delete;
+
+  void Run();
+  bool WriteBatch(std::vector<TracePacket>*);
+  bool WriteToFile(const void* data, size_t size);
+
+  base::ScopedFile fd_;
+  std::unique_ptr<Compressor> compressor_;
+  bool finalized_ = false;
+
+  // Accessed only by the writer thread until it is joined.
+  uint64_t bytes_written_ = 0;
+  uint64_t uncompressed_bytes_ = 0;
+  bool failed_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable batch_queued_;
+  std::condition_variable batch_written_;
+
+  // --- Begin |mutex_|-protected members ---
+  std::deque<std::vector<TracePacket>> pending_batches_;
+  bool quit_ = false;
+  // --- End |mutex_|-protected members ---
+
+  std::thread thread_;  // Keep last, Run() uses all the members above.
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_PERFETTO_CMD_TRACE_FILE_WRITER_H_
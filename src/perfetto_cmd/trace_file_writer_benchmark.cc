@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/base/temp_file.h"
+#include "perfetto/tracing/core/trace_packet.h"
+#include "src/perfetto_cmd/trace_file_writer.h"
+
+namespace {
+
+using perfetto::Slice;
+using perfetto::TraceFileWriter;
+using perfetto::TracePacket;
+
+// Models reading a full 64 MB trace buffer: ReadBuffers() delivers ~32 KB of
+// ~1 KB packets per OnTraceData() call.
+constexpr size_t kTraceSize = 64 * 1024 * 1024;
+constexpr size_t kBatchSize = 32 * 1024;
+constexpr size_t kPacketSize = 1024;
+
+}  // namespace
+
+// Throughput of writing a large trace into a file, as PerfettoCmd does when
+// the packets are sent over the IPC channel. The "blocked_ms" counter is the
+// time the caller spent in WritePackets(), during which it couldn't receive
+// more packets. state.range(0) enables the compression.
+static void BM_TraceFileWriter(benchmark::State& state) {
+  const bool compress = state.range(0);
+  if (compress && !TraceFileWriter::IsCompressionSupported()) {
+    state.SkipWithError("Built without zlib");
+    return;
+  }
+
+  // Something that compresses roughly like a real trace: 16 bytes events with
+  // the same fields, a few of which have small varying values (e.g. pids and
+  // timestamp deltas).
+  std::minstd_rand rnd;
+  std::vector<char> payload(kBatchSize);
+  for (size_t i = 0; i < kBatchSize; i += 16) {
+    const char event[16] = {0x0a, 0x0e, 0x08, static_cast<char>(rnd() % 128),
+                            0x10, static_cast<char>(rnd() % 4), 0x18, 0x01,
+                            0x22, 0x06, 's',  'c',
+                            'h',  'e',  'd',  static_cast<char>(rnd() % 8)};
+    std::copy(event, event + sizeof(event), &payload[i]);
+  }
+
+  double blocked_ms = 0;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    perfetto::base::TempFile file = perfetto::base::TempFile::CreateUnlinked();
+    state.ResumeTiming();
+
+    TraceFileWriter writer(perfetto::base::ScopedFile(dup(file.fd())),
+                           compress);
+    for (size_t written = 0; written < kTraceSize; written += kBatchSize) {
+      std::vector<TracePacket> packets;
+      for (size_t off = 0; off < kBatchSize; off += kPacketSize) {
+        packets.emplace_back();
+        packets.back().AddSlice(Slice(&payload[off], kPacketSize));
+      }
+      auto start = std::chrono::steady_clock::now();
+      writer.WritePackets(std::move(packets));
+      blocked_ms += std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    }
+    PERFETTO_CHECK(writer.Finalize());
+    state.counters["ratio"] = static_cast<double>(writer.uncompressed_bytes()) /
+                              static_cast<double>(writer.bytes_written());
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(kTraceSize));
+  state.counters["blocked_ms"] =
+      blocked_ms / static_cast<double>(state.iterations());
+}
+BENCHMARK(BM_TraceFileWriter)
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
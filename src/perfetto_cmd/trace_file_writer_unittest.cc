@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/perfetto_cmd/trace_file_writer.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "perfetto/base/file_utils.h"
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/base/temp_file.h"
+#include "perfetto/protozero/proto_utils.h"
+#include "perfetto/tracing/core/trace_packet.h"
+
+#include "gtest/gtest.h"
+
+#if defined(PERFETTO_ENABLE_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace perfetto {
+namespace {
+
+// Returns a packet made of |num_slices| slices of |slice_size| bytes, all set
+// to |value|.
+TracePacket CreatePacket(size_t num_slices, size_t slice_size, char value) {
+  TracePacket packet;
+  for (size_t i = 0; i < num_slices; i++) {
+    Slice slice = Slice::Allocate(slice_size);
+    memset(slice.own_data(), value, slice_size);
+    packet.AddSlice(std::move(slice));
+  }
+  return packet;
+}
+
+// Returns what the packets created by CreatePacket() look like in the file: a
+// perfetto.protos.Trace message with one |packet| field (id 1) per packet.
+std::string SerializePacket(size_t num_slices, size_t slice_size, char value) {
+  using protozero::proto_utils::MakeTagLengthDelimited;
+  using protozero::proto_utils::WriteVarInt;
+  const size_t size = num_slices * slice_size;
+  uint8_t preamble[16];
+  uint8_t* pos = WriteVarInt(MakeTagLengthDelimited(1), preamble);
+  pos = WriteVarInt(static_cast<uint32_t>(size), pos);
+  std::string serialized(reinterpret_cast<char*>(preamble),
+                         static_cast<size_t>(pos - preamble));
+  serialized.append(size, value);
+  return serialized;
+}
+
+std::string ReadFile(const base::TempFile& file) {
+  std::string contents;
+  EXPECT_TRUE(base::ReadFile(file.path(), &contents));
+  return contents;
+}
+
+TEST(TraceFileWriterTest, WritesPacketsInOrder) {
+  base::TempFile file = base::TempFile::Create();
+  TraceFileWriter writer(base::ScopedFile(dup(file.fd())), /*compress=*/false);
+  std::string expected;
+  for (char batch = 0; batch < 64; batch++) {
+    const char lower = static_cast<char>('a' + batch % 26);
+    const char upper = static_cast<char>('A' + batch % 26);
+    std::vector<TracePacket> packets;
+    packets.emplace_back(CreatePacket(1, 10, lower));
+    expected += SerializePacket(1, 10, lower);
+    packets.emplace_back(CreatePacket(3, 100, upper));
+    expected += SerializePacket(3, 100, upper);
+    writer.WritePackets(std::move(packets));
+  }
+  ASSERT_TRUE(writer.Finalize());
+  EXPECT_EQ(expected.size(), writer.bytes_written());
+  EXPECT_EQ(expected.size(), writer.uncompressed_bytes());
+  EXPECT_EQ(expected, ReadFile(file));
+}
+
+TEST(TraceFileWriterTest, AppendsAtFileOffset) {
+  base::TempFile file = base::TempFile::Create();
+  ASSERT_EQ(6, base::WriteAll(file.fd(), "header", 6));
+  TraceFileWriter writer(base::ScopedFile(dup(file.fd())), /*compress=*/false);
+  std::vector<TracePacket> packets;
+  packets.emplace_back(CreatePacket(2, 4096, 'x'));
+  writer.WritePackets(std::move(packets));
+  ASSERT_TRUE(writer.Finalize());
+  EXPECT_EQ("header" + SerializePacket(2, 4096, 'x'), ReadFile(file));
+}
+
+TEST(TraceFileWriterTest, FailedWrite) {
+  // Writing into the read end of a pipe fails.
+  int pipe_fds[2];
+  ASSERT_EQ(0, pipe(pipe_fds));
+  base::ScopedFile wr(pipe_fds[1]);
+  TraceFileWriter writer(base::ScopedFile(pipe_fds[0]), /*compress=*/false);
+  for (size_t i = 0; i < TraceFileWriter::kMaxPendingBatches * 2; i++) {
+    std::vector<TracePacket> packets;
+    packets.emplace_back(CreatePacket(1, 10, 'x'));
+    writer.WritePackets(std::move(packets));
+  }
+  EXPECT_FALSE(writer.Finalize());
+}
+
+#if defined(PERFETTO_ENABLE_ZLIB)
+TEST(TraceFileWriterTest, Compress) {
+  ASSERT_TRUE(TraceFileWriter::IsCompressionSupported());
+  base::TempFile file = base::TempFile::Create();
+  TraceFileWriter writer(base::ScopedFile(dup(file.fd())), /*compress=*/true);
+  std::string expected;
+  for (char batch = 0; batch < 64; batch++) {
+    const char value = static_cast<char>('a' + batch % 26);
+    std::vector<TracePacket> packets;
+    packets.emplace_back(CreatePacket(4, 4096, value));
+    expected += SerializePacket(4, 4096, value);
+    writer.WritePackets(std::move(packets));
+  }
+  ASSERT_TRUE(writer.Finalize());
+  EXPECT_EQ(expected.size(), writer.uncompressed_bytes());
+
+  std::string compressed = ReadFile(file);
+  EXPECT_EQ(compressed.size(), writer.bytes_written());
+  EXPECT_LT(compressed.size(), expected.size() / 10);
+
+  // 15 + 16: expect a gzip stream.
+  z_stream stream{};
+  ASSERT_EQ(Z_OK, inflateInit2(&stream, 15 + 16));
+  std::string decompressed(expected.size() + 1, '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+  stream.avail_in = static_cast<uInt>(compressed.size());
+  stream.next_out = reinterpret_cast<Bytef*>(&decompressed[0]);
+  stream.avail_out = static_cast<uInt>(decompressed.size());
+  ASSERT_EQ(Z_STREAM_END, inflate(&stream, Z_FINISH));
+  decompressed.resize(stream.total_out);
+  inflateEnd(&stream);
+  EXPECT_EQ(expected, decompressed);
+}
+#endif  // PERFETTO_ENABLE_ZLIB
+
+}  // namespace
+}  // namespace perfetto
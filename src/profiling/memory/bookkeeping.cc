@@ -21,10 +21,36 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <limits>
+
 #include "perfetto/base/file_utils.h"
 #include "perfetto/base/logging.h"
 #include "perfetto/base/scoped_file.h"
 
+namespace std {
+
+size_t hash<::perfetto::profiling::Mapping>::operator()(
+    const ::perfetto::profiling::Mapping& mapping) const {
+  size_t h = hash<uint64_t>()(mapping.build_id);
+  for (uint64_t v : {mapping.offset, mapping.start, mapping.end,
+                     mapping.load_bias}) {
+    h = h * 31 + hash<uint64_t>()(v);
+  }
+  for (const auto& path_component : mapping.path_components)
+    h = h * 31 + hash<uint64_t>()(path_component.id());
+  return h;
+}
+
+size_t hash<::perfetto::profiling::Frame>::operator()(
+    const ::perfetto::profiling::Frame& frame) const {
+  size_t h = hash<uint64_t>()(frame.mapping.id());
+  h = h * 31 + hash<uint64_t>()(frame.function_name.id());
+  return h * 31 + hash<uint64_t>()(frame.rel_pc);
+}
+
+}  // namespace std
+
 namespace perfetto {
 namespace profiling {
 namespace {
@@ -32,10 +58,11 @@ using ::perfetto::protos::pbzero::ProfilePacket;
 }
 
 GlobalCallstackTrie::Node* GlobalCallstackTrie::Node::GetOrCreateChild(
-    const Interner<Frame>::Interned& loc) {
+    const Interner<Frame>::Interned& loc,
+    uint64_t* next_id) {
   Node* child = children_.Get(loc);
   if (!child)
-    child = children_.Emplace(loc, this);
+    child = children_.Emplace(loc, this, (*next_id)++);
   return child;
 }
 
@@ -55,9 +82,9 @@ void HeapTracker::RecordMalloc(
     uint64_t address,
     uint64_t size,
     uint64_t sequence_number) {
-  auto it = allocations_.find(address);
-  if (it != allocations_.end()) {
-    if (it->second.sequence_number > sequence_number) {
+  const Allocation* prev = allocations_.Find(address);
+  if (prev != nullptr) {
+    if (prev->sequence_number > sequence_number) {
       return;
     } else {
       // Clean up previous allocation by pretending a free happened just after
@@ -65,31 +92,40 @@ void HeapTracker::RecordMalloc(
       // CommitFree only uses the sequence number to check whether the
       // currently active allocation is newer than the free, so we can make
       // up a sequence_number here.
-      CommitFree(it->second.sequence_number + 1, address);
+      CommitFree(prev->sequence_number + 1, address);
     }
   }
 
   GlobalCallstackTrie::Node* node = callsites_->CreateCallsite(callstack);
 
-  auto callstack_allocations_it = callstack_allocations_.find(node);
-  if (callstack_allocations_it == callstack_allocations_.end()) {
+  std::unique_ptr<CallstackAllocations>* callstack_allocations =
+      callstack_allocations_.Find(node);
+  if (callstack_allocations == nullptr) {
     GlobalCallstackTrie::IncrementNode(node);
     bool inserted;
-    std::tie(callstack_allocations_it, inserted) =
-        callstack_allocations_.emplace(node, node);
+    std::tie(callstack_allocations, inserted) = callstack_allocations_.Emplace(
+        node, new CallstackAllocations(node));
     PERFETTO_DCHECK(inserted);
   }
-  allocations_.emplace(
-      address,
-      Allocation(size, sequence_number, &(callstack_allocations_it->second)));
+  allocations_.Emplace(address, size, sequence_number,
+                       callstack_allocations->get());
+  (*callstack_allocations)->last_change = ++changes_;
 
   // Keep the sequence tracker consistent.
   RecordFree(kNoopFree, sequence_number);
 }
 
 void HeapTracker::RecordFree(uint64_t address, uint64_t sequence_number) {
+  if (sequence_number <= sequence_number_) {
+    if (address != kNoopFree)
+      CommitFree(sequence_number, address);
+    return;
+  }
+
   if (sequence_number != sequence_number_ + 1) {
-    pending_frees_.emplace(sequence_number, address);
+    pending_frees_.Emplace(sequence_number, address);
+    if (pending_frees_.size() > max_pending_frees_)
+      SkipSequenceGap();
     return;
   }
 
@@ -98,57 +134,108 @@ void HeapTracker::RecordFree(uint64_t address, uint64_t sequence_number) {
   sequence_number_++;
 
   // At this point some other pending frees might be eligible to be committed.
-  auto it = pending_frees_.begin();
-  while (it != pending_frees_.end() && it->first == sequence_number_ + 1) {
-    if (it->second != kNoopFree)
-      CommitFree(it->first, it->second);
+  CommitPendingFrees();
+}
+
+void HeapTracker::CommitPendingFrees() {
+  if (pending_frees_.size() == 0)
+    return;
+  for (const uint64_t* pending = pending_frees_.Find(sequence_number_ + 1);
+       pending != nullptr;
+       pending = pending_frees_.Find(sequence_number_ + 1)) {
+    if (*pending != kNoopFree)
+      CommitFree(sequence_number_ + 1, *pending);
     sequence_number_++;
-    it = pending_frees_.erase(it);
+    pending_frees_.Erase(sequence_number_);
   }
 }
 
-void HeapTracker::CommitFree(uint64_t sequence_number, uint64_t address) {
-  auto leaf_it = allocations_.find(address);
-  if (leaf_it == allocations_.end())
-    return;
+void HeapTracker::SkipSequenceGap() {
+  uint64_t oldest = std::numeric_limits<uint64_t>::max();
+  pending_frees_.ForEach([&oldest](uint64_t sequence_number, uint64_t) {
+    oldest = std::min(oldest, sequence_number);
+  });
+  PERFETTO_ELOG("%zu frees pending, skipping records %" PRIu64 " to %" PRIu64,
+                pending_frees_.size(), sequence_number_ + 1, oldest - 1);
+  sequence_number_ = oldest - 1;
+  CommitPendingFrees();
+}
 
-  const Allocation& value = leaf_it->second;
-  if (value.sequence_number > sequence_number)
+void HeapTracker::CommitFree(uint64_t sequence_number, uint64_t address) {
+  const Allocation* value = allocations_.Find(address);
+  if (value == nullptr || value->sequence_number > sequence_number)
     return;
-  allocations_.erase(leaf_it);
+  value->callstack_allocations->last_change = ++changes_;
+  allocations_.Erase(address);
 }
 
 void HeapTracker::Dump(
     ProfilePacket::ProcessHeapSamples* proto,
-    std::set<GlobalCallstackTrie::Node*>* callstacks_to_dump) {
+    std::set<GlobalCallstackTrie::Node*>* callstacks_to_dump,
+    const std::shared_ptr<DumpState>& incremental_state) {
+  // The callstacks that changed after this are written. The first dump for
+  // a data source, and all the ones without incremental dumps, write all.
+  uint64_t dumped_changes = 0;
+  bool incremental = false;
+  // A callstack can only be removed once all the data sources with
+  // incremental dumps have written it with its final counters.
+  uint64_t min_dumped_changes = std::numeric_limits<uint64_t>::max();
+  for (auto it = incremental_dumps_.begin(); it != incremental_dumps_.end();) {
+    if (it->first.expired()) {
+      it = incremental_dumps_.erase(it);
+      continue;
+    }
+    min_dumped_changes = std::min(min_dumped_changes, it->second);
+    ++it;
+  }
+  if (incremental_state) {
+    auto it = incremental_dumps_.find(incremental_state);
+    if (it != incremental_dumps_.end()) {
+      dumped_changes = it->second;
+      incremental = true;
+    } else {
+      min_dumped_changes = 0;
+    }
+    proto->set_incremental(incremental);
+  }
+
   // There are two reasons we remove the unused callstack allocations on the
   // next iteration of Dump:
   // * We need to remove them after the callstacks were dumped, which currently
   //   happens after the allocations are dumped.
   // * This way, we do not destroy and recreate callstacks as frequently.
-  for (auto it_and_alloc : dead_callstack_allocations_) {
-    auto& it = it_and_alloc.first;
-    uint64_t allocated = it_and_alloc.second;
-    const CallstackAllocations& alloc = it->second;
-    if (alloc.allocation_count == allocated && alloc.free_count == allocated)
-      callstack_allocations_.erase(it);
+  for (const auto& node_and_allocated : dead_callstack_allocations_) {
+    GlobalCallstackTrie::Node* node = node_and_allocated.first;
+    uint64_t allocated = node_and_allocated.second;
+    const CallstackAllocations& alloc = **callstack_allocations_.Find(node);
+    if (alloc.allocation_count == allocated && alloc.free_count == allocated &&
+        alloc.last_change <= min_dumped_changes) {
+      callstack_allocations_.Erase(node);
+    }
   }
   dead_callstack_allocations_.clear();
 
-  for (auto it = callstack_allocations_.begin();
-       it != callstack_allocations_.end(); ++it) {
-    const CallstackAllocations& alloc = it->second;
-    callstacks_to_dump->emplace(alloc.node);
-    ProfilePacket::HeapSample* sample = proto->add_samples();
-    sample->set_callstack_id(alloc.node->id());
-    sample->set_cumulative_allocated(alloc.allocated);
-    sample->set_cumulative_freed(alloc.freed);
-    sample->set_alloc_count(alloc.allocation_count);
-    sample->set_free_count(alloc.free_count);
-
-    if (alloc.allocation_count == alloc.free_count)
-      dead_callstack_allocations_.emplace_back(it, alloc.allocation_count);
-  }
+  callstack_allocations_.ForEach(
+      [this, proto, callstacks_to_dump, dumped_changes](
+          GlobalCallstackTrie::Node* const& node,
+          const std::unique_ptr<CallstackAllocations>& alloc) {
+        if (alloc->allocation_count == alloc->free_count)
+          dead_callstack_allocations_.emplace_back(node,
+                                                   alloc->allocation_count);
+        if (alloc->last_change <= dumped_changes)
+          return;
+
+        callstacks_to_dump->emplace(node);
+        ProfilePacket::HeapSample* sample = proto->add_samples();
+        sample->set_callstack_id(node->id());
+        sample->set_cumulative_allocated(alloc->allocated);
+        sample->set_cumulative_freed(alloc->freed);
+        sample->set_alloc_count(alloc->allocation_count);
+        sample->set_free_count(alloc->free_count);
+      });
+
+  if (incremental_state)
+    incremental_dumps_[incremental_state] = changes_;
 }
 
 uint64_t HeapTracker::GetSizeForTesting(
@@ -158,19 +245,19 @@ uint64_t HeapTracker::GetSizeForTesting(
   // This is only good because this is used for testing only.
   GlobalCallstackTrie::IncrementNode(node);
   GlobalCallstackTrie::DecrementNode(node);
-  auto it = callstack_allocations_.find(node);
-  if (it == callstack_allocations_.end()) {
+  const std::unique_ptr<CallstackAllocations>* alloc =
+      callstack_allocations_.Find(node);
+  if (alloc == nullptr) {
     return 0;
   }
-  const CallstackAllocations& alloc = it->second;
-  return alloc.allocated - alloc.freed;
+  return (*alloc)->allocated - (*alloc)->freed;
 }
 
 GlobalCallstackTrie::Node* GlobalCallstackTrie::CreateCallsite(
     const std::vector<unwindstack::FrameData>& callstack) {
   Node* node = &root_;
   for (const unwindstack::FrameData& loc : callstack) {
-    node = node->GetOrCreateChild(InternCodeLocation(loc));
+    node = node->GetOrCreateChild(InternCodeLocation(loc), &next_node_id_);
   }
   return node;
 }
@@ -285,10 +372,22 @@ void BookkeepingThread::HandleBookkeepingRecord(BookkeepingRecord* rec) {
     if (!trace_writer)
       return;
     PERFETTO_LOG("Dumping heaps");
+    std::shared_ptr<DumpState> incremental_state =
+        dump_rec.incremental_state.lock();
+    DumpState full_dump_state;
+    DumpState* dump_state =
+        incremental_state ? incremental_state.get() : &full_dump_state;
+
     std::set<GlobalCallstackTrie::Node*> callstacks_to_dump;
     TraceWriter::TracePacketHandle trace_packet =
         trace_writer->NewTracePacket();
     auto profile_packet = trace_packet->set_profile_packet();
+    if (incremental_state) {
+      profile_packet->set_incremental_sequence_id(
+          incremental_state->incremental_sequence_id);
+      profile_packet->set_incremental_index(
+          incremental_state->next_incremental_index++);
+    }
     for (const pid_t pid : dump_rec.pids) {
       ProfilePacket::ProcessHeapSamples* sample =
           profile_packet->add_process_dumps();
@@ -298,26 +397,35 @@ void BookkeepingThread::HandleBookkeepingRecord(BookkeepingRecord* rec) {
         continue;
 
       PERFETTO_LOG("Dumping %d ", it->first);
-      it->second.heap_tracker.Dump(sample, &callstacks_to_dump);
+      it->second.heap_tracker.Dump(sample, &callstacks_to_dump,
+                                   incremental_state);
     }
 
-    // TODO(fmayer): For incremental dumps, this should be owned by the
-    // producer. This way we can keep track on what we dumped accross multiple
-    // dumps.
-    DumpState dump_state;
-
     for (GlobalCallstackTrie::Node* node : callstacks_to_dump) {
+      if (!dump_state->dumped_callstacks.emplace(node->id()).second)
+        continue;
       // There need to be two separate loops over built_callstack because
       // protozero cannot interleave different messages.
       auto built_callstack = node->BuildCallstack();
       for (const Interner<Frame>::Interned& frame : built_callstack)
-        dump_state.WriteFrame(profile_packet, frame);
+        dump_state->WriteFrame(profile_packet, frame);
       ProfilePacket::Callstack* callstack = profile_packet->add_callstacks();
       callstack->set_id(node->id());
       for (const Interner<Frame>::Interned& frame : built_callstack)
         callstack->add_frame_ids(frame.id());
     }
 
+    if (dump_rec.elf_cache_stats) {
+      const ElfCache::Stats& elf_cache_stats = *dump_rec.elf_cache_stats;
+      ProfilePacket::ElfCacheStats* elf_cache_stats_proto =
+          profile_packet->set_elf_cache_stats();
+      elf_cache_stats_proto->set_hits(elf_cache_stats.hits);
+      elf_cache_stats_proto->set_misses(elf_cache_stats.misses);
+      elf_cache_stats_proto->set_evictions(elf_cache_stats.evictions);
+      elf_cache_stats_proto->set_entries(elf_cache_stats.entries);
+      elf_cache_stats_proto->set_bytes(elf_cache_stats.bytes);
+    }
+
     // We cannot garbage collect until we have finished dumping, as the state
     // in DumpState points into the GlobalCallstackTrie.
     for (const pid_t pid : dump_rec.pids) {
@@ -334,10 +442,8 @@ void BookkeepingThread::HandleBookkeepingRecord(BookkeepingRecord* rec) {
     dump_rec.callback();
   } else if (rec->record_type == BookkeepingRecord::Type::Free) {
     FreeRecord& free_rec = rec->free_record;
-    FreePageEntry* entries = free_rec.metadata->entries;
-    uint64_t num_entries = free_rec.metadata->num_entries;
-    if (num_entries > kFreePageSize)
-      return;
+    FreePageEntry* entries = free_rec.entries.get();
+    uint64_t num_entries = free_rec.num_entries;
     for (size_t i = 0; i < num_entries; ++i) {
       const FreePageEntry& entry = entries[i];
       bookkeeping_data->heap_tracker.RecordFree(entry.addr,
@@ -18,9 +18,13 @@
 #define SRC_PROFILING_MEMORY_BOOKKEEPING_H_
 
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "perfetto/base/flat_hash_map.h"
 #include "perfetto/base/lookup_set.h"
 #include "perfetto/base/string_splitter.h"
 #include "perfetto/trace/profiling/profile_packet.pbzero.h"
@@ -108,6 +112,11 @@ struct Mapping {
            std::tie(other.build_id, other.offset, other.start, other.end,
                     other.load_bias, other.path_components);
   }
+  bool operator==(const Mapping& other) const {
+    return std::tie(build_id, offset, start, end, load_bias, path_components) ==
+           std::tie(other.build_id, other.offset, other.start, other.end,
+                    other.load_bias, other.path_components);
+  }
 };
 
 struct Frame {
@@ -123,8 +132,33 @@ struct Frame {
     return std::tie(mapping, function_name, rel_pc) <
            std::tie(other.mapping, other.function_name, other.rel_pc);
   }
+  bool operator==(const Frame& other) const {
+    return std::tie(mapping, function_name, rel_pc) ==
+           std::tie(other.mapping, other.function_name, other.rel_pc);
+  }
+};
+
+}  // namespace profiling
+}  // namespace perfetto
+
+// For the Interner.
+namespace std {
+
+template <>
+struct hash<::perfetto::profiling::Mapping> {
+  size_t operator()(const ::perfetto::profiling::Mapping& mapping) const;
+};
+
+template <>
+struct hash<::perfetto::profiling::Frame> {
+  size_t operator()(const ::perfetto::profiling::Frame& frame) const;
 };
 
+}  // namespace std
+
+namespace perfetto {
+namespace profiling {
+
 // Graph of function callsites. This is shared between heap dumps for
 // different processes. Each call site is represented by a
 // GlobalCallstackTrie::Node that is owned by the parent (i.e. calling)
@@ -154,16 +188,22 @@ class GlobalCallstackTrie {
     // This is opaque except to GlobalCallstackTrie.
     friend class GlobalCallstackTrie;
 
-    Node(Interner<Frame>::Interned frame) : Node(std::move(frame), nullptr) {}
-    Node(Interner<Frame>::Interned frame, Node* parent)
-        : parent_(parent), location_(std::move(frame)) {}
+    Node(Interner<Frame>::Interned frame)
+        : Node(std::move(frame), nullptr, 0) {}
+    Node(Interner<Frame>::Interned frame, Node* parent, uint64_t id)
+        : id_(id), parent_(parent), location_(std::move(frame)) {}
 
     std::vector<Interner<Frame>::Interned> BuildCallstack() const;
-    uintptr_t id() const { return reinterpret_cast<uintptr_t>(this); }
+    // Unlike the address of the node, this is not reused for another
+    // callstack after the node is destroyed, so that incremental dumps can
+    // refer to callstacks written in a previous dump.
+    uint64_t id() const { return id_; }
 
    private:
-    Node* GetOrCreateChild(const Interner<Frame>::Interned& loc);
+    Node* GetOrCreateChild(const Interner<Frame>::Interned& loc,
+                           uint64_t* next_id);
 
+    const uint64_t id_;
     uint64_t ref_count_ = 0;
     Node* const parent_;
     const Interner<Frame>::Interned location_;
@@ -188,9 +228,12 @@ class GlobalCallstackTrie {
   Interner<Mapping> mapping_interner_;
   Interner<Frame> frame_interner_;
 
+  uint64_t next_node_id_ = 1;
   Node root_{MakeRootFrame()};
 };
 
+// What has been written in a dump, or, for incremental dumps, in all the
+// dumps of a data source by one BookkeepingThread so far.
 struct DumpState {
   void WriteMap(protos::pbzero::ProfilePacket* packet,
                 const Interner<Mapping>::Interned map);
@@ -202,25 +245,42 @@ struct DumpState {
   std::set<InternID> dumped_strings;
   std::set<InternID> dumped_frames;
   std::set<InternID> dumped_mappings;
+  std::set<uint64_t> dumped_callstacks;
+
+  // Only used for incremental dumps.
+  uint64_t incremental_sequence_id = 0;
+  uint64_t next_incremental_index = 0;
 };
 
 // Snapshot for memory allocations of a particular process. Shares callsites
 // with other processes.
 class HeapTracker {
  public:
+  // A free can only be committed once all the records before it were. If one
+  // of them was lost, e.g. because the client gave up waiting for space in the
+  // shared memory buffer, the frees would stay pending forever. Once there are
+  // more than this many, the oldest gap is skipped. This is far more than can
+  // be in flight with the default buffer size.
+  static constexpr size_t kMaxPendingFrees = 1 << 20;
+
   // Caller needs to ensure that callsites outlives the HeapTracker.
-  explicit HeapTracker(GlobalCallstackTrie* callsites)
-      : callsites_(callsites) {}
+  explicit HeapTracker(GlobalCallstackTrie* callsites,
+                       size_t max_pending_frees = kMaxPendingFrees)
+      : callsites_(callsites), max_pending_frees_(max_pending_frees) {}
 
   void RecordMalloc(const std::vector<unwindstack::FrameData>& stack,
                     uint64_t address,
                     uint64_t size,
                     uint64_t sequence_number);
   void RecordFree(uint64_t address, uint64_t sequence_number);
+  // If |incremental_state| is set and this was dumped for it before, only
+  // writes the callstacks that changed since.
   void Dump(protos::pbzero::ProfilePacket::ProcessHeapSamples* proto,
-            std::set<GlobalCallstackTrie::Node*>* callstacks_to_dump);
+            std::set<GlobalCallstackTrie::Node*>* callstacks_to_dump,
+            const std::shared_ptr<DumpState>& incremental_state = nullptr);
 
   uint64_t GetSizeForTesting(const std::vector<unwindstack::FrameData>& stack);
+  size_t GetPendingFreesForTesting() const { return pending_frees_.size(); }
 
  private:
   static constexpr uint64_t kNoopFree = 0;
@@ -232,6 +292,8 @@ class HeapTracker {
     uint64_t freed = 0;
     uint64_t allocation_count = 0;
     uint64_t free_count = 0;
+    // Value of HeapTracker::changes_ when the counters last changed.
+    uint64_t last_change = 0;
 
     GlobalCallstackTrie::Node* node;
 
@@ -290,34 +352,62 @@ class HeapTracker {
   //     sequence_number_ is advanced. All unblocked pending operations are
   //     commited to |allocations_|.
   //   otherwise: the free is added to the queue of pending operations.
+  //
+  // * operations with sequence numbers not above sequence_number_ arrive after
+  //   their gap was skipped (see kMaxPendingFrees). Frees are committed right
+  //   away, they only free allocations older than them.
 
   // Commits a free operation into |allocations_|.
   // This must be  called after all operations up to sequence_number have been
   // commited to |allocations_|.
   void CommitFree(uint64_t sequence_number, uint64_t address);
 
+  // Commits the pending frees that directly follow sequence_number_.
+  void CommitPendingFrees();
+
+  // Advances sequence_number_ to just before the oldest pending free, and
+  // commits the pending frees from there.
+  void SkipSequenceGap();
+
   // We cannot use an interner here, because after the last allocation goes
   // away, we still need to keep the CallstackAllocations around until the next
-  // dump.
-  std::map<GlobalCallstackTrie::Node*, CallstackAllocations>
+  // dump. The Allocations point to them, so they are not stored in the map
+  // itself.
+  base::FlatHashMap<GlobalCallstackTrie::Node*,
+                    std::unique_ptr<CallstackAllocations>>
       callstack_allocations_;
 
-  std::vector<std::pair<decltype(callstack_allocations_)::iterator, uint64_t>>
+  // The callstacks without live allocations at the last dump, with their
+  // allocation_count at the time.
+  std::vector<std::pair<GlobalCallstackTrie::Node*, uint64_t>>
       dead_callstack_allocations_;
 
   // Address -> (size, sequence_number, code location)
-  std::map<uint64_t, Allocation> allocations_;
+  base::FlatHashMap<uint64_t, Allocation> allocations_;
 
   // if allocation address != 0, there is pending free of the address.
   // if == 0, the pending operation is a no-op.
   // No-op operations come from allocs that have already been commited to
   // |allocations_|. It is important to keep track of them in the list of
   // pending to maintain the contiguity of the sequence.
-  std::map<uint64_t /* seq_id */, uint64_t /* allocation address */>
+  base::FlatHashMap<uint64_t /* seq_id */, uint64_t /* allocation address */>
       pending_frees_;
 
+  const size_t max_pending_frees_;
+
   // The sequence number all mallocs and frees have been handled up to.
   uint64_t sequence_number_ = 0;
+
+  // Incremented on every committed malloc and free.
+  uint64_t changes_ = 0;
+
+  // For each data source with incremental dumps, changes_ at its last dump of
+  // this process. The entries of the data sources that went away are
+  // removed at the next dump.
+  std::map<std::weak_ptr<DumpState>,
+           uint64_t,
+           std::owner_less<std::weak_ptr<DumpState>>>
+      incremental_dumps_;
   GlobalCallstackTrie* const callsites_;
 };
 
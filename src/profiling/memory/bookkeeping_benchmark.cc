@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <malloc.h>
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "perfetto/base/logging.h"
+#include "src/profiling/memory/bookkeeping.h"
+#include "src/profiling/memory/wire_protocol.h"
+#include "src/tracing/core/trace_writer_for_testing.h"
+
+namespace {
+
+using perfetto::TraceWriterForTesting;
+using perfetto::profiling::BookkeepingRecord;
+using perfetto::profiling::BookkeepingThread;
+using perfetto::profiling::DumpState;
+using perfetto::profiling::GlobalCallstackTrie;
+using perfetto::profiling::HeapTracker;
+using perfetto::profiling::kFreePageSize;
+
+constexpr size_t kCallstacks = 256;
+constexpr size_t kCallstackDepth = 16;
+
+struct Op {
+  bool is_free;
+  uint64_t address;
+  uint64_t size;
+  uint64_t sequence_number;
+  size_t callstack;
+};
+
+// A malloc/free stream as heapprofd receives it from a process with
+// |live_allocations| allocations alive at any time: the mallocs arrive as
+// they happen, the frees only once the client has filled a FreePage. The
+// frees are of random live allocations, and half of the mallocs reuse the
+// address that was freed last, as an allocator would.
+std::vector<Op> RecordStream(size_t live_allocations) {
+  std::minstd_rand rnd(42);
+  std::vector<Op> ops;
+  std::vector<uint64_t> live;
+  std::vector<Op> free_page;
+  uint64_t sequence_number = 0;
+  uint64_t next_address = 0x7f0000000000;
+  uint64_t last_freed = 0;
+
+  auto malloc_op = [&] {
+    uint64_t address = next_address;
+    if (last_freed && rnd() % 2) {
+      address = last_freed;
+      last_freed = 0;
+    } else {
+      next_address += 16 * (1 + rnd() % 64);
+    }
+    live.push_back(address);
+    ops.push_back(Op{false, address, 16 * (1 + rnd() % 64), ++sequence_number,
+                     rnd() % kCallstacks});
+  };
+  auto free_op = [&] {
+    size_t idx = rnd() % live.size();
+    last_freed = live[idx];
+    live[idx] = live.back();
+    live.pop_back();
+    free_page.push_back(Op{true, last_freed, 0, ++sequence_number, 0});
+    if (free_page.size() == kFreePageSize) {
+      ops.insert(ops.end(), free_page.begin(), free_page.end());
+      free_page.clear();
+    }
+  };
+
+  for (size_t i = 0; i < live_allocations; ++i)
+    malloc_op();
+  for (size_t i = 0; i < 4 * live_allocations; ++i) {
+    free_op();
+    malloc_op();
+  }
+  ops.insert(ops.end(), free_page.begin(), free_page.end());
+  return ops;
+}
+
+// Callstacks that share their outermost frames, like the ones of a real
+// process.
+std::vector<std::vector<unwindstack::FrameData>> MakeCallstacks() {
+  std::vector<std::vector<unwindstack::FrameData>> callstacks(kCallstacks);
+  for (size_t i = 0; i < kCallstacks; ++i) {
+    for (size_t depth = 0; depth < kCallstackDepth; ++depth) {
+      unwindstack::FrameData frame{};
+      size_t fn = depth < kCallstackDepth / 2 ? depth : i * depth;
+      frame.function_name = "fn" + std::to_string(fn);
+      frame.map_name = "/system/lib64/libfoo" + std::to_string(fn % 8) + ".so";
+      frame.rel_pc = 0x1000 + fn * 4;
+      callstacks[i].emplace_back(std::move(frame));
+    }
+  }
+  return callstacks;
+}
+
+void Replay(const std::vector<Op>& ops,
+            const std::vector<std::vector<unwindstack::FrameData>>& callstacks,
+            HeapTracker* heap_tracker) {
+  for (const Op& op : ops) {
+    if (op.is_free) {
+      heap_tracker->RecordFree(op.address, op.sequence_number);
+    } else {
+      heap_tracker->RecordMalloc(callstacks[op.callstack], op.address, op.size,
+                                 op.sequence_number);
+    }
+  }
+}
+
+// Including the large blocks that malloc maps separately.
+size_t HeapBytesInUse() {
+  struct mallinfo info = mallinfo();
+  return static_cast<size_t>(info.uordblks) + static_cast<size_t>(info.hblkhd);
+}
+
+void LiveAllocationsArgs(benchmark::internal::Benchmark* b) {
+  b->Arg(1 << 10);
+  b->Arg(1 << 16);
+  b->Arg(1 << 20);
+}
+
+}  // namespace
+
+// Replays the stream of a process into a new HeapTracker, as the bookkeeping
+// thread does. The arg is the number of live allocations. bytes_per_alloc is
+// the memory the HeapTracker uses for each of them.
+static void BM_HeapTracker_Replay(benchmark::State& state) {
+  const size_t live_allocations = static_cast<size_t>(state.range(0));
+  const std::vector<Op> ops = RecordStream(live_allocations);
+  const auto callstacks = MakeCallstacks();
+  GlobalCallstackTrie callsites;
+
+  for (auto _ : state) {
+    std::unique_ptr<HeapTracker> heap_tracker(new HeapTracker(&callsites));
+    Replay(ops, callstacks, heap_tracker.get());
+    // Destroying the HeapTracker is not part of the replay.
+    state.PauseTiming();
+    heap_tracker.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(
+      static_cast<int64_t>(state.iterations() * ops.size()));
+
+  size_t heap_before = HeapBytesInUse();
+  {
+    HeapTracker heap_tracker(&callsites);
+    Replay(ops, callstacks, &heap_tracker);
+    size_t heap_after = HeapBytesInUse();
+    state.counters["bytes_per_alloc"] =
+        static_cast<double>(heap_after - heap_before) /
+        static_cast<double>(live_allocations);
+  }
+}
+BENCHMARK(BM_HeapTracker_Replay)->Apply(LiveAllocationsArgs);
+
+// Continuous dumps of a process that allocates at a few of its callstacks
+// between two dumps. The arg is whether the dumps are incremental.
+// bytes_per_dump is the size of the TracePacket of each dump.
+static void BM_BookkeepingThread_ContinuousDump(benchmark::State& state) {
+  constexpr pid_t kPid = 1;
+  constexpr size_t kMallocsBetweenDumps = 16;
+  const bool incremental = state.range(0) != 0;
+  const auto callstacks = MakeCallstacks();
+  std::minstd_rand rnd(42);
+  BookkeepingThread bookkeeping_thread;
+  auto process_handle = bookkeeping_thread.NotifyProcessConnected(kPid);
+  auto incremental_state = std::make_shared<DumpState>();
+  uint64_t sequence_number = 0;
+
+  auto malloc_at = [&bookkeeping_thread, &callstacks,
+                    &sequence_number](size_t callstack) {
+    BookkeepingRecord record{};
+    record.pid = kPid;
+    record.record_type = BookkeepingRecord::Type::Malloc;
+    record.alloc_record.frames = callstacks[callstack];
+    record.alloc_record.alloc_metadata.sequence_number = ++sequence_number;
+    record.alloc_record.alloc_metadata.total_size = 16;
+    record.alloc_record.alloc_metadata.alloc_address =
+        0x7f0000000000 + 16 * sequence_number;
+    bookkeeping_thread.HandleBookkeepingRecord(&record);
+  };
+
+  for (size_t i = 0; i < kCallstacks; ++i)
+    malloc_at(i);
+
+  uint64_t dumps = 0;
+  uint64_t dumped_bytes = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (size_t i = 0; i < kMallocsBetweenDumps; ++i)
+      malloc_at(rnd() % kCallstacks);
+    auto trace_writer = std::make_shared<TraceWriterForTesting>();
+    BookkeepingRecord record{};
+    record.record_type = BookkeepingRecord::Type::Dump;
+    record.dump_record.pids = {kPid};
+    record.dump_record.trace_writer = trace_writer;
+    if (incremental)
+      record.dump_record.incremental_state = incremental_state;
+    record.dump_record.callback = [] {};
+    state.ResumeTiming();
+
+    bookkeeping_thread.HandleBookkeepingRecord(&record);
+
+    state.PauseTiming();
+    dumped_bytes +=
+        static_cast<uint64_t>(trace_writer->ParseProto()->ByteSize());
+    dumps++;
+    state.ResumeTiming();
+  }
+  state.counters["bytes_per_dump"] =
+      static_cast<double>(dumped_bytes) / static_cast<double>(dumps);
+}
+BENCHMARK(BM_BookkeepingThread_ContinuousDump)->Arg(0)->Arg(1);
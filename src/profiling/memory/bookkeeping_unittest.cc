@@ -16,6 +16,10 @@
 
 #include "src/profiling/memory/bookkeeping.h"
 
+#include "perfetto/protozero/scattered_stream_memory_delegate.h"
+#include "perfetto/protozero/scattered_stream_writer.h"
+#include "perfetto/trace/profiling/profile_packet.pb.h"
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -49,6 +53,28 @@ std::vector<unwindstack::FrameData> stack2() {
   return res;
 }
 
+// Dumps |heap_tracker| and parses the ProcessHeapSamples back.
+protos::ProfilePacket::ProcessHeapSamples Dump(
+    HeapTracker* heap_tracker,
+    const std::shared_ptr<DumpState>& incremental_state = nullptr) {
+  ScatteredStreamMemoryDelegate delegate(4096);
+  protozero::ScatteredStreamWriter stream(&delegate);
+  delegate.set_writer(&stream);
+  protos::pbzero::ProfilePacket::ProcessHeapSamples writer;
+  writer.Reset(&stream);
+  std::set<GlobalCallstackTrie::Node*> callstacks_to_dump;
+  heap_tracker->Dump(&writer, &callstacks_to_dump, incremental_state);
+  writer.Finalize();
+
+  std::vector<uint8_t> buffer = delegate.StitchChunks();
+  protos::ProfilePacket::ProcessHeapSamples samples;
+  EXPECT_TRUE(
+      samples.ParseFromArray(buffer.data(), static_cast<int>(buffer.size())));
+  EXPECT_EQ(callstacks_to_dump.size(),
+            static_cast<size_t>(samples.samples_size()));
+  return samples;
+}
+
 TEST(BookkeepingTest, Basic) {
   uint64_t sequence_number = 1;
   GlobalCallstackTrie c;
@@ -102,6 +128,122 @@ TEST(BookkeepingTest, OutOfOrder) {
   EXPECT_EQ(hd.GetSizeForTesting(stack2()), 0);
 }
 
+TEST(BookkeepingTest, DroppedMallocIsNoopFree) {
+  GlobalCallstackTrie c;
+  HeapTracker hd(&c);
+
+  hd.RecordMalloc(stack(), 1, 5, 1);
+  // The malloc with sequence number 2 was dropped by the client, which sends
+  // its sequence number as a free of the null address instead.
+  hd.RecordFree(1, 3);
+  EXPECT_EQ(hd.GetSizeForTesting(stack()), 5);
+  EXPECT_EQ(hd.GetPendingFreesForTesting(), 1u);
+  hd.RecordFree(0, 2);
+  EXPECT_EQ(hd.GetSizeForTesting(stack()), 0);
+  EXPECT_EQ(hd.GetPendingFreesForTesting(), 0u);
+}
+
+TEST(BookkeepingTest, SkipsLostRecords) {
+  GlobalCallstackTrie c;
+  HeapTracker hd(&c, /*max_pending_frees=*/1);
+
+  hd.RecordMalloc(stack(), 1, 5, 1);
+  hd.RecordMalloc(stack2(), 2, 2, 2);
+  // Sequence number 3 is lost.
+  hd.RecordFree(1, 4);
+  EXPECT_EQ(hd.GetSizeForTesting(stack()), 5);
+  EXPECT_EQ(hd.GetPendingFreesForTesting(), 1u);
+  hd.RecordFree(2, 5);
+  EXPECT_EQ(hd.GetSizeForTesting(stack()), 0);
+  EXPECT_EQ(hd.GetSizeForTesting(stack2()), 0);
+  EXPECT_EQ(hd.GetPendingFreesForTesting(), 0u);
+
+  // Later frees are committed right away.
+  hd.RecordMalloc(stack(), 1, 5, 6);
+  hd.RecordFree(1, 7);
+  EXPECT_EQ(hd.GetSizeForTesting(stack()), 0);
+
+  // The lost record does not get stuck if it turns up after all.
+  hd.RecordMalloc(stack2(), 3, 2, 3);
+  EXPECT_EQ(hd.GetSizeForTesting(stack2()), 2);
+  hd.RecordFree(3, 8);
+  EXPECT_EQ(hd.GetSizeForTesting(stack2()), 0);
+  EXPECT_EQ(hd.GetPendingFreesForTesting(), 0u);
+}
+
+TEST(BookkeepingTest, IncrementalDump) {
+  uint64_t sequence_number = 1;
+  GlobalCallstackTrie c;
+  HeapTracker hd(&c);
+  auto incremental_state = std::make_shared<DumpState>();
+
+  hd.RecordMalloc(stack(), 1, 5, sequence_number++);
+  hd.RecordMalloc(stack2(), 2, 2, sequence_number++);
+
+  // The first dump has all the callstacks.
+  auto samples = Dump(&hd, incremental_state);
+  EXPECT_FALSE(samples.incremental());
+  EXPECT_EQ(samples.samples_size(), 2);
+
+  samples = Dump(&hd, incremental_state);
+  EXPECT_TRUE(samples.incremental());
+  EXPECT_EQ(samples.samples_size(), 0);
+
+  // Dumps without incremental state are not affected.
+  samples = Dump(&hd);
+  EXPECT_FALSE(samples.has_incremental());
+  EXPECT_EQ(samples.samples_size(), 2);
+
+  hd.RecordFree(2, sequence_number++);
+  samples = Dump(&hd, incremental_state);
+  EXPECT_TRUE(samples.incremental());
+  ASSERT_EQ(samples.samples_size(), 1);
+  EXPECT_EQ(samples.samples(0).cumulative_allocated(), 2u);
+  EXPECT_EQ(samples.samples(0).cumulative_freed(), 2u);
+}
+
+TEST(BookkeepingTest, IncrementalDumpKeepsDeadCallstacks) {
+  uint64_t sequence_number = 1;
+  GlobalCallstackTrie c;
+  HeapTracker hd(&c);
+  auto state_a = std::make_shared<DumpState>();
+  auto state_b = std::make_shared<DumpState>();
+
+  hd.RecordMalloc(stack(), 1, 5, sequence_number++);
+  hd.RecordMalloc(stack2(), 2, 2, sequence_number++);
+  Dump(&hd, state_a);
+  Dump(&hd, state_b);
+  hd.RecordFree(2, sequence_number++);
+
+  // The callstack of the free is dead, but it is only removed once both
+  // data sources have written it.
+  EXPECT_EQ(Dump(&hd, state_a).samples_size(), 1);
+  EXPECT_EQ(Dump(&hd, state_a).samples_size(), 0);
+  EXPECT_EQ(Dump(&hd).samples_size(), 2);
+  auto samples = Dump(&hd, state_b);
+  ASSERT_EQ(samples.samples_size(), 1);
+  EXPECT_EQ(samples.samples(0).cumulative_freed(), 2u);
+  EXPECT_EQ(Dump(&hd).samples_size(), 1);
+}
+
+TEST(BookkeepingTest, IncrementalDumpOfDataSourceThatWentAway) {
+  uint64_t sequence_number = 1;
+  GlobalCallstackTrie c;
+  HeapTracker hd(&c);
+  auto state_a = std::make_shared<DumpState>();
+  auto state_b = std::make_shared<DumpState>();
+
+  hd.RecordMalloc(stack(), 1, 5, sequence_number++);
+  hd.RecordMalloc(stack2(), 2, 2, sequence_number++);
+  Dump(&hd, state_a);
+  Dump(&hd, state_b);
+  hd.RecordFree(2, sequence_number++);
+  EXPECT_EQ(Dump(&hd, state_a).samples_size(), 1);
+
+  state_b.reset();
+  EXPECT_EQ(Dump(&hd).samples_size(), 1);
+}
+
 }  // namespace
 }  // namespace profiling
 }  // namespace perfetto
@@ -17,9 +17,15 @@
 #ifndef SRC_PROFILING_MEMORY_BOUNDED_QUEUE_H_
 #define SRC_PROFILING_MEMORY_BOUNDED_QUEUE_H_
 
-#include <condition_variable>
-#include <deque>
-#include <mutex>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #include "perfetto/base/logging.h"
 
@@ -28,6 +34,13 @@ namespace profiling {
 
 // Transport messages between threads. Multiple-producer / single-consumer.
 //
+// This is a lock-free ring of |capacity| slots, each with a sequence number
+// that says whether it is free for the producer of the current lap or holds
+// an item for the consumer (see
+// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// ). Producers and the consumer only block on a futex if the queue is full or
+// empty, respectively, and are only woken up if somebody is blocked.
+//
 // This has to outlive both the consumer and the producer. The Shutdown method
 // can be used to unblock both producers and consumers blocked on the queue.
 // The general shutdown logic is:
@@ -38,70 +51,183 @@ template <typename T>
 class BoundedQueue {
  public:
   BoundedQueue() : BoundedQueue(1) {}
-  BoundedQueue(size_t capacity) : capacity_(capacity) {
-    PERFETTO_CHECK(capacity > 0);
-  }
+  BoundedQueue(size_t capacity) { AllocateSlots(capacity); }
 
   void Shutdown() {
-    {
-      std::lock_guard<std::mutex> l(mutex_);
-      shutdown_ = true;
-    }
-    full_cv_.notify_all();
-    empty_cv_.notify_all();
+    shutdown_.store(true, std::memory_order_seq_cst);
+    Wake(&add_epoch_, INT_MAX);
+    Wake(&get_epoch_, INT_MAX);
   }
 
   ~BoundedQueue() { PERFETTO_DCHECK(shutdown_); }
 
   bool Add(T item) {
-    std::unique_lock<std::mutex> l(mutex_);
-    if (deque_.size() == capacity_)
-      full_cv_.wait(l,
-                    [this] { return deque_.size() < capacity_ || shutdown_; });
+    for (;;) {
+      if (shutdown_.load(std::memory_order_acquire))
+        return false;
+      if (TryAdd(&item)) {
+        WakeOne(&blocked_getters_, &add_epoch_);
+        return true;
+      }
+
+      // The queue is full. Announce that we are about to block before trying
+      // again, so that either we see the slot freed by a Get, or the Get sees
+      // us and bumps the epoch.
+      uint32_t epoch = get_epoch_.load(std::memory_order_acquire);
+      blocked_adders_.fetch_add(1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      bool added = !shutdown_.load(std::memory_order_acquire) && TryAdd(&item);
+      if (!added && !shutdown_.load(std::memory_order_acquire))
+        Wait(&get_epoch_, epoch);
+      if (added) {
+        WakeOne(&blocked_getters_, &add_epoch_);
+        return true;
+      }
+    }
+  }
 
-    if (shutdown_)
-      return false;
+  // Must only be called by one thread at a time.
+  bool Get(T* out) {
+    for (;;) {
+      if (shutdown_.load(std::memory_order_acquire))
+        return false;
+      if (TryGet(out)) {
+        WakeOne(&blocked_adders_, &get_epoch_);
+        return true;
+      }
+
+      // The queue is empty. See Add.
+      uint32_t epoch = add_epoch_.load(std::memory_order_acquire);
+      blocked_getters_.fetch_add(1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      bool got = !shutdown_.load(std::memory_order_acquire) && TryGet(out);
+      if (!got && !shutdown_.load(std::memory_order_acquire))
+        Wait(&add_epoch_, epoch);
+      if (got) {
+        WakeOne(&blocked_adders_, &get_epoch_);
+        return true;
+      }
+    }
+  }
 
-    deque_.emplace_back(std::move(item));
-    if (deque_.size() == 1)
-      empty_cv_.notify_all();
-    return true;
+  // Must not be called concurrently with Add or Get. The items in the queue
+  // are kept.
+  void SetCapacity(size_t capacity) {
+    std::vector<T> items;
+    T item;
+    while (TryGet(&item))
+      items.emplace_back(std::move(item));
+    PERFETTO_CHECK(items.size() <= capacity);
+    AllocateSlots(capacity);
+    for (T& it : items) {
+      bool added = TryAdd(&it);
+      PERFETTO_CHECK(added);
+    }
   }
 
-  bool Get(T* out) {
-    std::unique_lock<std::mutex> l(mutex_);
-    if (deque_.empty())
-      empty_cv_.wait(l, [this] { return !deque_.empty() || shutdown_; });
+ private:
+  struct Slot {
+    // |pos| if the slot is free for the Add at position |pos|, |pos + 1| once
+    // that Add has stored its item.
+    std::atomic<uint64_t> sequence;
+    T value;
+  };
 
-    if (shutdown_)
-      return false;
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "futex needs a plain 32 bit word");
+
+  void AllocateSlots(size_t capacity) {
+    PERFETTO_CHECK(capacity > 0);
+    capacity_ = capacity;
+    slots_.reset(new Slot[capacity]);
+    for (size_t i = 0; i < capacity; ++i)
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+  }
 
-    *out = std::move(deque_.front());
-    deque_.pop_front();
-    if (deque_.size() == capacity_ - 1) {
-      l.unlock();
-      full_cv_.notify_all();
+  // Moves |*item| into the queue, unless it is full.
+  bool TryAdd(T* item) {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot& slot = slots_[pos % capacity_];
+      uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence == pos) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          slot.value = std::move(*item);
+          slot.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+        // |pos| now holds the tail another producer has moved to.
+      } else if (sequence < pos) {
+        // The item of the previous lap has not been consumed yet.
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
     }
+  }
+
+  // Returns false if the queue is empty, or the next item has been claimed
+  // but not yet stored by a producer.
+  bool TryGet(T* out) {
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[pos % capacity_];
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+      return false;
+    *out = std::move(slot.value);
+    slot.sequence.store(pos + capacity_, std::memory_order_release);
+    head_.store(pos + 1, std::memory_order_relaxed);
     return true;
   }
 
-  void SetCapacity(size_t capacity) {
-    PERFETTO_CHECK(capacity > 0);
-    {
-      std::lock_guard<std::mutex> l(mutex_);
-      capacity_ = capacity;
+  // Called after an item was added or got: one blocked thread can proceed.
+  // The blocked threads are counted off here rather than when they wake up,
+  // so that the Adds or Gets until they get to run do not make the syscall
+  // again. A thread that did not actually sleep is still counted until the
+  // next call, which at worst makes one syscall too many.
+  static void WakeOne(std::atomic<uint32_t>* blocked,
+                      std::atomic<uint32_t>* epoch) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t count = blocked->load(std::memory_order_relaxed);
+    while (count > 0 &&
+           !blocked->compare_exchange_weak(count, count - 1,
+                                           std::memory_order_seq_cst,
+                                           std::memory_order_relaxed)) {
     }
-    full_cv_.notify_all();
+    if (count > 0)
+      Wake(epoch, 1);
   }
 
- private:
-  size_t capacity_;
-  bool shutdown_ = false;
-  size_t elements_ = 0;
-  std::deque<T> deque_;
-  std::condition_variable full_cv_;
-  std::condition_variable empty_cv_;
-  std::mutex mutex_;
+  static void Wake(std::atomic<uint32_t>* epoch, int threads) {
+    epoch->fetch_add(1, std::memory_order_release);
+    syscall(__NR_futex, reinterpret_cast<uint32_t*>(epoch), FUTEX_WAKE_PRIVATE,
+            threads, nullptr, nullptr, 0);
+  }
+
+  // Returns immediately if |*epoch| is not |value| anymore. Spurious wakeups
+  // are fine, the callers try again.
+  static void Wait(std::atomic<uint32_t>* epoch, uint32_t value) {
+    syscall(__NR_futex, reinterpret_cast<uint32_t*>(epoch), FUTEX_WAIT_PRIVATE,
+            value, nullptr, nullptr, 0);
+  }
+
+  size_t capacity_ = 0;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<bool> shutdown_{false};
+
+  // Only accessed by the consumer.
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+
+  // Number of threads about to block in Add / Get.
+  std::atomic<uint32_t> blocked_adders_{0};
+  std::atomic<uint32_t> blocked_getters_{0};
+  // Futex words, bumped when an item is added / got while somebody is
+  // blocked, or on Shutdown.
+  std::atomic<uint32_t> add_epoch_{0};
+  std::atomic<uint32_t> get_epoch_{0};
 };
 
 }  // namespace profiling
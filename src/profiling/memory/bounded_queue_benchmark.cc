@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "src/profiling/memory/bounded_queue.h"
+
+namespace {
+
+using perfetto::profiling::BoundedQueue;
+
+// As the queues between the heapprofd threads.
+constexpr size_t kQueueSize = 1000;
+
+// Like an UnwindingRecord, the item owns a heap allocation.
+struct Item {
+  std::unique_ptr<uint64_t> data;
+};
+
+}  // namespace
+
+// state.range(0) threads add items as fast as possible, while the benchmark
+// thread gets them, as the unwinding threads and the bookkeeping thread do.
+// Reports the number of items that went through the queue.
+static void BM_BoundedQueue_Throughput(benchmark::State& state) {
+  const size_t producers = static_cast<size_t>(state.range(0));
+  BoundedQueue<Item> queue(kQueueSize);
+  std::atomic<bool> stop{false};
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < producers; ++i) {
+    threads.emplace_back([&queue, &stop] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        Item item;
+        item.data.reset(new uint64_t(1));
+        if (!queue.Add(std::move(item)))
+          return;
+      }
+    });
+  }
+
+  uint64_t items = 0;
+  while (state.KeepRunning()) {
+    Item item;
+    if (!queue.Get(&item))
+      break;
+    benchmark::DoNotOptimize(*item.data);
+    ++items;
+  }
+
+  stop = true;
+  queue.Shutdown();
+  for (std::thread& th : threads)
+    th.join();
+  state.SetItemsProcessed(static_cast<int64_t>(items));
+}
+BENCHMARK(BM_BoundedQueue_Throughput)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(5)
+    ->Arg(16)
+    ->UseRealTime();
@@ -18,7 +18,9 @@
 
 #include "gtest/gtest.h"
 
+#include <memory>
 #include <thread>
+#include <vector>
 
 namespace perfetto {
 namespace profiling {
@@ -114,6 +116,33 @@ TEST(BoundedQueueTest, ShutdownBlockingGet) {
   th.join();
 }
 
+TEST(BoundedQueueTest, MultipleProducers) {
+  constexpr int kProducers = 4;
+  constexpr int kItemsPerProducer = 10000;
+  BoundedQueue<std::unique_ptr<int>> q(3);
+  std::vector<std::thread> producers;
+  for (int producer = 0; producer < kProducers; ++producer) {
+    producers.emplace_back([&q, producer] {
+      for (int i = 0; i < kItemsPerProducer; ++i)
+        EXPECT_TRUE(q.Add(std::unique_ptr<int>(
+            new int(producer * kItemsPerProducer + i))));
+    });
+  }
+
+  // The items of each producer come out in the order they were added.
+  std::vector<int> next(kProducers, 0);
+  for (int i = 0; i < kProducers * kItemsPerProducer; ++i) {
+    std::unique_ptr<int> out;
+    ASSERT_TRUE(q.Get(&out));
+    ASSERT_TRUE(out);
+    int producer = *out / kItemsPerProducer;
+    EXPECT_EQ(*out % kItemsPerProducer, next[producer]++);
+  }
+  for (std::thread& th : producers)
+    th.join();
+  q.Shutdown();
+}
+
 }  // namespace
 }  // namespace profiling
 }  // namespace perfetto
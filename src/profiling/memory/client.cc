@@ -16,12 +16,16 @@
 
 #include "src/profiling/memory/client.h"
 
+#include <errno.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <new>
 
@@ -37,6 +41,7 @@
 #include "perfetto/base/logging.h"
 #include "perfetto/base/scoped_file.h"
 #include "perfetto/base/thread_utils.h"
+#include "perfetto/base/time.h"
 #include "perfetto/base/unix_socket.h"
 #include "perfetto/base/utils.h"
 #include "src/profiling/memory/sampler.h"
@@ -48,6 +53,102 @@ namespace {
 
 constexpr struct timeval kSendTimeout = {1 /* s */, 0 /* us */};
 
+// With ClientConfiguration.block_client, how long to wait for heapprofd to free
+// up space in the shared memory buffer before dropping the sample. The same as
+// kSendTimeout, for the socket.
+constexpr base::TimeMillis kBlockTimeout = base::TimeMillis(1000);
+constexpr uint32_t kMaxBlockBackoffUs = 1000;
+
+// The longest a free is held back in the FreePage before it is sent, as long
+// as the process keeps allocating or freeing. heapprofd only commits a record
+// once it has seen all the ones with a lower sequence number, so this also
+// bounds how long a held back free delays the allocations after it.
+constexpr base::TimeMillis kMaxFreePageAge = base::TimeMillis(100);
+// Reading the clock on every free would cost more than the rest of it, so the
+// age is only checked on the sampled mallocs and on every this many frees.
+constexpr uint64_t kFreesPerAgeCheck = 64;
+
+// With ClientConfiguration.frame_pointer_unwinding, the maximum number of
+// frames sent for a malloc.
+constexpr size_t kMaxFramePointerPcs = 128;
+
+// With ClientConfiguration.stack_deltas, the stack is compared to the one of
+// the previous record of the thread in windows of this many bytes, counted
+// from the base of the stack. The windows up to the first one that changed
+// are left out of the record.
+constexpr size_t kStackWindowSize = 256;
+// Only this many windows from the base are compared, 1 MiB.
+constexpr size_t kMaxStackWindows = 4096;
+
+// The hashes of the windows of the stack of the last record of a thread.
+struct StackHashes {
+  uint64_t stack_base;
+  // Zero if heapprofd does not have the record.
+  uint64_t sequence_number;
+  size_t num_windows;
+  // hashes[i] is the hash of the i-th window from the base of the stack.
+  uint64_t hashes[kMaxStackWindows];
+};
+
+// The StackHashes are mapped rather than allocated, as they are created in the
+// malloc hooks.
+void DestroyStackHashes(void* hashes) {
+  munmap(hashes, sizeof(StackHashes));
+}
+
+StackHashes* GetStackHashes(pthread_key_t key) {
+  void* hashes = pthread_getspecific(key);
+  if (hashes)
+    return static_cast<StackHashes*>(hashes);
+  hashes = mmap(nullptr, sizeof(StackHashes), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (hashes == MAP_FAILED)
+    return nullptr;
+  if (pthread_setspecific(key, hashes) != 0) {
+    DestroyStackHashes(hashes);
+    return nullptr;
+  }
+  // Anonymous mappings are zeroed, so there is no previous record.
+  return static_cast<StackHashes*>(hashes);
+}
+
+// A collision would make heapprofd mix up the stacks of two records of the
+// thread, so this uses all the bits of the window.
+__attribute__((no_sanitize("address"))) uint64_t HashStackWindow(
+    const char* window) {
+  uint64_t hash = 0;
+  for (size_t i = 0; i < kStackWindowSize; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, window + i, sizeof(word));
+    hash = ((hash << 5 | hash >> 59) ^ word) * 0x9e3779b97f4a7c15;
+  }
+  return hash;
+}
+
+// Replaces the hashes of the thread with the ones of the stack between
+// |stacktop| and |stackbase|. Returns the number of bytes at the base of the
+// stack that are the same as in the previous record.
+size_t UpdateStackHashes(StackHashes* hashes,
+                         const char* stacktop,
+                         const char* stackbase) {
+  const size_t stack_size = static_cast<size_t>(stackbase - stacktop);
+  const size_t num_windows =
+      std::min(stack_size / kStackWindowSize, kMaxStackWindows);
+  const uint64_t stack_base = reinterpret_cast<uint64_t>(stackbase);
+  bool same = hashes->sequence_number != 0 && hashes->stack_base == stack_base;
+  size_t same_windows = 0;
+  for (size_t i = 0; i < num_windows; ++i) {
+    uint64_t hash = HashStackWindow(stackbase - (i + 1) * kStackWindowSize);
+    same = same && i < hashes->num_windows && hashes->hashes[i] == hash;
+    if (same)
+      same_windows++;
+    hashes->hashes[i] = hash;
+  }
+  hashes->stack_base = stack_base;
+  hashes->num_windows = num_windows;
+  return same_windows * kStackWindowSize;
+}
+
 std::vector<base::ScopedFile> ConnectPool(const std::string& sock_name,
                                           size_t n) {
   sockaddr_un addr;
@@ -101,30 +202,100 @@ char* FindMainThreadStack() {
 
 }  // namespace
 
+FreePage::FreePage(base::TimeMillis max_age) : max_age_(max_age) {
+  pages_[0].available.store(false, std::memory_order_relaxed);
+}
+
 void FreePage::Add(const uint64_t addr,
                    const uint64_t sequence_number,
-                   SocketPool* pool) {
-  std::lock_guard<std::mutex> l(mutex_);
-  if (offset_ == kFreePageSize) {
-    FlushLocked(pool);
-    // Now that we have flushed, reset to after the header.
-    offset_ = 0;
+                   Client* client) {
+  for (;;) {
+    uint64_t state = state_.fetch_add(1, std::memory_order_acquire);
+    uint64_t filled = state >> 32;
+    uint64_t slot = state & 0xffffffff;
+    if (PERFETTO_UNLIKELY(slot >= kFreePageSize)) {
+      // Wait for the thread that claimed the last slot to switch pages.
+      while (state_.load(std::memory_order_acquire) >> 32 == filled)
+        sched_yield();
+      continue;
+    }
+
+    Page* page = &pages_[filled % 2];
+    if (PERFETTO_UNLIKELY(slot == 0)) {
+      page->first_entry_ms.store(base::GetWallTimeMs().count(),
+                                 std::memory_order_relaxed);
+    }
+    if (PERFETTO_UNLIKELY(slot == kFreePageSize - 1))
+      SwitchPage(filled);
+
+    FreePageEntry& current_entry = page->entries[slot];
+    current_entry.sequence_number = sequence_number;
+    current_entry.addr = addr;
+    if (page->written.fetch_add(1, std::memory_order_acq_rel) + 1 ==
+        kFreePageSize) {
+      Flush(page, client);
+    } else if (PERFETTO_UNLIKELY(slot % kFreesPerAgeCheck ==
+                                 kFreesPerAgeCheck - 1)) {
+      FlushIfStale(client);
+    }
+    return;
+  }
+}
+
+void FreePage::FlushIfStale(Client* client) {
+  uint64_t state = state_.load(std::memory_order_acquire);
+  const uint64_t filled = state >> 32;
+  Page* page = &pages_[filled % 2];
+  const int64_t first_entry_ms =
+      page->first_entry_ms.load(std::memory_order_relaxed);
+  if (first_entry_ms == 0 ||
+      base::GetWallTimeMs().count() - first_entry_ms < max_age_.count()) {
+    return;
+  }
+
+  // Claim all the remaining slots, the other threads wait for the page switch
+  // as if the page was full.
+  uint64_t slot;
+  do {
+    slot = state & 0xffffffff;
+    if (state >> 32 != filled || slot == 0 || slot >= kFreePageSize)
+      return;
+  } while (!state_.compare_exchange_weak(state, (filled << 32) | kFreePageSize,
+                                         std::memory_order_acquire));
+
+  page->num_entries = static_cast<size_t>(slot);
+  SwitchPage(filled);
+  const size_t unused = kFreePageSize - static_cast<size_t>(slot);
+  if (page->written.fetch_add(unused, std::memory_order_acq_rel) + unused ==
+      kFreePageSize) {
+    Flush(page, client);
   }
-  FreePageEntry& current_entry = free_page_.entries[offset_++];
-  current_entry.sequence_number = sequence_number;
-  current_entry.addr = addr;
 }
 
-void FreePage::FlushLocked(SocketPool* pool) {
+void FreePage::SwitchPage(uint64_t filled) {
+  // The other page can only be reused once it has been sent.
+  Page* next_page = &pages_[(filled + 1) % 2];
+  while (!next_page->available.load(std::memory_order_acquire))
+    sched_yield();
+  next_page->available.store(false, std::memory_order_relaxed);
+  state_.store((filled + 1) << 32, std::memory_order_release);
+}
+
+void FreePage::Flush(Page* page, Client* client) {
+  FreeMetadata metadata;
+  metadata.num_entries = page->num_entries;
   WireMessage msg = {};
   msg.record_type = RecordType::Free;
-  free_page_.num_entries = offset_;
-  msg.free_header = &free_page_;
-  BorrowedSocket fd(pool->Borrow());
-  if (!fd || !SendWireMessage(*fd, msg)) {
+  msg.free_header = &metadata;
+  msg.payload = reinterpret_cast<char*>(page->encoded);
+  msg.payload_size =
+      EncodeFreeEntries(page->entries, page->num_entries, page->encoded);
+  if (!client->SendWireMessage(msg))
     PERFETTO_ELOG("Failed to send wire message");
-    fd.Close();
-  }
+  page->num_entries = kFreePageSize;
+  page->first_entry_ms.store(0, std::memory_order_relaxed);
+  page->written.store(0, std::memory_order_relaxed);
+  page->available.store(true, std::memory_order_release);
 }
 
 SocketPool::SocketPool(std::vector<base::ScopedFile> sockets)
@@ -189,11 +360,54 @@ const char* GetThreadStackBase() {
   return stackaddr + stacksize;
 }
 
+// A frame record is the saved frame pointer of the caller followed by the
+// return address, on all the architectures supported here. The frame pointer
+// of a function points to its frame record.
+//
+// This reads the stack of the current thread only between its own frame and
+// |stackbase|, so it cannot fault. It does read parts of the stack that ASAN
+// considers out of bounds.
+__attribute__((noinline, no_sanitize("address"))) size_t UnwindFramePointers(
+    const char* stackbase,
+    uint64_t* pcs,
+    size_t max_pcs) {
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+  const uintptr_t base = reinterpret_cast<uintptr_t>(stackbase);
+  uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  size_t num_pcs = 0;
+  while (num_pcs < max_pcs) {
+    if (fp >= base || base - fp < 2 * sizeof(uintptr_t) ||
+        fp % sizeof(uintptr_t) != 0) {
+      break;
+    }
+    const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(fp);
+    const uintptr_t next_fp = frame[0];
+    const uintptr_t pc = frame[1];
+    if (pc == 0)
+      break;
+    pcs[num_pcs++] = pc;
+    // The stack grows down, so the frames of the callers are at numerically
+    // larger addresses. Anything else means the chain is broken.
+    if (next_fp <= fp)
+      break;
+    fp = next_fp;
+  }
+  return num_pcs;
+#else
+  base::ignore_result(stackbase, pcs, max_pcs);
+  return 0;
+#endif
+}
+
 Client::Client(std::vector<base::ScopedFile> socks)
     : pthread_key_(ThreadLocalSamplingData::KeyDestructor),
+      stack_hashes_key_(DestroyStackHashes),
       socket_pool_(std::move(socks)),
+      free_page_(kMaxFreePageAge),
       main_thread_stack_base_(FindMainThreadStack()) {
   PERFETTO_DCHECK(pthread_key_.valid());
+  PERFETTO_DCHECK(stack_hashes_key_.valid());
+  ThreadLocalSamplingData::NewGeneration();
 
   uint64_t size = 0;
   base::ScopedFile maps(base::OpenFile("/proc/self/maps", O_RDONLY));
@@ -214,11 +428,22 @@ Client::Client(std::vector<base::ScopedFile> socks)
     PERFETTO_DFATAL("Failed to send file descriptors.");
     return;
   }
-  if (recv(*fd, &client_config_, sizeof(client_config_), 0) !=
-      sizeof(client_config_)) {
+  // The configuration comes with the fd of the shared memory buffer, unless
+  // heapprofd wants the records over the sockets.
+  base::ScopedFile shmem_fd;
+  if (base::SockReceive(*fd, &client_config_, sizeof(client_config_),
+                        &shmem_fd, 1) != sizeof(client_config_)) {
     PERFETTO_DFATAL("Failed to receive client config.");
     return;
   }
+  if (shmem_fd) {
+    shmem_ = SharedRingBuffer::Attach(std::move(shmem_fd));
+    if (!shmem_) {
+      // heapprofd reads only from the buffer from now on.
+      PERFETTO_DFATAL("Failed to attach to shared memory.");
+      return;
+    }
+  }
   PERFETTO_DCHECK(client_config_.interval >= 1);
   PERFETTO_DLOG("Initialized client.");
   inited_.store(true, std::memory_order_release);
@@ -255,6 +480,12 @@ void Client::RecordMalloc(uint64_t alloc_size,
                           uint64_t alloc_address) {
   if (!inited_.load(std::memory_order_acquire))
     return;
+  sampled_addresses_.Add(alloc_address);
+  free_page_.FlushIfStale(this);
+  if (client_config_.frame_pointer_unwinding) {
+    RecordMallocPcs(alloc_size, total_size, alloc_address);
+    return;
+  }
   AllocMetadata metadata;
   const char* stackbase = GetStackBase();
   const char* stacktop = reinterpret_cast<char*>(__builtin_frame_address(0));
@@ -266,11 +497,17 @@ void Client::RecordMalloc(uint64_t alloc_size,
   }
 
   uint64_t stack_size = static_cast<uint64_t>(stackbase - stacktop);
+  uint64_t copy_size = stack_size;
+  if (client_config_.max_stack_size)
+    copy_size = std::min(copy_size, client_config_.max_stack_size);
   metadata.total_size = total_size;
   metadata.alloc_size = alloc_size;
   metadata.alloc_address = alloc_address;
   metadata.stack_pointer = reinterpret_cast<uint64_t>(stacktop);
   metadata.stack_pointer_offset = sizeof(AllocMetadata);
+  metadata.stack_size = stack_size;
+  metadata.stack_delta_base = 0;
+  metadata.stack_delta_size = 0;
   metadata.arch = unwindstack::Regs::CurrentArch();
   metadata.sequence_number =
       1 + sequence_number_.fetch_add(1, std::memory_order_acq_rel);
@@ -279,21 +516,145 @@ void Client::RecordMalloc(uint64_t alloc_size,
   msg.record_type = RecordType::Malloc;
   msg.alloc_header = &metadata;
   msg.payload = const_cast<char*>(stacktop);
-  msg.payload_size = static_cast<size_t>(stack_size);
+  msg.payload_size = static_cast<size_t>(copy_size);
+
+  // A truncated stack does not end at the base, so it cannot be a delta. The
+  // previous record of the thread stays the one to compare to.
+  StackHashes* hashes = nullptr;
+  if (client_config_.stack_deltas && shmem_ && copy_size == stack_size)
+    hashes = GetStackHashes(stack_hashes_key_.get());
+  if (hashes) {
+    const uint64_t previous_sequence_number = hashes->sequence_number;
+    size_t same_size = UpdateStackHashes(hashes, stacktop, stackbase);
+    msg.record_type = RecordType::MallocStackDelta;
+    msg.payload_size -= same_size;
+    if (same_size > 0) {
+      metadata.stack_delta_base = previous_sequence_number;
+      metadata.stack_delta_size = same_size;
+    }
+  }
 
-  BorrowedSocket fd = socket_pool_.Borrow();
-  if (!fd || !SendWireMessage(*fd, msg)) {
+  bool dropped = false;
+  if (!SendWireMessage(msg, &dropped))
     PERFETTO_DFATAL("Failed to send wire message.");
-    fd.Close();
+  if (dropped)
+    SendDroppedSequenceNumber(metadata.sequence_number);
+  if (hashes)
+    hashes->sequence_number = dropped ? 0 : metadata.sequence_number;
+}
+
+// Sends the return addresses on the stack rather than the stack. The registers
+// are not needed by heapprofd then.
+void Client::RecordMallocPcs(uint64_t alloc_size,
+                             uint64_t total_size,
+                             uint64_t alloc_address) {
+  const char* stackbase = GetStackBase();
+  if (!stackbase) {
+    PERFETTO_DFATAL("Failed to get stackbase.");
+    return;
   }
+  uint64_t pcs[kMaxFramePointerPcs];
+  size_t num_pcs = UnwindFramePointers(stackbase, pcs, kMaxFramePointerPcs);
+
+  AllocMetadata metadata{};
+  metadata.total_size = total_size;
+  metadata.alloc_size = alloc_size;
+  metadata.alloc_address = alloc_address;
+  metadata.arch = unwindstack::Regs::CurrentArch();
+  metadata.sequence_number =
+      1 + sequence_number_.fetch_add(1, std::memory_order_acq_rel);
+
+  WireMessage msg{};
+  msg.record_type = RecordType::MallocPcs;
+  msg.alloc_header = &metadata;
+  msg.payload = reinterpret_cast<char*>(pcs);
+  msg.payload_size = num_pcs * sizeof(uint64_t);
+
+  bool dropped = false;
+  if (!SendWireMessage(msg, &dropped))
+    PERFETTO_DFATAL("Failed to send wire message.");
+  if (dropped)
+    SendDroppedSequenceNumber(metadata.sequence_number);
+}
+
+// heapprofd commits the frees in the order of their sequence numbers, so the
+// one of a dropped malloc still has to reach it. It is sent as a free of the
+// null address, which heapprofd handles as a no-op.
+void Client::SendDroppedSequenceNumber(uint64_t sequence_number) {
+  free_page_.Add(0, sequence_number, this);
 }
 
 void Client::RecordFree(uint64_t alloc_address) {
   if (!inited_.load(std::memory_order_acquire))
     return;
+  // Only the frees of sampled allocations change the profile. This has to be
+  // checked before taking a sequence number: heapprofd waits for all of them.
+  if (!sampled_addresses_.MightContain(alloc_address))
+    return;
   free_page_.Add(alloc_address,
                  1 + sequence_number_.fetch_add(1, std::memory_order_acq_rel),
-                 &socket_pool_);
+                 this);
+}
+
+bool Client::SendWireMessage(const WireMessage& msg, bool* dropped) {
+  if (!shmem_) {
+    BorrowedSocket fd = socket_pool_.Borrow();
+    if (!fd || !profiling::SendWireMessage(*fd, msg)) {
+      fd.Close();
+      return false;
+    }
+    return true;
+  }
+
+  const size_t size = GetSerializedSize(msg);
+  SharedRingBuffer::Buffer buf = shmem_->BeginWrite(size);
+  // A free page holds up to kFreePageSize frees, and the sequence numbers of
+  // the dropped mallocs. Always wait for space for it rather than lose them.
+  const bool block =
+      client_config_.block_client || msg.record_type == RecordType::Free;
+  if (!buf && block && size <= shmem_->max_record_size())
+    buf = BeginWriteBlocking(size);
+  if (!buf) {
+    shmem_->AddDroppedWrite();
+    if (dropped)
+      *dropped = true;
+    return true;
+  }
+  SerializeWireMessage(msg, buf.data);
+  if (shmem_->EndWrite(std::move(buf)))
+    WakeUpReader();
+  return true;
+}
+
+SharedRingBuffer::Buffer Client::BeginWriteBlocking(size_t size) {
+  const base::TimeMillis deadline = base::GetWallTimeMs() + kBlockTimeout;
+  uint32_t backoff_us = 1;
+  for (;;) {
+    SharedRingBuffer::Buffer buf = shmem_->BeginWrite(size);
+    if (buf || !inited_.load(std::memory_order_relaxed) ||
+        base::GetWallTimeMs() >= deadline) {
+      return buf;
+    }
+    usleep(backoff_us);
+    backoff_us = std::min(backoff_us * 2, kMaxBlockBackoffUs);
+  }
+}
+
+// heapprofd drains the shared memory buffer when the socket becomes readable,
+// the contents do not matter. This is the only syscall on the allocating
+// thread, and only when heapprofd has run out of records.
+void Client::WakeUpReader() {
+  BorrowedSocket fd = socket_pool_.Borrow();
+  if (!fd)
+    return;
+  const char kWakeup = 0;
+  if (PERFETTO_EINTR(send(*fd, &kWakeup, sizeof(kWakeup),
+                          MSG_DONTWAIT | MSG_NOSIGNAL)) == -1 &&
+      errno != EAGAIN && errno != EWOULDBLOCK) {
+    // If the socket is full, heapprofd has wakeups pending already.
+    PERFETTO_DPLOG("Failed to wake up heapprofd");
+    fd.Close();
+  }
 }
 
 size_t Client::ShouldSampleAlloc(uint64_t alloc_size,
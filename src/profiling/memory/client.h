@@ -20,17 +20,22 @@
 #include <pthread.h>
 #include <stddef.h>
 
+#include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <vector>
 
 #include "perfetto/base/scoped_file.h"
+#include "perfetto/base/time.h"
+#include "src/profiling/memory/shared_ring_buffer.h"
 #include "src/profiling/memory/wire_protocol.h"
 
 namespace perfetto {
 namespace profiling {
 
 class BorrowedSocket;
+class Client;
 
 class SocketPool {
  public:
@@ -84,25 +89,97 @@ class BorrowedSocket {
 };
 
 // Cache for frees that have been observed. It is infeasible to send every
-// free separately, so we batch and send the whole buffer once it is full.
+// free separately, so we batch and send the whole buffer once it is full, or
+// once its first free is older than |max_age|.
+//
+// There are two pages, so that the frees go into one while the other one is
+// sent. The threads claim a slot of the current page with an atomic
+// increment, the one that fills the last slot sends the page. A page that is
+// sent early has its remaining slots claimed at once, and counted as written.
 class FreePage {
  public:
-  // Add address to buffer. Flush if necessary using a socket borrowed from
-  // pool.
-  // Can be called from any thread. Must not hold mutex_.`
-  void Add(const uint64_t addr, uint64_t sequence_number, SocketPool* pool);
+  explicit FreePage(base::TimeMillis max_age);
+
+  // Add address to buffer. Flush if necessary through the |client|.
+  // Can be called from any thread.
+  void Add(const uint64_t addr, uint64_t sequence_number, Client* client);
+
+  // Sends the current page through the |client| if its first free is older
+  // than |max_age|. Only the frees of sampled allocations go into the page, so
+  // with large sampling intervals it can take long to fill up. Add() checks
+  // this on some of the frees, the Client on every sampled malloc.
+  // Can be called from any thread.
+  void FlushIfStale(Client* client);
 
  private:
-  // Needs to be called holding mutex_.
-  void FlushLocked(SocketPool* pool);
+  struct Page {
+    FreePageEntry entries[kFreePageSize];
+    // Number of entries written. Claimed slots might still be being written.
+    std::atomic<size_t> written{0};
+    // Set once the page has been sent, until it becomes the current one.
+    std::atomic<bool> available{true};
+    // When the first slot was claimed, 0 while the page is empty.
+    std::atomic<int64_t> first_entry_ms{0};
+    // Number of entries to send, less than kFreePageSize if sent early. Set
+    // before the page is counted as fully written.
+    size_t num_entries = kFreePageSize;
+    uint8_t encoded[kFreePageSize * kMaxEncodedFreePageEntrySize];
+  };
 
-  FreeMetadata free_page_;
-  std::mutex mutex_;
-  size_t offset_ = 0;
+  void SwitchPage(uint64_t filled);
+  void Flush(Page* page, Client* client);
+
+  const base::TimeMillis max_age_;
+
+  // Number of pages that have been filled in the upper 32 bits, the next
+  // slot of the current page, pages_[filled % 2], in the lower ones.
+  std::atomic<uint64_t> state_{0};
+  Page pages_[2];
+};
+
+// Addresses of the sampled allocations, so that the frees of the others are
+// not sent. This is a Bloom filter with a single hash function: it says that
+// an address might have been added if its bit is set. Addresses never get
+// removed, so over time it says so for more of the ones that were not added,
+// and more of the frees are sent for nothing.
+class SampledAddressFilter {
+ public:
+  void Add(uint64_t addr) {
+    words_[Word(addr)].fetch_or(Bit(addr), std::memory_order_relaxed);
+  }
+
+  bool MightContain(uint64_t addr) const {
+    return (words_[Word(addr)].load(std::memory_order_relaxed) & Bit(addr)) !=
+           0;
+  }
+
+ private:
+  static constexpr int kHashBits = 19;
+  static constexpr size_t kBits = size_t{1} << kHashBits;
+
+  static uint64_t Hash(uint64_t addr) {
+    // Fibonacci hashing, the upper bits depend on all the bits of addr.
+    return (addr * 0x9e3779b97f4a7c15) >> (64 - kHashBits);
+  }
+  static size_t Word(uint64_t addr) { return Hash(addr) / 64; }
+  static uint64_t Bit(uint64_t addr) {
+    return uint64_t{1} << (Hash(addr) % 64);
+  }
+
+  std::atomic<uint64_t> words_[kBits / 64]{};
 };
 
 const char* GetThreadStackBase();
 
+// Walks the chain of frame records from the caller up to |stackbase|, and
+// writes the return addresses into |pcs|, innermost first. Stops at the first
+// frame record that does not look valid, e.g. because a function on the stack
+// was built without frame pointers. Returns the number of pcs written, which
+// is zero on architectures other than x86, x86_64 and arm64.
+size_t UnwindFramePointers(const char* stackbase,
+                           uint64_t* pcs,
+                           size_t max_pcs);
+
 // RAII wrapper around pthread_key_t. This is different from a ScopedResource
 // because it needs a separate boolean indicating validity.
 class PThreadKey {
@@ -142,10 +219,25 @@ class Client {
                         void (*unhooked_free)(void*));
   void Shutdown();
 
+  // Sends |msg| through the shared memory buffer if heapprofd set one up,
+  // through a socket of the pool otherwise. Returns false if the transport
+  // failed. A sample dropped because the buffer is full is not a failure,
+  // heapprofd finds out about it from the stats of the buffer. If |dropped|
+  // is not null, it gets set in that case. Free records wait for space for up
+  // to 1 s even without block_client.
+  bool SendWireMessage(const WireMessage& msg, bool* dropped = nullptr);
+
   ClientConfiguration client_config_for_testing() { return client_config_; }
   bool inited() { return inited_; }
 
  private:
+  SharedRingBuffer::Buffer BeginWriteBlocking(size_t size);
+  void SendDroppedSequenceNumber(uint64_t sequence_number);
+  void WakeUpReader();
+  void RecordMallocPcs(uint64_t alloc_size,
+                       uint64_t total_size,
+                       uint64_t alloc_address);
+
   size_t ShouldSampleAlloc(uint64_t alloc_size,
                            void* (*unhooked_malloc)(size_t),
                            void (*unhooked_free)(void*));
@@ -154,8 +246,14 @@ class Client {
   std::atomic<bool> inited_{false};
   ClientConfiguration client_config_;
   PThreadKey pthread_key_;
+  // The hashes of the stack of the last record of each thread, for
+  // ClientConfiguration::stack_deltas.
+  PThreadKey stack_hashes_key_;
   SocketPool socket_pool_;
+  // Set if heapprofd sent a shared memory buffer in the handshake.
+  std::unique_ptr<SharedRingBuffer> shmem_;
   FreePage free_page_;
+  SampledAddressFilter sampled_addresses_;
   const char* main_thread_stack_base_ = nullptr;
   std::atomic<uint64_t> sequence_number_{0};
 };
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "perfetto/base/logging.h"
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/base/unix_socket.h"
+#include "perfetto/base/utils.h"
+#include "src/profiling/memory/client.h"
+#include "src/profiling/memory/shared_ring_buffer.h"
+#include "src/profiling/memory/wire_protocol.h"
+
+namespace {
+
+using perfetto::base::ScopedFile;
+using perfetto::profiling::Client;
+using perfetto::profiling::ClientConfiguration;
+using perfetto::profiling::kFreePageSize;
+using perfetto::profiling::SharedRingBuffer;
+
+enum Transport { kSocket = 0, kSharedMemory = 1 };
+
+constexpr size_t kShmemSize = 8 * 1048576;
+
+ClientConfiguration MakeConfig(bool frame_pointer_unwinding) {
+  ClientConfiguration cfg{};
+  cfg.interval = 1;
+  cfg.block_client = true;
+  cfg.frame_pointer_unwinding = frame_pointer_unwinding;
+  return cfg;
+}
+
+// Stands in for heapprofd: does the handshake with the client, then reads the
+// records and throws them away. Only the cost on the allocating thread is
+// measured, the unwinding is left out.
+class FakeHeapprofd {
+ public:
+  FakeHeapprofd(ScopedFile sock,
+                Transport transport,
+                const ClientConfiguration& cfg)
+      : sock_(std::move(sock)),
+        transport_(transport),
+        cfg_(cfg),
+        thread_(&FakeHeapprofd::Run, this) {}
+
+  // Returns once the client has closed its end of the socket.
+  ~FakeHeapprofd() { Join(); }
+
+  void Join() {
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  // Only valid after Join().
+  uint64_t records() const { return records_; }
+  uint64_t record_bytes() const { return record_bytes_; }
+
+ private:
+  void Run() {
+    uint64_t size = 0;
+    ScopedFile fds[2];
+    PERFETTO_CHECK(perfetto::base::SockReceive(*sock_, &size, sizeof(size),
+                                               fds, 2) == sizeof(size));
+
+    ClientConfiguration cfg = cfg_;
+    std::unique_ptr<SharedRingBuffer> shmem;
+    int shmem_fd = -1;
+    if (transport_ == kSharedMemory) {
+      shmem = SharedRingBuffer::Create(kShmemSize);
+      PERFETTO_CHECK(shmem);
+      shmem_fd = shmem->fd();
+    }
+    PERFETTO_CHECK(perfetto::base::SockSend(*sock_, &cfg, sizeof(cfg),
+                                            &shmem_fd, shmem ? 1 : 0) ==
+                   sizeof(cfg));
+
+    char buf[4096];
+    std::vector<uint8_t> record;
+    for (;;) {
+      ssize_t rd = PERFETTO_EINTR(read(*sock_, buf, sizeof(buf)));
+      if (rd <= 0)
+        return;
+      if (!shmem)
+        continue;
+      // Same as the SocketListener: copy out all the records, then wait for
+      // the next wakeup.
+      do {
+        for (SharedRingBuffer::Buffer rec = shmem->BeginRead(); rec;
+             rec = shmem->BeginRead()) {
+          record.assign(rec.data, rec.data + rec.size);
+          records_++;
+          record_bytes_ += rec.size;
+          shmem->EndRead(std::move(rec));
+        }
+      } while (!shmem->ArmReaderWakeup());
+    }
+  }
+
+  ScopedFile sock_;
+  const Transport transport_;
+  const ClientConfiguration cfg_;
+  uint64_t records_ = 0;
+  uint64_t record_bytes_ = 0;
+  std::thread thread_;
+};
+
+// The args are the Transport, and whether the client unwinds the frame
+// pointers rather than sending the stack.
+void ClientArgs(benchmark::internal::Benchmark* b) {
+  for (int transport : {kSocket, kSharedMemory}) {
+    b->Args({transport, 0});
+    b->Args({transport, 1});
+  }
+}
+
+// The args are the number of freeing threads, and whether the frees are of
+// sampled allocations.
+void FreeArgs(benchmark::internal::Benchmark* b) {
+  for (int threads : {1, 4, 16}) {
+    b->Args({threads, 1});
+    b->Args({threads, 0});
+  }
+}
+
+// The args are ClientConfiguration.max_stack_size, and whether the client
+// sends stack deltas.
+void StackArgs(benchmark::internal::Benchmark* b) {
+  b->Args({0, 0});
+  b->Args({0, 1});
+  b->Args({4096, 0});
+  b->Args({4096, 1});
+}
+
+constexpr uint64_t kFreesPerThread = 16 * kFreePageSize;
+
+// Calls RecordMalloc |depth| frames deeper than the caller, each with some
+// data on the stack.
+__attribute__((noinline)) void RecordMallocAtDepth(Client* client,
+                                                   uint64_t addr,
+                                                   uint32_t depth) {
+  if (depth == 0) {
+    client->RecordMalloc(32 /* alloc_size */, 32 /* total_size */, addr);
+    return;
+  }
+  volatile char frame[128];
+  frame[0] = static_cast<char>(depth);
+  RecordMallocAtDepth(client, addr, depth - 1);
+  frame[1] = frame[0];
+}
+
+uint64_t FreedAddress(uint64_t thread, uint64_t i) {
+  return 0x7f0000000000 + (thread << 32) + 16 * i;
+}
+
+}  // namespace
+
+// The time a sampled malloc spends in the client, i.e. copying the stack (or
+// walking the frame pointers) and handing it over to heapprofd.
+static void BM_Client_RecordMalloc(benchmark::State& state) {
+  int sv[2];
+  PERFETTO_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  FakeHeapprofd heapprofd(ScopedFile(sv[1]),
+                          static_cast<Transport>(state.range(0)),
+                          MakeConfig(state.range(1) != 0));
+  std::vector<ScopedFile> socks;
+  socks.emplace_back(sv[0]);
+  Client client(std::move(socks));
+  PERFETTO_CHECK(client.inited());
+
+  uint64_t addr = 0x1000;
+  for (auto _ : state) {
+    client.RecordMalloc(32 /* alloc_size */, 32 /* total_size */, addr);
+    addr += 32;
+  }
+  client.Shutdown();
+}
+BENCHMARK(BM_Client_RecordMalloc)->Apply(ClientArgs);
+
+// The bytes a sampled malloc sends to heapprofd, from a deep stack whose top
+// frames change between samples, as they do in a loop that calls into
+// different functions that allocate.
+static void BM_Client_RecordMalloc_DeepStack(benchmark::State& state) {
+  int sv[2];
+  PERFETTO_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  ClientConfiguration cfg = MakeConfig(false /* frame_pointer_unwinding */);
+  cfg.max_stack_size = static_cast<uint64_t>(state.range(0));
+  cfg.stack_deltas = state.range(1) != 0;
+  FakeHeapprofd heapprofd(ScopedFile(sv[1]), kSharedMemory, cfg);
+  std::vector<ScopedFile> socks;
+  socks.emplace_back(sv[0]);
+  // Not on the stack, like the one of the malloc hooks, as it changes with
+  // every sample.
+  std::unique_ptr<Client> client(new Client(std::move(socks)));
+  PERFETTO_CHECK(client->inited());
+
+  uint64_t addr = 0x1000;
+  uint32_t i = 0;
+  for (auto _ : state) {
+    RecordMallocAtDepth(client.get(), addr, 64 + i++ % 4);
+    addr += 32;
+  }
+  client->Shutdown();
+  heapprofd.Join();
+  state.counters["bytes_per_sample"] =
+      heapprofd.records() ? static_cast<double>(heapprofd.record_bytes()) /
+                                static_cast<double>(heapprofd.records())
+                          : 0;
+}
+BENCHMARK(BM_Client_RecordMalloc_DeepStack)->Apply(StackArgs);
+
+// The time a free spends in the client, when several threads free at the
+// same time. The frees of allocations that were not sampled are dropped in
+// the client.
+static void BM_Client_RecordFree(benchmark::State& state) {
+  const uint64_t num_threads = static_cast<uint64_t>(state.range(0));
+  const bool sampled = state.range(1) != 0;
+  int sv[2];
+  PERFETTO_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  FakeHeapprofd heapprofd(ScopedFile(sv[1]), kSharedMemory,
+                          MakeConfig(true /* frame_pointer_unwinding */));
+  std::vector<ScopedFile> socks;
+  socks.emplace_back(sv[0]);
+  Client client(std::move(socks));
+  PERFETTO_CHECK(client.inited());
+
+  if (sampled) {
+    for (uint64_t thread = 0; thread < num_threads; ++thread) {
+      for (uint64_t i = 0; i < kFreesPerThread; ++i)
+        client.RecordMalloc(16, 16, FreedAddress(thread, i));
+    }
+  }
+
+  for (auto _ : state) {
+    std::vector<std::thread> threads;
+    for (uint64_t thread = 0; thread < num_threads; ++thread) {
+      threads.emplace_back([&client, thread] {
+        for (uint64_t i = 0; i < kFreesPerThread; ++i)
+          client.RecordFree(FreedAddress(thread, i));
+      });
+    }
+    for (std::thread& th : threads)
+      th.join();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(
+      static_cast<uint64_t>(state.iterations()) * num_threads *
+      kFreesPerThread));
+  client.Shutdown();
+}
+BENCHMARK(BM_Client_RecordFree)->Apply(FreeArgs)->UseRealTime();
@@ -18,12 +18,67 @@
 
 #include "gtest/gtest.h"
 
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <set>
 #include <thread>
 
+#include "perfetto/base/unix_socket.h"
+#include "src/profiling/memory/record_reader.h"
+#include "src/profiling/memory/shared_ring_buffer.h"
+
 namespace perfetto {
 namespace profiling {
 namespace {
 
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+__attribute__((noinline)) size_t UnwindFromHere(const char* stackbase,
+                                                uint64_t* pcs,
+                                                size_t max_pcs) {
+  return UnwindFramePointers(stackbase, pcs, max_pcs);
+}
+#endif
+
+// Connects a client to a fake heapprofd that sends it |cfg| and |shmem| in
+// the handshake.
+std::unique_ptr<Client> ConnectClient(const ClientConfiguration& cfg,
+                                      SharedRingBuffer* shmem,
+                                      base::ScopedFile* heapprofd_sock) {
+  int sv[2];
+  PERFETTO_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  heapprofd_sock->reset(sv[1]);
+  std::thread heapprofd([&cfg, shmem, heapprofd_sock] {
+    uint64_t size = 0;
+    base::ScopedFile fds[2];
+    PERFETTO_CHECK(base::SockReceive(**heapprofd_sock, &size, sizeof(size),
+                                     fds, 2) == sizeof(size));
+    int shmem_fd = shmem->fd();
+    PERFETTO_CHECK(base::SockSend(**heapprofd_sock, &cfg, sizeof(cfg),
+                                  &shmem_fd, 1) == sizeof(cfg));
+  });
+  std::vector<base::ScopedFile> socks;
+  socks.emplace_back(sv[0]);
+  std::unique_ptr<Client> client(new Client(std::move(socks)));
+  heapprofd.join();
+  return client;
+}
+
+std::vector<std::vector<char>> ReadRecords(SharedRingBuffer* shmem) {
+  std::vector<std::vector<char>> records;
+  for (SharedRingBuffer::Buffer buf = shmem->BeginRead(); buf;
+       buf = shmem->BeginRead()) {
+    records.emplace_back(buf.data, buf.data + buf.size);
+    shmem->EndRead(std::move(buf));
+  }
+  return records;
+}
+
+__attribute__((noinline)) void RecordMallocFromHere(Client* client,
+                                                    uint64_t addr) {
+  client->RecordMalloc(16, 16, addr);
+}
+
 TEST(SocketPoolTest, Basic) {
   std::vector<base::ScopedFile> files;
   files.emplace_back(base::OpenFile("/dev/null", O_RDONLY));
@@ -117,6 +172,284 @@ TEST(ClientTest, GetThreadStackBase) {
   th.join();
 }
 
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+TEST(ClientTest, UnwindFramePointers) {
+  std::thread th([] {
+    const char* stackbase = GetThreadStackBase();
+    ASSERT_NE(stackbase, nullptr);
+    uint64_t pcs[64];
+    size_t num_pcs = UnwindFromHere(stackbase, pcs, 64);
+    // The frame of UnwindFramePointers itself always has a frame pointer. How
+    // far the walk gets from there depends on how the test was built.
+    ASSERT_GE(num_pcs, 1u);
+    ASSERT_LE(num_pcs, 64u);
+    const uint64_t caller = reinterpret_cast<uint64_t>(&UnwindFromHere);
+    EXPECT_GT(pcs[0], caller);
+    EXPECT_LT(pcs[0], caller + 256);
+
+    EXPECT_EQ(UnwindFromHere(stackbase, pcs, 1), 1u);
+  });
+  th.join();
+}
+
+TEST(ClientTest, UnwindFramePointersOutsideOfStack) {
+  uint64_t pcs[64];
+  // The frame of the caller is not below the stackbase.
+  EXPECT_EQ(UnwindFromHere(nullptr, pcs, 64), 0u);
+}
+#endif
+
+TEST(SampledAddressFilterTest, Basic) {
+  std::unique_ptr<SampledAddressFilter> filter(new SampledAddressFilter());
+  constexpr uint64_t kAddresses = 10000;
+  for (uint64_t i = 0; i < kAddresses; ++i)
+    filter->Add(0x7f0000000000 + 32 * i);
+  for (uint64_t i = 0; i < kAddresses; ++i)
+    EXPECT_TRUE(filter->MightContain(0x7f0000000000 + 32 * i));
+  size_t false_positives = 0;
+  for (uint64_t i = 0; i < kAddresses; ++i)
+    false_positives += filter->MightContain(0x7f0000000010 + 32 * i);
+  // 10000 of the 2^19 bits are set.
+  EXPECT_LT(false_positives, kAddresses / 20);
+}
+
+// The frees of sampled allocations from several threads all get to heapprofd
+// once they fill the pages, each with its own sequence number.
+TEST(ClientTest, FreesOfSampledAllocations) {
+  constexpr uint64_t kThreads = 4;
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  base::ScopedFile heapprofd_sock(sv[1]);
+  std::vector<FreePageEntry> frees;
+  std::thread heapprofd([&heapprofd_sock, &frees] {
+    uint64_t size = 0;
+    base::ScopedFile fds[2];
+    ASSERT_EQ(base::SockReceive(*heapprofd_sock, &size, sizeof(size), fds, 2),
+              static_cast<ssize_t>(sizeof(size)));
+    ClientConfiguration cfg{};
+    cfg.interval = 1;
+    cfg.frame_pointer_unwinding = true;
+    ASSERT_EQ(base::SockSend(*heapprofd_sock, &cfg, sizeof(cfg), nullptr, 0),
+              static_cast<ssize_t>(sizeof(cfg)));
+
+    RecordReader record_reader;
+    for (;;) {
+      RecordReader::ReceiveBuffer buf = record_reader.BeginReceive();
+      ssize_t rd = PERFETTO_EINTR(read(*heapprofd_sock, buf.data, buf.size));
+      if (rd <= 0)
+        return;
+      RecordReader::Record record;
+      if (record_reader.EndReceive(static_cast<size_t>(rd), &record) !=
+          RecordReader::Result::RecordReceived) {
+        continue;
+      }
+      WireMessage msg;
+      ASSERT_TRUE(ReceiveWireMessage(reinterpret_cast<char*>(record.data.get()),
+                                     record.size, &msg));
+      if (msg.record_type != RecordType::Free)
+        continue;
+      size_t num_entries = static_cast<size_t>(msg.free_header->num_entries);
+      size_t old_size = frees.size();
+      frees.resize(old_size + num_entries);
+      ASSERT_TRUE(DecodeFreeEntries(msg.payload, msg.payload_size,
+                                    num_entries, &frees[old_size]));
+    }
+  });
+
+  std::set<uint64_t> freed_addrs;
+  {
+    std::vector<base::ScopedFile> socks;
+    socks.emplace_back(sv[0]);
+    Client client(std::move(socks));
+    ASSERT_TRUE(client.inited());
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < kThreads; ++t) {
+      uint64_t first_addr = 0x7f0000000000 + (t << 32);
+      for (uint64_t i = 0; i < kFreePageSize; ++i)
+        freed_addrs.emplace(first_addr + 16 * i);
+      threads.emplace_back([&client, first_addr] {
+        for (uint64_t i = 0; i < kFreePageSize; ++i) {
+          client.RecordMalloc(16, 16, first_addr + 16 * i);
+          client.RecordFree(first_addr + 16 * i);
+        }
+      });
+    }
+    for (std::thread& th : threads)
+      th.join();
+  }
+  heapprofd.join();
+
+  ASSERT_EQ(frees.size(), kThreads * kFreePageSize);
+  std::set<uint64_t> sequence_numbers;
+  std::set<uint64_t> received_addrs;
+  for (const FreePageEntry& entry : frees) {
+    sequence_numbers.emplace(entry.sequence_number);
+    received_addrs.emplace(entry.addr);
+  }
+  EXPECT_EQ(sequence_numbers.size(), frees.size());
+  EXPECT_EQ(received_addrs, freed_addrs);
+}
+
+TEST(ClientTest, FreesOfUnsampledAllocationsAreDropped) {
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  base::ScopedFile heapprofd_sock(sv[1]);
+  size_t received = 0;
+  std::thread heapprofd([&heapprofd_sock, &received] {
+    uint64_t size = 0;
+    base::ScopedFile fds[2];
+    ASSERT_EQ(base::SockReceive(*heapprofd_sock, &size, sizeof(size), fds, 2),
+              static_cast<ssize_t>(sizeof(size)));
+    ClientConfiguration cfg{};
+    cfg.interval = 1;
+    ASSERT_EQ(base::SockSend(*heapprofd_sock, &cfg, sizeof(cfg), nullptr, 0),
+              static_cast<ssize_t>(sizeof(cfg)));
+    char buf[4096];
+    ssize_t rd;
+    while ((rd = PERFETTO_EINTR(read(*heapprofd_sock, buf, sizeof(buf)))) > 0)
+      received += static_cast<size_t>(rd);
+  });
+
+  {
+    std::vector<base::ScopedFile> socks;
+    socks.emplace_back(sv[0]);
+    Client client(std::move(socks));
+    ASSERT_TRUE(client.inited());
+    // Without the filtering, this would fill a page.
+    for (uint64_t i = 0; i < kFreePageSize; ++i)
+      client.RecordFree(0x7f0000000000 + 16 * i);
+  }
+  heapprofd.join();
+  EXPECT_EQ(received, 0u);
+}
+
+// A free that does not fill up the page is sent once it has been held back for
+// long enough, with the next sampled malloc.
+TEST(ClientTest, StaleFreePageIsSent) {
+  std::unique_ptr<SharedRingBuffer> shmem = SharedRingBuffer::Create(1048576);
+  ASSERT_TRUE(shmem);
+  ClientConfiguration cfg{};
+  cfg.interval = 1;
+  cfg.frame_pointer_unwinding = true;
+  base::ScopedFile heapprofd_sock;
+  std::unique_ptr<Client> client =
+      ConnectClient(cfg, shmem.get(), &heapprofd_sock);
+  ASSERT_TRUE(client->inited());
+  client->RecordMalloc(16, 16, 0x1000);
+  client->RecordFree(0x1000);
+  EXPECT_EQ(ReadRecords(shmem.get()).size(), 1u);
+
+  usleep(200 * 1000);
+  client->RecordMalloc(16, 16, 0x2000);
+  std::vector<std::vector<char>> records = ReadRecords(shmem.get());
+  ASSERT_EQ(records.size(), 2u);
+  WireMessage msg;
+  ASSERT_TRUE(ReceiveWireMessage(records[0].data(), records[0].size(), &msg));
+  ASSERT_EQ(msg.record_type, RecordType::Free);
+  ASSERT_EQ(msg.free_header->num_entries, 1u);
+  FreePageEntry entry;
+  ASSERT_TRUE(DecodeFreeEntries(msg.payload, msg.payload_size, 1, &entry));
+  EXPECT_EQ(entry.addr, 0x1000u);
+  EXPECT_EQ(entry.sequence_number, 2u);
+}
+
+// heapprofd commits the frees in sequence, it still has to get the sequence
+// number of a malloc dropped because the buffer was full.
+TEST(ClientTest, DroppedMallocIsSentAsNoopFree) {
+  std::unique_ptr<SharedRingBuffer> shmem = SharedRingBuffer::Create(4096);
+  ASSERT_TRUE(shmem);
+  ClientConfiguration cfg{};
+  cfg.interval = 1;
+  cfg.frame_pointer_unwinding = true;
+  base::ScopedFile heapprofd_sock;
+  std::unique_ptr<Client> client =
+      ConnectClient(cfg, shmem.get(), &heapprofd_sock);
+  ASSERT_TRUE(client->inited());
+  uint64_t mallocs = 0;
+  while (shmem->GetStats().num_writes_dropped == 0 && mallocs < 4096)
+    client->RecordMalloc(16, 16, 0x1000 + 16 * mallocs++);
+  ASSERT_EQ(shmem->GetStats().num_writes_dropped, 1u);
+  ReadRecords(shmem.get());
+
+  usleep(200 * 1000);
+  client->RecordMalloc(16, 16, 0x1000);
+  std::vector<std::vector<char>> records = ReadRecords(shmem.get());
+  ASSERT_EQ(records.size(), 2u);
+  WireMessage msg;
+  ASSERT_TRUE(ReceiveWireMessage(records[0].data(), records[0].size(), &msg));
+  ASSERT_EQ(msg.record_type, RecordType::Free);
+  ASSERT_EQ(msg.free_header->num_entries, 1u);
+  FreePageEntry entry;
+  ASSERT_TRUE(DecodeFreeEntries(msg.payload, msg.payload_size, 1, &entry));
+  EXPECT_EQ(entry.addr, 0u);
+  EXPECT_EQ(entry.sequence_number, mallocs);
+}
+
+// The second record from the same place only has the top of the stack.
+TEST(ClientTest, StackDeltas) {
+  std::unique_ptr<SharedRingBuffer> shmem = SharedRingBuffer::Create(1048576);
+  ASSERT_TRUE(shmem);
+  ClientConfiguration cfg{};
+  cfg.interval = 1;
+  cfg.stack_deltas = true;
+  base::ScopedFile heapprofd_sock;
+  std::unique_ptr<Client> client =
+      ConnectClient(cfg, shmem.get(), &heapprofd_sock);
+  ASSERT_TRUE(client->inited());
+  std::thread th([&client] {
+    RecordMallocFromHere(client.get(), 0x1000);
+    RecordMallocFromHere(client.get(), 0x1010);
+  });
+  th.join();
+
+  std::vector<std::vector<char>> records = ReadRecords(shmem.get());
+  ASSERT_EQ(records.size(), 2u);
+  WireMessage first;
+  WireMessage second;
+  ASSERT_TRUE(ReceiveWireMessage(records[0].data(), records[0].size(), &first));
+  ASSERT_TRUE(
+      ReceiveWireMessage(records[1].data(), records[1].size(), &second));
+  ASSERT_EQ(first.record_type, RecordType::MallocStackDelta);
+  ASSERT_EQ(second.record_type, RecordType::MallocStackDelta);
+
+  const AllocMetadata& first_metadata = *first.alloc_header;
+  EXPECT_EQ(first_metadata.stack_delta_size, 0u);
+  EXPECT_EQ(first.payload_size, first_metadata.stack_size);
+
+  const AllocMetadata& second_metadata = *second.alloc_header;
+  EXPECT_EQ(second_metadata.stack_pointer + second_metadata.stack_size,
+            first_metadata.stack_pointer + first_metadata.stack_size);
+  EXPECT_EQ(second_metadata.stack_delta_base, first_metadata.sequence_number);
+  EXPECT_GT(second_metadata.stack_delta_size, 0u);
+  EXPECT_EQ(second.payload_size + second_metadata.stack_delta_size,
+            second_metadata.stack_size);
+}
+
+// A truncated stack is sent as a whole record, deltas only apply to full ones.
+TEST(ClientTest, MaxStackSize) {
+  std::unique_ptr<SharedRingBuffer> shmem = SharedRingBuffer::Create(1048576);
+  ASSERT_TRUE(shmem);
+  ClientConfiguration cfg{};
+  cfg.interval = 1;
+  cfg.max_stack_size = 64;
+  cfg.stack_deltas = true;
+  base::ScopedFile heapprofd_sock;
+  std::unique_ptr<Client> client =
+      ConnectClient(cfg, shmem.get(), &heapprofd_sock);
+  ASSERT_TRUE(client->inited());
+  std::thread th([&client] { RecordMallocFromHere(client.get(), 0x1000); });
+  th.join();
+
+  std::vector<std::vector<char>> records = ReadRecords(shmem.get());
+  ASSERT_EQ(records.size(), 1u);
+  WireMessage msg;
+  ASSERT_TRUE(ReceiveWireMessage(records[0].data(), records[0].size(), &msg));
+  EXPECT_EQ(msg.record_type, RecordType::Malloc);
+  EXPECT_EQ(msg.payload_size, 64u);
+  EXPECT_GT(msg.alloc_header->stack_size, 64u);
+  EXPECT_EQ(msg.alloc_header->stack_delta_size, 0u);
+}
+
 }  // namespace
 }  // namespace profiling
 }  // namespace perfetto
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/profiling/memory/elf_cache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unwindstack/Maps.h>
+
+namespace perfetto {
+namespace profiling {
+
+ElfCache::ElfCache(uint64_t max_bytes) : max_bytes_(max_bytes) {}
+
+// static
+bool ElfCache::GetKey(const unwindstack::MapInfo& map,
+                      Key* key,
+                      uint64_t* size) {
+  // Only the executable mappings are unwound through.
+  if (!(map.flags & PROT_EXEC) ||
+      (map.flags & unwindstack::MAPS_FLAGS_DEVICE_MAP) || map.name.empty() ||
+      map.name[0] != '/') {
+    return false;
+  }
+  // This is the file libunwindstack opens to parse the ELF, regardless of what
+  // the process had mapped. So it is also the one to identify the ELF by.
+  struct stat stat_buf;
+  if (stat(map.name.c_str(), &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode))
+    return false;
+  const uint64_t file_size = static_cast<uint64_t>(stat_buf.st_size);
+  if (map.offset >= file_size)
+    return false;
+  key->dev = static_cast<uint64_t>(stat_buf.st_dev);
+  key->inode = static_cast<uint64_t>(stat_buf.st_ino);
+  key->offset = map.offset;
+  *size = file_size - map.offset;
+  return true;
+}
+
+bool ElfCache::Get(const Key& key, unwindstack::MapInfo* map) {
+  std::lock_guard<std::mutex> l(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return false;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  const Entry& entry = *it->second;
+  map->elf = entry.elf;
+  map->elf_offset = entry.elf_offset;
+  stats_.hits++;
+  return true;
+}
+
+void ElfCache::Add(const Key& key,
+                   uint64_t size,
+                   const unwindstack::MapInfo& map) {
+  if (!map.elf)
+    return;
+
+  std::lock_guard<std::mutex> l(mutex_);
+  stats_.misses++;
+  // Another unwinder thread might have parsed the same file at the same time.
+  if (index_.count(key) || size > max_bytes_)
+    return;
+  entries_.push_front(Entry{key, size, map.elf, map.elf_offset});
+  index_.emplace(key, entries_.begin());
+  stats_.entries++;
+  stats_.bytes += size;
+
+  while (stats_.bytes > max_bytes_) {
+    const Entry& lru = entries_.back();
+    stats_.entries--;
+    stats_.bytes -= lru.size;
+    stats_.evictions++;
+    index_.erase(lru.key);
+    entries_.pop_back();
+  }
+}
+
+ElfCache::Stats ElfCache::GetStats() {
+  std::lock_guard<std::mutex> l(mutex_);
+  return stats_;
+}
+
+}  // namespace profiling
+}  // namespace perfetto
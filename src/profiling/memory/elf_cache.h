@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_PROFILING_MEMORY_ELF_CACHE_H_
+#define SRC_PROFILING_MEMORY_ELF_CACHE_H_
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+#include <unwindstack/Elf.h>
+#include <unwindstack/MapInfo.h>
+
+namespace perfetto {
+namespace profiling {
+
+// Cache of the ELF files parsed by libunwindstack (the eh_frame, debug_frame,
+// symbols, ...), shared by all the unwinder threads. Without it, the ELF of a
+// library is parsed again for every process that maps it, and every time the
+// maps of a process are parsed again.
+//
+// The entries are keyed by the file (device and inode) and the offset of the
+// mapping, so the same library is shared across processes regardless of the
+// path it was mapped from. The cache holds on to up to |max_bytes| of mapped
+// ELF files, and evicts the least recently used ones after that. Evicted ELFs
+// stay alive as long as a process still uses them.
+class ElfCache {
+ public:
+  struct Key {
+    uint64_t dev;
+    uint64_t inode;
+    uint64_t offset;
+
+    bool operator<(const Key& other) const {
+      return std::tie(dev, inode, offset) <
+             std::tie(other.dev, other.inode, other.offset);
+    }
+  };
+
+  struct Stats {
+    // Maps whose ELF was taken from the cache.
+    uint64_t hits;
+    // ELFs that had to be parsed, and were then added to the cache.
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    // Size of the ELF files held by the cache.
+    uint64_t bytes;
+  };
+
+  explicit ElfCache(uint64_t max_bytes);
+
+  // Returns false if the ELF of |map| cannot be cached, e.g. because it is not
+  // backed by a file. |size| is the size of the file from the offset of the
+  // mapping on, which is how much libunwindstack maps to read the ELF.
+  static bool GetKey(const unwindstack::MapInfo& map,
+                     Key* key,
+                     uint64_t* size);
+
+  // Sets the ELF of |map| if it is in the cache.
+  bool Get(const Key& key, unwindstack::MapInfo* map);
+  // Adds the ELF that libunwindstack parsed for |map|.
+  void Add(const Key& key, uint64_t size, const unwindstack::MapInfo& map);
+
+  Stats GetStats();
+
+ private:
+  struct Entry {
+    Key key;
+    uint64_t size;
+    std::shared_ptr<unwindstack::Elf> elf;
+    uint64_t elf_offset;
+  };
+
+  const uint64_t max_bytes_;
+
+  std::mutex mutex_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::map<Key, std::list<Entry>::iterator> index_;
+  Stats stats_{};
+};
+
+}  // namespace profiling
+}  // namespace perfetto
+
+#endif  // SRC_PROFILING_MEMORY_ELF_CACHE_H_
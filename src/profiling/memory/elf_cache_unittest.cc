@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/profiling/memory/elf_cache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unwindstack/Maps.h>
+
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace profiling {
+namespace {
+
+constexpr uint64_t kExecFlags = PROT_READ | PROT_EXEC;
+
+std::unique_ptr<unwindstack::MapInfo> MakeMap(uint64_t offset,
+                                              uint64_t flags,
+                                              const char* name) {
+  return std::unique_ptr<unwindstack::MapInfo>(
+      new unwindstack::MapInfo(nullptr, 0x1000, 0x2000, offset, flags, name));
+}
+
+ElfCache::Key MakeKey(uint64_t inode) {
+  return ElfCache::Key{1, inode, 0};
+}
+
+std::shared_ptr<unwindstack::Elf> MakeElf() {
+  return std::make_shared<unwindstack::Elf>(nullptr);
+}
+
+TEST(ElfCacheTest, GetKey) {
+  struct stat stat_buf;
+  ASSERT_EQ(0, stat("/proc/self/exe", &stat_buf));
+  auto map = MakeMap(0, kExecFlags, "/proc/self/exe");
+  ElfCache::Key key;
+  uint64_t size;
+  ASSERT_TRUE(ElfCache::GetKey(*map, &key, &size));
+  EXPECT_EQ(static_cast<uint64_t>(stat_buf.st_dev), key.dev);
+  EXPECT_EQ(static_cast<uint64_t>(stat_buf.st_ino), key.inode);
+  EXPECT_EQ(0u, key.offset);
+  EXPECT_EQ(static_cast<uint64_t>(stat_buf.st_size), size);
+}
+
+TEST(ElfCacheTest, GetKeyNotCacheable) {
+  ElfCache::Key key;
+  uint64_t size;
+  EXPECT_FALSE(
+      ElfCache::GetKey(*MakeMap(0, PROT_READ, "/proc/self/exe"), &key, &size));
+  EXPECT_FALSE(ElfCache::GetKey(*MakeMap(0, kExecFlags, ""), &key, &size));
+  EXPECT_FALSE(
+      ElfCache::GetKey(*MakeMap(0, kExecFlags, "[vdso]"), &key, &size));
+  EXPECT_FALSE(ElfCache::GetKey(
+      *MakeMap(0, kExecFlags | unwindstack::MAPS_FLAGS_DEVICE_MAP, "/dev/zero"),
+      &key, &size));
+  EXPECT_FALSE(ElfCache::GetKey(
+      *MakeMap(0, kExecFlags, "/does/not/exist.so"), &key, &size));
+}
+
+TEST(ElfCacheTest, GetAdd) {
+  ElfCache cache(100);
+  auto map = MakeMap(0, kExecFlags, "/system/lib/libc.so");
+  EXPECT_FALSE(cache.Get(MakeKey(1), map.get()));
+
+  map->elf = MakeElf();
+  map->elf_offset = 42;
+  cache.Add(MakeKey(1), 10, *map);
+
+  // The same file in another process.
+  auto other_map = MakeMap(0, kExecFlags, "/system/lib/libc.so");
+  ASSERT_TRUE(cache.Get(MakeKey(1), other_map.get()));
+  EXPECT_EQ(map->elf, other_map->elf);
+  EXPECT_EQ(42u, other_map->elf_offset);
+
+  ElfCache::Stats stats = cache.GetStats();
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+  EXPECT_EQ(1u, stats.entries);
+  EXPECT_EQ(10u, stats.bytes);
+}
+
+TEST(ElfCacheTest, EvictsLeastRecentlyUsed) {
+  ElfCache cache(100);
+  auto map = MakeMap(0, kExecFlags, "/system/lib/libc.so");
+  map->elf = MakeElf();
+  cache.Add(MakeKey(1), 60, *map);
+  cache.Add(MakeKey(2), 30, *map);
+  // 1 is now more recently used than 2.
+  ASSERT_TRUE(cache.Get(MakeKey(1), map.get()));
+  cache.Add(MakeKey(3), 30, *map);
+
+  EXPECT_TRUE(cache.Get(MakeKey(1), map.get()));
+  EXPECT_FALSE(cache.Get(MakeKey(2), map.get()));
+  EXPECT_TRUE(cache.Get(MakeKey(3), map.get()));
+
+  ElfCache::Stats stats = cache.GetStats();
+  EXPECT_EQ(1u, stats.evictions);
+  EXPECT_EQ(2u, stats.entries);
+  EXPECT_EQ(90u, stats.bytes);
+}
+
+TEST(ElfCacheTest, TooLarge) {
+  ElfCache cache(100);
+  auto map = MakeMap(0, kExecFlags, "/system/lib/libc.so");
+  map->elf = MakeElf();
+  cache.Add(MakeKey(1), 101, *map);
+  EXPECT_FALSE(cache.Get(MakeKey(1), map.get()));
+  EXPECT_EQ(0u, cache.GetStats().entries);
+}
+
+}  // namespace
+}  // namespace profiling
+}  // namespace perfetto
@@ -70,14 +70,14 @@ TEST_F(HeapprofdIntegrationTest, MAYBE_EndToEnd) {
 // TODO(fmayer): Fix out of tree integration test.
 #if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
         BookkeepingRecord bookkeeping_record;
-        ASSERT_TRUE(HandleUnwindingRecord(&r, &bookkeeping_record));
+        ASSERT_TRUE(HandleUnwindingRecord(&r, nullptr, &bookkeeping_record));
         bookkeeping_thread.HandleBookkeepingRecord(&bookkeeping_record);
 #endif
         base::ignore_result(r);
         base::ignore_result(bookkeeping_thread);
         done();
       },
-      &bookkeeping_thread);
+      &bookkeeping_thread, &task_runner);
 
   ProcessSetSpec spec{};
   spec.pids.emplace(getpid());
@@ -105,7 +105,7 @@ TEST_F(HeapprofdIntegrationTest, MAYBE_MultiSession) {
   auto done = task_runner.CreateCheckpoint("done");
   constexpr uint64_t kSamplingInterval = 123;
   SocketListener listener([&done](UnwindingRecord) { done(); },
-                          &bookkeeping_thread);
+                          &bookkeeping_thread, &task_runner);
 
   ProcessSetSpec spec{};
   spec.pids.emplace(getpid());
@@ -22,7 +22,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "perfetto/base/file_utils.h"
+#include "perfetto/base/utils.h"
 #include "perfetto/tracing/core/data_source_config.h"
 #include "perfetto/tracing/core/data_source_descriptor.h"
 #include "perfetto/tracing/core/trace_writer.h"
@@ -34,29 +37,107 @@ namespace {
 constexpr char kHeapprofdDataSource[] = "android.heapprofd";
 constexpr size_t kUnwinderQueueSize = 1000;
 constexpr size_t kBookkeepingQueueSize = 1000;
-constexpr size_t kUnwinderThreads = 5;
+constexpr size_t kDefaultUnwinderThreads = 5;
+constexpr size_t kDefaultBookkeepingThreads = 2;
+constexpr size_t kMaxThreads = 16;
+// Of ELF files mapped by the ElfCache shared by the unwinder threads.
+constexpr uint64_t kElfCacheSize = 256 * 1048576;  // 256 MiB
 constexpr int kHeapprofdSignal = 36;
 
 constexpr uint32_t kInitialConnectionBackoffMs = 100;
 constexpr uint32_t kMaxConnectionBackoffMs = 30 * 1000;
 
+constexpr uint64_t kDefaultShmemSize = 8 * 1048576;  // 8 MiB
+constexpr uint64_t kMaxShmemSize = 512 * 1048576;    // 512 MiB
+
 ClientConfiguration MakeClientConfiguration(const DataSourceConfig& cfg) {
   ClientConfiguration client_config;
   client_config.interval = cfg.heapprofd_config().sampling_interval_bytes();
+  client_config.block_client = cfg.heapprofd_config().block_client();
+  client_config.frame_pointer_unwinding =
+      cfg.heapprofd_config().frame_pointer_unwinding();
+  client_config.max_stack_size = cfg.heapprofd_config().max_stack_size_bytes();
+  client_config.stack_deltas = cfg.heapprofd_config().stack_deltas();
   return client_config;
 }
 
+size_t GetThreadCount(uint32_t requested, size_t default_count) {
+  if (requested == 0)
+    return default_count;
+  return std::min(static_cast<size_t>(requested), kMaxThreads);
+}
+
+// The SharedRingBuffer needs a power of two.
+size_t GetShmemSize(const HeapprofdConfig& heapprofd_config) {
+  uint64_t requested = heapprofd_config.shmem_size_bytes();
+  if (requested == 0)
+    requested = kDefaultShmemSize;
+  requested = std::min(requested, kMaxShmemSize);
+  uint64_t size = base::kPageSize;
+  while (size < requested)
+    size *= 2;
+  return static_cast<size_t>(size);
+}
+
 }  // namespace
 
-// We create kUnwinderThreads unwinding threads and one bookeeping thread.
-// The bookkeeping thread is singleton in order to avoid expensive and
-// complicated synchronisation in the bookkeeping.
+std::map<size_t, DumpRecord> MakeDumpRecords(
+    const std::set<pid_t>& pids,
+    const std::vector<std::shared_ptr<TraceWriter>>& trace_writers,
+    const std::vector<std::shared_ptr<DumpState>>& incremental_states,
+    base::TaskRunner* task_runner,
+    std::function<void()> done) {
+  const size_t num_shards = trace_writers.size();
+  std::map<size_t, DumpRecord> dump_records;
+  for (pid_t pid : pids) {
+    size_t shard = static_cast<size_t>(pid) % num_shards;
+    dump_records[shard].pids.push_back(pid);
+  }
+  if (dump_records.empty())
+    dump_records.emplace(0, DumpRecord());
+
+  // Only accessed on the task runner.
+  auto shards_left = std::make_shared<size_t>(dump_records.size());
+  for (auto& shard_and_record : dump_records) {
+    size_t shard = shard_and_record.first;
+    DumpRecord& dump_record = shard_and_record.second;
+    dump_record.trace_writer = trace_writers[shard];
+    if (!incremental_states.empty())
+      dump_record.incremental_state = incremental_states[shard];
+    if (!done) {
+      dump_record.callback = [] {};
+      continue;
+    }
+    std::weak_ptr<TraceWriter> weak_trace_writer = trace_writers[shard];
+    dump_record.callback = [task_runner, weak_trace_writer, shards_left,
+                            done] {
+      auto trace_writer = weak_trace_writer.lock();
+      if (trace_writer)
+        trace_writer->Flush();
+      task_runner->PostTask([shards_left, done] {
+        if (--*shards_left == 0)
+          done();
+      });
+    };
+  }
+  return dump_records;
+}
+
+// We create a number of unwinding threads and of bookkeeping threads, both
+// set in the HeapprofdConfig.
+// The processes are split between the bookkeeping threads by pid, so that all
+// the state of a process is only ever touched by one of them. This avoids
+// expensive and complicated synchronisation in the bookkeeping. Each
+// bookkeeping thread has its own GlobalCallstackTrie, and writes the dumps of
+// its processes in its own ProfilePacket.
 //
 // We wire up the system by creating BoundedQueues between the threads. The main
 // thread runs the TaskRunner driving the SocketListener. The unwinding thread
 // takes the data received by the SocketListener and if it is a malloc does
 // stack unwinding, and if it is a free just forwards the content of the record
-// to the bookkeeping thread.
+// to the bookkeeping thread of the process.
+// The unwinding threads share an ElfCache, so that the libraries that are
+// mapped by many processes are parsed only once.
 //
 //             +--------------+
 //             |SocketListener|
@@ -69,27 +150,32 @@ ClientConfiguration MakeClientConfiguration(const DataSourceConfig& cfg) {
 // +--------+-------+   +-------+--------+
 //          |                   |
 //          +-BookkeepingRecord +
-//                    |
-//           +--------v---------+
-//           |Bookkeeping Thread|
-//           +------------------+
+//          |                   |
+// +--------v---------+ +-------v----------+
+// |Bookkeeping Thread| |Bookkeeping Thread|
+// +------------------+ +------------------+
 
 HeapprofdProducer::HeapprofdProducer(base::TaskRunner* task_runner)
     : task_runner_(task_runner),
-      bookkeeping_queue_(kBookkeepingQueueSize),
-      bookkeeping_th_([this] { bookkeeping_thread_.Run(&bookkeeping_queue_); }),
-      unwinder_queues_(MakeUnwinderQueues(kUnwinderThreads)),
-      unwinding_threads_(MakeUnwindingThreads(kUnwinderThreads)),
-      socket_listener_(MakeSocketListenerCallback(), &bookkeeping_thread_),
+      elf_cache_(kElfCacheSize),
+      socket_listener_(MakeSocketListenerCallback(),
+                       [this](pid_t pid) {
+                         return BookkeepingThreadForPid(pid);
+                       },
+                       task_runner),
       socket_(MakeSocket()),
       weak_factory_(this) {}
 
 HeapprofdProducer::~HeapprofdProducer() {
-  bookkeeping_queue_.Shutdown();
+  for (auto& queue : bookkeeping_queues_) {
+    queue.Shutdown();
+  }
   for (auto& queue : unwinder_queues_) {
     queue.Shutdown();
   }
-  bookkeeping_th_.join();
+  for (std::thread& th : bookkeeping_ths_) {
+    th.join();
+  }
   for (std::thread& th : unwinding_threads_) {
     th.join();
   }
@@ -141,11 +227,24 @@ void HeapprofdProducer::SetupDataSource(DataSourceInstanceID id,
     return;
   }
 
+  size_t unwinder_threads = GetThreadCount(heapprofd_config.unwinder_threads(),
+                                           kDefaultUnwinderThreads);
+  size_t bookkeeping_threads = GetThreadCount(
+      heapprofd_config.bookkeeping_threads(), kDefaultBookkeepingThreads);
+  if (bookkeeping_threads_.empty()) {
+    StartThreads(unwinder_threads, bookkeeping_threads);
+  } else if (unwinder_threads != unwinding_threads_.size() ||
+             bookkeeping_threads != bookkeeping_threads_.size()) {
+    PERFETTO_LOG("Already running %zu unwinder and %zu bookkeeping threads.",
+                 unwinding_threads_.size(), bookkeeping_threads_.size());
+  }
+
   DataSource data_source;
 
   ProcessSetSpec process_set_spec{};
   process_set_spec.all = heapprofd_config.all();
   process_set_spec.client_configuration = MakeClientConfiguration(cfg);
+  process_set_spec.shmem_size = GetShmemSize(heapprofd_config);
   process_set_spec.pids.insert(heapprofd_config.pid().cbegin(),
                                heapprofd_config.pid().cend());
   process_set_spec.process_cmdline.insert(
@@ -157,7 +256,20 @@ void HeapprofdProducer::SetupDataSource(DataSourceInstanceID id,
           std::move(process_set_spec));
 
   auto buffer_id = static_cast<BufferID>(cfg.target_buffer());
-  data_source.trace_writer = endpoint_->CreateTraceWriter(buffer_id);
+  for (size_t i = 0; i < bookkeeping_threads_.size(); ++i) {
+    data_source.trace_writers.emplace_back(
+        endpoint_->CreateTraceWriter(buffer_id));
+    if (heapprofd_config.incremental_dumps()) {
+      std::shared_ptr<DumpState> incremental_state(new DumpState());
+      // Several heapprofd can write into the same trace, e.g. the ones forked
+      // for single processes, and each one starts counting at 1.
+      incremental_state->incremental_sequence_id =
+          (static_cast<uint64_t>(getpid()) << 32) |
+          next_incremental_sequence_id_++;
+      data_source.incremental_states.emplace_back(
+          std::move(incremental_state));
+    }
+  }
 
   data_sources_.emplace(id, std::move(data_source));
   PERFETTO_DLOG("Set up data source.");
@@ -247,33 +359,25 @@ bool HeapprofdProducer::Dump(DataSourceInstanceID id,
   }
 
   const DataSource& data_source = it->second;
-  BookkeepingRecord record{};
-  record.record_type = BookkeepingRecord::Type::Dump;
-  DumpRecord& dump_record = record.dump_record;
-  std::set<pid_t> pids = data_source.processes.GetPIDs();
-  dump_record.pids.insert(dump_record.pids.begin(), pids.cbegin(), pids.cend());
-  dump_record.trace_writer = data_source.trace_writer;
-
-  std::weak_ptr<TraceWriter> weak_trace_writer = data_source.trace_writer;
-
-  auto weak_producer = weak_factory_.GetWeakPtr();
-  base::TaskRunner* task_runner = task_runner_;
+  std::function<void()> done;
   if (has_flush_id) {
-    dump_record.callback = [task_runner, weak_producer, flush_id,
-                            weak_trace_writer] {
-      auto trace_writer = weak_trace_writer.lock();
-      if (trace_writer)
-        trace_writer->Flush();
-      task_runner->PostTask([weak_producer, flush_id] {
-        if (weak_producer)
-          return weak_producer->FinishDataSourceFlush(flush_id);
-      });
+    auto weak_producer = weak_factory_.GetWeakPtr();
+    done = [weak_producer, flush_id] {
+      if (weak_producer)
+        return weak_producer->FinishDataSourceFlush(flush_id);
     };
-  } else {
-    dump_record.callback = [] {};
   }
-
-  bookkeeping_queue_.Add(std::move(record));
+  std::map<size_t, DumpRecord> dump_records = MakeDumpRecords(
+      data_source.processes.GetPIDs(), data_source.trace_writers,
+      data_source.incremental_states, task_runner_, std::move(done));
+  // The ElfCache is shared, so its stats are only written once.
+  dump_records.begin()->second.elf_cache_stats = elf_cache_.GetStats();
+  for (auto& shard_and_record : dump_records) {
+    BookkeepingRecord record{};
+    record.record_type = BookkeepingRecord::Type::Dump;
+    record.dump_record = std::move(shard_and_record.second);
+    bookkeeping_queues_[shard_and_record.first].Add(std::move(record));
+  }
   return true;
 }
 
@@ -306,11 +410,47 @@ void HeapprofdProducer::FinishDataSourceFlush(FlushRequestID flush_id) {
 std::function<void(UnwindingRecord)>
 HeapprofdProducer::MakeSocketListenerCallback() {
   return [this](UnwindingRecord record) {
-    unwinder_queues_[static_cast<size_t>(record.pid) % kUnwinderThreads].Add(
-        std::move(record));
+    // The process has connected, so the threads are running.
+    size_t shard = static_cast<size_t>(record.pid) % unwinder_queues_.size();
+    unwinder_queues_[shard].Add(std::move(record));
   };
 }
 
+void HeapprofdProducer::StartThreads(size_t unwinder_threads,
+                                     size_t bookkeeping_threads) {
+  PERFETTO_DCHECK(bookkeeping_threads_.empty());
+  PERFETTO_DLOG("Starting %zu unwinder and %zu bookkeeping threads.",
+                unwinder_threads, bookkeeping_threads);
+  bookkeeping_queues_ =
+      std::vector<BoundedQueue<BookkeepingRecord>>(bookkeeping_threads);
+  for (size_t i = 0; i < bookkeeping_threads; ++i) {
+    bookkeeping_queues_[i].SetCapacity(kBookkeepingQueueSize);
+    bookkeeping_threads_.emplace_back(new BookkeepingThread());
+  }
+  for (size_t i = 0; i < bookkeeping_threads; ++i) {
+    bookkeeping_ths_.emplace_back([this, i] {
+      bookkeeping_threads_[i]->Run(&bookkeeping_queues_[i]);
+    });
+  }
+  unwinder_queues_ = MakeUnwinderQueues(unwinder_threads);
+  unwinding_threads_ = MakeUnwindingThreads(unwinder_threads);
+}
+
+BookkeepingThread* HeapprofdProducer::BookkeepingThreadForPid(pid_t pid) {
+  // A process can connect before any data source is set up, e.g. if it still
+  // has the system property of a previous session set.
+  if (bookkeeping_threads_.empty()) {
+    PERFETTO_LOG(
+        "Process %d connected before any data source was set up, starting "
+        "the default %zu unwinder and %zu bookkeeping threads. The thread "
+        "counts of the HeapprofdConfig will be ignored.",
+        pid, kDefaultUnwinderThreads, kDefaultBookkeepingThreads);
+    StartThreads(kDefaultUnwinderThreads, kDefaultBookkeepingThreads);
+  }
+  size_t shard = static_cast<size_t>(pid) % bookkeeping_threads_.size();
+  return bookkeeping_threads_[shard].get();
+}
+
 std::vector<BoundedQueue<UnwindingRecord>>
 HeapprofdProducer::MakeUnwinderQueues(size_t n) {
   std::vector<BoundedQueue<UnwindingRecord>> ret(n);
@@ -323,7 +463,8 @@ std::vector<std::thread> HeapprofdProducer::MakeUnwindingThreads(size_t n) {
   std::vector<std::thread> ret;
   for (size_t i = 0; i < n; ++i) {
     ret.emplace_back([this, i] {
-      UnwindingMainLoop(&unwinder_queues_[i], &bookkeeping_queue_);
+      UnwindingMainLoop(&unwinder_queues_[i], &bookkeeping_queues_,
+                        &elf_cache_);
     });
   }
   return ret;
@@ -17,7 +17,12 @@
 #ifndef SRC_PROFILING_MEMORY_HEAPPROFD_PRODUCER_H_
 #define SRC_PROFILING_MEMORY_HEAPPROFD_PRODUCER_H_
 
+#include <functional>
 #include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "perfetto/base/task_runner.h"
 
@@ -26,14 +31,30 @@
 #include "perfetto/tracing/core/tracing_service.h"
 
 #include "src/profiling/memory/bounded_queue.h"
+#include "src/profiling/memory/elf_cache.h"
 #include "src/profiling/memory/proc_utils.h"
 #include "src/profiling/memory/process_matcher.h"
+#include "src/profiling/memory/queue_messages.h"
 #include "src/profiling/memory/socket_listener.h"
 #include "src/profiling/memory/system_property.h"
 
 namespace perfetto {
 namespace profiling {
 
+// Makes the DumpRecords of a data source whose processes are |pids|, by
+// bookkeeping thread. Only the threads that have some of the processes get
+// one. If none has, the first thread still does, for the ElfCache stats.
+// |trace_writers| and |incremental_states| have one entry per thread, or none
+// for the latter if the dumps are not incremental. If |done| is set, each
+// record flushes its TraceWriter, and |done| is posted on |task_runner| once
+// all the records have been written.
+std::map<size_t, DumpRecord> MakeDumpRecords(
+    const std::set<pid_t>& pids,
+    const std::vector<std::shared_ptr<TraceWriter>>& trace_writers,
+    const std::vector<std::shared_ptr<DumpState>>& incremental_states,
+    base::TaskRunner* task_runner,
+    std::function<void()> done);
+
 class HeapprofdProducer : public Producer {
  public:
   HeapprofdProducer(base::TaskRunner* task_runner);
@@ -73,6 +94,8 @@ class HeapprofdProducer : public Producer {
   const char* socket_name_ = nullptr;
 
   std::function<void(UnwindingRecord)> MakeSocketListenerCallback();
+  void StartThreads(size_t unwinder_threads, size_t bookkeeping_threads);
+  BookkeepingThread* BookkeepingThreadForPid(pid_t pid);
   std::vector<BoundedQueue<UnwindingRecord>> MakeUnwinderQueues(size_t n);
   std::vector<std::thread> MakeUnwindingThreads(size_t n);
   std::unique_ptr<base::UnixSocket> MakeSocket();
@@ -84,9 +107,13 @@ class HeapprofdProducer : public Producer {
   void DoContinuousDump(DataSourceInstanceID id, uint32_t dump_interval);
 
   struct DataSource {
-    // This is a shared ptr so we can lend a weak_ptr to the bookkeeping
-    // thread for unwinding.
-    std::shared_ptr<TraceWriter> trace_writer;
+    // One per bookkeeping thread, as a TraceWriter can only be used from one
+    // thread. These are shared ptrs so we can lend a weak_ptr to the
+    // bookkeeping threads.
+    std::vector<std::shared_ptr<TraceWriter>> trace_writers;
+    // If the data source has incremental dumps, what the bookkeeping threads
+    // have written in the previous ones, one per thread like trace_writers.
+    std::vector<std::shared_ptr<DumpState>> incremental_states;
     // These are opaque handles that shut down the sockets in SocketListener
     // once they go away.
     ProcessMatcher::ProcessSetSpecHandle processes;
@@ -95,14 +122,17 @@ class HeapprofdProducer : public Producer {
 
   std::map<DataSourceInstanceID, DataSource> data_sources_;
   std::map<FlushRequestID, size_t> flushes_in_progress_;
+  uint64_t next_incremental_sequence_id_ = 1;
 
   // These two are borrowed from the caller.
   base::TaskRunner* const task_runner_;
   std::unique_ptr<TracingService::ProducerEndpoint> endpoint_;
 
-  BoundedQueue<BookkeepingRecord> bookkeeping_queue_;
-  BookkeepingThread bookkeeping_thread_;
-  std::thread bookkeeping_th_;
+  ElfCache elf_cache_;
+  // These are started by the first data source that is set up.
+  std::vector<BoundedQueue<BookkeepingRecord>> bookkeeping_queues_;
+  std::vector<std::unique_ptr<BookkeepingThread>> bookkeeping_threads_;
+  std::vector<std::thread> bookkeeping_ths_;
   std::vector<BoundedQueue<UnwindingRecord>> unwinder_queues_;
   std::vector<std::thread> unwinding_threads_;
   SocketListener socket_listener_;
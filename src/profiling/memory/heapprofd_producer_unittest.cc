@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/profiling/memory/heapprofd_producer.h"
+
+#include "src/base/test/test_task_runner.h"
+#include "src/tracing/core/null_trace_writer.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace profiling {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+class CountingTraceWriter : public NullTraceWriter {
+ public:
+  void Flush(std::function<void()>) override { flushes++; }
+
+  size_t flushes = 0;
+};
+
+std::vector<std::shared_ptr<TraceWriter>> MakeTraceWriters(size_t n) {
+  std::vector<std::shared_ptr<TraceWriter>> trace_writers;
+  for (size_t i = 0; i < n; ++i)
+    trace_writers.emplace_back(new CountingTraceWriter());
+  return trace_writers;
+}
+
+size_t Flushes(const std::shared_ptr<TraceWriter>& trace_writer) {
+  return static_cast<CountingTraceWriter*>(trace_writer.get())->flushes;
+}
+
+TEST(HeapprofdProducerTest, DumpRecordsByShard) {
+  base::TestTaskRunner task_runner;
+  std::vector<std::shared_ptr<TraceWriter>> trace_writers =
+      MakeTraceWriters(3);
+  std::vector<std::shared_ptr<DumpState>> incremental_states;
+  for (size_t i = 0; i < trace_writers.size(); ++i)
+    incremental_states.emplace_back(new DumpState());
+  size_t done_calls = 0;
+
+  // Nothing for shard 2.
+  std::map<size_t, DumpRecord> dump_records =
+      MakeDumpRecords({3, 4, 6, 7}, trace_writers, incremental_states,
+                      &task_runner, [&done_calls] { done_calls++; });
+  ASSERT_EQ(dump_records.size(), 2u);
+  ASSERT_EQ(dump_records.count(0), 1u);
+  ASSERT_EQ(dump_records.count(1), 1u);
+  EXPECT_THAT(dump_records[0].pids, ElementsAre(3, 6));
+  EXPECT_THAT(dump_records[1].pids, ElementsAre(4, 7));
+  for (const auto& shard_and_record : dump_records) {
+    size_t shard = shard_and_record.first;
+    const DumpRecord& dump_record = shard_and_record.second;
+    EXPECT_EQ(dump_record.trace_writer.lock(), trace_writers[shard]);
+    EXPECT_EQ(dump_record.incremental_state.lock(), incremental_states[shard]);
+  }
+
+  dump_records[1].callback();
+  task_runner.RunUntilIdle();
+  EXPECT_EQ(Flushes(trace_writers[1]), 1u);
+  EXPECT_EQ(done_calls, 0u);
+
+  dump_records[0].callback();
+  task_runner.RunUntilIdle();
+  EXPECT_EQ(Flushes(trace_writers[0]), 1u);
+  EXPECT_EQ(Flushes(trace_writers[2]), 0u);
+  EXPECT_EQ(done_calls, 1u);
+}
+
+TEST(HeapprofdProducerTest, DumpRecordsWithoutProcesses) {
+  base::TestTaskRunner task_runner;
+  std::vector<std::shared_ptr<TraceWriter>> trace_writers =
+      MakeTraceWriters(2);
+  size_t done_calls = 0;
+
+  std::map<size_t, DumpRecord> dump_records =
+      MakeDumpRecords({}, trace_writers, {}, &task_runner,
+                      [&done_calls] { done_calls++; });
+  ASSERT_EQ(dump_records.size(), 1u);
+  ASSERT_EQ(dump_records.count(0), 1u);
+  EXPECT_THAT(dump_records[0].pids, IsEmpty());
+  EXPECT_FALSE(dump_records[0].incremental_state.lock());
+
+  dump_records[0].callback();
+  task_runner.RunUntilIdle();
+  EXPECT_EQ(Flushes(trace_writers[0]), 1u);
+  EXPECT_EQ(done_calls, 1u);
+}
+
+TEST(HeapprofdProducerTest, DumpRecordsWithoutFlush) {
+  base::TestTaskRunner task_runner;
+  std::vector<std::shared_ptr<TraceWriter>> trace_writers =
+      MakeTraceWriters(2);
+
+  std::map<size_t, DumpRecord> dump_records =
+      MakeDumpRecords({1, 2}, trace_writers, {}, &task_runner, nullptr);
+  ASSERT_EQ(dump_records.size(), 2u);
+  for (auto& shard_and_record : dump_records)
+    shard_and_record.second.callback();
+  task_runner.RunUntilIdle();
+  EXPECT_EQ(Flushes(trace_writers[0]), 0u);
+  EXPECT_EQ(Flushes(trace_writers[1]), 0u);
+}
+
+}  // namespace
+}  // namespace profiling
+}  // namespace perfetto
@@ -19,8 +19,13 @@
 
 #include <stddef.h>
 #include <stdint.h>
-#include <set>
 
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "perfetto/base/flat_hash_map.h"
 #include "perfetto/base/logging.h"
 
 namespace perfetto {
@@ -28,26 +33,27 @@ namespace profiling {
 
 using InternID = uint64_t;
 
-template <typename T>
+// The entries are looked up by hash, with |Hasher| and T::operator==.
+template <typename T, typename Hasher = std::hash<T>>
 class Interner {
  private:
   struct Entry {
     template <typename... U>
-    Entry(Interner<T>* in, uint64_t i, U... args)
-        : data(std::forward<U...>(args...)), id(i), interner(in) {}
+    Entry(Interner* in, U&&... args)
+        : data(std::forward<U>(args)...), interner(in) {}
 
     bool operator<(const Entry& other) const { return data < other.data; }
 
     const T data;
     size_t ref_count = 0;
-    uint64_t id;
-    Interner<T>* interner;
+    uint64_t id = 0;
+    Interner* interner;
   };
 
  public:
   class Interned {
    public:
-    friend class Interner<T>;
+    friend class Interner;
     Interned(Entry* entry) : entry_(entry) {}
     Interned(const Interned& other) : entry_(other.entry_) {
       if (entry_ != nullptr)
@@ -73,6 +79,10 @@ class Interner {
         entry_->interner->Return(entry_);
     }
 
+    bool operator==(const Interned& other) const {
+      return entry_ == other.entry_;
+    }
+
     bool operator<(const Interned& other) const {
       if (entry_ == nullptr || other.entry_ == nullptr)
         return entry_ < other.entry_;
@@ -87,29 +97,68 @@ class Interner {
 
   template <typename... U>
   Interned Intern(U... args) {
-    auto itr = entries_.emplace(this, next_id++, std::forward<U...>(args...));
-    Entry& entry = const_cast<Entry&>(*itr.first);
-    entry.ref_count++;
-    return Interned(&entry);
+    return InternImpl(std::is_move_constructible<T>(),
+                      std::forward<U>(args)...);
   }
 
-  ~Interner() { PERFETTO_DCHECK(entries_.empty()); }
+  ~Interner() { PERFETTO_DCHECK(entries_.size() == 0); }
 
   size_t entry_count_for_testing() { return entries_.size(); }
 
  private:
+  // The entries are keyed by their data, so they need to stay where they are.
+  struct DataHash {
+    size_t operator()(const T* data) const { return Hasher()(*data); }
+  };
+  struct DataEqual {
+    bool operator()(const T* a, const T* b) const { return *a == *b; }
+  };
+
+  // Most values are already interned, so look the value up before allocating
+  // an Entry for it.
+  template <typename... U>
+  Interned InternImpl(std::true_type /* movable */, U&&... args) {
+    T data(std::forward<U>(args)...);
+    std::unique_ptr<Entry>* entry = entries_.Find(&data);
+    if (entry == nullptr)
+      entry = Insert(std::unique_ptr<Entry>(new Entry(this, std::move(data))));
+    (*entry)->ref_count++;
+    return Interned(entry->get());
+  }
+
+  // T can't be moved into an Entry, so it has to be constructed where it is
+  // going to stay before it can be looked up.
+  template <typename... U>
+  Interned InternImpl(std::false_type /* movable */, U&&... args) {
+    std::unique_ptr<Entry> new_entry(
+        new Entry(this, std::forward<U>(args)...));
+    std::unique_ptr<Entry>* entry = entries_.Find(&new_entry->data);
+    if (entry == nullptr)
+      entry = Insert(std::move(new_entry));
+    (*entry)->ref_count++;
+    return Interned(entry->get());
+  }
+
+  std::unique_ptr<Entry>* Insert(std::unique_ptr<Entry> new_entry) {
+    new_entry->id = next_id++;
+    const T* key = &new_entry->data;
+    return entries_.Emplace(key, std::move(new_entry)).first;
+  }
+
   void Return(Entry* entry) {
     if (--entry->ref_count == 0)
-      entries_.erase(*entry);
+      entries_.Erase(&entry->data);
   }
   uint64_t next_id = 1;
-  std::set<Entry> entries_;
+  base::FlatHashMap<const T*, std::unique_ptr<Entry>, DataHash, DataEqual>
+      entries_;
   static_assert(sizeof(Interned) == sizeof(void*),
                 "interned things should be small");
 };
 
-template <typename T>
-void swap(typename Interner<T>::Interned a, typename Interner<T>::Interned b) {
+template <typename T, typename Hasher>
+void swap(typename Interner<T, Hasher>::Interned a,
+          typename Interner<T, Hasher>::Interned b) {
   std::swap(a.entry_, b.entry_);
 }
 
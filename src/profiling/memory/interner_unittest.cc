@@ -127,14 +127,28 @@ class NoCopyOrMove {
   NoCopyOrMove(int d) : data(d) {}
   ~NoCopyOrMove() {}
   bool operator<(const NoCopyOrMove& other) const { return data < other.data; }
+  bool operator==(const NoCopyOrMove& other) const {
+    return data == other.data;
+  }
+
+  struct Hasher {
+    size_t operator()(const NoCopyOrMove& n) const {
+      return std::hash<int>()(n.data);
+    }
+  };
 
  private:
   int data;
 };
 
 TEST(InternerStringTest, NoCopyOrMove) {
-  Interner<NoCopyOrMove> interner;
-  Interner<NoCopyOrMove>::Interned interned_str = interner.Intern(1);
+  Interner<NoCopyOrMove, NoCopyOrMove::Hasher> interner;
+  Interner<NoCopyOrMove, NoCopyOrMove::Hasher>::Interned interned_str =
+      interner.Intern(1);
+  Interner<NoCopyOrMove, NoCopyOrMove::Hasher>::Interned same_interned_str =
+      interner.Intern(1);
+  EXPECT_EQ(interned_str.id(), same_interned_str.id());
+  EXPECT_EQ(interner.entry_count_for_testing(), 1);
 }
 
 }  // namespace
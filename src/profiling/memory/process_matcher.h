@@ -38,6 +38,9 @@ struct ProcessSetSpec {
   bool all = false;
 
   ClientConfiguration client_configuration{};
+  // Size of the SharedRingBuffer the samples are sent through. If 0, the
+  // samples are sent over the sockets.
+  size_t shmem_size = 0;
 };
 
 // The Matcher allows DataSources to wait for ProcessSetSpecs, and the
@@ -22,12 +22,15 @@
 #include <unwindstack/Maps.h>
 #include <unwindstack/Unwinder.h>
 
+#include "perfetto/base/optional.h"
 #include "perfetto/tracing/core/trace_writer.h"
+#include "src/profiling/memory/elf_cache.h"
 #include "src/profiling/memory/wire_protocol.h"
 
 namespace perfetto {
 namespace profiling {
 
+struct DumpState;
 struct UnwindingMetadata;
 
 struct UnwindingRecord {
@@ -38,9 +41,9 @@ struct UnwindingRecord {
 };
 
 struct FreeRecord {
-  std::unique_ptr<uint8_t[]> free_data;
-  // This is a pointer into free_data.
-  FreeMetadata* metadata;
+  // Decoded from the record of the client by the unwinder.
+  std::unique_ptr<FreePageEntry[]> entries;
+  uint64_t num_entries;
 };
 
 struct AllocRecord {
@@ -51,7 +54,13 @@ struct AllocRecord {
 struct DumpRecord {
   std::vector<pid_t> pids;
   std::weak_ptr<TraceWriter> trace_writer;
+  // Only set for incremental dumps. Owned by the data source, but only used
+  // by the BookkeepingThread the record is sent to.
+  std::weak_ptr<DumpState> incremental_state;
   std::function<void()> callback;
+  // The ElfCache is shared by all the bookkeeping threads, so this is only
+  // set in the DumpRecord sent to one of them.
+  base::Optional<ElfCache::Stats> elf_cache_stats;
 };
 
 struct BookkeepingRecord {
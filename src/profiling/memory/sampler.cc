@@ -16,15 +16,65 @@
 
 #include "src/profiling/memory/sampler.h"
 
+#include <new>
+
+#include "perfetto/base/build_config.h"
 #include "perfetto/base/utils.h"
 
 namespace perfetto {
 namespace profiling {
 namespace {
-ThreadLocalSamplingData* GetSpecific(pthread_key_t key,
-                                     uint64_t interval,
-                                     void* (*unhooked_malloc)(size_t),
-                                     void (*unhooked_free)(void*)) {
+
+// log2(1 + i / 64) in 16.16 fixed point, for i in [0, 64].
+constexpr uint32_t kLog2Table[] = {
+    0,     1466,  2909,  4331,  5732,  7112,  8473,  9814,  11136, 12440,
+    13727, 14996, 16248, 17484, 18704, 19909, 21098, 22272, 23433, 24579,
+    25711, 26830, 27936, 29029, 30109, 31178, 32234, 33279, 34312, 35334,
+    36346, 37346, 38336, 39316, 40286, 41246, 42196, 43137, 44068, 44990,
+    45904, 46809, 47705, 48593, 49472, 50344, 51207, 52063, 52911, 53751,
+    54584, 55410, 56229, 57040, 57845, 58643, 59434, 60219, 60997, 61769,
+    62534, 63294, 64047, 64794, 65536};
+
+// ln(2) in 32.32 fixed point.
+constexpr uint64_t kLn2 = 2977044472;
+
+// Returns -ln(x / 2^64) in 16.16 fixed point. x must not be 0.
+uint64_t NegativeLog(uint64_t x) {
+  int leading_zeros = __builtin_clzll(x);
+  // The bits after the leading one. The top 6 index the table, the next 16
+  // interpolate between two of its entries.
+  uint64_t mantissa = (x << leading_zeros) << 1;
+  size_t idx = static_cast<size_t>(mantissa >> 58);
+  uint64_t remainder = (mantissa >> 42) & 0xffff;
+  uint64_t log2_mantissa =
+      kLog2Table[idx] +
+      (((kLog2Table[idx + 1] - kLog2Table[idx]) * remainder) >> 16);
+  // log2(x) = 63 - leading_zeros + log2_mantissa.
+  uint64_t negative_log2 =
+      (static_cast<uint64_t>(leading_zeros + 1) << 16) - log2_mantissa;
+  return (negative_log2 * kLn2) >> 32;
+}
+
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX)
+__thread ThreadLocalSamplingData g_sampling_data
+    __attribute__((tls_model("initial-exec")));
+
+ThreadLocalSamplingData* GetThreadLocalSamplingData(
+    pthread_key_t,
+    uint64_t interval,
+    void* (*)(size_t),
+    void (*)(void*)) {
+  ThreadLocalSamplingData* data = &g_sampling_data;
+  if (PERFETTO_UNLIKELY(data->interval() != interval || !data->is_current()))
+    data->Reset(interval);
+  return data;
+}
+#else
+ThreadLocalSamplingData* GetThreadLocalSamplingData(
+    pthread_key_t key,
+    uint64_t interval,
+    void* (*unhooked_malloc)(size_t),
+    void (*unhooked_free)(void*)) {
   // This should not be used with glibc as it might re-enter into malloc, see
   // http://crbug.com/776475.
   void* specific = pthread_getspecific(key);
@@ -35,23 +85,46 @@ ThreadLocalSamplingData* GetSpecific(pthread_key_t key,
   }
   return reinterpret_cast<ThreadLocalSamplingData*>(specific);
 }
+#endif
 }  // namespace
 
 // The algorithm below is inspired by the Chromium sampling algorithm at
 // https://cs.chromium.org/search/?q=f:cc+symbol:AllocatorShimLogAlloc+package:%5Echromium$&type=cs
 
+void ThreadLocalSamplingData::Reset(uint64_t interval) {
+  generation_ = generation.load(std::memory_order_relaxed);
+  interval_ = interval;
+  // splitmix64, so that close seeds do not give correlated sequences.
+  uint64_t z = seed.load(std::memory_order_relaxed) + 0x9e3779b97f4a7c15;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  z ^= z >> 31;
+  // xorshift never leaves 0.
+  random_state_ = z ? z : 1;
+  interval_to_next_sample_ = NextSampleInterval();
+}
+
+// xorshift64*, see https://en.wikipedia.org/wiki/Xorshift.
+uint64_t ThreadLocalSamplingData::NextRandom() {
+  random_state_ ^= random_state_ >> 12;
+  random_state_ ^= random_state_ << 25;
+  random_state_ ^= random_state_ >> 27;
+  return random_state_ * 0x2545f4914f6cdd1d;
+}
+
 int64_t ThreadLocalSamplingData::NextSampleInterval() {
-  std::exponential_distribution<double> dist(rate_);
-  int64_t next = static_cast<int64_t>(dist(random_engine_));
+  // Exponentially distributed with mean |interval_|: -ln(u) * interval_ for u
+  // uniform in (0, 1].
+  uint64_t next = NegativeLog(NextRandom() | 1);
+  next = (next >> 16) * interval_ + (((next & 0xffff) * interval_) >> 16);
   // The +1 corrects the distribution of the first value in the interval.
   // TODO(fmayer): Figure out why.
-  return next + 1;
+  return static_cast<int64_t>(next + 1);
 }
 
-size_t ThreadLocalSamplingData::NumberOfSamples(size_t sz) {
-  interval_to_next_sample_ -= sz;
+size_t ThreadLocalSamplingData::NumberOfSamplesSlowPath() {
   size_t sz_multiplier = 0;
-  while (PERFETTO_UNLIKELY(interval_to_next_sample_ <= 0)) {
+  while (interval_to_next_sample_ <= 0) {
     interval_to_next_sample_ += NextSampleInterval();
     ++sz_multiplier;
   }
@@ -59,6 +132,7 @@ size_t ThreadLocalSamplingData::NumberOfSamples(size_t sz) {
 }
 
 std::atomic<uint64_t> ThreadLocalSamplingData::seed(1);
+std::atomic<uint64_t> ThreadLocalSamplingData::generation(1);
 
 size_t SampleSize(pthread_key_t key,
                   size_t sz,
@@ -67,7 +141,8 @@ size_t SampleSize(pthread_key_t key,
                   void (*unhooked_free)(void*)) {
   if (PERFETTO_UNLIKELY(sz >= interval))
     return sz;
-  return interval * GetSpecific(key, interval, unhooked_malloc, unhooked_free)
+  return interval * GetThreadLocalSamplingData(key, interval, unhooked_malloc,
+                                               unhooked_free)
                         ->NumberOfSamples(sz);
 }
 
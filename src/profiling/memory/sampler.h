@@ -22,7 +22,7 @@
 #include <pthread.h>
 #include <stdint.h>
 
-#include <random>
+#include "perfetto/base/utils.h"
 
 namespace perfetto {
 namespace profiling {
@@ -36,16 +36,45 @@ namespace profiling {
 //
 // Googlers see go/chrome-shp for more details about the sampling (from
 // Chrome's heap profiler).
+//
+// This runs on every malloc of the profiled process, so the intervals are
+// drawn from a xorshift generator using integer arithmetic only.
 class ThreadLocalSamplingData {
  public:
+  // The state of a thread that has not sampled yet, see Reset.
+  constexpr ThreadLocalSamplingData() {}
   ThreadLocalSamplingData(void (*unhooked_free)(void*), uint64_t interval)
-      : unhooked_free_(unhooked_free),
-        rate_(1 / static_cast<double>(interval)),
-        random_engine_(seed.load(std::memory_order_relaxed)),
-        interval_to_next_sample_(NextSampleInterval()) {}
+      : unhooked_free_(unhooked_free) {
+    Reset(interval);
+  }
+
+  // Reseeds the generator from |seed| and starts sampling every |interval|
+  // bytes.
+  void Reset(uint64_t interval);
+  uint64_t interval() const { return interval_; }
+
   // Returns number of times a sample should be accounted. Due to how the
   // poission sampling works, some samples should be accounted multiple times.
-  size_t NumberOfSamples(size_t sz);
+  size_t NumberOfSamples(size_t sz) {
+    interval_to_next_sample_ -= static_cast<int64_t>(sz);
+    if (PERFETTO_LIKELY(interval_to_next_sample_ > 0))
+      return 0;
+    return NumberOfSamplesSlowPath();
+  }
+
+  // Whether the state was Reset since the last NewGeneration.
+  bool is_current() const {
+    return generation_ == generation.load(std::memory_order_relaxed);
+  }
+
+  // Makes the state of every thread start over on its next sample. On Linux
+  // the state is not tied to the pthread key of a Client, see SampleSize, so
+  // each Client calls this when it is created. Otherwise a thread would carry
+  // on with the state of the previous Client, which might even have had the
+  // same key.
+  static void NewGeneration() {
+    generation.fetch_add(1, std::memory_order_relaxed);
+  }
 
   // Destroy a TheadLocalSamplingData object after the pthread key has been
   // deleted or when the thread shuts down. This uses unhooked_free passed in
@@ -53,13 +82,19 @@ class ThreadLocalSamplingData {
   static void KeyDestructor(void* ptr);
 
   static std::atomic<uint64_t> seed;
+  static std::atomic<uint64_t> generation;
 
  private:
+  size_t NumberOfSamplesSlowPath();
   int64_t NextSampleInterval();
-  void (*unhooked_free_)(void*);
-  double rate_;
-  std::default_random_engine random_engine_;
-  int64_t interval_to_next_sample_;
+  uint64_t NextRandom();
+
+  void (*unhooked_free_)(void*) = nullptr;
+  // The initial 0 is never current, generation starts at 1.
+  uint64_t generation_ = 0;
+  uint64_t interval_ = 0;
+  uint64_t random_state_ = 0;
+  int64_t interval_to_next_sample_ = 0;
 };
 
 // Returns number of bytes that should be be attributed to the sample.
@@ -70,7 +105,11 @@ class ThreadLocalSamplingData {
 //
 // Delegate to this thread's ThreadLocalSamplingData.
 //
-// We have to pass through the real malloc in order to allocate the TLS.
+// On Linux, that lives in initial-exec TLS and |key| is not used, the state
+// starts over on ThreadLocalSamplingData::NewGeneration instead. Android
+// does not allow initial-exec TLS in dlopen()ed libraries, like the one of the
+// heapprofd client, so there the data is stored in |key|. We have to pass
+// through the real malloc in order to allocate it.
 size_t SampleSize(pthread_key_t key,
                   size_t sz,
                   uint64_t rate,
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include "benchmark/benchmark.h"
+
+#include "perfetto/base/logging.h"
+#include "src/profiling/memory/client.h"  // For PThreadKey.
+#include "src/profiling/memory/sampler.h"
+
+namespace {
+
+using perfetto::profiling::PThreadKey;
+using perfetto::profiling::SampleSize;
+using perfetto::profiling::ThreadLocalSamplingData;
+
+// The args are the allocation size and the sampling interval. The larger
+// intervals sample few of the allocations, the ones close to the allocation
+// size sample most of them.
+void SamplerArgs(benchmark::internal::Benchmark* b) {
+  b->Args({32, 4096});
+  b->Args({32, 128000});
+  b->Args({32, 64});
+  b->Args({32, 33});
+}
+
+}  // namespace
+
+// The time the sampling adds to every malloc of the profiled process,
+// including finding the thread's sampling state.
+static void BM_Sampler_SampleSize(benchmark::State& state) {
+  PThreadKey key(ThreadLocalSamplingData::KeyDestructor);
+  PERFETTO_CHECK(key.valid());
+  const size_t size = static_cast<size_t>(state.range(0));
+  const uint64_t interval = static_cast<uint64_t>(state.range(1));
+  uint64_t sampled = 0;
+  for (auto _ : state) {
+    size_t sample_size = SampleSize(key.get(), size, interval, malloc, free);
+    benchmark::DoNotOptimize(sample_size);
+    sampled += sample_size != 0;
+  }
+  state.counters["sampled"] =
+      static_cast<double>(sampled) / static_cast<double>(state.iterations());
+}
+BENCHMARK(BM_Sampler_SampleSize)->Apply(SamplerArgs);
@@ -18,6 +18,7 @@
 
 #include "gtest/gtest.h"
 
+#include <cmath>
 #include <thread>
 
 #include "src/profiling/memory/client.h"  // For PThreadKey.
@@ -29,29 +30,110 @@ namespace {
 TEST(SamplerTest, TestLarge) {
   PThreadKey key(ThreadLocalSamplingData::KeyDestructor);
   ASSERT_TRUE(key.valid());
+  ThreadLocalSamplingData::NewGeneration();
   EXPECT_EQ(SampleSize(key.get(), 1024, 512, malloc, free), 1024);
 }
 
+// With the default seed, the first allocation of 511 bytes is not sampled and
+// the second one is sampled twice.
 TEST(SamplerTest, TestSmall) {
   PThreadKey key(ThreadLocalSamplingData::KeyDestructor);
   ASSERT_TRUE(key.valid());
-  EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 512);
+  ThreadLocalSamplingData::NewGeneration();
+  EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 0);
+  EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 1024);
+}
+
+// A new Client starts over, even if the thread has sampled for a previous one.
+TEST(SamplerTest, NewGenerationStartsOver) {
+  PThreadKey key(ThreadLocalSamplingData::KeyDestructor);
+  ASSERT_TRUE(key.valid());
+  ThreadLocalSamplingData::NewGeneration();
+  EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 0);
+  ThreadLocalSamplingData::NewGeneration();
+  EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 0);
+  EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 1024);
 }
 
 TEST(SamplerTest, TestSmallFromThread) {
   PThreadKey key(ThreadLocalSamplingData::KeyDestructor);
   ASSERT_TRUE(key.valid());
+  ThreadLocalSamplingData::NewGeneration();
   std::thread th([&key] {
-    EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 512);
+    EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 0);
   });
   std::thread th2([&key] {
     // The threads should have separate state.
-    EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 512);
+    EXPECT_EQ(SampleSize(key.get(), 511, 512, malloc, free), 0);
   });
   th.join();
   th2.join();
 }
 
+// The sampled bytes are an unbiased estimate of the allocated bytes.
+TEST(SamplerTest, SampledBytes) {
+  constexpr uint64_t kInterval = 512;
+  constexpr size_t kAllocs = 1000000;
+  for (size_t sz : {1, 16, 100, 511}) {
+    ThreadLocalSamplingData data(free, kInterval);
+    uint64_t sampled = 0;
+    for (size_t i = 0; i < kAllocs; ++i)
+      sampled += kInterval * data.NumberOfSamples(sz);
+    double allocated = static_cast<double>(sz * kAllocs);
+    EXPECT_NEAR(static_cast<double>(sampled) / allocated, 1, 0.02) << sz;
+  }
+}
+
+// Every byte is sampled with probability 1 / interval, so an allocation of sz
+// bytes is sampled with probability 1 - (1 - 1 / interval)^sz.
+TEST(SamplerTest, SampledAllocations) {
+  constexpr uint64_t kInterval = 4096;
+  constexpr size_t kAllocs = 200000;
+  for (size_t sz : {64, 1024, 4000}) {
+    ThreadLocalSamplingData data(free, kInterval);
+    size_t sampled = 0;
+    for (size_t i = 0; i < kAllocs; ++i)
+      sampled += data.NumberOfSamples(sz) > 0;
+    double expected = 1 - std::exp(-static_cast<double>(sz) / kInterval);
+    EXPECT_NEAR(static_cast<double>(sampled) / kAllocs, expected, 0.01) << sz;
+  }
+}
+
+// The interval between two samples is exponentially distributed: its standard
+// deviation is its mean.
+TEST(SamplerTest, IntervalDistribution) {
+  constexpr uint64_t kInterval = 1000;
+  constexpr size_t kSamples = 100000;
+  ThreadLocalSamplingData data(free, kInterval);
+  double sum = 0;
+  double sum_squares = 0;
+  for (size_t i = 0; i < kSamples; ++i) {
+    uint64_t bytes = 1;
+    while (data.NumberOfSamples(1) == 0)
+      ++bytes;
+    double interval = static_cast<double>(bytes);
+    sum += interval;
+    sum_squares += interval * interval;
+  }
+  double mean = sum / kSamples;
+  double stddev = std::sqrt(sum_squares / kSamples - mean * mean);
+  EXPECT_NEAR(mean, kInterval, kInterval * 0.02);
+  EXPECT_NEAR(stddev, kInterval, kInterval * 0.02);
+}
+
+TEST(SamplerTest, DifferentSeeds) {
+  constexpr uint64_t kInterval = 4096;
+  uint64_t old_seed = ThreadLocalSamplingData::seed.exchange(1);
+  ThreadLocalSamplingData data1(free, kInterval);
+  ThreadLocalSamplingData::seed = 2;
+  ThreadLocalSamplingData data2(free, kInterval);
+  ThreadLocalSamplingData::seed = old_seed;
+  bool differ = false;
+  for (size_t i = 0; i < 1000 && !differ; ++i)
+    differ = data1.NumberOfSamples(1024) != data2.NumberOfSamples(1024);
+  EXPECT_TRUE(differ);
+}
+
 }  // namespace
 }  // namespace profiling
 }  // namespace perfetto
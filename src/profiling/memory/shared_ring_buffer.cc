@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/profiling/memory/shared_ring_buffer.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/temp_file.h"
+#include "perfetto/base/utils.h"
+
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#include <linux/memfd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace perfetto {
+namespace profiling {
+
+// The first page of the shared memory. The reader and the writers update
+// different cache lines.
+struct SharedRingBuffer::MetadataPage {
+  // Written by the writers.
+  alignas(64) std::atomic<bool> spinlock;
+  std::atomic<uint64_t> write_pos;
+  std::atomic<uint64_t> bytes_written;
+  std::atomic<uint64_t> num_writes_succeeded;
+  std::atomic<uint64_t> num_writes_dropped;
+
+  // Written by the reader.
+  alignas(64) std::atomic<uint64_t> read_pos;
+  // Set by the reader when it runs out of records, cleared by the writer that
+  // wakes it up.
+  std::atomic<bool> reader_waiting;
+};
+
+// Precedes each record. |size| is zero until the record has been written.
+struct SharedRingBuffer::RecordHeader {
+  std::atomic<uint32_t> size;
+  uint32_t reserved;
+};
+
+namespace {
+
+constexpr size_t kMetadataSize = base::kPageSize;
+constexpr size_t kRecordHeaderSize = sizeof(uint64_t);
+constexpr size_t kRecordAlignment = sizeof(uint64_t);
+
+// Spins this many times before yielding the CPU. The lock is held only to
+// bump the write position, so it is rarely contended for long.
+constexpr int kSpinsBeforeYield = 64;
+
+// Gives up after this many attempts, e.g. if a writer died while holding the
+// lock: the write is dropped rather than hanging the thread forever.
+constexpr int kMaxLockAttempts = kSpinsBeforeYield + 1024;
+
+bool IsValidSize(size_t size) {
+  return size > 0 && size % base::kPageSize == 0 && (size & (size - 1)) == 0;
+}
+
+size_t GetRecordSize(size_t payload_size) {
+  return (kRecordHeaderSize + payload_size + kRecordAlignment - 1) &
+         ~(kRecordAlignment - 1);
+}
+
+class ScopedSpinlock {
+ public:
+  explicit ScopedSpinlock(std::atomic<bool>* lock) : lock_(lock) {
+    for (int attempt = 0; attempt < kMaxLockAttempts; attempt++) {
+      if (!lock_->exchange(true, std::memory_order_acquire)) {
+        locked_ = true;
+        return;
+      }
+      if (attempt >= kSpinsBeforeYield)
+        sched_yield();
+    }
+  }
+  ~ScopedSpinlock() {
+    if (locked_)
+      lock_->store(false, std::memory_order_release);
+  }
+
+  bool locked() const { return locked_; }
+
+ private:
+  std::atomic<bool>* const lock_;
+  bool locked_ = false;
+};
+
+}  // namespace
+
+// static
+std::unique_ptr<SharedRingBuffer> SharedRingBuffer::Create(size_t size) {
+  PERFETTO_DCHECK(IsValidSize(size));
+  if (!IsValidSize(size))
+    return nullptr;
+
+  base::ScopedFile fd;
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  fd.reset(static_cast<int>(syscall(__NR_memfd_create, "heapprofd_ringbuf",
+                                    MFD_CLOEXEC | MFD_ALLOW_SEALING)));
+  if (!fd)
+    PERFETTO_DPLOG("memfd_create() failed");
+#endif
+  if (!fd)
+    fd = base::TempFile::CreateUnlinked().ReleaseFD();
+  if (!fd)
+    return nullptr;
+
+  if (ftruncate(*fd, static_cast<off_t>(kMetadataSize + size)) != 0) {
+    PERFETTO_PLOG("ftruncate");
+    return nullptr;
+  }
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // The client must not be able to shrink the buffer under our feet.
+  fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+  std::unique_ptr<SharedRingBuffer> ring_buffer = MapFD(std::move(fd), size);
+  if (ring_buffer) {
+    // The file is zero-filled, i.e. all the positions and counters start at
+    // zero. There are no records yet, so the reader is waiting for some.
+    ring_buffer->meta_->reader_waiting.store(true, std::memory_order_relaxed);
+  }
+  return ring_buffer;
+}
+
+// static
+std::unique_ptr<SharedRingBuffer> SharedRingBuffer::Attach(
+    base::ScopedFile fd) {
+  struct stat stat_buf = {};
+  if (fstat(*fd, &stat_buf) != 0) {
+    PERFETTO_PLOG("fstat");
+    return nullptr;
+  }
+  if (stat_buf.st_size <= static_cast<off_t>(kMetadataSize))
+    return nullptr;
+  const size_t size = static_cast<size_t>(stat_buf.st_size) - kMetadataSize;
+  if (!IsValidSize(size))
+    return nullptr;
+  return MapFD(std::move(fd), size);
+}
+
+// static
+std::unique_ptr<SharedRingBuffer> SharedRingBuffer::MapFD(base::ScopedFile fd,
+                                                          size_t size) {
+  // Reserve the address space for the metadata and for two copies of the data,
+  // then map the file over it: the metadata and the data first, and then the
+  // data again right after.
+  const size_t outer_size = kMetadataSize + size * 2;
+  void* reserved =
+      mmap(nullptr, outer_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    PERFETTO_PLOG("mmap");
+    return nullptr;
+  }
+  uint8_t* start = static_cast<uint8_t*>(reserved);
+  void* mem = mmap(start, kMetadataSize + size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, *fd, 0);
+  void* mirror = mmap(start + kMetadataSize + size, size,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, *fd,
+                      static_cast<off_t>(kMetadataSize));
+  if (mem == MAP_FAILED || mirror == MAP_FAILED) {
+    PERFETTO_PLOG("mmap");
+    munmap(reserved, outer_size);
+    return nullptr;
+  }
+  return std::unique_ptr<SharedRingBuffer>(
+      new SharedRingBuffer(std::move(fd), start, size));
+}
+
+SharedRingBuffer::SharedRingBuffer(base::ScopedFile fd, void* mem, size_t size)
+    : fd_(std::move(fd)),
+      meta_(static_cast<MetadataPage*>(mem)),
+      data_(static_cast<uint8_t*>(mem) + kMetadataSize),
+      size_(size) {
+  static_assert(sizeof(MetadataPage) <= kMetadataSize,
+                "MetadataPage must fit in a page");
+  static_assert(sizeof(RecordHeader) == kRecordHeaderSize,
+                "RecordHeader size mismatch");
+  read_pos_ = meta_->read_pos.load(std::memory_order_relaxed);
+}
+
+SharedRingBuffer::~SharedRingBuffer() {
+  munmap(meta_, kMetadataSize + size_ * 2);
+}
+
+SharedRingBuffer::RecordHeader* SharedRingBuffer::GetRecordHeader(
+    uint64_t pos) const {
+  return reinterpret_cast<RecordHeader*>(data_ + (pos & (size_ - 1)));
+}
+
+SharedRingBuffer::Buffer SharedRingBuffer::BeginWrite(size_t size) {
+  PERFETTO_DCHECK(size > 0);
+  const size_t record_size = GetRecordSize(size);
+  if (record_size > size_ || size > UINT32_MAX)
+    return Buffer();
+
+  uint64_t write_pos;
+  {
+    ScopedSpinlock lock(&meta_->spinlock);
+    if (!lock.locked())
+      return Buffer();
+    const uint64_t read_pos = meta_->read_pos.load(std::memory_order_acquire);
+    write_pos = meta_->write_pos.load(std::memory_order_relaxed);
+    if (write_pos - read_pos + record_size > size_)
+      return Buffer();
+    // Mark the record as not written before the reader can see it.
+    GetRecordHeader(write_pos)->size.store(0, std::memory_order_relaxed);
+    meta_->write_pos.store(write_pos + record_size, std::memory_order_release);
+  }
+  return Buffer(reinterpret_cast<uint8_t*>(GetRecordHeader(write_pos) + 1),
+                size);
+}
+
+bool SharedRingBuffer::EndWrite(Buffer buf) {
+  PERFETTO_DCHECK(buf);
+  RecordHeader* header = reinterpret_cast<RecordHeader*>(buf.data) - 1;
+  header->size.store(static_cast<uint32_t>(buf.size),
+                     std::memory_order_release);
+  meta_->bytes_written.fetch_add(buf.size, std::memory_order_relaxed);
+  meta_->num_writes_succeeded.fetch_add(1, std::memory_order_relaxed);
+
+  // Pairs with the fence in ArmReaderWakeup(): either the reader sees the
+  // record, or this sees that the reader is waiting.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return meta_->reader_waiting.load(std::memory_order_relaxed) &&
+         meta_->reader_waiting.exchange(false, std::memory_order_relaxed);
+}
+
+void SharedRingBuffer::AddDroppedWrite() {
+  meta_->num_writes_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+SharedRingBuffer::Buffer SharedRingBuffer::BeginRead() {
+  if (corrupt_)
+    return Buffer();
+  const uint64_t write_pos = meta_->write_pos.load(std::memory_order_acquire);
+  const uint64_t avail = write_pos - read_pos_;
+  if (avail == 0)
+    return Buffer();
+  if (avail > size_ || avail % kRecordAlignment != 0) {
+    PERFETTO_ELOG("Invalid write position in shared memory buffer.");
+    corrupt_ = true;
+    return Buffer();
+  }
+
+  const uint32_t size =
+      GetRecordHeader(read_pos_)->size.load(std::memory_order_acquire);
+  if (size == 0)
+    return Buffer();  // Still being written.
+  if (GetRecordSize(size) > avail) {
+    PERFETTO_ELOG("Invalid record size in shared memory buffer.");
+    corrupt_ = true;
+    return Buffer();
+  }
+  return Buffer(reinterpret_cast<uint8_t*>(GetRecordHeader(read_pos_) + 1),
+                size);
+}
+
+void SharedRingBuffer::EndRead(Buffer buf) {
+  PERFETTO_DCHECK(buf);
+  read_pos_ += GetRecordSize(buf.size);
+  meta_->read_pos.store(read_pos_, std::memory_order_release);
+}
+
+bool SharedRingBuffer::ArmReaderWakeup() {
+  meta_->reader_waiting.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!BeginRead())
+    return true;
+  meta_->reader_waiting.store(false, std::memory_order_relaxed);
+  return false;
+}
+
+SharedRingBuffer::Stats SharedRingBuffer::GetStats() const {
+  Stats stats{};
+  stats.bytes_written = meta_->bytes_written.load(std::memory_order_relaxed);
+  stats.num_writes_succeeded =
+      meta_->num_writes_succeeded.load(std::memory_order_relaxed);
+  stats.num_writes_dropped =
+      meta_->num_writes_dropped.load(std::memory_order_relaxed);
+  return stats;
+}
+
+}  // namespace profiling
+}  // namespace perfetto
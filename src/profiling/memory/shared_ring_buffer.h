@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_PROFILING_MEMORY_SHARED_RING_BUFFER_H_
+#define SRC_PROFILING_MEMORY_SHARED_RING_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "perfetto/base/scoped_file.h"
+
+namespace perfetto {
+namespace profiling {
+
+// Ring buffer of variable sized records in shared memory, written by the
+// threads of a heapprofd client and read by heapprofd. This is the transport of
+// the samples, the socket is only used for the handshake and to wake up the
+// reader.
+//
+// Writers reserve space under a spinlock in the shared memory, held only to
+// bump the write position, and then fill the record concurrently with the
+// other writers. The reader never takes the lock, and the writers never wait
+// for the reader: if the buffer is full BeginWrite() fails straight away. It
+// also fails if the lock can't be taken after a bounded number of attempts,
+// e.g. because a writer died while holding it.
+//
+// The reader must not trust the contents of the buffer, the client might write
+// anything into it. The positions and the sizes are validated, and the records
+// have to be copied out before being parsed.
+//
+// The data is mapped twice back to back, so that records that wrap around the
+// end of the buffer are contiguous in memory.
+class SharedRingBuffer {
+ public:
+  class Buffer {
+   public:
+    Buffer() = default;
+    Buffer(uint8_t* d, size_t s) : data(d), size(s) {}
+
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+    Buffer(Buffer&&) = default;
+    Buffer& operator=(Buffer&&) = default;
+
+    explicit operator bool() const { return data != nullptr; }
+
+    uint8_t* data = nullptr;
+    size_t size = 0;
+  };
+
+  struct Stats {
+    uint64_t bytes_written;
+    uint64_t num_writes_succeeded;
+    uint64_t num_writes_dropped;
+  };
+
+  // |size| must be a power of two and a multiple of the page size. Returns
+  // nullptr if the shared memory could not be created.
+  static std::unique_ptr<SharedRingBuffer> Create(size_t size);
+  // Maps the buffer created by Create() in another process, whose fd has been
+  // received over a socket. Returns nullptr if |fd| is not a valid buffer.
+  static std::unique_ptr<SharedRingBuffer> Attach(base::ScopedFile fd);
+
+  ~SharedRingBuffer();
+
+  // Writer side, can be called on any thread.
+
+  // Reserves a record of |size| bytes. Returns an invalid Buffer if there is
+  // not enough free space, or if the lock is stuck.
+  Buffer BeginWrite(size_t size);
+  // Makes the record visible to the reader. Returns true if the reader is
+  // waiting for data, in which case the caller has to wake it up.
+  bool EndWrite(Buffer buf);
+  // Counts a record that was not written because the buffer was full.
+  void AddDroppedWrite();
+
+  // Reader side, can be called on one thread only.
+
+  // Returns the oldest record, or an invalid Buffer if there are none (or the
+  // oldest one is still being written).
+  Buffer BeginRead();
+  // Frees the record returned by BeginRead().
+  void EndRead(Buffer buf);
+  // Asks the writers to wake up the reader on the next EndWrite(). Returns
+  // false if a record can be read already, in which case the caller should
+  // read it rather than wait.
+  bool ArmReaderWakeup();
+  // Set if BeginRead() found inconsistent positions or sizes in the buffer.
+  bool is_corrupt() const { return corrupt_; }
+
+  Stats GetStats() const;
+
+  int fd() const { return *fd_; }
+  size_t size() const { return size_; }
+  // The largest record that fits in the empty buffer, next to its header.
+  size_t max_record_size() const { return size_ - sizeof(uint64_t); }
+
+ private:
+  struct MetadataPage;
+  struct RecordHeader;
+
+  SharedRingBuffer(base::ScopedFile fd, void* mem, size_t size);
+  SharedRingBuffer(const SharedRingBuffer&) = delete;
+  SharedRingBuffer& operator=(const SharedRingBuffer&) = delete;
+
+  static std::unique_ptr<SharedRingBuffer> MapFD(base::ScopedFile fd,
+                                                 size_t size);
+  RecordHeader* GetRecordHeader(uint64_t pos) const;
+
+  base::ScopedFile fd_;
+  MetadataPage* meta_ = nullptr;
+  uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+
+  // Reader state. Kept out of the shared memory, where the client could
+  // change it.
+  uint64_t read_pos_ = 0;
+  bool corrupt_ = false;
+};
+
+}  // namespace profiling
+}  // namespace perfetto
+
+#endif  // SRC_PROFILING_MEMORY_SHARED_RING_BUFFER_H_
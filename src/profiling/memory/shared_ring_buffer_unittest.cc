@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/profiling/memory/shared_ring_buffer.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace profiling {
+namespace {
+
+constexpr size_t kSize = 4096;
+
+bool TryWrite(SharedRingBuffer* ring, const std::string& payload) {
+  SharedRingBuffer::Buffer buf = ring->BeginWrite(payload.size());
+  if (!buf)
+    return false;
+  memcpy(buf.data, payload.data(), payload.size());
+  ring->EndWrite(std::move(buf));
+  return true;
+}
+
+std::string Read(SharedRingBuffer* ring) {
+  SharedRingBuffer::Buffer buf = ring->BeginRead();
+  if (!buf)
+    return "";
+  std::string payload(reinterpret_cast<char*>(buf.data), buf.size);
+  ring->EndRead(std::move(buf));
+  return payload;
+}
+
+TEST(SharedRingBufferTest, ReadWrite) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  EXPECT_EQ("", Read(ring.get()));
+
+  ASSERT_TRUE(TryWrite(ring.get(), "foo"));
+  ASSERT_TRUE(TryWrite(ring.get(), "barbaz"));
+  EXPECT_EQ("foo", Read(ring.get()));
+  EXPECT_EQ("barbaz", Read(ring.get()));
+  EXPECT_EQ("", Read(ring.get()));
+
+  SharedRingBuffer::Stats stats = ring->GetStats();
+  EXPECT_EQ(9u, stats.bytes_written);
+  EXPECT_EQ(2u, stats.num_writes_succeeded);
+  EXPECT_EQ(0u, stats.num_writes_dropped);
+}
+
+TEST(SharedRingBufferTest, Full) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  // 8 bytes of header each.
+  const std::string payload(kSize / 4 - 8, 'x');
+  for (int i = 0; i < 4; i++)
+    ASSERT_TRUE(TryWrite(ring.get(), payload));
+  EXPECT_FALSE(TryWrite(ring.get(), "a"));
+  // Too big for the buffer, even when empty.
+  EXPECT_FALSE(ring->BeginWrite(kSize));
+
+  EXPECT_EQ(payload, Read(ring.get()));
+  EXPECT_TRUE(TryWrite(ring.get(), "a"));
+}
+
+TEST(SharedRingBufferTest, RecordsAcrossTheEndAreContiguous) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  ASSERT_TRUE(TryWrite(ring.get(), std::string(kSize - 8 - 16, 'a')));
+  EXPECT_EQ(kSize - 8 - 16, Read(ring.get()).size());
+
+  // Starts 16 bytes before the end of the buffer.
+  std::string payload;
+  for (size_t i = 0; i < 1000; i++)
+    payload.push_back(static_cast<char>('a' + i % 26));
+  ASSERT_TRUE(TryWrite(ring.get(), payload));
+  EXPECT_EQ(payload, Read(ring.get()));
+}
+
+TEST(SharedRingBufferTest, UnfinishedRecordIsNotRead) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  SharedRingBuffer::Buffer first = ring->BeginWrite(3);
+  ASSERT_TRUE(first);
+  ASSERT_TRUE(TryWrite(ring.get(), "bar"));
+  // The records are read in order, the second waits for the first.
+  EXPECT_FALSE(ring->BeginRead());
+
+  memcpy(first.data, "foo", 3);
+  ring->EndWrite(std::move(first));
+  EXPECT_EQ("foo", Read(ring.get()));
+  EXPECT_EQ("bar", Read(ring.get()));
+}
+
+TEST(SharedRingBufferTest, ReaderWakeup) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  // The reader is waiting from the start.
+  SharedRingBuffer::Buffer buf = ring->BeginWrite(1);
+  EXPECT_TRUE(ring->EndWrite(std::move(buf)));
+  buf = ring->BeginWrite(1);
+  EXPECT_FALSE(ring->EndWrite(std::move(buf)));
+
+  // There is data, the reader must not wait.
+  EXPECT_FALSE(ring->ArmReaderWakeup());
+  Read(ring.get());
+  Read(ring.get());
+  EXPECT_TRUE(ring->ArmReaderWakeup());
+  buf = ring->BeginWrite(1);
+  EXPECT_TRUE(ring->EndWrite(std::move(buf)));
+}
+
+TEST(SharedRingBufferTest, Attach) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  auto client_ring =
+      SharedRingBuffer::Attach(base::ScopedFile(dup(ring->fd())));
+  ASSERT_TRUE(client_ring);
+  EXPECT_EQ(kSize, client_ring->size());
+
+  ASSERT_TRUE(TryWrite(client_ring.get(), "foo"));
+  EXPECT_EQ("foo", Read(ring.get()));
+  client_ring->AddDroppedWrite();
+  EXPECT_EQ(1u, ring->GetStats().num_writes_dropped);
+}
+
+TEST(SharedRingBufferTest, AttachInvalidSize) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  base::ScopedFile fd(dup(ring->fd()));
+  ASSERT_EQ(0, ftruncate(*fd, 4096 + 3 * 4096));
+  EXPECT_FALSE(SharedRingBuffer::Attach(std::move(fd)));
+}
+
+TEST(SharedRingBufferTest, CorruptRecordSize) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  SharedRingBuffer::Buffer buf = ring->BeginWrite(8);
+  uint8_t* data = buf.data;
+  ring->EndWrite(std::move(buf));
+  // A malicious client overwrites the size of the record after the fact.
+  uint32_t size = kSize * 2;
+  memcpy(data - 8, &size, sizeof(size));
+  EXPECT_FALSE(ring->BeginRead());
+  EXPECT_TRUE(ring->is_corrupt());
+}
+
+TEST(SharedRingBufferTest, StuckLockFailsWrites) {
+  auto ring = SharedRingBuffer::Create(kSize);
+  ASSERT_TRUE(ring);
+  // A writer died while holding the spinlock, which is the first byte of the
+  // metadata page.
+  void* meta = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ring->fd(), 0);
+  ASSERT_NE(MAP_FAILED, meta);
+  static_cast<uint8_t*>(meta)[0] = 1;
+  EXPECT_FALSE(TryWrite(ring.get(), "foo"));
+  static_cast<uint8_t*>(meta)[0] = 0;
+  EXPECT_TRUE(TryWrite(ring.get(), "foo"));
+  munmap(meta, 4096);
+}
+
+TEST(SharedRingBufferTest, ConcurrentWriters) {
+  constexpr size_t kThreads = 4;
+  constexpr uint32_t kRecordsPerThread = 10000;
+  auto ring = SharedRingBuffer::Create(kSize * 4);
+  ASSERT_TRUE(ring);
+
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < kThreads; t++) {
+    threads.emplace_back([&ring, t] {
+      for (uint32_t i = 0; i < kRecordsPerThread;) {
+        // Variable sizes, so that the records wrap at different offsets.
+        const size_t size = sizeof(uint32_t) * (2 + i % 7);
+        SharedRingBuffer::Buffer buf = ring->BeginWrite(size);
+        if (!buf) {
+          std::this_thread::yield();
+          continue;
+        }
+        for (size_t off = 0; off < size; off += sizeof(uint32_t)) {
+          const uint32_t word = off == 0 ? t : i;
+          memcpy(buf.data + off, &word, sizeof(word));
+        }
+        ring->EndWrite(std::move(buf));
+        i++;
+      }
+    });
+  }
+
+  std::vector<uint32_t> next_seq(kThreads);
+  for (uint32_t read = 0; read < kThreads * kRecordsPerThread;) {
+    SharedRingBuffer::Buffer buf = ring->BeginRead();
+    if (!buf) {
+      std::this_thread::yield();
+      continue;
+    }
+    uint32_t thread;
+    uint32_t seq;
+    memcpy(&thread, buf.data, sizeof(thread));
+    memcpy(&seq, buf.data + sizeof(thread), sizeof(seq));
+    ASSERT_LT(thread, kThreads);
+    ASSERT_EQ(next_seq[thread]++, seq);
+    ASSERT_EQ(sizeof(uint32_t) * (2 + seq % 7), buf.size);
+    for (size_t off = sizeof(uint32_t); off < buf.size; off += sizeof(seq)) {
+      uint32_t word;
+      memcpy(&word, buf.data + off, sizeof(word));
+      ASSERT_EQ(seq, word);
+    }
+    ring->EndRead(std::move(buf));
+    read++;
+  }
+  for (auto& thread : threads)
+    thread.join();
+  EXPECT_FALSE(ring->is_corrupt());
+  EXPECT_EQ(kThreads * kRecordsPerThread,
+            ring->GetStats().num_writes_succeeded);
+}
+
+}  // namespace
+}  // namespace profiling
+}  // namespace perfetto
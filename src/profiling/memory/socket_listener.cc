@@ -16,6 +16,9 @@
 
 #include "src/profiling/memory/socket_listener.h"
 
+#include <inttypes.h>
+#include <string.h>
+
 #include "perfetto/base/utils.h"
 #include "src/profiling/memory/proc_utils.h"
 
@@ -37,6 +40,18 @@ ClientConfiguration MergeProcessSetSpecs(
   return result;
 }
 
+// Max number of bytes of records read from the shared memory buffer of a
+// client in one task. The rest is read in a new task, so that a client that
+// keeps writing cannot starve the others.
+constexpr size_t kMaxBytesPerRead = 1024 * 1024;
+
+size_t MergeShmemSizes(const std::vector<const ProcessSetSpec*>& process_sets) {
+  size_t result = 0;
+  for (const ProcessSetSpec* process_set : process_sets)
+    result = std::max(result, process_set->shmem_size);
+  return result;
+}
+
 }  // namespace
 
 SocketListener::ProcessInfo::ProcessInfo(pid_t pid) {
@@ -62,7 +77,19 @@ void SocketListener::OnDisconnect(base::UnixSocket* self) {
 }
 
 void SocketListener::Disconnect(pid_t pid) {
-  process_info_.erase(pid);
+  auto it = process_info_.find(pid);
+  if (it == process_info_.end())
+    return;
+  if (it->second.shmem) {
+    SharedRingBuffer::Stats stats = it->second.shmem->GetStats();
+    if (stats.num_writes_dropped) {
+      PERFETTO_LOG("%d: %" PRIu64 " of %" PRIu64
+                   " records dropped, shared memory buffer full.",
+                   pid, stats.num_writes_dropped,
+                   stats.num_writes_dropped + stats.num_writes_succeeded);
+    }
+  }
+  process_info_.erase(it);
 }
 
 void SocketListener::Match(
@@ -82,10 +109,17 @@ void SocketListener::Match(
   }
 
   ClientConfiguration cfg = MergeProcessSetSpecs(process_sets);
+  const size_t shmem_size = MergeShmemSizes(process_sets);
+  if (shmem_size) {
+    process_info.shmem = SharedRingBuffer::Create(shmem_size);
+    if (!process_info.shmem)
+      PERFETTO_ELOG("%d: Failed to create shared memory buffer.", pid);
+  }
+  const int shmem_fd = process_info.shmem ? process_info.shmem->fd() : -1;
   for (auto& raw_sock_and_sockinfo : process_info.sockets) {
     SocketInfo& sock_info = raw_sock_and_sockinfo.second;
     // TODO(fmayer): Send on one and poll(2) on the other end.
-    sock_info.sock->Send(&cfg, sizeof(cfg), -1,
+    sock_info.sock->Send(&cfg, sizeof(cfg), shmem_fd,
                          base::UnixSocket::BlockingMode::kBlocking);
   }
   process_info.client_config = std::move(cfg);
@@ -101,11 +135,13 @@ void SocketListener::OnNewIncomingConnection(
   decltype(process_info_)::iterator it;
   std::tie(it, std::ignore) = process_info_.emplace(peer_pid, peer_pid);
   ProcessInfo& process_info = it->second;
-  process_info.Connected(&process_matcher_, bookkeeping_thread_);
+  process_info.Connected(&process_matcher_,
+                         bookkeeping_thread_for_pid_(peer_pid));
   process_info.sockets.emplace(new_connection_raw, std::move(new_connection));
   if (process_info.set_up) {
+    const int shmem_fd = process_info.shmem ? process_info.shmem->fd() : -1;
     new_connection_raw->Send(&process_info.client_config,
-                             sizeof(process_info.client_config), -1,
+                             sizeof(process_info.client_config), shmem_fd,
                              base::UnixSocket::BlockingMode::kBlocking);
   }
 }
@@ -127,25 +163,20 @@ void SocketListener::OnDataAvailable(base::UnixSocket* self) {
   }
   SocketInfo& socket_info = socket_it->second;
 
-  RecordReader::ReceiveBuffer buf = socket_info.record_reader.BeginReceive();
-
-  size_t rd;
-  if (PERFETTO_LIKELY(process_info.unwinding_metadata)) {
-    rd = self->Receive(buf.data, buf.size);
-  } else {
-    base::ScopedFile fds[2];
-    rd = self->Receive(buf.data, buf.size, fds, base::ArraySize(fds));
-    if (fds[0] && fds[1]) {
-      PERFETTO_DLOG("%d: Received FDs.", peer_pid);
-      process_info.unwinding_metadata = std::make_shared<UnwindingMetadata>(
-          peer_pid, std::move(fds[0]), std::move(fds[1]));
-    } else if (fds[0] || fds[1]) {
-      PERFETTO_DLOG("%d: Received partial FDs.", peer_pid);
-    } else {
-      PERFETTO_DLOG("%d: Received no FDs.", peer_pid);
+  if (process_info.shmem) {
+    // Only the (empty) record with the fds and the wakeups come through the
+    // socket, their contents can be discarded.
+    uint8_t buf[1024];
+    while (ReceiveFromClient(self, &process_info, buf, sizeof(buf)) ==
+           sizeof(buf)) {
     }
+    ReadSharedMemory(self, &process_info);
+    return;
   }
 
+  RecordReader::ReceiveBuffer buf = socket_info.record_reader.BeginReceive();
+  size_t rd = ReceiveFromClient(self, &process_info, buf.data, buf.size);
+
   RecordReader::Record record;
   auto status = socket_info.record_reader.EndReceive(rd, &record);
   switch (status) {
@@ -161,6 +192,84 @@ void SocketListener::OnDataAvailable(base::UnixSocket* self) {
   }
 }
 
+size_t SocketListener::ReceiveFromClient(base::UnixSocket* self,
+                                         ProcessInfo* process_info,
+                                         void* buf,
+                                         size_t size) {
+  if (PERFETTO_LIKELY(process_info->unwinding_metadata))
+    return self->Receive(buf, size);
+
+  pid_t peer_pid = self->peer_pid();
+  base::ScopedFile fds[2];
+  size_t rd = self->Receive(buf, size, fds, base::ArraySize(fds));
+  if (fds[0] && fds[1]) {
+    PERFETTO_DLOG("%d: Received FDs.", peer_pid);
+    process_info->unwinding_metadata = std::make_shared<UnwindingMetadata>(
+        peer_pid, std::move(fds[0]), std::move(fds[1]));
+  } else if (fds[0] || fds[1]) {
+    PERFETTO_DLOG("%d: Received partial FDs.", peer_pid);
+  } else {
+    PERFETTO_DLOG("%d: Received no FDs.", peer_pid);
+  }
+  return rd;
+}
+
+// Reads all the records in the buffer, then asks the client to wake us up when
+// it writes the next one. The copies are needed anyway, the records go to the
+// unwinder threads, and they make sure that the client cannot change the
+// records while they are parsed. After kMaxBytesPerRead the rest is left to a
+// new task.
+void SocketListener::ReadSharedMemory(base::UnixSocket* self,
+                                      ProcessInfo* process_info) {
+  SharedRingBuffer* shmem = process_info->shmem.get();
+  size_t bytes_read = 0;
+  for (;;) {
+    if (bytes_read >= kMaxBytesPerRead) {
+      PostReadSharedMemory(self->peer_pid(), process_info);
+      return;
+    }
+    SharedRingBuffer::Buffer buf = shmem->BeginRead();
+    if (!buf) {
+      if (shmem->is_corrupt()) {
+        PERFETTO_ELOG("%d: Shared memory buffer corrupted, disconnecting.",
+                      self->peer_pid());
+        self->Shutdown(true);
+        return;
+      }
+      if (shmem->ArmReaderWakeup())
+        return;
+      continue;
+    }
+    const size_t size = buf.size;
+    std::unique_ptr<uint8_t[]> record(new uint8_t[size]);
+    memcpy(record.get(), buf.data, size);
+    shmem->EndRead(std::move(buf));
+    bytes_read += size;
+    RecordReceived(self, size, std::move(record));
+  }
+}
+
+void SocketListener::PostReadSharedMemory(pid_t pid,
+                                          ProcessInfo* process_info) {
+  if (process_info->read_posted)
+    return;
+  process_info->read_posted = true;
+  base::WeakPtr<SocketListener> weak_this = weak_factory_.GetWeakPtr();
+  task_runner_->PostTask([weak_this, pid] {
+    if (!weak_this)
+      return;
+    auto it = weak_this->process_info_.find(pid);
+    if (it == weak_this->process_info_.end())
+      return;
+    ProcessInfo& process_info = it->second;
+    process_info.read_posted = false;
+    if (!process_info.shmem || process_info.sockets.empty())
+      return;
+    base::UnixSocket* sock = process_info.sockets.begin()->second.sock.get();
+    weak_this->ReadSharedMemory(sock, &process_info);
+  });
+}
+
 void SocketListener::RecordReceived(base::UnixSocket* self,
                                     size_t size,
                                     std::unique_ptr<uint8_t[]> buf) {
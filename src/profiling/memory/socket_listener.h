@@ -17,15 +17,19 @@
 #ifndef SRC_PROFILING_MEMORY_SOCKET_LISTENER_H_
 #define SRC_PROFILING_MEMORY_SOCKET_LISTENER_H_
 
+#include "perfetto/base/task_runner.h"
 #include "perfetto/base/unix_socket.h"
+#include "perfetto/base/weak_ptr.h"
 
 #include "src/profiling/memory/bookkeeping.h"
 #include "src/profiling/memory/process_matcher.h"
 #include "src/profiling/memory/queue_messages.h"
 #include "src/profiling/memory/record_reader.h"
+#include "src/profiling/memory/shared_ring_buffer.h"
 #include "src/profiling/memory/unwinding.h"
 #include "src/profiling/memory/wire_protocol.h"
 
+#include <functional>
 #include <map>
 #include <memory>
 
@@ -35,11 +39,26 @@ namespace profiling {
 class SocketListener : public base::UnixSocket::EventListener,
                        public ProcessMatcher::Delegate {
  public:
+  // |bookkeeping_thread_for_pid| returns the BookkeepingThread that keeps
+  // track of the heap of a process. |task_runner| is the one the sockets are
+  // watched on.
+  SocketListener(
+      std::function<void(UnwindingRecord)> fn,
+      std::function<BookkeepingThread*(pid_t)> bookkeeping_thread_for_pid,
+      base::TaskRunner* task_runner)
+      : process_matcher_(this),
+        callback_function_(std::move(fn)),
+        bookkeeping_thread_for_pid_(std::move(bookkeeping_thread_for_pid)),
+        task_runner_(task_runner),
+        weak_factory_(this) {}
   SocketListener(std::function<void(UnwindingRecord)> fn,
-                 BookkeepingThread* bookkeeping_thread)
-      : callback_function_(std::move(fn)),
-        bookkeeping_thread_(bookkeeping_thread),
-        process_matcher_(this) {}
+                 BookkeepingThread* bookkeeping_thread,
+                 base::TaskRunner* task_runner)
+      : SocketListener(std::move(fn),
+                       [bookkeeping_thread](pid_t) {
+                         return bookkeeping_thread;
+                       },
+                       task_runner) {}
   void OnDisconnect(base::UnixSocket* self) override;
   void OnNewIncomingConnection(
       base::UnixSocket* self,
@@ -74,14 +93,29 @@ class SocketListener : public base::UnixSocket::EventListener,
     ClientConfiguration client_config{};
     std::map<base::UnixSocket*, SocketInfo> sockets;
     std::shared_ptr<UnwindingMetadata> unwinding_metadata;
+    // If set, the client writes the records into this rather than sending
+    // them over the sockets, which only wake us up.
+    std::unique_ptr<SharedRingBuffer> shmem;
+    // Set while a task that reads the rest of |shmem| is posted.
+    bool read_posted = false;
   };
 
+  size_t ReceiveFromClient(base::UnixSocket* self,
+                           ProcessInfo* process_info,
+                           void* buf,
+                           size_t size);
+  void ReadSharedMemory(base::UnixSocket* self, ProcessInfo* process_info);
+  void PostReadSharedMemory(pid_t pid, ProcessInfo* process_info);
   void RecordReceived(base::UnixSocket*, size_t, std::unique_ptr<uint8_t[]>);
 
+  // Must outlive |process_info_|, whose handles unregister from it.
+  ProcessMatcher process_matcher_;
   std::map<pid_t, ProcessInfo> process_info_;
   std::function<void(UnwindingRecord)> callback_function_;
-  BookkeepingThread* const bookkeeping_thread_;
-  ProcessMatcher process_matcher_;
+  std::function<BookkeepingThread*(pid_t)> bookkeeping_thread_for_pid_;
+  base::TaskRunner* const task_runner_;
+
+  base::WeakPtrFactory<SocketListener> weak_factory_;  // Keep last.
 };
 
 }  // namespace profiling
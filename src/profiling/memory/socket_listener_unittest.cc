@@ -19,6 +19,7 @@
 #include "perfetto/base/scoped_file.h"
 #include "src/base/test/test_task_runner.h"
 #include "src/ipc/test/test_socket.h"
+#include "src/profiling/memory/shared_ring_buffer.h"
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -41,6 +42,7 @@ class SocketListenerTest : public ::testing::Test {
 class MockEventListener : public base::UnixSocket::EventListener {
  public:
   MOCK_METHOD2(OnConnect, void(base::UnixSocket*, bool));
+  MOCK_METHOD1(OnDataAvailable, void(base::UnixSocket*));
 };
 
 TEST_F(SocketListenerTest, ReceiveRecord) {
@@ -55,7 +57,8 @@ TEST_F(SocketListenerTest, ReceiveRecord) {
   };
 
   BookkeepingThread bookkeeping_thread;
-  SocketListener listener(std::move(callback_fn), &bookkeeping_thread);
+  SocketListener listener(std::move(callback_fn), &bookkeeping_thread,
+                          &task_runner);
   ProcessSetSpec spec{};
   spec.pids.emplace(getpid());
   spec.client_configuration.interval = 1;
@@ -85,6 +88,96 @@ TEST_F(SocketListenerTest, ReceiveRecord) {
   task_runner.RunUntilCheckpoint("callback.called");
 }
 
+TEST_F(SocketListenerTest, ReceiveRecordSharedMemory) {
+  base::TestTaskRunner task_runner;
+  auto callback_called = task_runner.CreateCheckpoint("callback.called");
+  auto connected = task_runner.CreateCheckpoint("connected");
+  auto config_received = task_runner.CreateCheckpoint("config.received");
+  auto callback_fn = [&callback_called](UnwindingRecord r) {
+    ASSERT_EQ(r.size, 1u);
+    ASSERT_EQ(r.data[0], '1');
+    ASSERT_FALSE(r.metadata.expired());
+    callback_called();
+  };
+
+  BookkeepingThread bookkeeping_thread;
+  SocketListener listener(std::move(callback_fn), &bookkeeping_thread,
+                          &task_runner);
+  ProcessSetSpec spec{};
+  spec.pids.emplace(getpid());
+  spec.client_configuration.interval = 1;
+  spec.shmem_size = 4096;
+  auto handle = listener.process_matcher().AwaitProcessSetSpec(std::move(spec));
+  MockEventListener client_listener;
+  EXPECT_CALL(client_listener, OnConnect(_, _))
+      .WillOnce(InvokeWithoutArgs(connected));
+  EXPECT_CALL(client_listener, OnDataAvailable(_))
+      .WillOnce(InvokeWithoutArgs(config_received));
+
+  std::unique_ptr<base::UnixSocket> recv_socket =
+      base::UnixSocket::Listen(kSocketName, &listener, &task_runner);
+
+  std::unique_ptr<base::UnixSocket> client_socket =
+      base::UnixSocket::Connect(kSocketName, &client_listener, &task_runner);
+
+  task_runner.RunUntilCheckpoint("connected");
+  uint64_t size = 1;
+  base::ScopedFile fds[2] = {
+      base::ScopedFile(base::OpenFile("/dev/null", O_RDONLY)),
+      base::ScopedFile(base::OpenFile("/dev/null", O_RDONLY))};
+  int raw_fds[2] = {*fds[0], *fds[1]};
+  ASSERT_TRUE(client_socket->Send(&size, sizeof(size), raw_fds,
+                                  base::ArraySize(raw_fds),
+                                  base::UnixSocket::BlockingMode::kBlocking));
+
+  task_runner.RunUntilCheckpoint("config.received");
+  ClientConfiguration client_config{};
+  base::ScopedFile shmem_fd;
+  ASSERT_EQ(sizeof(client_config),
+            client_socket->Receive(&client_config, sizeof(client_config),
+                                   &shmem_fd, 1));
+  ASSERT_TRUE(shmem_fd);
+  auto shmem = SharedRingBuffer::Attach(std::move(shmem_fd));
+  ASSERT_TRUE(shmem);
+
+  SharedRingBuffer::Buffer buf = shmem->BeginWrite(1);
+  ASSERT_TRUE(buf);
+  buf.data[0] = '1';
+  // heapprofd is waiting for the first record.
+  ASSERT_TRUE(shmem->EndWrite(std::move(buf)));
+  ASSERT_TRUE(client_socket->Send("w", 1, -1,
+                                  base::UnixSocket::BlockingMode::kBlocking));
+
+  task_runner.RunUntilCheckpoint("callback.called");
+}
+
+TEST_F(SocketListenerTest, BookkeepingThreadForPeerPid) {
+  base::TestTaskRunner task_runner;
+  auto connected = task_runner.CreateCheckpoint("connected");
+  auto thread_requested = task_runner.CreateCheckpoint("thread.requested");
+
+  BookkeepingThread bookkeeping_thread;
+  SocketListener listener([](UnwindingRecord) {},
+                          [&thread_requested, &bookkeeping_thread](pid_t pid) {
+                            EXPECT_EQ(pid, getpid());
+                            thread_requested();
+                            return &bookkeeping_thread;
+                          },
+                          &task_runner);
+  MockEventListener client_listener;
+  EXPECT_CALL(client_listener, OnConnect(_, _))
+      .WillOnce(InvokeWithoutArgs(connected));
+
+  std::unique_ptr<base::UnixSocket> recv_socket =
+      base::UnixSocket::Listen(kSocketName, &listener, &task_runner);
+
+  std::unique_ptr<base::UnixSocket> client_socket =
+      base::UnixSocket::Connect(kSocketName, &client_listener, &task_runner);
+
+  task_runner.RunUntilCheckpoint("connected");
+  task_runner.RunUntilCheckpoint("thread.requested");
+}
+
 }  // namespace
 }  // namespace profiling
 }  // namespace perfetto
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include <unwindstack/MachineArm.h>
 #include <unwindstack/MachineArm64.h>
 #include <unwindstack/MachineMips.h>
@@ -81,10 +83,136 @@ std::unique_ptr<unwindstack::Regs> CreateFromRawData(unwindstack::ArchEnum arch,
   return ret;
 }
 
+// Takes the ELFs of the maps of the process from the cache, where possible.
+void LookUpElfs(UnwindingMetadata* metadata, ElfCache* elf_cache) {
+  metadata->elf_cache_pending.clear();
+  for (unwindstack::MapInfo* map : metadata->maps) {
+    ElfCache::Key key;
+    uint64_t size;
+    if (!ElfCache::GetKey(*map, &key, &size) || elf_cache->Get(key, map))
+      continue;
+    metadata->elf_cache_pending.emplace(
+        map->start, UnwindingMetadata::PendingElf{map, key, size});
+  }
+  metadata->elf_cache_lookup_done = true;
+}
+
+// Adds the ELFs that libunwindstack parsed during the unwind to the cache.
+void AddElfs(UnwindingMetadata* metadata,
+             const std::vector<unwindstack::FrameData>& frames,
+             ElfCache* elf_cache) {
+  if (metadata->elf_cache_pending.empty())
+    return;
+  for (const unwindstack::FrameData& frame : frames) {
+    auto it = metadata->elf_cache_pending.find(frame.map_start);
+    if (it == metadata->elf_cache_pending.end())
+      continue;
+    const UnwindingMetadata::PendingElf& pending = it->second;
+    if (!pending.map->elf)
+      continue;
+    elf_cache->Add(pending.key, pending.size, *pending.map);
+    metadata->elf_cache_pending.erase(it);
+  }
+}
+
+// The pcs sent by the client are return addresses, i.e. they point to the
+// instruction after the call. The same adjustment as libunwindstack makes for
+// all but the innermost frame, so the call gets attributed to the right line.
+uint64_t GetPcAdjustment(unwindstack::ArchEnum arch) {
+  switch (arch) {
+    case unwindstack::ARCH_X86:
+    case unwindstack::ARCH_X86_64:
+      return 1;
+    case unwindstack::ARCH_ARM64:
+      return 4;
+    case unwindstack::ARCH_ARM:
+    case unwindstack::ARCH_MIPS:
+    case unwindstack::ARCH_MIPS64:
+    case unwindstack::ARCH_UNKNOWN:
+      return 0;
+  }
+  return 0;
+}
+
+// Fills in |frames| the same way the unwinder does, for the pcs that the client
+// found by walking the frame pointers. Returns false if a pc was not in any of
+// the maps.
+bool SymbolizePcs(const uint64_t* pcs,
+                  size_t num_pcs,
+                  unwindstack::ArchEnum arch,
+                  UnwindingMetadata* metadata,
+                  std::vector<unwindstack::FrameData>* frames) {
+  // Reading the ELFs of the libraries needs the memory of the process, not its
+  // stack.
+  std::shared_ptr<unwindstack::Memory> process_memory =
+      std::make_shared<StackMemory>(*metadata->mem_fd, 0, nullptr, 0, 0);
+  const uint64_t pc_adjustment = GetPcAdjustment(arch);
+  bool all_mapped = true;
+  frames->clear();
+  frames->reserve(num_pcs);
+  for (size_t i = 0; i < num_pcs; ++i) {
+    unwindstack::FrameData frame{};
+    frame.num = i;
+    frame.pc = pcs[i] - pc_adjustment;
+    frame.rel_pc = frame.pc;
+    unwindstack::MapInfo* map = metadata->maps.Find(frame.pc);
+    if (map == nullptr) {
+      all_mapped = false;
+      frames->emplace_back(std::move(frame));
+      continue;
+    }
+    frame.map_name = map->name;
+    frame.map_offset = map->offset;
+    frame.map_start = map->start;
+    frame.map_end = map->end;
+    frame.map_flags = static_cast<int>(map->flags);
+    unwindstack::Elf* elf = map->GetElf(process_memory, arch);
+    if (elf != nullptr) {
+      frame.rel_pc = elf->GetRelPc(frame.pc, map);
+      frame.map_load_bias = elf->GetLoadBias();
+      elf->GetFunctionName(frame.rel_pc, &frame.function_name,
+                           &frame.function_offset);
+    }
+    frames->emplace_back(std::move(frame));
+  }
+  return all_mapped;
+}
+
+bool DoSymbolize(WireMessage* msg,
+                 UnwindingMetadata* metadata,
+                 ElfCache* elf_cache,
+                 AllocRecord* out) {
+  AllocMetadata* alloc_metadata = msg->alloc_header;
+  out->alloc_metadata = *alloc_metadata;
+  const uint64_t* pcs = reinterpret_cast<const uint64_t*>(msg->payload);
+  const size_t num_pcs = msg->payload_size / sizeof(uint64_t);
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    if (attempt > 0 && !metadata->ReparseMaps())
+      break;
+    if (elf_cache && !metadata->elf_cache_lookup_done)
+      LookUpElfs(metadata, elf_cache);
+    if (SymbolizePcs(pcs, num_pcs, alloc_metadata->arch, metadata,
+                     &out->frames)) {
+      break;
+    }
+  }
+  if (elf_cache)
+    AddElfs(metadata, out->frames, elf_cache);
+  return true;
+}
+
 }  // namespace
 
-StackMemory::StackMemory(int mem_fd, uint64_t sp, uint8_t* stack, size_t size)
-    : mem_fd_(mem_fd), sp_(sp), stack_end_(sp + size), stack_(stack) {}
+StackMemory::StackMemory(int mem_fd,
+                         uint64_t sp,
+                         uint8_t* stack,
+                         size_t size,
+                         uint64_t stack_base)
+    : mem_fd_(mem_fd),
+      sp_(sp),
+      stack_end_(sp + size),
+      stack_base_(stack_base),
+      stack_(stack) {}
 
 size_t StackMemory::Read(uint64_t addr, void* dst, size_t size) {
   if (addr >= sp_ && addr + size <= stack_end_ && addr + size > sp_) {
@@ -93,6 +221,9 @@ size_t StackMemory::Read(uint64_t addr, void* dst, size_t size) {
     return size;
   }
 
+  if (addr < stack_base_ && addr + size > stack_end_)
+    return 0;
+
   if (lseek(mem_fd_, static_cast<off_t>(addr), SEEK_SET) == -1)
     return 0;
 
@@ -135,7 +266,82 @@ void FileDescriptorMaps::Reset() {
   maps_.clear();
 }
 
-bool DoUnwind(WireMessage* msg, UnwindingMetadata* metadata, AllocRecord* out) {
+// static
+constexpr size_t UnwindingMetadata::kMaxStackSnapshots;
+// static
+constexpr base::TimeMillis UnwindingMetadata::kMinMapsReparseInterval;
+
+bool UnwindingMetadata::ReparseMaps() {
+  base::TimeMillis now = base::GetWallTimeMs();
+  if (last_maps_reparse.count() != 0 &&
+      now - last_maps_reparse < kMinMapsReparseInterval) {
+    return false;
+  }
+  last_maps_reparse = now;
+  maps.Reset();
+  maps.Parse();
+  elf_cache_lookup_done = false;
+  return true;
+}
+
+uint8_t* ApplyStackDelta(const WireMessage& msg, UnwindingMetadata* metadata) {
+  const AllocMetadata& alloc_metadata = *msg.alloc_header;
+  const uint64_t stack_size = alloc_metadata.stack_size;
+  const uint64_t delta_size = alloc_metadata.stack_delta_size;
+  const uint64_t stack_base = alloc_metadata.stack_pointer + stack_size;
+  auto it = metadata->stack_snapshots.find(stack_base);
+  if (delta_size > stack_size || msg.payload_size != stack_size - delta_size) {
+    PERFETTO_DLOG("Invalid stack delta.");
+    if (it != metadata->stack_snapshots.end())
+      metadata->stack_snapshots.erase(it);
+    return nullptr;
+  }
+  if (it == metadata->stack_snapshots.end()) {
+    if (metadata->stack_snapshots.size() >=
+        UnwindingMetadata::kMaxStackSnapshots) {
+      auto lru = std::min_element(
+          metadata->stack_snapshots.begin(), metadata->stack_snapshots.end(),
+          [](const std::pair<const uint64_t, StackSnapshot>& a,
+             const std::pair<const uint64_t, StackSnapshot>& b) {
+            return a.second.last_use < b.second.last_use;
+          });
+      metadata->stack_snapshots.erase(lru);
+    }
+    it = metadata->stack_snapshots.emplace(stack_base, StackSnapshot{}).first;
+  }
+  StackSnapshot& snapshot = it->second;
+  snapshot.last_use = ++metadata->stack_snapshot_uses;
+  if (delta_size > 0 &&
+      (snapshot.sequence_number != alloc_metadata.stack_delta_base ||
+       snapshot.size < delta_size)) {
+    PERFETTO_DLOG("Missing stack %" PRIu64 " for delta.",
+                  alloc_metadata.stack_delta_base);
+    metadata->stack_snapshots.erase(it);
+    return nullptr;
+  }
+
+  if (snapshot.data.size() < stack_size) {
+    std::vector<uint8_t> data(static_cast<size_t>(stack_size));
+    if (delta_size > 0) {
+      memcpy(data.data() + data.size() - delta_size,
+             snapshot.data.data() + snapshot.data.size() - delta_size,
+             static_cast<size_t>(delta_size));
+    }
+    snapshot.data = std::move(data);
+  }
+  snapshot.sequence_number = alloc_metadata.sequence_number;
+  snapshot.size = static_cast<size_t>(stack_size);
+  memcpy(snapshot.stack(), msg.payload, msg.payload_size);
+  return snapshot.stack();
+}
+
+bool DoUnwind(WireMessage* msg,
+              UnwindingMetadata* metadata,
+              ElfCache* elf_cache,
+              AllocRecord* out) {
+  if (msg->record_type == RecordType::MallocPcs)
+    return DoSymbolize(msg, metadata, elf_cache, out);
+
   AllocMetadata* alloc_metadata = msg->alloc_header;
   std::unique_ptr<unwindstack::Regs> regs(
       CreateFromRawData(alloc_metadata->arch, alloc_metadata->register_data));
@@ -145,24 +351,39 @@ bool DoUnwind(WireMessage* msg, UnwindingMetadata* metadata, AllocRecord* out) {
   }
   out->alloc_metadata = *alloc_metadata;
   uint8_t* stack = reinterpret_cast<uint8_t*>(msg->payload);
+  size_t stack_size = msg->payload_size;
+  if (msg->record_type == RecordType::MallocStackDelta) {
+    uint8_t* full_stack = ApplyStackDelta(*msg, metadata);
+    if (full_stack) {
+      stack = full_stack;
+      stack_size = static_cast<size_t>(alloc_metadata->stack_size);
+    }
+  }
+  // The stack in the record ends before the base of the stack if the client
+  // truncated it, or if the delta could not be applied.
+  const uint64_t stack_base =
+      alloc_metadata->stack_pointer +
+      std::max(alloc_metadata->stack_size, static_cast<uint64_t>(stack_size));
   std::shared_ptr<unwindstack::Memory> mems = std::make_shared<StackMemory>(
-      *metadata->mem_fd, alloc_metadata->stack_pointer, stack,
-      msg->payload_size);
+      *metadata->mem_fd, alloc_metadata->stack_pointer, stack, stack_size,
+      stack_base);
   unwindstack::Unwinder unwinder(kMaxFrames, &metadata->maps, regs.get(), mems);
   // Surpress incorrect "variable may be uninitialized" error for if condition
   // after this loop. error_code = LastErrorCode gets run at least once.
   uint8_t error_code = 0;
   for (int attempt = 0; attempt < 2; ++attempt) {
-    if (attempt > 0) {
-      metadata->maps.Reset();
-      metadata->maps.Parse();
-    }
+    if (attempt > 0 && !metadata->ReparseMaps())
+      break;
+    if (elf_cache && !metadata->elf_cache_lookup_done)
+      LookUpElfs(metadata, elf_cache);
     unwinder.Unwind();
     error_code = unwinder.LastErrorCode();
     if (error_code != unwindstack::ERROR_INVALID_MAP)
       break;
   }
   out->frames = unwinder.frames();
+  if (elf_cache)
+    AddElfs(metadata, out->frames, elf_cache);
   if (error_code != 0) {
     unwindstack::FrameData frame_data{};
     frame_data.function_name = "ERROR " + std::to_string(error_code);
@@ -174,12 +395,16 @@ bool DoUnwind(WireMessage* msg, UnwindingMetadata* metadata, AllocRecord* out) {
   return true;
 }
 
-bool HandleUnwindingRecord(UnwindingRecord* rec, BookkeepingRecord* out) {
+bool HandleUnwindingRecord(UnwindingRecord* rec,
+                           ElfCache* elf_cache,
+                           BookkeepingRecord* out) {
   WireMessage msg;
   if (!ReceiveWireMessage(reinterpret_cast<char*>(rec->data.get()), rec->size,
                           &msg))
     return false;
-  if (msg.record_type == RecordType::Malloc) {
+  if (msg.record_type == RecordType::Malloc ||
+      msg.record_type == RecordType::MallocPcs ||
+      msg.record_type == RecordType::MallocStackDelta) {
     std::shared_ptr<UnwindingMetadata> metadata = rec->metadata.lock();
     if (!metadata) {
       // Process has already gone away.
@@ -188,30 +413,34 @@ bool HandleUnwindingRecord(UnwindingRecord* rec, BookkeepingRecord* out) {
 
     out->pid = rec->pid;
     out->record_type = BookkeepingRecord::Type::Malloc;
-    return DoUnwind(&msg, metadata.get(), &out->alloc_record);
+    return DoUnwind(&msg, metadata.get(), elf_cache, &out->alloc_record);
   } else if (msg.record_type == RecordType::Free) {
     out->record_type = BookkeepingRecord::Type::Free;
     out->pid = rec->pid;
-    // We need to keep this alive, because msg.free_header is a pointer into
-    // this.
-    out->free_record.free_data = std::move(rec->data);
-    out->free_record.metadata = msg.free_header;
-    return true;
+    FreeRecord& free_rec = out->free_record;
+    free_rec.num_entries = msg.free_header->num_entries;
+    free_rec.entries.reset(new FreePageEntry[free_rec.num_entries]);
+    return DecodeFreeEntries(msg.payload, msg.payload_size,
+                             free_rec.num_entries, free_rec.entries.get());
   } else {
     PERFETTO_DFATAL("Invalid record type.");
     return false;
   }
 }
 
-void UnwindingMainLoop(BoundedQueue<UnwindingRecord>* input_queue,
-                       BoundedQueue<BookkeepingRecord>* output_queue) {
+void UnwindingMainLoop(
+    BoundedQueue<UnwindingRecord>* input_queue,
+    std::vector<BoundedQueue<BookkeepingRecord>>* output_queues,
+    ElfCache* elf_cache) {
   for (;;) {
     UnwindingRecord rec;
     if (!input_queue->Get(&rec))
       return;
     BookkeepingRecord out;
-    if (HandleUnwindingRecord(&rec, &out))
-      output_queue->Add(std::move(out));
+    if (!HandleUnwindingRecord(&rec, elf_cache, &out))
+      continue;
+    size_t shard = static_cast<size_t>(rec.pid) % output_queues->size();
+    (*output_queues)[shard].Add(std::move(out));
   }
 }
 
@@ -19,9 +19,15 @@
 
 #include <unwindstack/Maps.h>
 #include <unwindstack/Unwinder.h>
+
+#include <map>
+#include <vector>
+
 #include "perfetto/base/scoped_file.h"
+#include "perfetto/base/time.h"
 #include "src/profiling/memory/bookkeeping.h"
 #include "src/profiling/memory/bounded_queue.h"
+#include "src/profiling/memory/elf_cache.h"
 #include "src/profiling/memory/queue_messages.h"
 #include "src/profiling/memory/wire_protocol.h"
 
@@ -40,6 +46,19 @@ class FileDescriptorMaps : public unwindstack::Maps {
   base::ScopedFile fd_;
 };
 
+// The stack of the last RecordType::MallocStackDelta of a thread. It is at the
+// end of |data|, as the end of the stack is the part that the next record is
+// most likely to leave as it is.
+struct StackSnapshot {
+  uint64_t sequence_number = 0;
+  // UnwindingMetadata::stack_snapshot_uses when the snapshot was last used.
+  uint64_t last_use = 0;
+  size_t size = 0;
+  std::vector<uint8_t> data;
+
+  uint8_t* stack() { return data.data() + data.size() - size; }
+};
+
 struct UnwindingMetadata {
   UnwindingMetadata(pid_t p, base::ScopedFile maps_fd, base::ScopedFile mem)
       : pid(p), maps(std::move(maps_fd)), mem_fd(std::move(mem)) {
@@ -48,29 +67,84 @@ struct UnwindingMetadata {
   pid_t pid;
   FileDescriptorMaps maps;
   base::ScopedFile mem_fd;
+
+  // Parses |maps| again, as a library might have been loaded since they were
+  // last parsed. Does nothing and returns false if they were reparsed less
+  // than kMinMapsReparseInterval ago: a pc that is in no map (e.g. in JIT
+  // code) would otherwise have them reparsed for every sample.
+  static constexpr base::TimeMillis kMinMapsReparseInterval{100};
+  bool ReparseMaps();
+  base::TimeMillis last_maps_reparse{0};
+
+  // Whether the ELFs of |maps| have been looked up in the ElfCache since they
+  // were last parsed.
+  bool elf_cache_lookup_done = false;
+  // The maps whose ELF was not in the ElfCache, by start address. The ELF gets
+  // added once an unwind goes through the map, i.e. once libunwindstack has
+  // parsed it.
+  struct PendingElf {
+    unwindstack::MapInfo* map;
+    ElfCache::Key key;
+    uint64_t size;
+  };
+  std::map<uint64_t, PendingElf> elf_cache_pending;
+
+  // The stacks of the threads that send RecordType::MallocStackDelta, by the
+  // base of the stack. Only the unwinder thread of the process uses them, so
+  // they see the records of a thread in order. At most kMaxStackSnapshots are
+  // kept: the least recently used one, likely of a thread that has exited, is
+  // dropped to make room for a new one.
+  static constexpr size_t kMaxStackSnapshots = 32;
+  std::map<uint64_t, StackSnapshot> stack_snapshots;
+  uint64_t stack_snapshot_uses = 0;
 };
 
+// Puts the stack of the RecordType::MallocStackDelta |msg| together from its
+// payload and the snapshot of its thread in |metadata|, and makes it the new
+// snapshot. Returns the stack, or nullptr if the snapshot is not the record
+// the delta is against. In that case the snapshot is dropped and only the
+// payload is usable.
+uint8_t* ApplyStackDelta(const WireMessage& msg, UnwindingMetadata* metadata);
+
 // Overlays size bytes pointed to by stack for addresses in [sp, sp + size).
-// Addresses outside of that range are read from mem_fd, which should be an fd
-// that opened /proc/[pid]/mem.
+// Reads of [sp + size, stack_base) fail: that part of the stack was not copied,
+// and it has changed since. Other addresses are read from mem_fd, which should
+// be an fd that opened /proc/[pid]/mem.
 class StackMemory : public unwindstack::Memory {
  public:
-  StackMemory(int mem_fd, uint64_t sp, uint8_t* stack, size_t size);
+  StackMemory(int mem_fd,
+              uint64_t sp,
+              uint8_t* stack,
+              size_t size,
+              uint64_t stack_base);
   size_t Read(uint64_t addr, void* dst, size_t size) override;
 
  private:
   int mem_fd_;
   uint64_t sp_;
   uint64_t stack_end_;
+  uint64_t stack_base_;
   uint8_t* stack_;
 };
 
-bool DoUnwind(WireMessage*, UnwindingMetadata* metadata, AllocRecord* out);
+// Unwinds the stack of a RecordType::Malloc, or symbolizes the pcs of a
+// RecordType::MallocPcs, into |out|.
+// |elf_cache| can be nullptr, in which case each process parses its own ELFs.
+bool DoUnwind(WireMessage*,
+              UnwindingMetadata* metadata,
+              ElfCache* elf_cache,
+              AllocRecord* out);
 
-bool HandleUnwindingRecord(UnwindingRecord* rec, BookkeepingRecord* out);
+bool HandleUnwindingRecord(UnwindingRecord* rec,
+                           ElfCache* elf_cache,
+                           BookkeepingRecord* out);
 
-void UnwindingMainLoop(BoundedQueue<UnwindingRecord>* input_queue,
-                       BoundedQueue<BookkeepingRecord>* output_queue);
+// Sends the records of a process to the output queue at pid modulo the number
+// of output queues, i.e. to the same bookkeeping thread.
+void UnwindingMainLoop(
+    BoundedQueue<UnwindingRecord>* input_queue,
+    std::vector<BoundedQueue<BookkeepingRecord>>* output_queues,
+    ElfCache* elf_cache);
 
 }  // namespace profiling
 }  // namespace perfetto
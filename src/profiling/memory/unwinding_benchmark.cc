@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include <unwindstack/RegsGetLocal.h>
+
+#include "benchmark/benchmark.h"
+
+#include "perfetto/base/file_utils.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/base/utils.h"
+#include "src/profiling/memory/client.h"
+#include "src/profiling/memory/elf_cache.h"
+#include "src/profiling/memory/unwinding.h"
+#include "src/profiling/memory/wire_protocol.h"
+
+namespace {
+
+using perfetto::base::OpenFile;
+using perfetto::profiling::AllocMetadata;
+using perfetto::profiling::AllocRecord;
+using perfetto::profiling::ElfCache;
+using perfetto::profiling::UnwindingMetadata;
+using perfetto::profiling::WireMessage;
+
+constexpr uint64_t kElfCacheSize = 256 * 1048576;
+
+// The same as the record the client sends for a malloc, with the stack of the
+// benchmark.
+struct StackRecord {
+  WireMessage msg;
+  AllocMetadata metadata;
+  std::unique_ptr<uint8_t[]> stack;
+};
+
+// This is needed because ASAN thinks copying the whole stack is a buffer
+// underrun.
+void __attribute__((noinline, no_sanitize("address")))
+UnsafeMemcpy(void* dst, const void* src, size_t n) {
+  const uint8_t* from = reinterpret_cast<const uint8_t*>(src);
+  uint8_t* to = reinterpret_cast<uint8_t*>(dst);
+  for (size_t i = 0; i < n; ++i)
+    to[i] = from[i];
+}
+
+void __attribute__((noinline)) GetRecord(StackRecord* record) {
+  const char* stackbase = perfetto::profiling::GetThreadStackBase();
+  const char* stacktop = reinterpret_cast<char*>(__builtin_frame_address(0));
+  unwindstack::AsmGetRegs(record->metadata.register_data);
+  PERFETTO_CHECK(stackbase >= stacktop);
+  size_t stack_size = static_cast<size_t>(stackbase - stacktop);
+
+  record->metadata.alloc_size = 10;
+  record->metadata.alloc_address = 0x10;
+  record->metadata.stack_pointer = reinterpret_cast<uint64_t>(stacktop);
+  record->metadata.stack_pointer_offset = sizeof(AllocMetadata);
+  record->metadata.stack_size = stack_size;
+  record->metadata.stack_delta_base = 0;
+  record->metadata.stack_delta_size = 0;
+  record->metadata.arch = unwindstack::Regs::CurrentArch();
+  record->metadata.sequence_number = 1;
+
+  record->stack.reset(new uint8_t[stack_size]);
+  UnsafeMemcpy(record->stack.get(), stacktop, stack_size);
+
+  record->msg = {};
+  record->msg.alloc_header = &record->metadata;
+  record->msg.payload = reinterpret_cast<char*>(record->stack.get());
+  record->msg.payload_size = stack_size;
+}
+
+// The same as the record the client sends for a malloc with
+// ClientConfiguration.frame_pointer_unwinding.
+struct PcsRecord {
+  WireMessage msg;
+  AllocMetadata metadata;
+  uint64_t pcs[128];
+};
+
+void __attribute__((noinline)) GetPcsRecord(PcsRecord* record) {
+  const char* stackbase = perfetto::profiling::GetThreadStackBase();
+  size_t num_pcs = perfetto::profiling::UnwindFramePointers(
+      stackbase, record->pcs, perfetto::base::ArraySize(record->pcs));
+
+  record->metadata = {};
+  record->metadata.alloc_size = 10;
+  record->metadata.alloc_address = 0x10;
+  record->metadata.arch = unwindstack::Regs::CurrentArch();
+  record->metadata.sequence_number = 1;
+
+  record->msg = {};
+  record->msg.record_type = perfetto::profiling::RecordType::MallocPcs;
+  record->msg.alloc_header = &record->metadata;
+  record->msg.payload = reinterpret_cast<char*>(record->pcs);
+  record->msg.payload_size = num_pcs * sizeof(uint64_t);
+}
+
+std::unique_ptr<UnwindingMetadata> MakeMetadata() {
+  return std::unique_ptr<UnwindingMetadata>(
+      new UnwindingMetadata(getpid(), OpenFile("/proc/self/maps", O_RDONLY),
+                            OpenFile("/proc/self/mem", O_RDONLY)));
+}
+
+// The args are whether the unwinder uses an ElfCache.
+void ElfCacheArgs(benchmark::internal::Benchmark* b) {
+  b->Arg(0);
+  b->Arg(1);
+}
+
+}  // namespace
+
+// Unwinds of a process that has just connected, i.e. whose maps have just been
+// parsed. Without the cache, the ELFs of all the libraries in the stack are
+// parsed again.
+static void BM_Unwind_NewProcess(benchmark::State& state) {
+  std::unique_ptr<ElfCache> elf_cache;
+  if (state.range(0))
+    elf_cache.reset(new ElfCache(kElfCacheSize));
+  StackRecord record;
+  GetRecord(&record);
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::unique_ptr<UnwindingMetadata> metadata = MakeMetadata();
+    state.ResumeTiming();
+    AllocRecord out;
+    PERFETTO_CHECK(perfetto::profiling::DoUnwind(&record.msg, metadata.get(),
+                                                 elf_cache.get(), &out));
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_Unwind_NewProcess)->Apply(ElfCacheArgs);
+
+// Unwinds of a process whose ELFs have been parsed already.
+static void BM_Unwind_SameProcess(benchmark::State& state) {
+  std::unique_ptr<ElfCache> elf_cache;
+  if (state.range(0))
+    elf_cache.reset(new ElfCache(kElfCacheSize));
+  StackRecord record;
+  GetRecord(&record);
+  std::unique_ptr<UnwindingMetadata> metadata = MakeMetadata();
+  for (auto _ : state) {
+    AllocRecord out;
+    PERFETTO_CHECK(perfetto::profiling::DoUnwind(&record.msg, metadata.get(),
+                                                 elf_cache.get(), &out));
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_Unwind_SameProcess)->Apply(ElfCacheArgs);
+
+// Symbolization of the pcs found by the client walking the frame pointers, of
+// a process whose ELFs have been parsed already. Compare to
+// BM_Unwind_SameProcess for the cost of the DWARF unwinding in heapprofd.
+static void BM_Symbolize_SameProcess(benchmark::State& state) {
+  std::unique_ptr<ElfCache> elf_cache;
+  if (state.range(0))
+    elf_cache.reset(new ElfCache(kElfCacheSize));
+  PcsRecord record;
+  GetPcsRecord(&record);
+  std::unique_ptr<UnwindingMetadata> metadata = MakeMetadata();
+  for (auto _ : state) {
+    AllocRecord out;
+    PERFETTO_CHECK(perfetto::profiling::DoUnwind(&record.msg, metadata.get(),
+                                                 elf_cache.get(), &out));
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_Symbolize_SameProcess)->Apply(ElfCacheArgs);
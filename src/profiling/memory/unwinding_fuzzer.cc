@@ -38,7 +38,7 @@ int FuzzUnwinding(const uint8_t* data, size_t size) {
   record.metadata = unwinding_metadata;
 
   BookkeepingRecord out;
-  HandleUnwindingRecord(&record, &out);
+  HandleUnwindingRecord(&record, nullptr, &out);
   return 0;
 }
 
@@ -37,7 +37,7 @@ TEST(UnwindingTest, StackMemoryOverlay) {
   base::ScopedFile proc_mem(base::OpenFile("/proc/self/mem", O_RDONLY));
   ASSERT_TRUE(proc_mem);
   uint8_t fake_stack[1] = {120};
-  StackMemory memory(*proc_mem, 0u, fake_stack, 1);
+  StackMemory memory(*proc_mem, 0u, fake_stack, 1, 1u);
   uint8_t buf[1] = {};
   ASSERT_EQ(memory.Read(0u, buf, 1), 1);
   ASSERT_EQ(buf[0], 120);
@@ -49,12 +49,142 @@ TEST(UnwindingTest, StackMemoryNonOverlay) {
   base::ScopedFile proc_mem(base::OpenFile("/proc/self/mem", O_RDONLY));
   ASSERT_TRUE(proc_mem);
   uint8_t fake_stack[1] = {120};
-  StackMemory memory(*proc_mem, 0u, fake_stack, 1);
+  StackMemory memory(*proc_mem, 0u, fake_stack, 1, 1u);
   uint8_t buf[1] = {1};
   ASSERT_EQ(memory.Read(reinterpret_cast<uint64_t>(&value), buf, 1), 1);
   ASSERT_EQ(buf[0], value);
 }
 
+TEST(UnwindingTest, StackMemoryNotCopied) {
+  uint8_t value[2] = {52, 53};
+  const uint64_t addr = reinterpret_cast<uint64_t>(&value[0]);
+
+  base::ScopedFile proc_mem(base::OpenFile("/proc/self/mem", O_RDONLY));
+  ASSERT_TRUE(proc_mem);
+  uint8_t fake_stack[1] = {120};
+  // Only the first byte of the stack was copied, the second is out of date.
+  StackMemory memory(*proc_mem, addr, fake_stack, 1, addr + 2);
+  uint8_t buf[2] = {1, 1};
+  ASSERT_EQ(memory.Read(addr, buf, 1), 1u);
+  EXPECT_EQ(buf[0], 120);
+  EXPECT_EQ(memory.Read(addr + 1, buf, 1), 0u);
+  EXPECT_EQ(memory.Read(addr, buf, 2), 0u);
+}
+
+// A RecordType::MallocStackDelta of the thread whose stack ends at
+// |stack_base|, without the last |delta_size| bytes of |full_stack|.
+struct FakeStackRecord {
+  AllocMetadata metadata{};
+  std::vector<uint8_t> stack;
+  WireMessage msg{};
+
+  FakeStackRecord(uint64_t sequence_number,
+                  uint64_t stack_base,
+                  std::vector<uint8_t> full_stack,
+                  uint64_t delta_base,
+                  size_t delta_size)
+      : stack(full_stack.begin(), full_stack.end() - delta_size) {
+    metadata.sequence_number = sequence_number;
+    metadata.stack_pointer = stack_base - full_stack.size();
+    metadata.stack_pointer_offset = sizeof(AllocMetadata);
+    metadata.stack_size = full_stack.size();
+    metadata.stack_delta_base = delta_base;
+    metadata.stack_delta_size = delta_size;
+    msg.record_type = RecordType::MallocStackDelta;
+    msg.alloc_header = &metadata;
+    msg.payload = reinterpret_cast<char*>(stack.data());
+    msg.payload_size = stack.size();
+  }
+};
+
+TEST(UnwindingTest, ApplyStackDelta) {
+  base::ScopedFile proc_maps(base::OpenFile("/proc/self/maps", O_RDONLY));
+  base::ScopedFile proc_mem(base::OpenFile("/proc/self/mem", O_RDONLY));
+  UnwindingMetadata metadata(getpid(), std::move(proc_maps),
+                             std::move(proc_mem));
+  constexpr uint64_t kStackBase = 0x10000;
+
+  std::vector<uint8_t> first = {1, 2, 3, 4, 5, 6};
+  FakeStackRecord full(1, kStackBase, first, 0, 0);
+  uint8_t* stack = ApplyStackDelta(full.msg, &metadata);
+  ASSERT_NE(stack, nullptr);
+  EXPECT_EQ(std::vector<uint8_t>(stack, stack + first.size()), first);
+
+  // A deeper stack, with the same two bytes at the base.
+  std::vector<uint8_t> second = {7, 8, 9, 10, 11, 12, 13, 5, 6};
+  FakeStackRecord deeper(2, kStackBase, second, 1, 2);
+  ASSERT_EQ(deeper.msg.payload_size, 7u);
+  stack = ApplyStackDelta(deeper.msg, &metadata);
+  ASSERT_NE(stack, nullptr);
+  EXPECT_EQ(std::vector<uint8_t>(stack, stack + second.size()), second);
+
+  // A shallower one, with the same four bytes at the base.
+  std::vector<uint8_t> third = {14, 12, 13, 5, 6};
+  FakeStackRecord shallower(3, kStackBase, third, 2, 4);
+  stack = ApplyStackDelta(shallower.msg, &metadata);
+  ASSERT_NE(stack, nullptr);
+  EXPECT_EQ(std::vector<uint8_t>(stack, stack + third.size()), third);
+
+  // Another thread does not mix with the first one.
+  std::vector<uint8_t> other = {20, 21, 22};
+  FakeStackRecord other_thread(4, 2 * kStackBase, other, 0, 0);
+  stack = ApplyStackDelta(other_thread.msg, &metadata);
+  ASSERT_NE(stack, nullptr);
+  EXPECT_EQ(std::vector<uint8_t>(stack, stack + other.size()), other);
+  EXPECT_EQ(metadata.stack_snapshots.size(), 2u);
+}
+
+TEST(UnwindingTest, ApplyStackDeltaMissingBase) {
+  base::ScopedFile proc_maps(base::OpenFile("/proc/self/maps", O_RDONLY));
+  base::ScopedFile proc_mem(base::OpenFile("/proc/self/mem", O_RDONLY));
+  UnwindingMetadata metadata(getpid(), std::move(proc_maps),
+                             std::move(proc_mem));
+  constexpr uint64_t kStackBase = 0x10000;
+
+  FakeStackRecord full(1, kStackBase, {1, 2, 3, 4}, 0, 0);
+  ASSERT_NE(ApplyStackDelta(full.msg, &metadata), nullptr);
+  // The record with sequence number 2 never arrived.
+  FakeStackRecord delta(3, kStackBase, {5, 6, 3, 4}, 2, 2);
+  EXPECT_EQ(ApplyStackDelta(delta.msg, &metadata), nullptr);
+  EXPECT_EQ(metadata.stack_snapshots.size(), 0u);
+  FakeStackRecord next_delta(4, kStackBase, {7, 6, 3, 4}, 3, 3);
+  EXPECT_EQ(ApplyStackDelta(next_delta.msg, &metadata), nullptr);
+
+  // The delta is bigger than the stack.
+  FakeStackRecord invalid(5, kStackBase, {1, 2}, 0, 0);
+  invalid.metadata.stack_delta_base = 1;
+  invalid.metadata.stack_delta_size = 3;
+  EXPECT_EQ(ApplyStackDelta(invalid.msg, &metadata), nullptr);
+}
+
+TEST(UnwindingTest, ApplyStackDeltaEvictsLeastRecentlyUsed) {
+  base::ScopedFile proc_maps(base::OpenFile("/proc/self/maps", O_RDONLY));
+  base::ScopedFile proc_mem(base::OpenFile("/proc/self/mem", O_RDONLY));
+  UnwindingMetadata metadata(getpid(), std::move(proc_maps),
+                             std::move(proc_mem));
+  constexpr uint64_t kStackBase = 0x10000;
+  constexpr size_t kMax = UnwindingMetadata::kMaxStackSnapshots;
+
+  uint64_t sequence_number = 0;
+  for (uint64_t i = 0; i < kMax; ++i) {
+    FakeStackRecord record(++sequence_number, (i + 1) * kStackBase, {1, 2}, 0,
+                           0);
+    ASSERT_NE(ApplyStackDelta(record.msg, &metadata), nullptr);
+  }
+  // Use the first thread's snapshot again, so that the second one is the
+  // least recently used.
+  FakeStackRecord first(++sequence_number, kStackBase, {3, 2}, 1, 1);
+  ASSERT_NE(ApplyStackDelta(first.msg, &metadata), nullptr);
+
+  FakeStackRecord new_thread(++sequence_number, (kMax + 1) * kStackBase,
+                             {1, 2}, 0, 0);
+  ASSERT_NE(ApplyStackDelta(new_thread.msg, &metadata), nullptr);
+  EXPECT_EQ(metadata.stack_snapshots.size(), kMax);
+  EXPECT_EQ(metadata.stack_snapshots.count(kStackBase), 1u);
+  EXPECT_EQ(metadata.stack_snapshots.count(2 * kStackBase), 0u);
+  EXPECT_EQ(metadata.stack_snapshots.count((kMax + 1) * kStackBase), 1u);
+}
+
 TEST(UnwindingTest, FileDescriptorMapsParse) {
   base::ScopedFile proc_maps(base::OpenFile("/proc/self/maps", O_RDONLY));
   ASSERT_TRUE(proc_maps);
@@ -66,6 +196,24 @@ TEST(UnwindingTest, FileDescriptorMapsParse) {
   ASSERT_EQ(map_info->name, "[stack]");
 }
 
+TEST(UnwindingTest, ReparseMapsIsRateLimited) {
+  base::ScopedFile proc_maps(base::OpenFile("/proc/self/maps", O_RDONLY));
+  base::ScopedFile proc_mem(base::OpenFile("/proc/self/mem", O_RDONLY));
+  UnwindingMetadata metadata(getpid(), std::move(proc_maps),
+                             std::move(proc_mem));
+  metadata.elf_cache_lookup_done = true;
+  EXPECT_TRUE(metadata.ReparseMaps());
+  EXPECT_FALSE(metadata.elf_cache_lookup_done);
+  EXPECT_NE(metadata.maps.Total(), 0u);
+
+  metadata.elf_cache_lookup_done = true;
+  EXPECT_FALSE(metadata.ReparseMaps());
+  EXPECT_TRUE(metadata.elf_cache_lookup_done);
+
+  metadata.last_maps_reparse -= UnwindingMetadata::kMinMapsReparseInterval;
+  EXPECT_TRUE(metadata.ReparseMaps());
+}
+
 #if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
 #define MAYBE_DoUnwind DoUnwind
 #else
@@ -105,6 +253,9 @@ RecordMemory __attribute__((noinline)) GetRecord(WireMessage* msg) {
   metadata->alloc_address = 0x10;
   metadata->stack_pointer = reinterpret_cast<uint64_t>(stacktop);
   metadata->stack_pointer_offset = sizeof(AllocMetadata);
+  metadata->stack_size = stack_size;
+  metadata->stack_delta_base = 0;
+  metadata->stack_delta_size = 0;
   metadata->arch = unwindstack::Regs::CurrentArch();
   metadata->sequence_number = 1;
 
@@ -128,7 +279,7 @@ TEST(UnwindingTest, MAYBE_DoUnwind) {
   WireMessage msg;
   auto record = GetRecord(&msg);
   AllocRecord out;
-  ASSERT_TRUE(DoUnwind(&msg, &metadata, &out));
+  ASSERT_TRUE(DoUnwind(&msg, &metadata, nullptr, &out));
   int st;
   std::unique_ptr<char> demangled(abi::__cxa_demangle(
       out.frames[0].function_name.c_str(), nullptr, nullptr, &st));
@@ -138,6 +289,35 @@ TEST(UnwindingTest, MAYBE_DoUnwind) {
       "perfetto::(anonymous namespace)::GetRecord(perfetto::WireMessage*)");
 }
 
+TEST(UnwindingTest, DoUnwindMallocPcs) {
+  base::ScopedFile proc_maps(base::OpenFile("/proc/self/maps", O_RDONLY));
+  base::ScopedFile proc_mem(base::OpenFile("/proc/self/mem", O_RDONLY));
+  UnwindingMetadata metadata(getpid(), std::move(proc_maps),
+                             std::move(proc_mem));
+  // A return address into this binary, and one that is not mapped.
+  uint64_t pcs[2] = {reinterpret_cast<uint64_t>(&GetRecord) + 16, 1};
+  AllocMetadata alloc_metadata{};
+  alloc_metadata.alloc_size = 10;
+  alloc_metadata.arch = unwindstack::Regs::CurrentArch();
+  WireMessage msg{};
+  msg.record_type = RecordType::MallocPcs;
+  msg.alloc_header = &alloc_metadata;
+  msg.payload = reinterpret_cast<char*>(pcs);
+  msg.payload_size = sizeof(pcs);
+
+  AllocRecord out;
+  ASSERT_TRUE(DoUnwind(&msg, &metadata, nullptr, &out));
+  EXPECT_EQ(out.alloc_metadata.alloc_size, 10u);
+  ASSERT_EQ(out.frames.size(), 2u);
+  unwindstack::MapInfo* map = metadata.maps.Find(pcs[0]);
+  ASSERT_NE(map, nullptr);
+  EXPECT_EQ(out.frames[0].map_name, map->name);
+  EXPECT_EQ(out.frames[0].map_start, map->start);
+  EXPECT_GE(out.frames[0].pc, map->start);
+  EXPECT_LT(out.frames[0].pc, pcs[0]);
+  EXPECT_EQ(out.frames[1].map_name, "");
+}
+
 }  // namespace
 }  // namespace profiling
 }  // namespace perfetto
@@ -19,7 +19,9 @@
 #include "perfetto/base/logging.h"
 #include "perfetto/base/unix_socket.h"
 #include "perfetto/base/utils.h"
+#include "perfetto/protozero/proto_utils.h"
 
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -35,6 +37,27 @@ bool ViewAndAdvance(char** ptr, T** out, const char* end) {
   *ptr += sizeof(T);
   return true;
 }
+
+bool IsMalloc(RecordType record_type) {
+  return record_type == RecordType::Malloc ||
+         record_type == RecordType::MallocPcs ||
+         record_type == RecordType::MallocStackDelta;
+}
+
+size_t GetHeaderSize(const WireMessage& msg) {
+  if (msg.alloc_header) {
+    PERFETTO_DCHECK(IsMalloc(msg.record_type));
+    return sizeof(*msg.alloc_header);
+  }
+  PERFETTO_DCHECK(msg.free_header && msg.record_type == RecordType::Free);
+  return sizeof(*msg.free_header);
+}
+
+// Inverse of ZigZagEncode. Returns the two's complement of negative values,
+// so that adding it to an uint64_t subtracts.
+uint64_t ZigZagDecode(uint64_t value) {
+  return (value >> 1) ^ (0 - (value & 1));
+}
 }  // namespace
 
 bool SendWireMessage(int sock, const WireMessage& msg) {
@@ -46,7 +69,7 @@ bool SendWireMessage(int sock, const WireMessage& msg) {
   iovecs[1].iov_base = const_cast<RecordType*>(&msg.record_type);
   iovecs[1].iov_len = sizeof(msg.record_type);
   if (msg.alloc_header) {
-    PERFETTO_DCHECK(msg.record_type == RecordType::Malloc);
+    PERFETTO_DCHECK(IsMalloc(msg.record_type));
     iovecs[2].iov_base = msg.alloc_header;
     iovecs[2].iov_len = sizeof(*msg.alloc_header);
   } else if (msg.free_header) {
@@ -76,6 +99,74 @@ bool SendWireMessage(int sock, const WireMessage& msg) {
   return sent == static_cast<ssize_t>(total_size + sizeof(total_size));
 }
 
+size_t GetSerializedSize(const WireMessage& msg) {
+  return sizeof(msg.record_type) + GetHeaderSize(msg) +
+         (msg.payload ? msg.payload_size : 0);
+}
+
+void SerializeWireMessage(const WireMessage& msg, uint8_t* buf) {
+  memcpy(buf, &msg.record_type, sizeof(msg.record_type));
+  buf += sizeof(msg.record_type);
+  const size_t header_size = GetHeaderSize(msg);
+  if (msg.alloc_header)
+    memcpy(buf, msg.alloc_header, header_size);
+  else
+    memcpy(buf, msg.free_header, header_size);
+  buf += header_size;
+  if (msg.payload)
+    memcpy(buf, msg.payload, msg.payload_size);
+}
+
+size_t EncodeFreeEntries(const FreePageEntry* entries,
+                         size_t num_entries,
+                         uint8_t* buf) {
+  using protozero::proto_utils::WriteVarInt;
+  using protozero::proto_utils::ZigZagEncode;
+  uint8_t* ptr = buf;
+  uint64_t prev_sequence_number = 0;
+  uint64_t prev_addr = 0;
+  for (size_t i = 0; i < num_entries; ++i) {
+    const FreePageEntry& entry = entries[i];
+    // Unsigned subtraction wraps around, the cast makes it the signed
+    // difference.
+    ptr = WriteVarInt(ZigZagEncode(static_cast<int64_t>(
+                          entry.sequence_number - prev_sequence_number)),
+                      ptr);
+    ptr = WriteVarInt(
+        ZigZagEncode(static_cast<int64_t>(entry.addr - prev_addr)), ptr);
+    prev_sequence_number = entry.sequence_number;
+    prev_addr = entry.addr;
+  }
+  return static_cast<size_t>(ptr - buf);
+}
+
+bool DecodeFreeEntries(const char* buf,
+                       size_t size,
+                       size_t num_entries,
+                       FreePageEntry* entries) {
+  using protozero::proto_utils::ParseVarInt;
+  const uint8_t* ptr = reinterpret_cast<const uint8_t*>(buf);
+  const uint8_t* end = ptr + size;
+  uint64_t sequence_number = 0;
+  uint64_t addr = 0;
+  for (size_t i = 0; i < num_entries; ++i) {
+    uint64_t value;
+    const uint8_t* next = ParseVarInt(ptr, end, &value);
+    if (next == ptr)
+      return false;
+    sequence_number += ZigZagDecode(value);
+    ptr = next;
+    next = ParseVarInt(ptr, end, &value);
+    if (next == ptr)
+      return false;
+    addr += ZigZagDecode(value);
+    ptr = next;
+    entries[i].sequence_number = sequence_number;
+    entries[i].addr = addr;
+  }
+  return ptr == end;
+}
+
 bool ReceiveWireMessage(char* buf, size_t size, WireMessage* out) {
   RecordType* record_type;
   char* end = buf + size;
@@ -86,7 +177,7 @@ bool ReceiveWireMessage(char* buf, size_t size, WireMessage* out) {
   out->payload_size = 0;
   out->record_type = *record_type;
 
-  if (*record_type == RecordType::Malloc) {
+  if (IsMalloc(*record_type)) {
     if (!ViewAndAdvance<AllocMetadata>(&buf, &out->alloc_header, end))
       return false;
     out->payload = buf;
@@ -95,9 +186,17 @@ bool ReceiveWireMessage(char* buf, size_t size, WireMessage* out) {
       return false;
     }
     out->payload_size = static_cast<size_t>(end - buf);
+    if (*record_type == RecordType::MallocPcs &&
+        out->payload_size % sizeof(uint64_t) != 0) {
+      return false;
+    }
   } else if (*record_type == RecordType::Free) {
     if (!ViewAndAdvance<FreeMetadata>(&buf, &out->free_header, end))
       return false;
+    if (out->free_header->num_entries > kFreePageSize)
+      return false;
+    out->payload = buf;
+    out->payload_size = static_cast<size_t>(end - buf);
   } else {
     PERFETTO_DFATAL("Invalid record type.");
     return false;
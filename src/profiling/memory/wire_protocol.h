@@ -36,7 +36,15 @@ namespace profiling {
 // and heapprofd. The basic format of a record is
 // record size (uint64_t) | record type (RecordType = uint64_t) | record
 // If record type is malloc, the record format is AllocMetdata | raw stack.
-// If the record type is free, the record is a sequence of FreePageEntry.
+// If record type is malloc unwound by the client (see
+// ClientConfiguration::frame_pointer_unwinding), the record format is
+// AllocMetadata | uint64_t pcs[], where pcs are the return addresses on the
+// stack, innermost first.
+// If the record type is malloc with stack deltas (see
+// ClientConfiguration::stack_deltas), the format is the same as for malloc,
+// but the raw stack might only be the top of it, see AllocMetadata.
+// If the record type is free, the record format is FreeMetadata | encoded
+// FreePageEntry[], see EncodeFreeEntries.
 
 // Use uint64_t to make sure the following data is aligned as 64bit is the
 // strongest alignment requirement.
@@ -68,6 +76,8 @@ constexpr size_t kFreePageSize = 1024;
 enum class RecordType : uint64_t {
   Free = 0,
   Malloc = 1,
+  MallocPcs = 2,
+  MallocStackDelta = 3,
 };
 
 struct AllocMetadata {
@@ -82,6 +92,16 @@ struct AllocMetadata {
   uint64_t stack_pointer;
   // Offset of the data at stack_pointer from the start of this record.
   uint64_t stack_pointer_offset;
+  // Number of bytes between stack_pointer and the base of the stack. The
+  // record has fewer of them if the stack was truncated (see
+  // ClientConfiguration::max_stack_size) or is a delta.
+  uint64_t stack_size;
+  // For RecordType::MallocStackDelta, the last stack_delta_size bytes of the
+  // stack are not in the record, they are the same as in the record of the
+  // same thread with sequence number stack_delta_base. Zero if the record has
+  // the whole stack.
+  uint64_t stack_delta_base;
+  uint64_t stack_delta_size;
   alignas(uint64_t) char register_data[kMaxRegisterDataSize];
   // CPU architecture of the client. This determines the size of the
   // register data that follows this struct.
@@ -93,16 +113,34 @@ struct FreePageEntry {
   uint64_t addr;
 };
 
+// Upper bound of the size of an encoded FreePageEntry: two varints.
+constexpr size_t kMaxEncodedFreePageEntrySize = 2 * 10;
+
 struct ClientConfiguration {
   // On average, sample one allocation every interval bytes,
   // If interval == 1, sample every allocation.
   // Must be >= 1.
   uint64_t interval;
+  // If the shared memory buffer is full, block the allocating thread until
+  // heapprofd frees up space in it, rather than dropping the sample.
+  bool block_client;
+  // Unwind by walking the frame pointers in the client, and send only the
+  // return addresses rather than the whole stack. Only correct if the code on
+  // the stack was built with frame pointers.
+  bool frame_pointer_unwinding;
+  // Copy at most this many bytes of the stack, starting at the stack pointer.
+  // 0 means the whole stack.
+  uint64_t max_stack_size;
+  // Only send the part of the stack that changed since the previous record of
+  // the same thread, as RecordType::MallocStackDelta. Ignored without the
+  // shared memory buffer, as the records on different sockets of the pool
+  // can be reordered.
+  bool stack_deltas;
 };
 
 struct FreeMetadata {
+  // Number of FreePageEntry encoded in the payload, at most kFreePageSize.
   uint64_t num_entries;
-  FreePageEntry entries[kFreePageSize];
 };
 
 struct WireMessage {
@@ -117,6 +155,35 @@ struct WireMessage {
 
 bool SendWireMessage(int sock, const WireMessage& msg);
 
+// Returns the size of |msg| once serialized, without the record size that
+// precedes it on the socket.
+size_t GetSerializedSize(const WireMessage& msg);
+
+// Serializes |msg| into |buf|, which must be at least GetSerializedSize(msg)
+// bytes. This is the format that ReceiveWireMessage() parses, used to write
+// into the SharedRingBuffer.
+void SerializeWireMessage(const WireMessage& msg, uint8_t* buf);
+
+// Writes |entries| into |buf|, which must be at least
+// |num_entries| * kMaxEncodedFreePageEntrySize bytes. Returns the number of
+// bytes written.
+//
+// Each entry is encoded as the zigzag varints of the differences of its
+// sequence_number and addr to the ones of the entry before it, or to zero for
+// the first. The sequence numbers of a page of frees are close to each other,
+// and so are many of the addresses, so this is a fraction of the size of the
+// entries.
+size_t EncodeFreeEntries(const FreePageEntry* entries,
+                         size_t num_entries,
+                         uint8_t* buf);
+
+// Decodes the |num_entries| entries that EncodeFreeEntries wrote into
+// |buf| into |entries|. Returns false if |buf| is not a valid encoding.
+bool DecodeFreeEntries(const char* buf,
+                       size_t size,
+                       size_t num_entries,
+                       FreePageEntry* entries);
+
 // Parse message received over the wire.
 // |buf| has to outlive |out|.
 // If buf is not a valid message, return false.
@@ -31,24 +31,21 @@ namespace profiling {
 bool operator==(const AllocMetadata& one, const AllocMetadata& other);
 bool operator==(const AllocMetadata& one, const AllocMetadata& other) {
   return std::tie(one.sequence_number, one.alloc_size, one.alloc_address,
-                  one.stack_pointer, one.stack_pointer_offset, one.arch) ==
+                  one.stack_pointer, one.stack_pointer_offset, one.stack_size,
+                  one.stack_delta_base, one.stack_delta_size, one.arch) ==
              std::tie(other.sequence_number, other.alloc_size,
                       other.alloc_address, other.stack_pointer,
-                      other.stack_pointer_offset, other.arch) &&
+                      other.stack_pointer_offset, other.stack_size,
+                      other.stack_delta_base, other.stack_delta_size,
+                      other.arch) &&
          memcmp(one.register_data, other.register_data, kMaxRegisterDataSize) ==
              0;
 }
 
-bool operator==(const FreeMetadata& one, const FreeMetadata& other);
-bool operator==(const FreeMetadata& one, const FreeMetadata& other) {
-  if (one.num_entries != other.num_entries)
-    return false;
-  for (size_t i = 0; i < one.num_entries; ++i) {
-    if (std::tie(one.entries[i].sequence_number, one.entries[i].addr) !=
-        std::tie(other.entries[i].sequence_number, other.entries[i].addr))
-      return false;
-  }
-  return true;
+bool operator==(const FreePageEntry& one, const FreePageEntry& other);
+bool operator==(const FreePageEntry& one, const FreePageEntry& other) {
+  return std::tie(one.sequence_number, one.addr) ==
+         std::tie(other.sequence_number, other.addr);
 }
 
 namespace {
@@ -86,6 +83,9 @@ TEST(WireProtocolTest, AllocMessage) {
   metadata.alloc_address = 0xC1C2C3C4C5C6C7C8;
   metadata.stack_pointer = 0xD1D2D3D4D5D6D7D8;
   metadata.stack_pointer_offset = 0xE1E2E3E4E5E6E7E8;
+  metadata.stack_size = 0xF1F2F3F4F5F6F7F8;
+  metadata.stack_delta_base = 0x9192939495969798;
+  metadata.stack_delta_size = 0x8182838485868788;
   metadata.arch = unwindstack::ARCH_X86;
   for (size_t i = 0; i < kMaxRegisterDataSize; ++i)
     metadata.register_data[i] = 0x66;
@@ -115,11 +115,16 @@ TEST(WireProtocolTest, FreeMessage) {
   msg.record_type = RecordType::Free;
   FreeMetadata metadata = {};
   metadata.num_entries = kFreePageSize;
+  std::vector<FreePageEntry> entries(kFreePageSize);
   for (size_t i = 0; i < kFreePageSize; ++i) {
-    metadata.entries[i].sequence_number = 0x111111111111111;
-    metadata.entries[i].addr = 0x222222222222222;
+    entries[i].sequence_number = 0x111111111111111 + i;
+    entries[i].addr = 0x222222222222222 - 16 * i;
   }
+  std::vector<uint8_t> encoded(kFreePageSize * kMaxEncodedFreePageEntrySize);
   msg.free_header = &metadata;
+  msg.payload = reinterpret_cast<char*>(encoded.data());
+  msg.payload_size =
+      EncodeFreeEntries(entries.data(), entries.size(), encoded.data());
 
   int sv[2];
   ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
@@ -133,8 +138,94 @@ TEST(WireProtocolTest, FreeMessage) {
   ASSERT_TRUE(ReceiveWireMessage(reinterpret_cast<char*>(record.data.get()),
                                  record.size, &recv_msg));
   ASSERT_EQ(recv_msg.record_type, msg.record_type);
-  ASSERT_EQ(*recv_msg.free_header, *msg.free_header);
+  ASSERT_EQ(recv_msg.free_header->num_entries, metadata.num_entries);
   ASSERT_EQ(recv_msg.payload_size, msg.payload_size);
+  std::vector<FreePageEntry> recv_entries(kFreePageSize);
+  ASSERT_TRUE(DecodeFreeEntries(recv_msg.payload, recv_msg.payload_size,
+                                recv_msg.free_header->num_entries,
+                                recv_entries.data()));
+  EXPECT_EQ(recv_entries, entries);
+}
+
+TEST(WireProtocolTest, FreeEntries) {
+  std::vector<FreePageEntry> entries = {
+      {1, 0x7f0000001000}, {2, 0x7f0000000ff0}, {4, 0x7f0000001010},
+      {3, 0},              {0, 0xffffffffffffffff}, {0xffffffffffffffff, 1}};
+  std::vector<uint8_t> encoded(entries.size() * kMaxEncodedFreePageEntrySize);
+  size_t size = EncodeFreeEntries(entries.data(), entries.size(),
+                                  encoded.data());
+  std::vector<FreePageEntry> decoded(entries.size());
+  ASSERT_TRUE(DecodeFreeEntries(reinterpret_cast<char*>(encoded.data()), size,
+                                decoded.size(), decoded.data()));
+  EXPECT_EQ(decoded, entries);
+
+  // Close sequence numbers and addresses take few bytes.
+  std::vector<FreePageEntry> close = {{100, 0x7f0000001000},
+                                      {101, 0x7f0000001040}};
+  size = EncodeFreeEntries(close.data(), close.size(), encoded.data());
+  EXPECT_EQ(size - EncodeFreeEntries(close.data(), 1, encoded.data()), 3u);
+
+  // Truncated, or with bytes left over.
+  EXPECT_FALSE(DecodeFreeEntries(reinterpret_cast<char*>(encoded.data()),
+                                 size - 1, close.size(), decoded.data()));
+  EXPECT_FALSE(DecodeFreeEntries(reinterpret_cast<char*>(encoded.data()), size,
+                                 close.size() - 1, decoded.data()));
+}
+
+TEST(WireProtocolTest, SerializedAllocMessage) {
+  char payload[] = {0x77, 0x77, 0x77, 0x00};
+  WireMessage msg = {};
+  msg.record_type = RecordType::Malloc;
+  AllocMetadata metadata = {};
+  metadata.sequence_number = 0xA1A2A3A4A5A6A7A8;
+  metadata.alloc_size = 0xB1B2B3B4B5B6B7B8;
+  metadata.arch = unwindstack::ARCH_X86;
+  msg.alloc_header = &metadata;
+  msg.payload = payload;
+  msg.payload_size = sizeof(payload);
+
+  const size_t size = GetSerializedSize(msg);
+  ASSERT_EQ(sizeof(RecordType) + sizeof(AllocMetadata) + sizeof(payload),
+            size);
+  // The shared memory buffer aligns records to 8 bytes.
+  std::unique_ptr<uint64_t[]> buf(new uint64_t[(size + 7) / 8]);
+  SerializeWireMessage(msg, reinterpret_cast<uint8_t*>(buf.get()));
+
+  WireMessage recv_msg;
+  ASSERT_TRUE(
+      ReceiveWireMessage(reinterpret_cast<char*>(buf.get()), size, &recv_msg));
+  ASSERT_EQ(recv_msg.record_type, msg.record_type);
+  ASSERT_EQ(*recv_msg.alloc_header, *msg.alloc_header);
+  ASSERT_EQ(recv_msg.payload_size, msg.payload_size);
+  ASSERT_STREQ(recv_msg.payload, msg.payload);
+}
+
+TEST(WireProtocolTest, MallocPcsMessage) {
+  uint64_t pcs[] = {0x1000, 0x2000, 0x3000};
+  WireMessage msg = {};
+  msg.record_type = RecordType::MallocPcs;
+  AllocMetadata metadata = {};
+  metadata.sequence_number = 0xA1A2A3A4A5A6A7A8;
+  metadata.arch = unwindstack::ARCH_ARM64;
+  msg.alloc_header = &metadata;
+  msg.payload = reinterpret_cast<char*>(pcs);
+  msg.payload_size = sizeof(pcs);
+
+  const size_t size = GetSerializedSize(msg);
+  std::unique_ptr<uint64_t[]> buf(new uint64_t[size / 8]);
+  SerializeWireMessage(msg, reinterpret_cast<uint8_t*>(buf.get()));
+
+  WireMessage recv_msg;
+  ASSERT_TRUE(
+      ReceiveWireMessage(reinterpret_cast<char*>(buf.get()), size, &recv_msg));
+  ASSERT_EQ(recv_msg.record_type, RecordType::MallocPcs);
+  ASSERT_EQ(*recv_msg.alloc_header, *msg.alloc_header);
+  ASSERT_EQ(recv_msg.payload_size, sizeof(pcs));
+  ASSERT_EQ(0, memcmp(recv_msg.payload, pcs, sizeof(pcs)));
+
+  // A truncated pc.
+  EXPECT_FALSE(ReceiveWireMessage(reinterpret_cast<char*>(buf.get()), size - 1,
+                                  &recv_msg));
 }
 
 }  // namespace
@@ -90,7 +90,8 @@ ProtoDecoder::Field ProtoDecoder::ReadField() {
       // Alternatively, we may not have space to fully read the length
       // delimited field. Set the id to zero and return but don't update the
       // offset so a future read can read this field.
-      if (new_pos == pos || new_pos + field_intvalue > end) {
+      if (new_pos == pos ||
+          field_intvalue > static_cast<uint64_t>(end - new_pos)) {
         return field;
       }
       pos = new_pos;
@@ -196,6 +196,17 @@ TEST(ProtoUtilsTest, VarIntDecodingOutOfBounds) {
   }
 }
 
+TEST(ProtoUtilsTest, VarIntDecodingMalformed) {
+  // An 11 bytes long varint cannot be decoded into 64 bits.
+  uint8_t buf[11];
+  memset(buf, 0xff, sizeof(buf));
+  buf[10] = 0x01;
+  uint64_t value = static_cast<uint64_t>(-1);
+  const uint8_t* res = ParseVarInt(buf, buf + sizeof(buf), &value);
+  EXPECT_EQ(&buf[0], res);
+  EXPECT_EQ(0u, value);
+}
+
 }  // namespace
 }  // namespace proto_utils
 }  // namespace protozero
@@ -21,6 +21,7 @@
 #include <string>
 
 #include "perfetto/base/logging.h"
+#include "perfetto/base/metatrace.h"
 #include "perfetto/base/string_view.h"
 #include "perfetto/base/utils.h"
 #include "perfetto/protozero/proto_decoder.h"
@@ -135,7 +136,14 @@ ProtoTraceParser::ProtoTraceParser(TraceProcessorContext* context)
       batt_current_id_(context->storage->InternString("batt.current_ua")),
       batt_current_avg_id_(
           context->storage->InternString("batt.current.avg_ua")),
-      oom_score_adj_id_(context->storage->InternString("oom_score_adj")) {
+      oom_score_adj_id_(context->storage->InternString("oom_score_adj")),
+      metatrace_cat_id_(context->storage->InternString("perfetto")),
+      metatrace_overruns_id_(
+          context->storage->InternString("perfetto.metatrace_overruns")) {
+  for (uint32_t i = 0; i < base::metatrace::EVENTS_MAX; i++) {
+    metatrace_event_names_.emplace_back(
+        context->storage->InternString(base::metatrace::GetEventName(i)));
+  }
   for (const auto& name : BuildMeminfoCounterNames()) {
     meminfo_strs_id_.emplace_back(context->storage->InternString(name));
   }
@@ -199,6 +207,11 @@ void ProtoTraceParser::ParseTracePacket(int64_t ts, TraceBlobView packet) {
         ParseBatteryCounters(ts, packet.slice(fld_off, fld.size()));
         break;
       }
+      case protos::TracePacket::kPerfettoMetatraceFieldNumber: {
+        const size_t fld_off = packet.offset_of(fld.data());
+        ParsePerfettoMetatrace(ts, packet.slice(fld_off, fld.size()));
+        break;
+      }
       default:
         break;
     }
@@ -876,6 +889,46 @@ void ProtoTraceParser::ParseBatteryCounters(int64_t ts, TraceBlobView battery) {
   PERFETTO_DCHECK(decoder.IsEndOfBuffer());
 }
 
+void ProtoTraceParser::ParsePerfettoMetatrace(int64_t ts,
+                                              TraceBlobView metatrace) {
+  ProtoDecoder decoder(metatrace.data(), metatrace.length());
+  uint32_t event_id = 0;
+  uint32_t duration_ns = 0;
+  uint32_t tid = 0;
+  uint32_t overruns = 0;
+  for (auto fld = decoder.ReadField(); fld.id != 0; fld = decoder.ReadField()) {
+    switch (fld.id) {
+      case protos::PerfettoMetatrace::kEventIdFieldNumber:
+        event_id = fld.as_uint32();
+        break;
+      case protos::PerfettoMetatrace::kEventDurationNsFieldNumber:
+        duration_ns = fld.as_uint32();
+        break;
+      case protos::PerfettoMetatrace::kThreadIdFieldNumber:
+        tid = fld.as_uint32();
+        break;
+      case protos::PerfettoMetatrace::kOverrunsFieldNumber:
+        overruns = fld.as_uint32();
+        break;
+      default:
+        break;
+    }
+  }
+  PERFETTO_DCHECK(decoder.IsEndOfBuffer());
+
+  if (overruns) {
+    context_->event_tracker->PushCounter(ts, overruns, metatrace_overruns_id_,
+                                         0, RefType::kRefNoRef);
+  }
+  // Events added after the trace processor was built.
+  if (event_id >= metatrace_event_names_.size())
+    return;
+  UniqueTid utid = context_->process_tracker->UpdateThread(ts, tid, 0);
+  context_->slice_tracker->Scoped(ts, utid, metatrace_cat_id_,
+                                  metatrace_event_names_[event_id],
+                                  duration_ns);
+}
+
 void ProtoTraceParser::ParseOOMScoreAdjUpdate(int64_t ts,
                                               TraceBlobView oom_update) {
   ProtoDecoder decoder(oom_update.data(), oom_update.length());
@@ -82,6 +82,7 @@ class ProtoTraceParser {
   void ParseLowmemoryKill(int64_t ts, TraceBlobView);
   void ParseBatteryCounters(int64_t ts, TraceBlobView);
   void ParseOOMScoreAdjUpdate(int64_t ts, TraceBlobView);
+  void ParsePerfettoMetatrace(int64_t ts, TraceBlobView);
 
  private:
   TraceProcessorContext* context_;
@@ -109,10 +110,15 @@ class ProtoTraceParser {
   const StringId batt_current_id_;
   const StringId batt_current_avg_id_;
   const StringId oom_score_adj_id_;
+  const StringId metatrace_cat_id_;
+  const StringId metatrace_overruns_id_;
   std::vector<StringId> meminfo_strs_id_;
   std::vector<StringId> vmstat_strs_id_;
   std::vector<StringId> rss_members_;
 
+  // Indexed by base::metatrace::EventId.
+  std::vector<StringId> metatrace_event_names_;
+
   // Maps a proto field number from ProcessStats::MemCounters to its StringId.
   // Keep kProcMemCounterSize equal to 1 + max proto field id of MemCounters.
   static constexpr size_t kProcMemCounterSize = 10;
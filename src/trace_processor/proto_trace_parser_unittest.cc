@@ -18,10 +18,12 @@
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "perfetto/base/metatrace.h"
 #include "perfetto/base/string_view.h"
 #include "src/trace_processor/event_tracker.h"
 #include "src/trace_processor/process_tracker.h"
 #include "src/trace_processor/proto_trace_parser.h"
+#include "src/trace_processor/slice_tracker.h"
 #include "src/trace_processor/trace_sorter.h"
 
 #include "perfetto/trace/trace.pb.h"
@@ -323,6 +325,37 @@ TEST_F(ProtoTraceParserTest, LoadThreadPacket) {
   Tokenize(trace);
 }
 
+TEST_F(ProtoTraceParserTest, LoadPerfettoMetatrace) {
+  context_.slice_tracker.reset(new SliceTracker(&context_));
+  protos::Trace trace;
+  auto* packet = trace.add_packet();
+  packet->set_timestamp(1000);
+  auto* event = packet->mutable_perfetto_metatrace();
+  event->set_event_id(base::metatrace::FTRACE_DRAIN_CPUS);
+  event->set_event_duration_ns(50);
+  event->set_thread_id(42);
+
+  // Events unknown to this version are skipped.
+  packet = trace.add_packet();
+  packet->set_timestamp(2000);
+  packet->mutable_perfetto_metatrace()->set_event_id(
+      base::metatrace::EVENTS_MAX);
+
+  EXPECT_CALL(*storage_, InternString(_)).Times(::testing::AnyNumber());
+  EXPECT_CALL(*storage_, InternString(base::StringView("ftrace_drain_cpus")))
+      .WillRepeatedly(::testing::Return(7));
+  // The parser interns the names on construction.
+  context_.proto_parser.reset(new ProtoTraceParser(&context_));
+  Tokenize(trace);
+
+  const auto& slices = context_.storage->nestable_slices();
+  ASSERT_EQ(1u, slices.slice_count());
+  EXPECT_EQ(1000, slices.start_ns()[0]);
+  EXPECT_EQ(50, slices.durations()[0]);
+  EXPECT_EQ(7u, slices.names()[0]);
+  EXPECT_EQ(42u, context_.storage->GetThread(slices.utids()[0]).tid);
+}
+
 TEST(SystraceParserTest, SystraceEvent) {
   SystraceTracePoint result{};
   ASSERT_TRUE(ParseSystraceTracePoint(base::StringView("B|1|foo"), &result));
@@ -52,7 +52,6 @@ constexpr uint32_t kTypePadding = 29;
 constexpr uint32_t kTypeTimeExtend = 30;
 constexpr uint32_t kTypeTimeStamp = 31;
 
-constexpr uint32_t kMainThread = 255;  // for METATRACE
 
 struct PageHeader {
   uint64_t timestamp;
@@ -244,10 +243,13 @@ void CpuReader::RunWorkerThread(size_t cpu,
   // Returns the number of ftrace bytes read, or -1 in case of failure.
   auto read_ftrace_pipe = [&sync_pipe, trace_fd, pool, cpu, header_size_len](
                               ReadMode mode, Block block) -> int {
-    static const char* const kModesStr[] = {"read-nonblock", "read-block",
-                                            "splice-nonblock", "splice-block"};
-    const char* mode_str = kModesStr[(mode == kSplice) * 2 + (block == kBlock)];
-    PERFETTO_METATRACE(mode_str, cpu);
+    static const base::metatrace::EventId kModeEvents[] = {
+        base::metatrace::FTRACE_CPU_READER_READ_NONBLOCK,
+        base::metatrace::FTRACE_CPU_READER_READ_BLOCK,
+        base::metatrace::FTRACE_CPU_READER_SPLICE_NONBLOCK,
+        base::metatrace::FTRACE_CPU_READER_SPLICE_BLOCK};
+    PERFETTO_METATRACE_DYNAMIC(
+        kModeEvents[(mode == kSplice) * 2 + (block == kBlock)], cpu);
     uint8_t* pool_page = pool->BeginWrite();
     PERFETTO_DCHECK(pool_page);
 
@@ -324,7 +326,7 @@ void CpuReader::RunWorkerThread(size_t cpu,
     // Commands are tagged with an ID, every new command has a new |cmd_id|, so
     // we can distinguish spurious wakeups from actual cmd requests.
     {
-      PERFETTO_METATRACE("wait cmd", cpu);
+      PERFETTO_METATRACE(FTRACE_CPU_READER_WAIT_CMD, cpu);
       std::unique_lock<std::mutex> lock(thread_sync->mutex);
       while (thread_sync->cmd_id == last_cmd_id)
         thread_sync->cond.wait(lock);
@@ -347,7 +349,7 @@ void CpuReader::RunWorkerThread(size_t cpu,
         break;
 
       case FtraceThreadSync::kRun: {
-        PERFETTO_METATRACE(cur_mode == kRead ? "read" : "splice", cpu);
+        PERFETTO_METATRACE(FTRACE_CPU_READER_RUN_CYCLE, cpu);
 
         // Do a blocking read/splice. This can fail for a variety of reasons:
         // - FtraceController interrupts us with a signal for a new cmd
@@ -369,13 +371,14 @@ void CpuReader::RunWorkerThread(size_t cpu,
         // Do as many non-blocking read/splice as we can.
         while (read_ftrace_pipe(cur_mode, kNonBlock) > kRoughlyAPage) {
         }
-        pool->CommitWrittenPages();
-        FtraceController::OnCpuReaderRead(cpu, generation, thread_sync);
+        size_t pages_read = pool->CommitWrittenPages();
+        FtraceController::OnCpuReaderRead(cpu, generation, pages_read,
+                                          thread_sync);
         break;
       }
 
       case FtraceThreadSync::kFlush: {
-        PERFETTO_METATRACE("flush", cpu);
+        PERFETTO_METATRACE(FTRACE_CPU_READER_FLUSH, cpu);
         cur_mode = kRead;
         while (read_ftrace_pipe(cur_mode, kNonBlock) > kRoughlyAPage) {
         }
@@ -399,12 +402,14 @@ void CpuReader::RunWorkerThread(size_t cpu,
 
 // Invoked on the main thread by FtraceController, |drain_rate_ms| after the
 // first CPU wakes up from the blocking read()/splice().
-void CpuReader::Drain(const std::set<FtraceDataSource*>& data_sources) {
+size_t CpuReader::Drain(const std::set<FtraceDataSource*>& data_sources) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
-  PERFETTO_METATRACE("Drain(" + std::to_string(cpu_) + ")", kMainThread);
+  PERFETTO_METATRACE(FTRACE_CPU_READER_DRAIN, cpu_);
 
+  size_t pages_drained = 0;
   auto page_blocks = pool_.BeginRead();
   for (const auto& page_block : page_blocks) {
+    pages_drained += page_block.size();
     for (size_t i = 0; i < page_block.size(); i++) {
       const uint8_t* page = page_block.At(i);
 
@@ -426,6 +431,7 @@ void CpuReader::Drain(const std::set<FtraceDataSource*>& data_sources) {
     }
   }
   pool_.EndRead(std::move(page_blocks));
+  return pages_drained;
 }
 
 // The structure of a raw trace buffer page is as follows:
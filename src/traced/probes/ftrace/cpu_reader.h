@@ -66,7 +66,8 @@ class CpuReader {
   ~CpuReader();
 
   // Drains all available data into the buffer of the passed data sources.
-  void Drain(const std::set<FtraceDataSource*>&);
+  // Returns the number of ftrace pages drained.
+  size_t Drain(const std::set<FtraceDataSource*>&);
 
   void InterruptWorkerThreadWithSignal();
 
@@ -12,11 +12,18 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
 #include "benchmark/benchmark.h"
 
 #include "src/traced/probes/ftrace/cpu_reader.h"
 #include "src/traced/probes/ftrace/proto_translation_table.h"
 
+#include "perfetto/base/file_utils.h"
+#include "perfetto/base/logging.h"
 #include "perfetto/base/utils.h"
 #include "perfetto/protozero/scattered_stream_null_delegate.h"
 #include "perfetto/protozero/scattered_stream_writer.h"
@@ -324,3 +331,39 @@ static void BM_ParsePageFullOfSchedSwitch(benchmark::State& state) {
   }
 }
 BENCHMARK(BM_ParsePageFullOfSchedSwitch);
+
+// Parses the pages of the cpu_reader fuzzer corpus, which are raw pages
+// captured from a device. This is the userspace cost (per page) that is saved
+// for every page worth of events discarded by a kernel filter
+// (FtraceConfig.kernel_filters). Must be run in the root directory.
+static void BM_ParseFuzzerCorpusPage(benchmark::State& state) {
+  std::string data;
+  PERFETTO_CHECK(perfetto::base::ReadFile(
+      "src/traced/probes/ftrace/cpu_reader_fuzzer_corpus/one_page_sched_switch",
+      &data));
+  std::unique_ptr<uint8_t[]> page(new uint8_t[perfetto::base::kPageSize]());
+  memcpy(page.get(), data.data(),
+         std::min(data.size(), perfetto::base::kPageSize));
+
+  ScatteredStreamWriterNullDelegate delegate(perfetto::base::kPageSize);
+  ScatteredStreamWriter stream(&delegate);
+  FtraceEventBundle writer;
+
+  ProtoTranslationTable* table = GetTable("synthetic");
+
+  EventFilter filter;
+  filter.AddEnabledEvent(
+      table->EventToFtraceId(GroupAndName("sched", "sched_switch")));
+  filter.AddEnabledEvent(
+      table->EventToFtraceId(GroupAndName("ftrace", "print")));
+
+  FtraceMetadata metadata{};
+  while (state.KeepRunning()) {
+    writer.Reset(&stream);
+    CpuReader::ParsePage(page.get(), &filter, &writer, table, &metadata);
+    metadata.Clear();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(perfetto::base::kPageSize));
+}
+BENCHMARK(BM_ParseFuzzerCorpusPage);
@@ -54,6 +54,13 @@ bool IsValidFtraceEventName(const std::string& str) {
   return true;
 }
 
+bool IsValidKernelFilter(const std::string& str) {
+  // The kernel rejects filters that don't fit in a page.
+  if (str.empty() || str.size() >= 4096)
+    return false;
+  return str.find('\n') == std::string::npos;
+}
+
 }  // namespace
 
 FtraceConfig CreateFtraceConfig(std::set<std::string> names) {
@@ -86,6 +93,23 @@ bool ValidConfig(const FtraceConfig& config) {
       return false;
     }
   }
+  for (const auto& kernel_filter : config.kernel_filters()) {
+    const std::string& event_name = kernel_filter.event();
+    if (!IsValidFtraceEventName(event_name) || event_name.empty() ||
+        event_name.back() == '*') {
+      PERFETTO_ELOG("Bad kernel filter event '%s'", event_name.c_str());
+      return false;
+    }
+    // Events in the "ftrace" group are always on and can't be filtered.
+    if (event_name.compare(0, 7, "ftrace/") == 0) {
+      PERFETTO_ELOG("Can't filter ftrace group event '%s'", event_name.c_str());
+      return false;
+    }
+    if (!IsValidKernelFilter(kernel_filter.filter())) {
+      PERFETTO_ELOG("Bad kernel filter for '%s'", event_name.c_str());
+      return false;
+    }
+  }
   return true;
 }
 
@@ -65,6 +65,19 @@ std::pair<std::string, std::string> EventToStringGroupAndName(
                         event.substr(slash_pos + 1));
 }
 
+// Returns the union of |predicates| in the kernel filter syntax.
+std::string MergeKernelFilters(const std::set<std::string>& predicates) {
+  if (predicates.size() == 1)
+    return *predicates.begin();
+  std::string merged;
+  for (const std::string& predicate : predicates) {
+    if (!merged.empty())
+      merged += " || ";
+    merged += "(" + predicate + ")";
+  }
+  return merged;
+}
+
 }  // namespace
 
 std::set<GroupAndName> FtraceConfigMuxer::GetFtraceEvents(
@@ -234,6 +247,31 @@ std::set<GroupAndName> FtraceConfigMuxer::GetFtraceEvents(
   return events;
 }
 
+std::map<GroupAndName, std::string> FtraceConfigMuxer::GetKernelFilters(
+    const FtraceConfig& request,
+    const ProtoTranslationTable* table) {
+  std::map<GroupAndName, std::string> filters;
+  for (const auto& kernel_filter : request.kernel_filters()) {
+    std::string group;
+    std::string name;
+    std::tie(group, name) = EventToStringGroupAndName(kernel_filter.event());
+    if (group.empty()) {
+      const Event* e = table->GetEventByName(name);
+      if (!e) {
+        PERFETTO_DLOG("Can't filter %s, event not known", name.c_str());
+        continue;
+      }
+      group = e->group;
+    }
+    // Two filters for the same event in the same config: match either.
+    std::string& filter = filters[GroupAndName(group, name)];
+    filter = filter.empty() ? kernel_filter.filter()
+                            : MergeKernelFilters({filter,
+                                                  kernel_filter.filter()});
+  }
+  return filters;
+}
+
 // Post-conditions:
 // 1. result >= 1 (should have at least one page per CPU)
 // 2. result * 4 < kMaxTotalBufferSizeKb
@@ -287,6 +325,9 @@ FtraceConfigId FtraceConfigMuxer::SetupConfig(const FtraceConfig& request) {
   }
 
   std::set<GroupAndName> events = GetFtraceEvents(request, table_);
+  std::map<GroupAndName, std::string> kernel_filters =
+      GetKernelFilters(request, table_);
+  std::map<size_t, std::string> predicates;
 
   if (RequiresAtrace(request))
     UpdateAtrace(request);
@@ -298,12 +339,28 @@ FtraceConfigId FtraceConfigMuxer::SetupConfig(const FtraceConfig& request) {
                     group_and_name.ToString().c_str());
       continue;
     }
+    auto kernel_filter_it = kernel_filters.find(group_and_name);
+    if (kernel_filter_it != kernel_filters.end() &&
+        std::string("ftrace") == event->group) {
+      // ValidConfig() rejects "ftrace/name" but a bare name can still resolve
+      // to one of these always-on events, which have no filter file.
+      PERFETTO_ELOG("Ignoring kernel filter for %s",
+                    group_and_name.ToString().c_str());
+      kernel_filter_it = kernel_filters.end();
+    }
+    if (kernel_filter_it != kernel_filters.end())
+      predicates[event->ftrace_event_id] = kernel_filter_it->second;
     if (current_state_.ftrace_events.IsEventEnabled(event->ftrace_event_id) ||
         std::string("ftrace") == event->group) {
       filter.AddEnabledEvent(event->ftrace_event_id);
       *actual.add_ftrace_events() = group_and_name.ToString();
       continue;
     }
+    // Nobody else has this event enabled, so our predicate is the merged one.
+    // Set it before enabling the event so that the kernel never records
+    // unfiltered events.
+    if (kernel_filter_it != kernel_filters.end())
+      SetKernelFilter(*event, kernel_filter_it->second);
     if (ftrace_->EnableEvent(event->group, event->name)) {
       current_state_.ftrace_events.AddEnabledEvent(event->ftrace_event_id);
       filter.AddEnabledEvent(event->ftrace_event_id);
@@ -313,9 +370,17 @@ FtraceConfigId FtraceConfigMuxer::SetupConfig(const FtraceConfig& request) {
     }
   }
 
+  for (const auto& kernel_filter : request.kernel_filters())
+    *actual.add_kernel_filters() = kernel_filter;
+
   FtraceConfigId id = ++last_id_;
   configs_.emplace(id, std::move(actual));
   filters_.emplace(id, std::move(filter));
+  kernel_filters_.emplace(id, std::move(predicates));
+
+  // Events that were already enabled by other configs might need their
+  // filter widened (or removed) to also let through what this config wants.
+  UpdateKernelFilters();
   return id;
 }
 
@@ -345,6 +410,7 @@ bool FtraceConfigMuxer::ActivateConfig(FtraceConfigId id) {
 bool FtraceConfigMuxer::RemoveConfig(FtraceConfigId config_id) {
   if (!config_id || !filters_.erase(config_id) || !configs_.erase(config_id))
     return false;
+  kernel_filters_.erase(config_id);
   EventFilter expected_ftrace_events;
   for (const auto& id_filter : filters_) {
     expected_ftrace_events.EnableEventsFrom(id_filter.second);
@@ -363,6 +429,9 @@ bool FtraceConfigMuxer::RemoveConfig(FtraceConfigId config_id) {
       current_state_.ftrace_events.DisableEvent(event->ftrace_event_id);
   }
 
+  // Filters are cleared only after disabling the events they apply to.
+  UpdateKernelFilters();
+
   // If there aren't any more active configs, disable ftrace.
   auto active_it = active_configs_.find(config_id);
   if (active_it != active_configs_.end()) {
@@ -389,6 +458,80 @@ bool FtraceConfigMuxer::RemoveConfig(FtraceConfigId config_id) {
   return true;
 }
 
+void FtraceConfigMuxer::UpdateKernelFilters() {
+  for (size_t event_id : current_state_.ftrace_events.GetEnabledEvents()) {
+    std::set<std::string> predicates;
+    bool unfiltered = false;
+    for (const auto& id_filter : filters_) {
+      if (!id_filter.second.IsEventEnabled(event_id))
+        continue;
+      const auto& config_predicates = kernel_filters_[id_filter.first];
+      auto it = config_predicates.find(event_id);
+      if (it == config_predicates.end()) {
+        unfiltered = true;
+        break;
+      }
+      predicates.insert(it->second);
+    }
+    std::string filter;
+    if (!unfiltered && !predicates.empty())
+      filter = MergeKernelFilters(predicates);
+    auto it = current_state_.kernel_filters.find(event_id);
+    if (it == current_state_.kernel_filters.end() ? filter.empty()
+                                                  : it->second == filter) {
+      continue;
+    }
+    const Event* event = table_->GetEventById(event_id);
+    // Any event that was enabled must exist.
+    PERFETTO_DCHECK(event);
+    if (event)
+      SetKernelFilter(*event, filter);
+  }
+
+  std::vector<size_t> stale_event_ids;
+  for (const auto& id_and_filter : current_state_.kernel_filters) {
+    if (!current_state_.ftrace_events.IsEventEnabled(id_and_filter.first))
+      stale_event_ids.push_back(id_and_filter.first);
+  }
+  for (size_t event_id : stale_event_ids) {
+    const Event* event = table_->GetEventById(event_id);
+    PERFETTO_DCHECK(event);
+    if (event)
+      SetKernelFilter(*event, "");
+  }
+}
+
+void FtraceConfigMuxer::SetKernelFilter(const Event& event,
+                                        const std::string& filter) {
+  auto it = current_state_.kernel_filters.find(event.ftrace_event_id);
+  bool has_filter = it != current_state_.kernel_filters.end();
+  if (has_filter ? it->second == filter : filter.empty())
+    return;
+
+  if (filter.empty()) {
+    if (ftrace_->ClearEventFilter(event.group, event.name)) {
+      current_state_.kernel_filters.erase(it);
+    } else {
+      PERFETTO_DPLOG("Failed to clear filter of %s/%s", event.group,
+                     event.name);
+    }
+    return;
+  }
+
+  if (ftrace_->SetEventFilter(event.group, event.name, filter)) {
+    current_state_.kernel_filters[event.ftrace_event_id] = filter;
+    return;
+  }
+
+  // The kernel rejected the filter (e.g. a field that doesn't exist). Keeping
+  // the previous one could drop events that some config asked for: fall back
+  // to not filtering at all.
+  PERFETTO_ELOG("Failed to set filter \"%s\" for %s/%s", filter.c_str(),
+                event.group, event.name);
+  if (has_filter && ftrace_->ClearEventFilter(event.group, event.name))
+    current_state_.kernel_filters.erase(event.ftrace_event_id);
+}
+
 const FtraceConfig* FtraceConfigMuxer::GetConfigForTesting(FtraceConfigId id) {
   if (!configs_.count(id))
     return nullptr;
@@ -41,6 +41,12 @@ namespace perfetto {
 // To see which settings we actually managed to set you can call |GetConfig|
 // and when you are finished with a config you can signal that with
 // |RemoveConfig|.
+
+// Kernel filters (FtraceConfig.kernel_filters) are muxed per event: the
+// per-event "filter" file is programmed with the union of the predicates of
+// all the configs that enabled the event, or left empty if any of them
+// enabled the event without a predicate. Configs may therefore receive events
+// that don't match their own predicate, but never miss one that does.
 class FtraceConfigMuxer {
  public:
   // The FtraceConfigMuxer and ProtoTranslationTable
@@ -68,6 +74,12 @@ class FtraceConfigMuxer {
 
   const EventFilter* GetEventFilter(FtraceConfigId id);
 
+  // Returns the size of the per-cpu kernel buffer, as set up by the first
+  // config.
+  size_t GetPerCpuBufferSizePages() const {
+    return current_state_.cpu_buffer_size_pages;
+  }
+
   // public for testing
   void SetupClockForTesting(const FtraceConfig& request) {
     SetupClock(request);
@@ -84,6 +96,8 @@ class FtraceConfigMuxer {
  private:
   struct FtraceState {
     EventFilter ftrace_events;
+    // Filter expression currently programmed in the kernel, by event id.
+    std::map<size_t, std::string> kernel_filters;
     std::set<std::string> atrace_categories;
     std::set<std::string> atrace_apps;
     bool tracing_on = false;
@@ -99,6 +113,20 @@ class FtraceConfigMuxer {
   void UpdateAtrace(const FtraceConfig& request);
   void DisableAtrace();
 
+  // Recomputes the merged kernel filter of every enabled event and clears
+  // the filters of events that are not enabled anymore.
+  void UpdateKernelFilters();
+
+  // Programs |filter| (or no filter if empty) for |event|, if different from
+  // the one currently set. If the kernel rejects it the event is left
+  // unfiltered.
+  void SetKernelFilter(const Event& event, const std::string& filter);
+
+  // Resolves the events of the kernel filters in |request|.
+  std::map<GroupAndName, std::string> GetKernelFilters(
+      const FtraceConfig& request,
+      const ProtoTranslationTable*);
+
   // This processes the config to get the exact events.
   // group/* -> Will read the fs and add all events in group.
   // event -> Will look up the event to find the group.
@@ -118,6 +146,10 @@ class FtraceConfigMuxer {
   // to check if a certain ftrace event with id x is enabled.
   std::map<FtraceConfigId, EventFilter> filters_;
 
+  // Kernel filter predicates requested by each config, by event id. Events
+  // enabled by a config but not in its map are wanted unfiltered.
+  std::map<FtraceConfigId, std::map<size_t, std::string>> kernel_filters_;
+
   // Set of all configurations. Note that not all of them might be active.
   // When a config is present but not active, we do setup buffer sizes and
   // events, but don't enable ftrace (i.e. tracing_on).
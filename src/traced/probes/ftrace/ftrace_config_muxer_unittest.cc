@@ -16,10 +16,17 @@
 
 #include "src/traced/probes/ftrace/ftrace_config_muxer.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include <memory>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "perfetto/base/file_utils.h"
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/base/temp_file.h"
+#include "perfetto/base/utils.h"
 #include "src/traced/probes/ftrace/atrace_wrapper.h"
 #include "src/traced/probes/ftrace/ftrace_procfs.h"
 #include "src/traced/probes/ftrace/proto_translation_table.h"
@@ -30,7 +37,9 @@ using testing::MatchesRegex;
 using testing::Contains;
 using testing::ElementsAreArray;
 using testing::Eq;
+using testing::InSequence;
 using testing::IsEmpty;
+using testing::Mock;
 using testing::NiceMock;
 using testing::Not;
 using testing::Return;
@@ -499,5 +508,198 @@ TEST_F(FtraceConfigMuxerTest, GetFtraceEventsAtraceCategories) {
   EXPECT_THAT(events, Contains(GroupAndName("ftrace", "print")));
 }
 
+TEST_F(FtraceConfigMuxerTest, KernelFilters) {
+  NiceMock<MockFtraceProcfs> ftrace;
+  FtraceConfigMuxer model(&ftrace, table_.get());
+
+  const char kFilter[] = "/root/events/sched/sched_switch/filter";
+  const char kEnable[] = "/root/events/sched/sched_switch/enable";
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+
+  FtraceConfig config_a = CreateFtraceConfig({"sched/sched_switch"});
+  FtraceConfig::KernelFilter* kernel_filter = config_a.add_kernel_filters();
+  kernel_filter->set_event("sched_switch");
+  kernel_filter->set_filter("prev_pid == 1");
+  {
+    // The filter must be in place before the event is enabled.
+    InSequence seq;
+    EXPECT_CALL(ftrace, WriteToFile(kFilter, "prev_pid == 1"));
+    EXPECT_CALL(ftrace, WriteToFile(kEnable, "1"));
+  }
+  FtraceConfigId id_a = model.SetupConfig(config_a);
+  ASSERT_TRUE(id_a);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&ftrace));
+  const FtraceConfig* actual_config = model.GetConfigForTesting(id_a);
+  ASSERT_TRUE(actual_config);
+  ASSERT_EQ(actual_config->kernel_filters_size(), 1);
+  EXPECT_EQ(actual_config->kernel_filters()[0].filter(), "prev_pid == 1");
+
+  // Another config filtering the same event widens the filter.
+  FtraceConfig config_b = CreateFtraceConfig({"sched/sched_switch"});
+  kernel_filter = config_b.add_kernel_filters();
+  kernel_filter->set_event("sched/sched_switch");
+  kernel_filter->set_filter("next_pid == 2");
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+  EXPECT_CALL(ftrace,
+              WriteToFile(kFilter, "(next_pid == 2) || (prev_pid == 1)"));
+  EXPECT_CALL(ftrace, WriteToFile(kEnable, _)).Times(0);
+  FtraceConfigId id_b = model.SetupConfig(config_b);
+  ASSERT_TRUE(id_b);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&ftrace));
+
+  // A config that wants all the sched_switch events removes the filter.
+  FtraceConfig config_c = CreateFtraceConfig({"sched/sched_switch"});
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+  EXPECT_CALL(ftrace, WriteToFile(kFilter, "0"));
+  FtraceConfigId id_c = model.SetupConfig(config_c);
+  ASSERT_TRUE(id_c);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&ftrace));
+
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+  EXPECT_CALL(ftrace,
+              WriteToFile(kFilter, "(next_pid == 2) || (prev_pid == 1)"));
+  ASSERT_TRUE(model.RemoveConfig(id_c));
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&ftrace));
+
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+  EXPECT_CALL(ftrace, WriteToFile(kFilter, "prev_pid == 1"));
+  ASSERT_TRUE(model.RemoveConfig(id_b));
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&ftrace));
+
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+  {
+    // The filter is cleared only once the event is disabled.
+    InSequence seq;
+    EXPECT_CALL(ftrace, WriteToFile(kEnable, "0"));
+    EXPECT_CALL(ftrace, WriteToFile(kFilter, "0"));
+  }
+  ASSERT_TRUE(model.RemoveConfig(id_a));
+}
+
+TEST_F(FtraceConfigMuxerTest, KernelFilterRejected) {
+  NiceMock<MockFtraceProcfs> ftrace;
+  FtraceConfigMuxer model(&ftrace, table_.get());
+
+  const char kFilter[] = "/root/events/sched/sched_switch/filter";
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+
+  FtraceConfig config_a = CreateFtraceConfig({"sched/sched_switch"});
+  FtraceConfig::KernelFilter* kernel_filter = config_a.add_kernel_filters();
+  kernel_filter->set_event("sched/sched_switch");
+  kernel_filter->set_filter("prev_pid == 1");
+  EXPECT_CALL(ftrace, WriteToFile(kFilter, "prev_pid == 1"));
+  FtraceConfigId id_a = model.SetupConfig(config_a);
+  ASSERT_TRUE(id_a);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&ftrace));
+
+  // If the kernel doesn't accept the merged filter, the event must not stay
+  // filtered with the predicate of the first config only.
+  FtraceConfig config_b = CreateFtraceConfig({"sched/sched_switch"});
+  kernel_filter = config_b.add_kernel_filters();
+  kernel_filter->set_event("sched/sched_switch");
+  kernel_filter->set_filter("no_such_field == 2");
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+  EXPECT_CALL(ftrace, WriteToFile(kFilter,
+                                  "(no_such_field == 2) || (prev_pid == 1)"))
+      .WillOnce(Return(false));
+  EXPECT_CALL(ftrace, WriteToFile(kFilter, "0"));
+  FtraceConfigId id_b = model.SetupConfig(config_b);
+  ASSERT_TRUE(id_b);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&ftrace));
+
+  // Going back to a single config programs its filter again.
+  EXPECT_CALL(ftrace, WriteToFile(_, _)).Times(AnyNumber());
+  EXPECT_CALL(ftrace, WriteToFile(kFilter, "prev_pid == 1"));
+  ASSERT_TRUE(model.RemoveConfig(id_b));
+}
+
+// Runs the muxer against a fake tracefs directory tree, using the real
+// FtraceProcfs.
+TEST_F(FtraceConfigMuxerTest, KernelFiltersOnFakeTracefs) {
+  auto fake_tracefs = base::TempDir::Create();
+  const std::string root = fake_tracefs.path() + "/";
+  std::vector<std::string> dirs_to_delete;
+  std::vector<std::string> files_to_delete;
+  auto make_dir = [&root, &dirs_to_delete](const std::string& path) {
+    dirs_to_delete.push_back(root + path);
+    mkdir((root + path).c_str(), 0755);
+  };
+  auto write_file = [&root, &files_to_delete](const std::string& path,
+                                              const std::string& content) {
+    files_to_delete.push_back(root + path);
+    base::ScopedFile fd =
+        base::OpenFile(root + path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_TRUE(fd);
+    ASSERT_EQ(base::WriteAll(fd.get(), content.data(), content.size()),
+              static_cast<ssize_t>(content.size()));
+  };
+  // Returns what was written in the file since the last call. Regular files,
+  // unlike the tracefs ones, aren't replaced by a write.
+  auto take_file = [&root](const std::string& path) {
+    std::string content;
+    EXPECT_TRUE(base::ReadFile(root + path, &content));
+    base::ScopedFile fd = base::OpenFile(root + path, O_WRONLY | O_TRUNC);
+    EXPECT_TRUE(fd);
+    return content;
+  };
+
+  write_file("trace", "");
+  write_file("tracing_on", "0");
+  write_file("trace_clock", "[local] global boot");
+  write_file("buffer_size_kb", "");
+  make_dir("events");
+  write_file("events/enable", "");
+  make_dir("events/sched");
+  for (const char* name : {"sched_switch", "sched_wakeup"}) {
+    make_dir(std::string("events/sched/") + name);
+    write_file(std::string("events/sched/") + name + "/enable", "");
+    write_file(std::string("events/sched/") + name + "/filter", "");
+  }
+
+  std::unique_ptr<FtraceProcfs> ftrace = FtraceProcfs::Create(root);
+  ASSERT_TRUE(ftrace);
+  FtraceConfigMuxer model(ftrace.get(), table_.get());
+
+  FtraceConfig config_a =
+      CreateFtraceConfig({"sched/sched_switch", "sched/sched_wakeup"});
+  FtraceConfig::KernelFilter* kernel_filter = config_a.add_kernel_filters();
+  kernel_filter->set_event("sched/sched_switch");
+  kernel_filter->set_filter("prev_pid == 1");
+  FtraceConfigId id_a = model.SetupConfig(config_a);
+  ASSERT_TRUE(id_a);
+  ASSERT_TRUE(model.ActivateConfig(id_a));
+  EXPECT_EQ(take_file("events/sched/sched_switch/filter"), "prev_pid == 1");
+  EXPECT_EQ(take_file("events/sched/sched_switch/enable"), "1");
+  EXPECT_EQ(take_file("events/sched/sched_wakeup/filter"), "");
+  EXPECT_EQ(take_file("events/sched/sched_wakeup/enable"), "1");
+
+  FtraceConfig config_b = CreateFtraceConfig({"sched/sched_switch"});
+  kernel_filter = config_b.add_kernel_filters();
+  kernel_filter->set_event("sched_switch");
+  kernel_filter->set_filter("next_pid == 2");
+  FtraceConfigId id_b = model.SetupConfig(config_b);
+  ASSERT_TRUE(id_b);
+  ASSERT_TRUE(model.ActivateConfig(id_b));
+  EXPECT_EQ(take_file("events/sched/sched_switch/filter"),
+            "(next_pid == 2) || (prev_pid == 1)");
+  EXPECT_EQ(take_file("events/sched/sched_switch/enable"), "");
+
+  ASSERT_TRUE(model.RemoveConfig(id_a));
+  EXPECT_EQ(take_file("events/sched/sched_switch/filter"), "next_pid == 2");
+  EXPECT_EQ(take_file("events/sched/sched_wakeup/enable"), "0");
+  EXPECT_EQ(take_file("events/sched/sched_wakeup/filter"), "");
+
+  ASSERT_TRUE(model.RemoveConfig(id_b));
+  EXPECT_EQ(take_file("events/sched/sched_switch/enable"), "0");
+  EXPECT_EQ(take_file("events/sched/sched_switch/filter"), "0");
+  EXPECT_EQ(take_file("tracing_on"), "0");
+
+  // Cleanup |fake_tracefs|. TempDir checks that the directory is empty.
+  for (const std::string& path : files_to_delete)
+    unlink(path.c_str());
+  for (auto it = dirs_to_delete.rbegin(); it != dirs_to_delete.rend(); ++it)
+    rmdir(it->c_str());
+}
+
 }  // namespace
 }  // namespace perfetto
@@ -33,5 +33,34 @@ TEST(ConfigTest, CreateFtraceConfig) {
   EXPECT_THAT(config.ftrace_events(), Contains("bbb"));
 }
 
+TEST(ConfigTest, ValidKernelFilters) {
+  FtraceConfig config = CreateFtraceConfig({"sched/sched_switch"});
+  EXPECT_TRUE(ValidConfig(config));
+
+  FtraceConfig::KernelFilter* kernel_filter = config.add_kernel_filters();
+  kernel_filter->set_event("sched/sched_switch");
+  kernel_filter->set_filter("prev_pid == 42 || next_pid == 42");
+  EXPECT_TRUE(ValidConfig(config));
+
+  kernel_filter->set_event("sched_switch");
+  EXPECT_TRUE(ValidConfig(config));
+
+  kernel_filter->set_event("sched/*");
+  EXPECT_FALSE(ValidConfig(config));
+
+  kernel_filter->set_event("ftrace/print");
+  EXPECT_FALSE(ValidConfig(config));
+
+  kernel_filter->set_event("");
+  EXPECT_FALSE(ValidConfig(config));
+
+  kernel_filter->set_event("sched/sched_switch");
+  kernel_filter->set_filter("");
+  EXPECT_FALSE(ValidConfig(config));
+
+  kernel_filter->set_filter("common_pid == 1\n");
+  EXPECT_FALSE(ValidConfig(config));
+}
+
 }  // namespace
 }  // namespace perfetto
@@ -24,7 +24,9 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <limits>
 #include <string>
 #include <utility>
 
@@ -51,7 +53,18 @@ constexpr int kDefaultDrainPeriodMs = 100;
 constexpr int kFlushTimeoutMs = 500;
 constexpr int kMinDrainPeriodMs = 1;
 constexpr int kMaxDrainPeriodMs = 1000 * 60;
-constexpr uint32_t kMainThread = 255;  // for METATRACE
+
+// Parameters of the adaptive drain scheduling. The drain period is shortened
+// (down to kMinAdaptiveDrainPeriodMs) when, at the current data rate, the
+// kernel buffers would fill above kDrainWatermarkPercent before the end of the
+// period. Conversely, when the buffers would stay below 1/kIdleBackoffMargin
+// of the watermark, the period is stretched up to kMaxDrainBackoffFactor times
+// the configured one to batch more pages in each drain.
+constexpr uint32_t kMinAdaptiveDrainPeriodMs = 10;
+constexpr size_t kDrainWatermarkPercent = 50;
+constexpr uint32_t kMaxDrainBackoffFactor = 4;
+constexpr double kIdleBackoffMargin = 4;
+constexpr uint64_t kNoOverrunSample = std::numeric_limits<uint64_t>::max();
 
 uint32_t ClampDrainPeriodMs(uint32_t drain_period_ms) {
   if (drain_period_ms == 0) {
@@ -164,16 +177,32 @@ uint64_t FtraceController::NowMs() const {
 // static
 void FtraceController::OnCpuReaderRead(size_t cpu,
                                        int generation,
+                                       size_t pages_read,
                                        FtraceThreadSync* thread_sync) {
-  PERFETTO_METATRACE("OnCpuReaderRead()", cpu);
+  PERFETTO_METATRACE(FTRACE_ON_CPU_READER_READ, cpu);
 
+  bool drain_now = false;
   {
     std::lock_guard<std::mutex> lock(thread_sync->mutex);
     // If this was the first CPU to wake up, schedule a drain for the next
     // drain interval.
     bool post_drain_task = thread_sync->cpus_to_drain.none();
     thread_sync->cpus_to_drain[cpu] = true;
-    if (!post_drain_task)
+    if (post_drain_task) {
+      thread_sync->first_read_ns =
+          static_cast<uint64_t>(base::GetWallTimeNs().count());
+    }
+
+    // If this CPU found its kernel buffer above the high watermark, waiting
+    // for the end of the drain period would likely cause the kernel to start
+    // overwriting events. Drain as soon as the main thread gets to it instead.
+    if (thread_sync->early_drain_threshold_pages &&
+        pages_read >= thread_sync->early_drain_threshold_pages &&
+        !thread_sync->early_drain_pending) {
+      thread_sync->early_drain_pending = true;
+      drain_now = true;
+    }
+    if (!post_drain_task && !drain_now)
       return;
   }  // lock(thread_sync_.mutex)
 
@@ -181,19 +210,29 @@ void FtraceController::OnCpuReaderRead(size_t cpu,
   base::TaskRunner* task_runner = thread_sync->task_runner;
 
   // The nested PostTask is used because the FtraceController (and hence
-  // GetDrainPeriodMs()) can be called only on the main thread.
-  task_runner->PostTask([weak_ctl, task_runner, generation] {
+  // GetNextDrainDelayMs()) can be called only on the main thread.
+  task_runner->PostTask([weak_ctl, task_runner, generation, drain_now] {
 
     if (!weak_ctl)
       return;
-    uint32_t drain_period_ms = weak_ctl->GetDrainPeriodMs();
 
+    if (drain_now) {
+      weak_ctl->DrainCPUs(generation);
+      return;
+    }
+
+    uint32_t drain_delay_ms = weak_ctl->GetNextDrainDelayMs();
+
+    // If another drain (an early one or a flush) happens in the meantime, it
+    // will pick up the data this task was posted for. In that case this task
+    // becomes a no-op and the next CpuReader to have data posts a new one.
+    uint64_t drain_seq = weak_ctl->drain_seq_;
     task_runner->PostDelayedTask(
-        [weak_ctl, generation] {
-          if (weak_ctl)
+        [weak_ctl, generation, drain_seq] {
+          if (weak_ctl && weak_ctl->drain_seq_ == drain_seq)
             weak_ctl->DrainCPUs(generation);
         },
-        drain_period_ms - (weak_ctl->NowMs() % drain_period_ms));
+        drain_delay_ms - (weak_ctl->NowMs() % drain_delay_ms));
 
   });
 }
@@ -220,18 +259,25 @@ void FtraceController::OnCpuReaderFlush(size_t cpu,
 
 void FtraceController::DrainCPUs(int generation) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
-  PERFETTO_METATRACE("DrainCPUs()", kMainThread);
+  PERFETTO_METATRACE(FTRACE_DRAIN_CPUS, 0);
 
   if (generation != generation_)
     return;
 
+  drain_seq_++;
   const size_t num_cpus = ftrace_procfs_->NumberOfCpus();
   PERFETTO_DCHECK(cpu_readers_.size() == num_cpus);
   FlushRequestID ack_flush_request_id = 0;
   std::bitset<base::kMaxCpus> cpus_to_drain;
+  bool is_early_drain = false;
+  uint64_t first_read_ns = 0;
   {
     std::lock_guard<std::mutex> lock(thread_sync_.mutex);
     std::swap(cpus_to_drain, thread_sync_.cpus_to_drain);
+    is_early_drain = thread_sync_.early_drain_pending;
+    thread_sync_.early_drain_pending = false;
+    first_read_ns = thread_sync_.first_read_ns;
+    thread_sync_.first_read_ns = 0;
 
     // Check also if a flush is pending and if all cpus have acked. If that's
     // the case, ack the overall Flush() request at the end of this function.
@@ -242,15 +288,49 @@ void FtraceController::DrainCPUs(int generation) {
     }
   }
 
+  const uint64_t drain_start_ns =
+      static_cast<uint64_t>(base::GetWallTimeNs().count());
+  size_t max_pages_drained = 0;
+  bool overruns_during_burst = false;
   for (size_t cpu = 0; cpu < num_cpus; cpu++) {
     if (!cpus_to_drain[cpu])
       continue;
     // This method reads the pipe and converts the raw ftrace data into
     // protobufs using the |data_source|'s TraceWriter.
-    cpu_readers_[cpu]->Drain(started_data_sources_);
+    size_t pages_drained = cpu_readers_[cpu]->Drain(started_data_sources_);
+    max_pages_drained = std::max(max_pages_drained, pages_drained);
+
+    // Under bursty load also check whether the kernel had to overwrite events.
+    if (drain_watermark_pages_ && pages_drained >= drain_watermark_pages_ / 2)
+      overruns_during_burst |= CheckForNewOverruns(cpu);
+
     OnDrainCpuForTesting(cpu);
   }
 
+  if (cpus_to_drain.any()) {
+    UpdateDrainRate(max_pages_drained);
+    // If events were lost, the rate estimate is too optimistic: the kernel
+    // didn't even have room to hold the pages we failed to drain in time.
+    if (overruns_during_burst)
+      max_pages_per_sec_ *= 2;
+
+    const uint64_t drain_end_ns =
+        static_cast<uint64_t>(base::GetWallTimeNs().count());
+    uint64_t latency_us =
+        first_read_ns && drain_start_ns > first_read_ns
+            ? (drain_start_ns - first_read_ns) / 1000
+            : 0;
+    uint64_t duration_us = (drain_end_ns - drain_start_ns) / 1000;
+    drain_stats_.num_drains++;
+    drain_stats_.num_early_drains += is_early_drain;
+    drain_stats_.total_drain_latency_us += latency_us;
+    drain_stats_.max_drain_latency_us =
+        std::max(drain_stats_.max_drain_latency_us, latency_us);
+    drain_stats_.total_drain_duration_us += duration_us;
+    drain_stats_.max_drain_duration_us =
+        std::max(drain_stats_.max_drain_duration_us, duration_us);
+  }
+
   // If we filled up any SHM pages while draining the data, we will have posted
   // a task to notify traced about this. Only unblock the readers after this
   // notification is sent to make it less likely that they steal CPU time away
@@ -279,7 +359,7 @@ void FtraceController::DrainCPUs(int generation) {
 }
 
 void FtraceController::UnblockReaders() {
-  PERFETTO_METATRACE("UnblockReaders()", kMainThread);
+  PERFETTO_METATRACE(FTRACE_UNBLOCK_READERS, 0);
 
   // If a flush or a quit is pending, do nothing.
   std::unique_lock<std::mutex> lock(thread_sync_.mutex);
@@ -305,6 +385,21 @@ void FtraceController::StartIfNeeded() {
   }
 
   generation_++;
+
+  // The first config sets up the kernel buffer size, which doesn't change
+  // until all the data sources are gone.
+  drain_watermark_pages_ = ftrace_config_muxer_->GetPerCpuBufferSizePages() *
+                           kDrainWatermarkPercent / 100;
+  {
+    std::lock_guard<std::mutex> lock(thread_sync_.mutex);
+    thread_sync_.early_drain_threshold_pages = drain_watermark_pages_;
+    thread_sync_.early_drain_pending = false;
+  }
+  last_drain_ms_ = 0;
+  max_pages_per_sec_ = 0;
+  last_overrun_.assign(ftrace_procfs_->NumberOfCpus(), kNoOverrunSample);
+  drain_stats_ = {};
+
   cpu_readers_.clear();
   cpu_readers_.reserve(ftrace_procfs_->NumberOfCpus());
   for (size_t cpu = 0; cpu < ftrace_procfs_->NumberOfCpus(); cpu++) {
@@ -325,6 +420,64 @@ uint32_t FtraceController::GetDrainPeriodMs() {
   return ClampDrainPeriodMs(min_drain_period_ms);
 }
 
+// Returns the delay of the next periodic drain. This is the configured drain
+// period, unless the data rate observed in the previous drains requires to
+// drain earlier to avoid overruns, or allows to back off because ftrace is
+// mostly idle.
+uint32_t FtraceController::GetNextDrainDelayMs() {
+  const uint32_t period_ms = GetDrainPeriodMs();
+  uint32_t delay_ms = period_ms;
+  if (max_pages_per_sec_ > 0 && drain_watermark_pages_) {
+    const double ms_to_watermark =
+        1000.0 * drain_watermark_pages_ / max_pages_per_sec_;
+    if (ms_to_watermark < period_ms) {
+      const uint32_t min_ms = std::min(period_ms, kMinAdaptiveDrainPeriodMs);
+      delay_ms = std::max(min_ms, static_cast<uint32_t>(ms_to_watermark));
+    } else {
+      const double max_ms =
+          std::min(period_ms * kMaxDrainBackoffFactor,
+                   static_cast<uint32_t>(kMaxDrainPeriodMs));
+      delay_ms = static_cast<uint32_t>(std::max(
+          static_cast<double>(period_ms),
+          std::min(max_ms, ms_to_watermark / kIdleBackoffMargin)));
+    }
+  }
+  drain_stats_.cur_drain_period_ms = delay_ms;
+  return delay_ms;
+}
+
+// The pages drained from a CPU have been accumulating in the kernel buffer
+// roughly since the previous drain, as CpuReader(s) stay blocked in between.
+// The rate of the busiest CPU is what determines the risk of overruns.
+void FtraceController::UpdateDrainRate(size_t max_pages_drained) {
+  const uint64_t now_ms = NowMs();
+  if (last_drain_ms_ && now_ms > last_drain_ms_) {
+    const double pages_per_sec =
+        1000.0 * max_pages_drained / (now_ms - last_drain_ms_);
+    // Follow bursts immediately but decay gradually, so that a single quiet
+    // cycle in the middle of a burst doesn't stretch the drain period.
+    max_pages_per_sec_ = std::max(pages_per_sec, max_pages_per_sec_ / 2);
+  }
+  last_drain_ms_ = now_ms;
+}
+
+// Samples the kernel overrun counter of |cpu| and returns true if it
+// increased since the previous sample. Reading per_cpu/stats costs a few
+// syscalls, so this is done only for CPUs that look close to overrunning.
+bool FtraceController::CheckForNewOverruns(size_t cpu) {
+  FtraceCpuStats cpu_stats{};
+  if (cpu >= last_overrun_.size() ||
+      !DumpCpuStats(ftrace_procfs_->ReadCpuStats(cpu), &cpu_stats)) {
+    return false;
+  }
+  const uint64_t last_overrun = last_overrun_[cpu];
+  last_overrun_[cpu] = cpu_stats.overrun;
+  if (last_overrun == kNoOverrunSample || cpu_stats.overrun <= last_overrun)
+    return false;
+  drain_stats_.burst_overruns += cpu_stats.overrun - last_overrun;
+  return true;
+}
+
 void FtraceController::ClearTrace() {
   ftrace_procfs_->ClearTrace();
 }
@@ -436,6 +589,7 @@ void FtraceController::RemoveDataSource(FtraceDataSource* data_source) {
 
 void FtraceController::DumpFtraceStats(FtraceStats* stats) {
   DumpAllCpuStats(ftrace_procfs_.get(), stats);
+  stats->drain_stats = drain_stats_;
 }
 
 void FtraceController::IssueThreadSyncCmd(
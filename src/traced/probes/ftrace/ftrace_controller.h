@@ -26,6 +26,7 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "perfetto/base/gtest_prod_util.h"
 #include "perfetto/base/task_runner.h"
@@ -33,6 +34,7 @@
 #include "perfetto/base/weak_ptr.h"
 #include "perfetto/tracing/core/basic_types.h"
 #include "src/traced/probes/ftrace/ftrace_config.h"
+#include "src/traced/probes/ftrace/ftrace_stats.h"
 #include "src/traced/probes/ftrace/ftrace_thread_sync.h"
 
 namespace perfetto {
@@ -42,7 +44,6 @@ class FtraceConfigMuxer;
 class FtraceDataSource;
 class FtraceProcfs;
 class ProtoTranslationTable;
-struct FtraceStats;
 
 // Method of last resort to reset ftrace state.
 void HardResetFtraceState();
@@ -63,7 +64,12 @@ class FtraceController {
   virtual ~FtraceController();
 
   // These two methods are called by CpuReader(s) from their worker threads.
-  static void OnCpuReaderRead(size_t cpu, int generation, FtraceThreadSync*);
+  // |pages_read| is the number of pages moved out of the kernel buffer in the
+  // read cycle and is used to adapt the drain scheduling to the load.
+  static void OnCpuReaderRead(size_t cpu,
+                              int generation,
+                              size_t pages_read,
+                              FtraceThreadSync*);
   static void OnCpuReaderFlush(size_t cpu, int generation, FtraceThreadSync*);
 
   void DisableAllEvents();
@@ -113,6 +119,9 @@ class FtraceController {
                           std::unique_lock<std::mutex> = {});
 
   uint32_t GetDrainPeriodMs();
+  uint32_t GetNextDrainDelayMs();
+  void UpdateDrainRate(size_t max_pages_drained);
+  bool CheckForNewOverruns(size_t cpu);
 
   void StartIfNeeded();
   void StopIfNeeded();
@@ -129,6 +138,15 @@ class FtraceController {
   std::vector<std::unique_ptr<CpuReader>> cpu_readers_;
   std::set<FtraceDataSource*> data_sources_;
   std::set<FtraceDataSource*> started_data_sources_;
+
+  // State of the adaptive drain scheduling, reset on every StartIfNeeded().
+  uint64_t drain_seq_ = 0;  // Incremented on every DrainCPUs().
+  uint64_t last_drain_ms_ = 0;
+  double max_pages_per_sec_ = 0;  // Estimated rate of the busiest CPU.
+  size_t drain_watermark_pages_ = 0;
+  std::vector<uint64_t> last_overrun_;  // Last overrun sample for each CPU.
+  FtraceDrainStats drain_stats_ = {};
+
   base::WeakPtrFactory<FtraceController> weak_factory_;  // Keep last.
   PERFETTO_THREAD_CHECKER(thread_checker_)
 };
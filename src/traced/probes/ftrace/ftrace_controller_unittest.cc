@@ -218,12 +218,16 @@ class TestFtraceController : public FtraceController,
   uint64_t NowMs() const override { return now_ms; }
 
   uint32_t drain_period_ms() { return GetDrainPeriodMs(); }
+  uint32_t next_drain_delay_ms() { return GetNextDrainDelayMs(); }
+  void SimulateDrain(size_t pages) { UpdateDrainRate(pages); }
 
-  std::function<void()> GetDataAvailableCallback(size_t cpu) {
+  std::function<void()> GetDataAvailableCallback(size_t cpu,
+                                                 size_t pages_read = 1) {
     int generation = generation_;
     auto* thread_sync = &thread_sync_;
-    return [cpu, generation, thread_sync] {
-      FtraceController::OnCpuReaderRead(cpu, generation, thread_sync);
+    return [cpu, generation, pages_read, thread_sync] {
+      FtraceController::OnCpuReaderRead(cpu, generation, pages_read,
+                                        thread_sync);
     };
   }
 
@@ -546,6 +550,73 @@ TEST(FtraceControllerTest, PeriodicDrainConfig) {
   }
 }
 
+TEST(FtraceControllerTest, EarlyDrainAboveWatermark) {
+  auto controller =
+      CreateTestController(false /* nice runner */, true /* nice procfs */);
+
+  // The default 512KB buffer is 128 pages per cpu, the watermark is half.
+  FtraceConfig config = CreateFtraceConfig({"group/foo"});
+  auto data_source = controller->AddFakeDataSource(config);
+  ASSERT_TRUE(controller->StartDataSource(data_source.get()));
+
+  // Reading the whole watermark in one cycle should not wait for the drain
+  // period.
+  EXPECT_CALL(*controller->runner(), PostTask(_)).Times(1);
+  EXPECT_CALL(*controller->runner(), PostDelayedTask(_, _)).Times(0);
+  auto on_data_available = controller->GetDataAvailableCallback(0u, 64);
+  std::thread worker([on_data_available] { on_data_available(); });
+  controller->WaitForData(0u);
+  worker.join();
+
+  // Running the posted task drains straight away and then posts a task to
+  // unblock the readers.
+  EXPECT_CALL(*controller, OnDrainCpuForTesting(0u));
+  EXPECT_CALL(*controller->runner(), PostTask(_)).Times(1);
+  controller->runner()->RunLastTask();
+
+  FtraceStats stats{};
+  controller->DumpFtraceStats(&stats);
+  EXPECT_EQ(1u, stats.drain_stats.num_drains);
+  EXPECT_EQ(1u, stats.drain_stats.num_early_drains);
+
+  controller->runner()->TakeTask();
+  data_source.reset();
+}
+
+TEST(FtraceControllerTest, AdaptiveDrainPeriod) {
+  auto controller =
+      CreateTestController(true /* nice runner */, true /* nice procfs */);
+
+  FtraceConfig config = CreateFtraceConfig({"group/foo"});
+  config.set_drain_period_ms(100);
+  auto data_source = controller->AddFakeDataSource(config);
+  ASSERT_TRUE(controller->StartDataSource(data_source.get()));
+
+  // No data rate known yet -> the configured period.
+  EXPECT_EQ(100u, controller->next_drain_delay_ms());
+
+  // 128 pages every 100ms would fill the 64 pages watermark in 50ms.
+  controller->now_ms = 1000;
+  controller->SimulateDrain(1);
+  controller->now_ms = 1100;
+  controller->SimulateDrain(128);
+  EXPECT_EQ(50u, controller->next_drain_delay_ms());
+
+  // A single quiet cycle doesn't undo the burst straight away.
+  controller->now_ms = 1150;
+  controller->SimulateDrain(1);
+  EXPECT_EQ(100u, controller->next_drain_delay_ms());
+
+  // Once ftrace goes idle, back off up to 4x the configured period.
+  for (int i = 0; i < 10; i++) {
+    controller->now_ms += 100;
+    controller->SimulateDrain(1);
+  }
+  EXPECT_EQ(400u, controller->next_drain_delay_ms());
+
+  data_source.reset();
+}
+
 TEST(FtraceMetadataTest, Clear) {
   FtraceMetadata metadata;
   metadata.inode_and_device.push_back(std::make_pair(1, 1));
@@ -616,6 +687,32 @@ TEST(FtraceStatsTest, Write) {
   EXPECT_EQ(result.cpu(), 0);
   EXPECT_EQ(result.entries(), 1);
   EXPECT_EQ(result.overrun(), 2);
+  EXPECT_FALSE(result_packet->ftrace_stats().has_drain_stats());
+}
+
+TEST(FtraceStatsTest, WriteDrainStats) {
+  FtraceStats stats{};
+  stats.drain_stats.num_drains = 4;
+  stats.drain_stats.num_early_drains = 1;
+  stats.drain_stats.total_drain_latency_us = 400;
+  stats.drain_stats.max_drain_latency_us = 250;
+  stats.drain_stats.cur_drain_period_ms = 50;
+
+  std::unique_ptr<TraceWriterForTesting> writer =
+      std::unique_ptr<TraceWriterForTesting>(new TraceWriterForTesting());
+  {
+    auto packet = writer->NewTracePacket();
+    auto* out = packet->set_ftrace_stats();
+    stats.Write(out);
+  }
+
+  std::unique_ptr<protos::TracePacket> result_packet = writer->ParseProto();
+  auto result = result_packet->ftrace_stats().drain_stats();
+  EXPECT_EQ(result.num_drains(), 4u);
+  EXPECT_EQ(result.num_early_drains(), 1u);
+  EXPECT_EQ(result.total_drain_latency_us(), 400u);
+  EXPECT_EQ(result.max_drain_latency_us(), 250u);
+  EXPECT_EQ(result.cur_drain_period_ms(), 50u);
 }
 
 }  // namespace perfetto
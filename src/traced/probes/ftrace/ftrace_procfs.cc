@@ -77,6 +77,19 @@ bool FtraceProcfs::DisableEvent(const std::string& group,
   return WriteToFile(path, "0");
 }
 
+bool FtraceProcfs::SetEventFilter(const std::string& group,
+                                  const std::string& name,
+                                  const std::string& filter) {
+  std::string path = root_ + "events/" + group + "/" + name + "/filter";
+  return WriteToFile(path, filter);
+}
+
+bool FtraceProcfs::ClearEventFilter(const std::string& group,
+                                    const std::string& name) {
+  std::string path = root_ + "events/" + group + "/" + name + "/filter";
+  return WriteToFile(path, "0");
+}
+
 bool FtraceProcfs::DisableAllEvents() {
   std::string path = root_ + "events/enable";
   return WriteToFile(path, "0");
@@ -39,6 +39,17 @@ class FtraceProcfs {
   // Disable the event under with the given |group| and |name|.
   bool DisableEvent(const std::string& group, const std::string& name);
 
+  // Program the kernel-side filter of the event with the given |group| and
+  // |name|. |filter| uses the syntax of the per-event "filter" file, events
+  // that don't match it are discarded before reaching the ring buffer.
+  bool SetEventFilter(const std::string& group,
+                      const std::string& name,
+                      const std::string& filter);
+
+  // Remove the kernel-side filter of the event with the given |group| and
+  // |name|.
+  bool ClearEventFilter(const std::string& group, const std::string& name);
+
   // Disable all events by writing to the global enable file.
   bool DisableAllEvents();
 
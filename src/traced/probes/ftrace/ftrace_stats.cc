@@ -24,6 +24,8 @@ void FtraceStats::Write(protos::pbzero::FtraceStats* writer) const {
   for (const FtraceCpuStats& cpu_specific_stats : cpu_stats) {
     cpu_specific_stats.Write(writer->add_cpu_stats());
   }
+  if (drain_stats.num_drains)
+    drain_stats.Write(writer->set_drain_stats());
 }
 
 void FtraceCpuStats::Write(protos::pbzero::FtraceCpuStats* writer) const {
@@ -38,4 +40,15 @@ void FtraceCpuStats::Write(protos::pbzero::FtraceCpuStats* writer) const {
   writer->set_read_events(read_events);
 }
 
+void FtraceDrainStats::Write(protos::pbzero::FtraceDrainStats* writer) const {
+  writer->set_num_drains(num_drains);
+  writer->set_num_early_drains(num_early_drains);
+  writer->set_total_drain_latency_us(total_drain_latency_us);
+  writer->set_max_drain_latency_us(max_drain_latency_us);
+  writer->set_total_drain_duration_us(total_drain_duration_us);
+  writer->set_max_drain_duration_us(max_drain_duration_us);
+  writer->set_cur_drain_period_ms(cur_drain_period_ms);
+  writer->set_burst_overruns(burst_overruns);
+}
+
 }  // namespace perfetto
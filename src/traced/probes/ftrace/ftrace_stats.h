@@ -27,6 +27,7 @@ namespace protos {
 namespace pbzero {
 class FtraceStats;
 class FtraceCpuStats;
+class FtraceDrainStats;
 }  // namespace pbzero
 }  // namespace protos
 
@@ -44,8 +45,22 @@ struct FtraceCpuStats {
   void Write(protos::pbzero::FtraceCpuStats*) const;
 };
 
+struct FtraceDrainStats {
+  uint64_t num_drains;
+  uint64_t num_early_drains;
+  uint64_t total_drain_latency_us;
+  uint64_t max_drain_latency_us;
+  uint64_t total_drain_duration_us;
+  uint64_t max_drain_duration_us;
+  uint32_t cur_drain_period_ms;
+  uint64_t burst_overruns;
+
+  void Write(protos::pbzero::FtraceDrainStats*) const;
+};
+
 struct FtraceStats {
   std::vector<FtraceCpuStats> cpu_stats;
+  FtraceDrainStats drain_stats;
 
   void Write(protos::pbzero::FtraceStats*) const;
 };
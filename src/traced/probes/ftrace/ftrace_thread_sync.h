@@ -71,6 +71,20 @@ struct FtraceThreadSync {
   // This bitmap is cleared by the FtraceController before issuing a kFlush
   // command and set by each CpuReader after they have completed the flush.
   std::bitset<base::kMaxCpus> flush_acks;
+
+  // Set by the FtraceController when starting the CpuReader(s). If a CpuReader
+  // reads at least this many pages in one cycle, its kernel buffer is above
+  // the high watermark and the FtraceController drains immediately rather
+  // than at the end of the drain period. 0 disables early drains.
+  size_t early_drain_threshold_pages = 0;
+
+  // Set by the CpuReader that requests an early drain and cleared by the
+  // FtraceController when draining, to avoid posting one task per CPU.
+  bool early_drain_pending = false;
+
+  // Wall time (in ns) when the first CpuReader had data available after the
+  // last drain. Used to measure the drain latency.
+  uint64_t first_read_ns = 0;
 };
 
 }  // namespace perfetto
@@ -16,40 +16,54 @@
 
 #include "src/traced/probes/ftrace/page_pool.h"
 
-#include <array>
-
 namespace perfetto {
 
-namespace {
-constexpr size_t kMaxFreelistBlocks = 128;  // 128 * 32 * 4KB = 16MB.
+constexpr size_t PagePool::kReadyQueueCapacity;
+constexpr size_t PagePool::kFreelistCapacity;
+
+PagePool::BlockRing::BlockRing(size_t capacity)
+    : capacity_(capacity),
+      slots_(new base::Optional<PageBlock>[capacity]()) {
+  PERFETTO_CHECK(capacity && (capacity & (capacity - 1)) == 0);
 }
 
 void PagePool::NewPageBlock() {
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (freelist_.empty()) {
-    write_queue_.emplace_back(PageBlock::Create());
+  base::Optional<PageBlock> block = freelist_.Pop();
+  if (block) {
+    write_queue_.emplace_back(std::move(*block));
   } else {
-    write_queue_.emplace_back(std::move(freelist_.back()));
-    freelist_.pop_back();
+    write_queue_.emplace_back(PageBlock::Create());
   }
   PERFETTO_DCHECK(write_queue_.back().size() == 0);
 }
 
+size_t PagePool::CommitWrittenPages() {
+  PERFETTO_DCHECK_THREAD(writer_thread_);
+  size_t pages = 0;
+  auto it = write_queue_.begin();
+  for (; it != write_queue_.end(); ++it) {
+    size_t block_pages = it->size();
+    if (!ready_queue_.Push(&*it)) {
+      PERFETTO_DLOG("PagePool ready queue full, deferring commit");
+      break;
+    }
+    pages += block_pages;
+  }
+  write_queue_.erase(write_queue_.begin(), it);
+  return pages;
+}
+
 void PagePool::EndRead(std::vector<PageBlock> page_blocks) {
   PERFETTO_DCHECK_THREAD(reader_thread_);
-  for (PageBlock& page_block : page_blocks)
+  for (PageBlock& page_block : page_blocks) {
     page_block.Clear();
-
-  std::lock_guard<std::mutex> lock(mutex_);
-  freelist_.insert(freelist_.end(),
-                   std::make_move_iterator(page_blocks.begin()),
-                   std::make_move_iterator(page_blocks.end()));
-
-  // Even if blocks in the freelist don't waste any resident memory (because
-  // the Clear() call above madvise()s them) let's avoid that in pathological
-  // cases we keep accumulating virtual address space reservations.
-  if (freelist_.size() > kMaxFreelistBlocks)
-    freelist_.erase(freelist_.begin() + kMaxFreelistBlocks, freelist_.end());
+    // Even if blocks in the freelist don't waste any resident memory (because
+    // the Clear() call above madvise()s them) let's avoid that in pathological
+    // cases we keep accumulating virtual address space reservations: once the
+    // freelist is full the remaining blocks are freed.
+    if (!freelist_.Push(&page_block))
+      break;
+  }
 }
 
 }  // namespace perfetto
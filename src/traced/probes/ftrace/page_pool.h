@@ -19,7 +19,8 @@
 
 #include <stdint.h>
 
-#include <mutex>
+#include <atomic>
+#include <memory>
 #include <vector>
 
 #include "perfetto/base/logging.h"
@@ -33,7 +34,7 @@ namespace perfetto {
 // This class is a page pool tailored around the needs of the ftrace CpuReader.
 // It has two responsibilities:
 // 1) A cheap bump-pointer page allocator for the writing side of CpuReader.
-// 2) A thread-safe producer/consumer queue to synchronize the read/write
+// 2) A lock-free producer/consumer queue to synchronize the read/write
 //    threads of CpuReader.
 // For context, CpuReader (and hence this class) is used on two threads:
 // (1) A worker thread that writes into the buffer and (2) the main thread which
@@ -68,8 +69,12 @@ namespace perfetto {
 //      |                                             |
 //      +------------------------------- freelist <---+
 //                                  ~~~~~~~~~~~~~~~~~~~~~
-//                                  ~  mutex protected  ~
+//                                  ~   lock-free SPSC  ~
 //                                  ~~~~~~~~~~~~~~~~~~~~~
+//
+// The ready queue and the freelist are bounded single-producer/single-consumer
+// rings: the writer produces into the ready queue and consumes from the
+// freelist, the reader does the opposite. Neither side ever blocks the other.
 class PagePool {
  public:
   class PageBlock {
@@ -115,7 +120,61 @@ class PagePool {
     size_t size_ = 0;
   };
 
-  PagePool() {
+  // Lock-free bounded queue of PageBlock(s), for exactly one producer thread
+  // and one consumer thread.
+  class BlockRing {
+   public:
+    // |capacity| must be a power of two.
+    explicit BlockRing(size_t capacity);
+
+    // Producer side. Moves |*block| into the ring. Returns false, leaving
+    // |*block| untouched, if the ring is full.
+    bool Push(PageBlock* block) {
+      size_t tail = tail_.load(std::memory_order_relaxed);
+      if (tail - head_.load(std::memory_order_acquire) >= capacity_)
+        return false;
+      slots_[tail & (capacity_ - 1)] = std::move(*block);
+      tail_.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer side. Returns nullopt if the ring is empty.
+    base::Optional<PageBlock> Pop() {
+      size_t head = head_.load(std::memory_order_relaxed);
+      if (head == tail_.load(std::memory_order_acquire))
+        return base::nullopt;
+      base::Optional<PageBlock>& slot = slots_[head & (capacity_ - 1)];
+      base::Optional<PageBlock> block = std::move(slot);
+      slot.reset();
+      head_.store(head + 1, std::memory_order_release);
+      return block;
+    }
+
+    // Only exact if neither side is concurrently using the ring.
+    size_t size() const {
+      return tail_.load(std::memory_order_acquire) -
+             head_.load(std::memory_order_acquire);
+    }
+
+   private:
+    BlockRing(const BlockRing&) = delete;
+    BlockRing& operator=(const BlockRing&) = delete;
+
+    const size_t capacity_;
+    std::unique_ptr<base::Optional<PageBlock>[]> slots_;
+    std::atomic<size_t> head_{0};  // Written only by the consumer.
+    std::atomic<size_t> tail_{0};  // Written only by the producer.
+  };
+
+  // Max number of committed blocks not yet read. It exceeds the max size of
+  // the per-cpu kernel buffer, so the writer should never find it full.
+  static constexpr size_t kReadyQueueCapacity = 1024;  // 1024 * 128KB = 128MB.
+
+  // Blocks returned by EndRead() in excess of this are freed.
+  static constexpr size_t kFreelistCapacity = 128;  // 128 * 128KB = 16MB.
+
+  PagePool()
+      : ready_queue_(kReadyQueueCapacity), freelist_(kFreelistCapacity) {
     PERFETTO_DETACH_FROM_THREAD(writer_thread_);
     PERFETTO_DETACH_FROM_THREAD(reader_thread_);
   }
@@ -139,24 +198,24 @@ class PagePool {
     write_queue_.back().NextPage();
   }
 
-  // Makes all written pages available to the reader.
-  void CommitWrittenPages() {
-    PERFETTO_DCHECK_THREAD(writer_thread_);
-    std::lock_guard<std::mutex> lock(mutex_);
-    read_queue_.insert(read_queue_.end(),
-                       std::make_move_iterator(write_queue_.begin()),
-                       std::make_move_iterator(write_queue_.end()));
-    write_queue_.clear();
-  }
+  // Makes all written pages available to the reader. Returns the number of
+  // pages committed. If the ready queue is full (i.e. the reader is lagging
+  // behind by more than kReadyQueueCapacity blocks) the remaining pages are
+  // committed by the next call.
+  size_t CommitWrittenPages();
 
-  // Moves ownership of all the page blocks in the read queue to the caller.
+  // Moves ownership of all the page blocks in the ready queue to the caller.
   // The caller is expected to move them back after reading through EndRead().
   // PageBlocks will be freed if the caller doesn't call EndRead().
   std::vector<PageBlock> BeginRead() {
     PERFETTO_DCHECK_THREAD(reader_thread_);
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto res = std::move(read_queue_);
-    read_queue_.clear();
+    std::vector<PageBlock> res;
+    for (;;) {
+      base::Optional<PageBlock> block = ready_queue_.Pop();
+      if (!block)
+        break;
+      res.emplace_back(std::move(*block));
+    }
     return res;
   }
 
@@ -175,11 +234,9 @@ class PagePool {
   PERFETTO_THREAD_CHECKER(writer_thread_)
   std::vector<PageBlock> write_queue_;  // Accessed exclusively by the writer.
 
-  std::mutex mutex_;  // Protects both the read queue and the freelist.
-
   PERFETTO_THREAD_CHECKER(reader_thread_)
-  std::vector<PageBlock> read_queue_;  // Accessed by both threads.
-  std::vector<PageBlock> freelist_;    // Accessed by both threads.
+  BlockRing ready_queue_;  // Writer -> reader.
+  BlockRing freelist_;     // Reader -> writer.
 };
 
 }  // namespace perfetto
@@ -0,0 +1,127 @@
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/time.h"
+#include "src/traced/probes/ftrace/page_pool.h"
+
+namespace {
+
+using perfetto::PagePool;
+
+// Max number of blocks committed but not yet read back. Keeps the writer from
+// running away from the reader (and the latency from measuring the backlog).
+constexpr size_t kMaxBlocksInFlight = 64;
+
+constexpr size_t kMaxPagesPerCommit = 256;
+
+uint64_t NowNs() {
+  return static_cast<uint64_t>(perfetto::base::GetWallTimeNs().count());
+}
+
+}  // namespace
+
+// Write, commit, read and recycle state.range(0) pages on the same thread.
+// This is the fixed cost of the handoff when there is no contention.
+static void BM_PagePoolSingleThreaded(benchmark::State& state) {
+  PagePool pool;
+  const size_t pages_per_commit = static_cast<size_t>(state.range(0));
+  while (state.KeepRunning()) {
+    for (size_t i = 0; i < pages_per_commit; i++) {
+      uint8_t* page = pool.BeginWrite();
+      page[0] = 1;
+      pool.EndWrite();
+    }
+    pool.CommitWrittenPages();
+    auto blocks = pool.BeginRead();
+    benchmark::DoNotOptimize(blocks.data());
+    pool.EndRead(std::move(blocks));
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(pages_per_commit));
+}
+BENCHMARK(BM_PagePoolSingleThreaded)->Arg(1)->Arg(32)->Arg(256);
+
+// A writer thread writes pages and commits them in bursts of state.range(0)
+// pages while the benchmark thread reads them back as fast as possible, as
+// the CpuReader worker and the main thread do. Reports the read throughput and
+// the average latency between CommitWrittenPages() and BeginRead() returning
+// the page.
+static void BM_PagePoolContended(benchmark::State& state) {
+  PagePool pool;
+  const size_t pages_per_commit = static_cast<size_t>(state.range(0));
+  PERFETTO_CHECK(pages_per_commit <= kMaxPagesPerCommit);
+  std::atomic<bool> stop{false};
+  std::atomic<size_t> blocks_in_flight{0};
+
+  // Every commit starts a new block.
+  const size_t blocks_per_commit =
+      (pages_per_commit + PagePool::PageBlock::kPagesPerBlock - 1) /
+      PagePool::PageBlock::kPagesPerBlock;
+
+  std::thread writer([&pool, &stop, &blocks_in_flight, pages_per_commit,
+                      blocks_per_commit] {
+    while (!stop.load(std::memory_order_relaxed)) {
+      if (blocks_in_flight.load(std::memory_order_relaxed) +
+              blocks_per_commit >
+          kMaxBlocksInFlight) {
+        std::this_thread::yield();
+        continue;
+      }
+      uint8_t* pages[kMaxPagesPerCommit];
+      for (size_t i = 0; i < pages_per_commit; i++) {
+        pages[i] = pool.BeginWrite();
+        pool.EndWrite();
+      }
+      uint64_t commit_ns = NowNs();
+      for (size_t i = 0; i < pages_per_commit; i++)
+        memcpy(pages[i], &commit_ns, sizeof(commit_ns));
+      blocks_in_flight.fetch_add(blocks_per_commit, std::memory_order_relaxed);
+      pool.CommitWrittenPages();
+    }
+  });
+
+  uint64_t pages_read = 0;
+  uint64_t total_latency_ns = 0;
+  while (state.KeepRunning()) {
+    auto blocks = pool.BeginRead();
+    uint64_t now_ns = NowNs();
+    size_t pages = 0;
+    for (const auto& block : blocks) {
+      for (size_t i = 0; i < block.size(); i++) {
+        uint64_t commit_ns;
+        memcpy(&commit_ns, block.At(i), sizeof(commit_ns));
+        total_latency_ns += now_ns - commit_ns;
+      }
+      pages += block.size();
+    }
+    size_t num_blocks = blocks.size();
+    pool.EndRead(std::move(blocks));
+    blocks_in_flight.fetch_sub(num_blocks, std::memory_order_relaxed);
+    pages_read += pages;
+  }
+
+  stop = true;
+  writer.join();
+  state.SetItemsProcessed(static_cast<int64_t>(pages_read));
+  state.counters["latency_ns"] =
+      pages_read ? static_cast<double>(total_latency_ns / pages_read) : 0;
+}
+BENCHMARK(BM_PagePoolContended)->Arg(1)->Arg(32)->Arg(256)->UseRealTime();
@@ -65,6 +65,54 @@ TEST(PagePoolTest, SingleThreaded) {
   }
 }
 
+TEST(PagePoolTest, BlockRing) {
+  PagePool::BlockRing ring(4);
+  ASSERT_FALSE(ring.Pop());
+
+  std::vector<uint8_t*> pages;
+  for (size_t i = 0; i < 4; i++) {
+    PagePool::PageBlock block = PagePool::PageBlock::Create();
+    pages.push_back(block.At(0));
+    ASSERT_TRUE(ring.Push(&block));
+  }
+  ASSERT_EQ(ring.size(), 4u);
+
+  // A push on a full ring must leave the block with the caller.
+  PagePool::PageBlock extra_block = PagePool::PageBlock::Create();
+  uint8_t* extra_page = extra_block.At(0);
+  ASSERT_FALSE(ring.Push(&extra_block));
+  ASSERT_EQ(extra_block.At(0), extra_page);
+
+  // Blocks come out in FIFO order, also when wrapping around.
+  for (size_t i = 0; i < 4; i++) {
+    base::Optional<PagePool::PageBlock> block = ring.Pop();
+    ASSERT_TRUE(block);
+    ASSERT_EQ(block->At(0), pages[i]);
+    if (i == 0)
+      ASSERT_TRUE(ring.Push(&extra_block));
+  }
+  base::Optional<PagePool::PageBlock> block = ring.Pop();
+  ASSERT_TRUE(block);
+  ASSERT_EQ(block->At(0), extra_page);
+  ASSERT_FALSE(ring.Pop());
+  ASSERT_EQ(ring.size(), 0u);
+}
+
+TEST(PagePoolTest, FreelistIsBounded) {
+  PagePool pool;
+  const size_t kNumBlocks = PagePool::kFreelistCapacity + 2;
+  for (size_t i = 0; i < kNumBlocks * PagePool::PageBlock::kPagesPerBlock;
+       i++) {
+    pool.BeginWrite();
+    pool.EndWrite();
+  }
+  pool.CommitWrittenPages();
+  auto blocks = pool.BeginRead();
+  ASSERT_EQ(blocks.size(), kNumBlocks);
+  pool.EndRead(std::move(blocks));
+  ASSERT_EQ(pool.freelist_size_for_testing(), PagePool::kFreelistCapacity);
+}
+
 TEST(PagePoolTest, MultiThreaded) {
   PagePool pool;
 
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/traced/probes/metatrace/metatrace_data_source.h"
+
+#include "perfetto/base/task_runner.h"
+#include "perfetto/tracing/core/trace_writer.h"
+
+#include "perfetto/trace/perfetto_metatrace.pbzero.h"
+#include "perfetto/trace/trace_packet.pbzero.h"
+
+namespace perfetto {
+
+namespace {
+// Well within the time it takes the busiest threads to fill their ring.
+constexpr uint32_t kReadPeriodMs = 500;
+}  // namespace
+
+MetatraceDataSource::MetatraceDataSource(base::TaskRunner* task_runner,
+                                         TracingSessionID session_id,
+                                         std::unique_ptr<TraceWriter> writer)
+    : ProbesDataSource(session_id, kTypeId),
+      task_runner_(task_runner),
+      writer_(std::move(writer)),
+      weak_factory_(this) {}
+
+MetatraceDataSource::~MetatraceDataSource() {
+  if (enabled_)
+    base::metatrace::Disable();
+}
+
+base::WeakPtr<MetatraceDataSource> MetatraceDataSource::GetWeakPtr() const {
+  return weak_factory_.GetWeakPtr();
+}
+
+void MetatraceDataSource::Start() {
+  base::metatrace::Enable();
+  enabled_ = true;
+  Tick();
+}
+
+void MetatraceDataSource::Tick() {
+  auto weak_this = GetWeakPtr();
+  task_runner_->PostDelayedTask(
+      [weak_this] {
+        if (weak_this)
+          weak_this->Tick();
+      },
+      kReadPeriodMs);
+  WriteEvents();
+}
+
+void MetatraceDataSource::WriteEvents() {
+  uint64_t overruns = base::metatrace::ReadEvents(&records_);
+  for (const base::metatrace::Record& record : records_) {
+    auto packet = writer_->NewTracePacket();
+    packet->set_timestamp(record.timestamp_ns);
+    auto* event = packet->set_perfetto_metatrace();
+    event->set_event_id(record.event_id);
+    event->set_event_duration_ns(record.duration_ns);
+    event->set_thread_id(record.thread_id);
+    if (record.arg)
+      event->set_arg(record.arg);
+    if (overruns) {
+      event->set_overruns(static_cast<uint32_t>(overruns));
+      overruns = 0;
+    }
+  }
+  records_.clear();
+}
+
+void MetatraceDataSource::Flush(FlushRequestID,
+                                std::function<void()> callback) {
+  WriteEvents();
+  writer_->Flush(callback);
+}
+
+}  // namespace perfetto
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACED_PROBES_METATRACE_METATRACE_DATA_SOURCE_H_
+#define SRC_TRACED_PROBES_METATRACE_METATRACE_DATA_SOURCE_H_
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "perfetto/base/metatrace.h"
+#include "perfetto/base/weak_ptr.h"
+#include "perfetto/tracing/core/basic_types.h"
+#include "src/traced/probes/probes_data_source.h"
+
+namespace perfetto {
+
+class TraceWriter;
+namespace base {
+class TaskRunner;
+}
+
+// Writes the events of PERFETTO_METATRACE of traced_probes into the trace.
+// The service does the same for its own events, see
+// TracingServiceImpl::MaybeEmitMetatrace().
+class MetatraceDataSource : public ProbesDataSource {
+ public:
+  static constexpr int kTypeId = 6;
+
+  MetatraceDataSource(base::TaskRunner*,
+                      TracingSessionID,
+                      std::unique_ptr<TraceWriter> writer);
+  ~MetatraceDataSource() override;
+
+  base::WeakPtr<MetatraceDataSource> GetWeakPtr() const;
+
+  // ProbesDataSource implementation.
+  void Start() override;
+  void Flush(FlushRequestID, std::function<void()> callback) override;
+
+ private:
+  MetatraceDataSource(const MetatraceDataSource&) = delete;
+  MetatraceDataSource& operator=(const MetatraceDataSource&) = delete;
+
+  void Tick();
+  void WriteEvents();
+
+  base::TaskRunner* const task_runner_;
+  std::unique_ptr<TraceWriter> writer_;
+  bool enabled_ = false;
+  std::vector<base::metatrace::Record> records_;  // Reused across reads.
+  base::WeakPtrFactory<MetatraceDataSource> weak_factory_;  // Keep last.
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACED_PROBES_METATRACE_METATRACE_DATA_SOURCE_H_
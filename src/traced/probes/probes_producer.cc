@@ -35,6 +35,7 @@
 #include "perfetto/tracing/ipc/producer_ipc_client.h"
 #include "src/traced/probes/filesystem/inode_file_data_source.h"
 #include "src/traced/probes/ftrace/ftrace_data_source.h"
+#include "src/traced/probes/metatrace/metatrace_data_source.h"
 #include "src/traced/probes/power/android_power_data_source.h"
 #include "src/traced/probes/probes_data_source.h"
 
@@ -57,6 +58,7 @@ constexpr char kProcessStatsSourceName[] = "linux.process_stats";
 constexpr char kInodeMapSourceName[] = "linux.inode_file_map";
 constexpr char kSysStatsSourceName[] = "linux.sys_stats";
 constexpr char kAndroidPowerSourceName[] = "android.power";
+constexpr char kMetatraceSourceName[] = "perfetto.metatrace";
 
 }  // namespace.
 
@@ -110,6 +112,12 @@ void ProbesProducer::OnConnect() {
     desc.set_name(kAndroidPowerSourceName);
     endpoint_->RegisterDataSource(desc);
   }
+
+  {
+    DataSourceDescriptor desc;
+    desc.set_name(kMetatraceSourceName);
+    endpoint_->RegisterDataSource(desc);
+  }
 }
 
 void ProbesProducer::OnDisconnect() {
@@ -160,6 +168,8 @@ void ProbesProducer::SetupDataSource(DataSourceInstanceID instance_id,
     data_source = CreateSysStatsDataSource(session_id, instance_id, config);
   } else if (config.name() == kAndroidPowerSourceName) {
     data_source = CreateAndroidPowerDataSource(session_id, instance_id, config);
+  } else if (config.name() == kMetatraceSourceName) {
+    data_source = CreateMetatraceDataSource(session_id, instance_id, config);
   }
 
   if (!data_source) {
@@ -279,6 +289,16 @@ std::unique_ptr<SysStatsDataSource> ProbesProducer::CreateSysStatsDataSource(
                              endpoint_->CreateTraceWriter(buffer_id), config));
 }
 
+std::unique_ptr<MetatraceDataSource> ProbesProducer::CreateMetatraceDataSource(
+    TracingSessionID session_id,
+    DataSourceInstanceID id,
+    const DataSourceConfig& config) {
+  base::ignore_result(id);
+  auto buffer_id = static_cast<BufferID>(config.target_buffer());
+  return std::unique_ptr<MetatraceDataSource>(new MetatraceDataSource(
+      task_runner_, session_id, endpoint_->CreateTraceWriter(buffer_id)));
+}
+
 void ProbesProducer::StopDataSource(DataSourceInstanceID id) {
   PERFETTO_LOG("Producer stop (id=%" PRIu64 ")", id);
   auto it = data_sources_.find(id);
@@ -419,6 +439,7 @@ void ProbesProducer::OnFtraceDataWrittenIntoDataSourceBuffers() {
         break;
       }
       case SysStatsDataSource::kTypeId:
+      case MetatraceDataSource::kTypeId:
         break;
       default:
         PERFETTO_DFATAL("Invalid data source.");
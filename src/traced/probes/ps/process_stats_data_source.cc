@@ -16,9 +16,15 @@
 
 #include "src/traced/probes/ps/process_stats_data_source.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <limits>
 #include <utility>
 
 #include "perfetto/base/file_utils.h"
@@ -27,6 +33,7 @@
 #include "perfetto/base/string_splitter.h"
 #include "perfetto/base/task_runner.h"
 #include "perfetto/base/time.h"
+#include "perfetto/base/utils.h"
 
 #include "perfetto/trace/ps/process_stats.pbzero.h"
 #include "perfetto/trace/ps/process_tree.pbzero.h"
@@ -71,18 +78,34 @@ int32_t ReadNextNumericDir(DIR* dirp) {
   return 0;
 }
 
-inline int ToInt(const std::string& str) {
-  return atoi(str.c_str());
+// Parses the decimal number at the beginning of |str|, stopping at the first
+// non-digit character (e.g., the " kB" suffix of the memory counters).
+inline uint32_t ParseLeadingU32(const char* str, const char* end) {
+  uint32_t ret = 0;
+  for (; str < end && *str >= '0' && *str <= '9'; str++)
+    ret = ret * 10 + static_cast<uint32_t>(*str - '0');
+  return ret;
 }
 
-inline uint32_t ToU32(const char* str) {
-  return static_cast<uint32_t>(strtol(str, nullptr, 10));
+// Size of the buffer used to read /proc/<pid>/* files. /proc/<pid>/status is
+// ~1.5KB, longer cmdlines are truncated.
+constexpr size_t kReadBufSize = 4 * base::kPageSize;
+
+// FNV-1a, used to detect cmdline changes without caching the whole cmdline.
+inline uint64_t HashCmdline(const char* cmdline, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<uint8_t>(cmdline[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
 }
 
 }  // namespace
 
 // static
 constexpr int ProcessStatsDataSource::kTypeId;
+constexpr size_t ProcessStatsDataSource::kMaxScanEntriesPerTask;
 
 ProcessStatsDataSource::ProcessStatsDataSource(
     base::TaskRunner* task_runner,
@@ -92,6 +115,7 @@ ProcessStatsDataSource::ProcessStatsDataSource(
     : ProbesDataSource(session_id, kTypeId),
       task_runner_(task_runner),
       writer_(std::move(writer)),
+      read_buf_(new char[kReadBufSize]),
       record_thread_names_(config.process_stats_config().record_thread_names()),
       dump_all_procs_on_start_(
           config.process_stats_config().scan_all_processes_on_start()),
@@ -108,6 +132,10 @@ ProcessStatsDataSource::ProcessStatsDataSource(
                   poll_period_ms_);
     poll_period_ms_ = 100;
   }
+  if (poll_period_ms_ && ps_config.proc_stats_cache_ttl_ms()) {
+    cache_ttl_polls_ =
+        std::max(1u, ps_config.proc_stats_cache_ttl_ms() / poll_period_ms_);
+  }
 }
 
 ProcessStatsDataSource::~ProcessStatsDataSource() = default;
@@ -128,37 +156,89 @@ base::WeakPtr<ProcessStatsDataSource> ProcessStatsDataSource::GetWeakPtr()
 }
 
 void ProcessStatsDataSource::WriteAllProcesses() {
-  PERFETTO_METATRACE("WriteAllProcesses", 0);
   PERFETTO_DCHECK(!cur_ps_tree_);
-  base::ScopedDir proc_dir = OpenProcDir();
-  if (!proc_dir)
+  if (scan_proc_dir_)
+    return;  // A scan is already in progress.
+  scan_proc_dir_ = OpenProcDir();
+  if (!scan_proc_dir_)
     return;
-  while (int32_t pid = ReadNextNumericDir(*proc_dir)) {
-    WriteProcessOrThread(pid);
-    char task_path[255];
-    sprintf(task_path, "/proc/%d/task", pid);
-    base::ScopedDir task_dir(opendir(task_path));
-    if (!task_dir)
-      continue;
+  if (!ScanProcesses(kMaxScanEntriesPerTask)) {
+    task_runner_->PostTask(
+        std::bind(&ProcessStatsDataSource::ScanProcessesTask, GetWeakPtr()));
+  }
+}
+
+// static
+void ProcessStatsDataSource::ScanProcessesTask(
+    base::WeakPtr<ProcessStatsDataSource> weak_this) {
+  if (!weak_this)
+    return;
+  if (!weak_this->ScanProcesses(kMaxScanEntriesPerTask)) {
+    weak_this->task_runner_->PostTask(
+        std::bind(&ProcessStatsDataSource::ScanProcessesTask, weak_this));
+  }
+}
 
-    while (int32_t tid = ReadNextNumericDir(*task_dir)) {
-      if (tid == pid)
+bool ProcessStatsDataSource::ScanProcesses(size_t max_entries) {
+  if (!scan_proc_dir_)
+    return true;
+  PERFETTO_METATRACE(PS_WRITE_ALL_PROCESSES, 0);
+  size_t entries = 0;
+  bool done = false;
+  while (entries < max_entries) {
+    if (scan_task_dir_) {
+      int32_t tid = ReadNextNumericDir(*scan_task_dir_);
+      if (!tid) {
+        scan_task_dir_.reset();
+        continue;
+      }
+      // The thread might have been written by OnPids() in the meantime.
+      if (tid == scan_pid_ || seen_pids_.count(tid))
         continue;
+      entries++;
       if (record_thread_names_) {
         WriteProcessOrThread(tid);
       } else {
         // If we are not interested in thread names, there is no need to open
         // a proc file for each thread. We can save time and directly write the
         // thread record.
-        WriteThread(tid, pid, /*optional_name=*/nullptr);
+        WriteThread(tid, scan_pid_, /*optional_name=*/nullptr);
       }
+      continue;
+    }
+
+    int32_t pid = ReadNextNumericDir(*scan_proc_dir_);
+    if (!pid) {
+      done = true;
+      break;
+    }
+    entries++;
+    // The process might have been written by OnPids() in the meantime.
+    if (!seen_pids_.count(pid))
+      WriteProcessOrThread(pid);
+    char task_path[32];
+    sprintf(task_path, "%d/task", pid);
+    int task_fd = openat(dirfd(*scan_proc_dir_), task_path,
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd < 0)
+      continue;
+    scan_task_dir_.reset(fdopendir(task_fd));
+    if (!scan_task_dir_) {
+      close(task_fd);
+      continue;
     }
+    scan_pid_ = pid;
   }
   FinalizeCurPacket();
+  if (done) {
+    scan_task_dir_.reset();
+    scan_proc_dir_.reset();
+  }
+  return done;
 }
 
 void ProcessStatsDataSource::OnPids(const std::vector<int32_t>& pids) {
-  PERFETTO_METATRACE("OnPids", 0);
+  PERFETTO_METATRACE(PS_ON_PIDS, 0);
   if (!enable_on_demand_dumps_)
     return;
   PERFETTO_DCHECK(!cur_ps_tree_);
@@ -175,42 +255,45 @@ void ProcessStatsDataSource::Flush(FlushRequestID,
   // We shouldn't get this in the middle of WriteAllProcesses() or OnPids().
   PERFETTO_DCHECK(!cur_ps_tree_);
   PERFETTO_DCHECK(!cur_ps_stats_);
+  // Complete any pending process scan, so that the flushed data contains it.
+  ScanProcesses(std::numeric_limits<size_t>::max());
   writer_->Flush(callback);
 }
 
 void ProcessStatsDataSource::WriteProcessOrThread(int32_t pid) {
-  std::string proc_status = ReadProcPidFile(pid, "status");
-  if (proc_status.empty())
+  ProcStatus proc_status;
+  if (!ReadProcStatus(pid, &proc_status))
     return;
-  int tgid = ToInt(ReadProcStatusEntry(proc_status, "Tgid:"));
+  int32_t tgid = proc_status.tgid;
   if (tgid <= 0)
     return;
   if (!seen_pids_.count(tgid))
     WriteProcess(tgid, proc_status);
   if (pid != tgid) {
     PERFETTO_DCHECK(!seen_pids_.count(pid));
-    std::string thread_name;
-    if (record_thread_names_)
-      thread_name = ReadProcStatusEntry(proc_status, "Name:");
-    WriteThread(pid, tgid, thread_name.empty() ? nullptr : thread_name.c_str());
+    const char* thread_name = nullptr;
+    if (record_thread_names_ && proc_status.name[0])
+      thread_name = proc_status.name;
+    WriteThread(pid, tgid, thread_name);
   }
 }
 
 void ProcessStatsDataSource::WriteProcess(int32_t pid,
-                                          const std::string& proc_status) {
-  PERFETTO_DCHECK(ToInt(ReadProcStatusEntry(proc_status, "Tgid:")) == pid);
+                                          const ProcStatus& proc_status) {
+  PERFETTO_DCHECK(proc_status.tgid == pid);
   auto* proc = GetOrCreatePsTree()->add_processes();
   proc->set_pid(pid);
-  proc->set_ppid(ToInt(ReadProcStatusEntry(proc_status, "PPid:")));
+  proc->set_ppid(proc_status.ppid);
 
-  std::string cmdline = ReadProcPidFile(pid, "cmdline");
-  if (!cmdline.empty()) {
+  char* cmdline = read_buf_.get();
+  size_t cmdline_size = ReadProcPidFile(pid, "cmdline", cmdline, kReadBufSize);
+  if (cmdline_size) {
     using base::StringSplitter;
-    for (StringSplitter ss(&cmdline[0], cmdline.size(), '\0'); ss.Next();)
-      proc->add_cmdline(ss.cur_token());
+    for (StringSplitter ss(cmdline, cmdline_size, '\0'); ss.Next();)
+      proc->add_cmdline(ss.cur_token(), ss.cur_token_size());
   } else {
     // Nothing in cmdline so use the thread name instead (which is == "comm").
-    proc->add_cmdline(ReadProcStatusEntry(proc_status, "Name:").c_str());
+    proc->add_cmdline(proc_status.name);
   }
   seen_pids_.emplace(pid);
 }
@@ -224,6 +307,9 @@ void ProcessStatsDataSource::WriteThread(int32_t tid,
   if (optional_name)
     thread->set_name(optional_name);
   seen_pids_.emplace(tid);
+  // In delta mode, processes can be forgotten together with their threads.
+  if (cache_ttl_polls_ > 0)
+    seen_threads_[tgid].push_back(tid);
 }
 
 base::ScopedDir ProcessStatsDataSource::OpenProcDir() {
@@ -233,27 +319,115 @@ base::ScopedDir ProcessStatsDataSource::OpenProcDir() {
   return proc_dir;
 }
 
-std::string ProcessStatsDataSource::ReadProcPidFile(int32_t pid,
-                                                    const std::string& file) {
-  std::string contents;
-  contents.reserve(4096);
-  if (!base::ReadFile("/proc/" + std::to_string(pid) + "/" + file, &contents))
-    return "";
-  return contents;
+size_t ProcessStatsDataSource::ReadProcPidFile(int32_t pid,
+                                               const char* file,
+                                               char* buf,
+                                               size_t buf_size) {
+  PERFETTO_DCHECK(buf_size > 0);
+  buf[0] = '\0';
+  if (!proc_dir_fd_) {
+    base::ScopedDir proc_dir = OpenProcDir();
+    if (!proc_dir)
+      return 0;
+    proc_dir_fd_.reset(dup(dirfd(*proc_dir)));
+    if (!proc_dir_fd_)
+      return 0;
+  }
+  char path[64];
+  snprintf(path, sizeof(path), "%d/%s", pid, file);
+  base::ScopedFile fd(openat(*proc_dir_fd_, path, O_RDONLY | O_CLOEXEC));
+  if (!fd)
+    return 0;
+  size_t size = 0;
+  while (size < buf_size - 1) {
+    ssize_t rsize = PERFETTO_EINTR(read(*fd, buf + size, buf_size - 1 - size));
+    if (rsize <= 0)
+      break;
+    size += static_cast<size_t>(rsize);
+  }
+  buf[size] = '\0';
+  return size;
 }
 
-std::string ProcessStatsDataSource::ReadProcStatusEntry(const std::string& buf,
-                                                        const char* key) {
-  auto begin = buf.find(key);
-  if (begin == std::string::npos)
-    return "";
-  begin = buf.find_first_not_of(" \t", begin + strlen(key));
-  if (begin == std::string::npos)
-    return "";
-  auto end = buf.find('\n', begin);
-  if (end == std::string::npos || end <= begin)
-    return "";
-  return buf.substr(begin, end - begin);
+bool ProcessStatsDataSource::ReadProcStatus(int32_t pid,
+                                            ProcStatus* proc_status) {
+  size_t size = ReadProcPidFile(pid, "status", read_buf_.get(), kReadBufSize);
+  if (!size)
+    return false;
+  ParseProcStatus(read_buf_.get(), size, proc_status);
+  return true;
+}
+
+// static
+void ProcessStatsDataSource::ParseProcStatus(const char* buf,
+                                             size_t size,
+                                             ProcStatus* out) {
+  // /proc/[pid]/status looks like this:
+  // Name:   cat
+  // Umask:  0027
+  // State:  R (running)
+  // Tgid:   6790
+  // ...
+  // PPid:   6776
+  // ...
+  // VmPeak:     5992 kB
+  // VmSize:     5992 kB
+  // VmLck:         0 kB
+  // ...
+  struct MemCounterKey {
+    const char* key;
+    size_t key_len;
+    ProcStatus::MemCounter counter;
+  };
+  static const MemCounterKey kMemCounterKeys[] = {
+      {"VmSize", 6, ProcStatus::kVmSize},
+      {"VmLck", 5, ProcStatus::kVmLck},
+      {"VmHWM", 5, ProcStatus::kVmHWM},
+      {"VmRSS", 5, ProcStatus::kVmRSS},
+      {"RssAnon", 7, ProcStatus::kRssAnon},
+      {"RssFile", 7, ProcStatus::kRssFile},
+      {"RssShmem", 8, ProcStatus::kRssShmem},
+      {"VmSwap", 6, ProcStatus::kVmSwap},
+  };
+
+  out->name[0] = '\0';
+  out->tgid = 0;
+  out->ppid = 0;
+  out->mem_counters_present = 0;
+  const char* const buf_end = buf + size;
+  for (const char* line = buf; line < buf_end;) {
+    const char* line_end = static_cast<const char*>(
+        memchr(line, '\n', static_cast<size_t>(buf_end - line)));
+    if (!line_end)
+      line_end = buf_end;
+    const char* colon = static_cast<const char*>(
+        memchr(line, ':', static_cast<size_t>(line_end - line)));
+    if (colon) {
+      size_t key_len = static_cast<size_t>(colon - line);
+      const char* value = colon + 1;
+      while (value < line_end && (*value == ' ' || *value == '\t'))
+        value++;
+      if (key_len == 4 && memcmp(line, "Name", 4) == 0) {
+        size_t len = std::min(static_cast<size_t>(line_end - value),
+                              sizeof(out->name) - 1);
+        memcpy(out->name, value, len);
+        out->name[len] = '\0';
+      } else if (key_len == 4 && memcmp(line, "Tgid", 4) == 0) {
+        out->tgid = static_cast<int32_t>(ParseLeadingU32(value, line_end));
+      } else if (key_len == 4 && memcmp(line, "PPid", 4) == 0) {
+        out->ppid = static_cast<int32_t>(ParseLeadingU32(value, line_end));
+      } else if (key_len >= 5 && (line[0] == 'V' || line[0] == 'R')) {
+        for (const MemCounterKey& k : kMemCounterKeys) {
+          if (k.key_len != key_len || memcmp(line, k.key, key_len) != 0)
+            continue;
+          out->mem_counters_kb[k.counter] = ParseLeadingU32(value, line_end);
+          out->mem_counters_present |= 1u << k.counter;
+          break;
+        }
+      }
+    }
+    line = line_end + 1;
+  }
 }
 
 void ProcessStatsDataSource::StartNewPacketIfNeeded() {
@@ -303,32 +477,91 @@ void ProcessStatsDataSource::Tick(
 
 void ProcessStatsDataSource::WriteAllProcessStats() {
   // TODO(primiano): implement whitelisting of processes by names.
-  // TODO(primiano): Have a pid cache to avoid wasting cycles reading kthreads
-  // proc files over and over. Same for non-whitelist processes (see above).
 
-  PERFETTO_METATRACE("WriteAllProcessStats", 0);
+  PERFETTO_METATRACE(PS_WRITE_ALL_PROCESS_STATS, 0);
   base::ScopedDir proc_dir = OpenProcDir();
   if (!proc_dir)
     return;
+
+  // In delta mode, every |cache_ttl_polls_| polls all the counters are
+  // re-emitted, as if the cache was empty.
+  const bool delta_mode = cache_ttl_polls_ > 0;
+  const bool full_poll = !delta_mode || poll_count_ % cache_ttl_polls_ == 0;
+  poll_count_++;
+  if (delta_mode && full_poll) {
+    // Kernel threads can exit and their pid be reused by a process.
+    pids_to_skip_.clear();
+  }
+
   std::vector<int32_t> pids;
+  ProcStatus proc_status;
   while (int32_t pid = ReadNextNumericDir(*proc_dir)) {
     uint32_t pid_u = static_cast<uint32_t>(pid);
     if (pids_to_skip_.size() > pid_u && pids_to_skip_[pid_u])
       continue;
-    std::string proc_status = ReadProcPidFile(pid, "status");
-    if (proc_status.empty())
+
+    CachedProcessStats* cached = nullptr;
+    bool cache_hit = false;
+    if (delta_mode) {
+      auto it_and_inserted =
+          process_stats_cache_.emplace(pid, CachedProcessStats{});
+      cached = &it_and_inserted.first->second;
+      cache_hit = !it_and_inserted.second;
+      cached->last_poll = poll_count_;
+      uint32_t statm[3] = {};
+      bool has_statm = ReadProcStatm(pid, statm);
+      if (has_statm && cache_hit && !full_poll &&
+          memcmp(statm, cached->statm, sizeof(statm)) == 0) {
+        continue;  // Very likely none of the counters changed.
+      }
+      memcpy(cached->statm, statm, sizeof(statm));
+      if (full_poll)
+        cached->mem_counters_present = 0;
+    }
+
+    // If the process exited after the readdir() above, or became a zombie,
+    // it is reported as exited if its counters had been written. Either way
+    // it is dropped from the cache.
+    if (!ReadProcStatus(pid, &proc_status)) {
+      if (cached) {
+        if (cache_hit)
+          WriteExitedProcess(pid);
+        process_stats_cache_.erase(pid);
+      }
       continue;
-    if (!WriteProcessStats(pid, proc_status)) {
+    }
+    if (!WriteProcessStats(pid, proc_status, cached)) {
       // If WriteProcessStats() fails the pid is very likely a kernel thread
       // that has a valid /proc/[pid]/status but no memory values. In this
       // case avoid keep polling it over and over.
       if (pids_to_skip_.size() <= pid_u)
         pids_to_skip_.resize(pid_u + 1);
       pids_to_skip_[pid_u] = true;
+      if (cached) {
+        if (cache_hit)
+          WriteExitedProcess(pid);
+        process_stats_cache_.erase(pid);
+      }
       continue;
     }
+    if (cached) {
+      char* cmdline = read_buf_.get();
+      size_t cmdline_size =
+          ReadProcPidFile(pid, "cmdline", cmdline, kReadBufSize);
+      uint64_t cmdline_hash = HashCmdline(cmdline, cmdline_size);
+      // A process that changed name or cmdline (e.g. after an exec()) is
+      // dumped again.
+      if (cache_hit && (strcmp(cached->name, proc_status.name) != 0 ||
+                        cached->cmdline_hash != cmdline_hash)) {
+        ForgetProcess(pid);
+      }
+      memcpy(cached->name, proc_status.name, sizeof(cached->name));
+      cached->cmdline_hash = cmdline_hash;
+    }
     pids.push_back(pid);
   }
+  if (delta_mode)
+    WriteExitedProcesses();
   FinalizeCurPacket();
 
   // Ensure that we write once long-term process info (e.g., name) for new pids
@@ -336,93 +569,117 @@ void ProcessStatsDataSource::WriteAllProcessStats() {
   OnPids(pids);
 }
 
+// Emits and forgets the processes in |process_stats_cache_| that were not
+// found in /proc by the current poll.
+void ProcessStatsDataSource::WriteExitedProcesses() {
+  for (auto it = process_stats_cache_.begin();
+       it != process_stats_cache_.end();) {
+    if (it->second.last_poll == poll_count_) {
+      ++it;
+      continue;
+    }
+    WriteExitedProcess(it->first);
+    it = process_stats_cache_.erase(it);
+  }
+}
+
+void ProcessStatsDataSource::WriteExitedProcess(int32_t pid) {
+  GetOrCreateStats()->add_exited_pids(pid);
+  // The pid can be reused by a new process, which will need to be dumped.
+  ForgetProcess(pid);
+}
+
+void ProcessStatsDataSource::ForgetProcess(int32_t pid) {
+  seen_pids_.erase(pid);
+  auto it = seen_threads_.find(pid);
+  if (it == seen_threads_.end())
+    return;
+  for (int32_t tid : it->second)
+    seen_pids_.erase(tid);
+  seen_threads_.erase(it);
+}
+
+// Reads the size, resident and shared fields of /proc/|pid|/statm.
+bool ProcessStatsDataSource::ReadProcStatm(int32_t pid, uint32_t statm[3]) {
+  char buf[128];
+  size_t size = ReadProcPidFile(pid, "statm", buf, sizeof(buf));
+  if (!size)
+    return false;
+  const char* s = buf;
+  for (size_t i = 0; i < 3; i++) {
+    char* end = nullptr;
+    unsigned long value = strtoul(s, &end, 10);
+    if (end == s)
+      return false;
+    statm[i] = static_cast<uint32_t>(value);
+    s = end;
+  }
+  return true;
+}
+
 // Returns true if the stats for the given |pid| have been written, false it
 // it failed (e.g., |pid| was a kernel thread and, as such, didn't report any
-// memory counters).
+// memory counters). If |cached| is not null, only the counters that differ
+// from it are written, and |cached| is updated.
 bool ProcessStatsDataSource::WriteProcessStats(int32_t pid,
-                                               const std::string& proc_status) {
-  // The MemCounters entry for a process is created lazily on the first call.
-  // This is to prevent creating empty entries that have only a pid for
-  // kernel threads and other /proc/[pid] entries that have no counters
-  // associated.
-  bool proc_status_has_mem_counters = false;
-  protos::pbzero::ProcessStats::MemCounters* mem_counters = nullptr;
-  auto get_counters_lazy = [this, &mem_counters, pid] {
-    if (!mem_counters) {
-      mem_counters = GetOrCreateStats()->add_mem_counters();
-      mem_counters->set_pid(pid);
-    }
-    return mem_counters;
-  };
-
-  // Parse /proc/[pid]/status, which looks like this:
-  // Name:   cat
-  // Umask:  0027
-  // State:  R (running)
-  // FDSize: 256
-  // Groups: 4 20 24 46 997
-  // VmPeak:     5992 kB
-  // VmSize:     5992 kB
-  // VmLck:         0 kB
-  // ...
-  std::vector<char> key;
-  std::vector<char> value;
-  enum { kKey, kSeparator, kValue } state = kKey;
-  for (char c : proc_status) {
-    if (c == '\n') {
-      key.push_back('\0');
-      value.push_back('\0');
-
-      // |value| will contain "1234 KB". We rely on strtol() (in ToU32()) to
-      // stop parsing at the first non-numeric character.
-      if (strcmp(key.data(), "VmSize") == 0) {
-        // Assume that if we see VmSize we'll see also the others.
-        proc_status_has_mem_counters = true;
-        get_counters_lazy()->set_vm_size_kb(ToU32(value.data()));
-      } else if (strcmp(key.data(), "VmLck") == 0) {
-        get_counters_lazy()->set_vm_locked_kb(ToU32(value.data()));
-      } else if (strcmp(key.data(), "VmHWM") == 0) {
-        get_counters_lazy()->set_vm_hwm_kb(ToU32(value.data()));
-      } else if (strcmp(key.data(), "VmRSS") == 0) {
-        get_counters_lazy()->set_vm_rss_kb(ToU32(value.data()));
-      } else if (strcmp(key.data(), "RssAnon") == 0) {
-        get_counters_lazy()->set_rss_anon_kb(ToU32(value.data()));
-      } else if (strcmp(key.data(), "RssFile") == 0) {
-        get_counters_lazy()->set_rss_file_kb(ToU32(value.data()));
-      } else if (strcmp(key.data(), "RssShmem") == 0) {
-        get_counters_lazy()->set_rss_shmem_kb(ToU32(value.data()));
-      } else if (strcmp(key.data(), "VmSwap") == 0) {
-        get_counters_lazy()->set_vm_swap_kb(ToU32(value.data()));
-      }
+                                               const ProcStatus& proc_status,
+                                               CachedProcessStats* cached) {
+  // Don't create empty entries that have only a pid for kernel threads and
+  // other /proc/[pid] entries that have no counters associated.
+  if (!proc_status.mem_counters_present)
+    return false;
 
-      key.clear();
-      state = kKey;
+  protos::pbzero::ProcessStats::MemCounters* mem_counters = nullptr;
+  for (uint32_t i = 0; i < ProcStatus::kNumMemCounters; i++) {
+    const uint32_t bit = 1u << i;
+    if (!(proc_status.mem_counters_present & bit))
       continue;
-    }
-
-    if (state == kKey) {
-      if (c == ':') {
-        state = kSeparator;
+    const uint32_t kb = proc_status.mem_counters_kb[i];
+    if (cached) {
+      if ((cached->mem_counters_present & bit) &&
+          cached->mem_counters_kb[i] == kb) {
         continue;
       }
-      key.push_back(c);
-      continue;
+      cached->mem_counters_present |= bit;
+      cached->mem_counters_kb[i] = kb;
     }
-
-    if (state == kSeparator) {
-      if (isspace(c))
-        continue;
-      value.clear();
-      value.push_back(c);
-      state = kValue;
-      continue;
+    if (!mem_counters) {
+      mem_counters = GetOrCreateStats()->add_mem_counters();
+      mem_counters->set_pid(pid);
     }
-
-    if (state == kValue) {
-      value.push_back(c);
+    switch (static_cast<ProcStatus::MemCounter>(i)) {
+      case ProcStatus::kVmSize:
+        mem_counters->set_vm_size_kb(kb);
+        break;
+      case ProcStatus::kVmLck:
+        mem_counters->set_vm_locked_kb(kb);
+        break;
+      case ProcStatus::kVmHWM:
+        mem_counters->set_vm_hwm_kb(kb);
+        break;
+      case ProcStatus::kVmRSS:
+        mem_counters->set_vm_rss_kb(kb);
+        break;
+      case ProcStatus::kRssAnon:
+        mem_counters->set_rss_anon_kb(kb);
+        break;
+      case ProcStatus::kRssFile:
+        mem_counters->set_rss_file_kb(kb);
+        break;
+      case ProcStatus::kRssShmem:
+        mem_counters->set_rss_shmem_kb(kb);
+        break;
+      case ProcStatus::kVmSwap:
+        mem_counters->set_vm_swap_kb(kb);
+        break;
+      case ProcStatus::kNumMemCounters:
+        PERFETTO_DCHECK(false);
+        break;
     }
   }
-  return proc_status_has_mem_counters;
+
+  // Assume that if we see VmSize we'll see also the others.
+  return (proc_status.mem_counters_present & (1u << ProcStatus::kVmSize)) != 0;
 }
 
 }  // namespace perfetto
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 #include "perfetto/base/scoped_file.h"
@@ -52,6 +53,10 @@ class ProcessStatsDataSource : public ProbesDataSource {
   ~ProcessStatsDataSource() override;
 
   base::WeakPtr<ProcessStatsDataSource> GetWeakPtr() const;
+
+  // Writes the process tree of all the processes and threads in /proc. On
+  // large systems the scan is split in several tasks, to avoid stalling the
+  // task runner for too long.
   void WriteAllProcesses();
   void OnPids(const std::vector<int32_t>& pids);
 
@@ -63,9 +68,53 @@ class ProcessStatsDataSource : public ProbesDataSource {
 
   // Virtual for testing.
   virtual base::ScopedDir OpenProcDir();
-  virtual std::string ReadProcPidFile(int32_t pid, const std::string& file);
+
+  // Reads /proc/|pid|/|file| into |buf|, truncating it to |buf_size| - 1
+  // bytes. Returns the number of bytes read (the content is always
+  // NUL-terminated), 0 on failure.
+  virtual size_t ReadProcPidFile(int32_t pid,
+                                 const char* file,
+                                 char* buf,
+                                 size_t buf_size);
+
+  // Max number of /proc entries processed by each task of WriteAllProcesses().
+  static constexpr size_t kMaxScanEntriesPerTask = 512;
 
  private:
+  // Fields of /proc/<pid>/status, as filled by ParseProcStatus().
+  struct ProcStatus {
+    enum MemCounter {
+      kVmSize = 0,
+      kVmLck,
+      kVmHWM,
+      kVmRSS,
+      kRssAnon,
+      kRssFile,
+      kRssShmem,
+      kVmSwap,
+      kNumMemCounters
+    };
+
+    char name[64];  // Truncated if longer, always NUL-terminated.
+    int32_t tgid;
+    int32_t ppid;
+    uint32_t mem_counters_kb[kNumMemCounters];
+    uint32_t mem_counters_present;  // Bitmap of MemCounter.
+  };
+
+  // Last state emitted for a process in the delta mode of the periodic
+  // stats (see |proc_stats_cache_ttl_ms| in process_stats_config.proto).
+  struct CachedProcessStats {
+    // size, resident and shared pages from /proc/<pid>/statm. Cheaper to read
+    // than /proc/<pid>/status: if they didn't change, the status is not read.
+    uint32_t statm[3];
+    char name[sizeof(ProcStatus::name)];
+    uint64_t cmdline_hash;
+    uint32_t mem_counters_kb[ProcStatus::kNumMemCounters];
+    uint32_t mem_counters_present;  // Bitmap of ProcStatus::MemCounter.
+    uint32_t last_poll;  // Value of |poll_count_| when last seen in /proc.
+  };
+
   // Common functions.
   ProcessStatsDataSource(const ProcessStatsDataSource&) = delete;
   ProcessStatsDataSource& operator=(const ProcessStatsDataSource&) = delete;
@@ -75,22 +124,50 @@ class ProcessStatsDataSource : public ProbesDataSource {
   protos::pbzero::ProcessTree* GetOrCreatePsTree();
   protos::pbzero::ProcessStats* GetOrCreateStats();
 
+  // Parses /proc/<pid>/status in a single pass. Missing fields are left
+  // zeroed (or, for the memory counters, not marked as present).
+  static void ParseProcStatus(const char* buf, size_t size, ProcStatus*);
+
+  // Reads and parses /proc/|pid|/status using |read_buf_|. Returns false if
+  // the file can't be read.
+  bool ReadProcStatus(int32_t pid, ProcStatus*);
+
   // Functions for snapshotting process/thread long-term info and relationships.
-  void WriteProcess(int32_t pid, const std::string& proc_status);
+  void WriteProcess(int32_t pid, const ProcStatus&);
   void WriteThread(int32_t tid, int32_t tgid, const char* optional_name);
   void WriteProcessOrThread(int32_t pid);
-  std::string ReadProcStatusEntry(const std::string& buf, const char* key);
+
+  // Processes up to |max_entries| entries of the /proc scan started by
+  // WriteAllProcesses(). Returns true when the scan is complete.
+  bool ScanProcesses(size_t max_entries);
+  static void ScanProcessesTask(base::WeakPtr<ProcessStatsDataSource>);
 
   // Functions for periodically sampling process stats/counters.
   static void Tick(base::WeakPtr<ProcessStatsDataSource>);
   void WriteAllProcessStats();
-  bool WriteProcessStats(int32_t pid, const std::string& proc_status);
+  bool WriteProcessStats(int32_t pid,
+                         const ProcStatus&,
+                         CachedProcessStats* cached);
+  bool ReadProcStatm(int32_t pid, uint32_t statm[3]);
+  void WriteExitedProcesses();
+  void WriteExitedProcess(int32_t pid);
+
+  // Removes |pid| and its threads from |seen_pids_|, so that they are dumped
+  // again by OnPids().
+  void ForgetProcess(int32_t pid);
 
   // Common fields used for both process/tree relationships and stats/counters.
   base::TaskRunner* const task_runner_;
   std::unique_ptr<TraceWriter> writer_;
   TraceWriter::TracePacketHandle cur_packet_;
 
+  // The directory returned by OpenProcDir(), /proc/<pid>/* files are opened
+  // relative to it. Opened lazily.
+  base::ScopedFile proc_dir_fd_;
+
+  // Buffer for the contents of /proc/<pid>/* files, reused for all reads.
+  std::unique_ptr<char[]> read_buf_;
+
   // Fields for keeping track of the state of process/tree relationships.
   protos::pbzero::ProcessTree* cur_ps_tree_ = nullptr;
   bool record_thread_names_ = false;
@@ -102,11 +179,28 @@ class ProcessStatsDataSource : public ProbesDataSource {
   // seen, not just the main thread id (aka thread group ID).
   std::set<int32_t> seen_pids_;
 
+  // The threads in |seen_pids_| by their tgid. Only filled in delta mode.
+  std::unordered_map<int32_t, std::vector<int32_t>> seen_threads_;
+
+  // State of the scan started by WriteAllProcesses(). |scan_proc_dir_| is
+  // null when no scan is in progress. |scan_task_dir_| is the
+  // /proc/|scan_pid_|/task directory, if its threads haven't all been written
+  // yet.
+  base::ScopedDir scan_proc_dir_;
+  base::ScopedDir scan_task_dir_;
+  int32_t scan_pid_ = 0;
+
   // Fields for keeping track of the periodic stats/counters.
   uint32_t poll_period_ms_ = 0;
   protos::pbzero::ProcessStats* cur_ps_stats_ = nullptr;
   std::vector<bool> pids_to_skip_;
 
+  // Delta mode state, used only if |cache_ttl_polls_| > 0. The cache is
+  // invalidated once every |cache_ttl_polls_| polls.
+  uint32_t cache_ttl_polls_ = 0;
+  uint32_t poll_count_ = 0;
+  std::unordered_map<int32_t, CachedProcessStats> process_stats_cache_;
+
   base::WeakPtrFactory<ProcessStatsDataSource> weak_factory_;  // Keep last.
 };
 
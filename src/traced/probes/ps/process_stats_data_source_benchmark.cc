@@ -0,0 +1,314 @@
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "perfetto/base/file_utils.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/base/task_runner.h"
+#include "perfetto/base/temp_file.h"
+#include "perfetto/protozero/scattered_stream_writer.h"
+#include "perfetto/trace/trace_packet.pbzero.h"
+#include "src/base/test/test_task_runner.h"
+#include "src/traced/probes/ps/process_stats_data_source.h"
+#include "src/tracing/core/null_trace_writer.h"
+
+namespace {
+
+using perfetto::DataSourceConfig;
+using perfetto::ProcessStatsDataSource;
+using perfetto::base::ScopedDir;
+
+constexpr int32_t kThreadsPerProcess = 10;
+
+// A real /proc/<pid>/status file has ~50 lines, only a handful of which are
+// used.
+std::string FakeStatus(int32_t pid, int32_t tgid, uint32_t rss_kb = 12388) {
+  std::string name = "proc_" + std::to_string(tgid);
+  std::string s;
+  s += "Name:\t" + name + "\n";
+  s += "Umask:\t0022\nState:\tS (sleeping)\n";
+  s += "Tgid:\t" + std::to_string(tgid) + "\n";
+  s += "Ngid:\t0\n";
+  s += "Pid:\t" + std::to_string(pid) + "\n";
+  s += "PPid:\t1\nTracerPid:\t0\n";
+  s += "Uid:\t0\t0\t0\t0\nGid:\t0\t0\t0\t0\nFDSize:\t64\nGroups:\t \n";
+  s += "NStgid:\t" + std::to_string(pid) + "\n";
+  s += "NSpid:\t" + std::to_string(pid) + "\n";
+  s += "NSpgid:\t1\nNSsid:\t1\n";
+  s += "VmPeak:\t  171144 kB\nVmSize:\t  171144 kB\nVmLck:\t       0 kB\n";
+  s += "VmPin:\t       0 kB\nVmHWM:\t   12388 kB\n";
+  s += "VmRSS:\t   " + std::to_string(rss_kb) + " kB\n";
+  s += "RssAnon:\t    2416 kB\nRssFile:\t    9972 kB\nRssShmem:\t       0 kB\n";
+  s += "VmData:\t   19772 kB\nVmStk:\t     132 kB\nVmExe:\t     804 kB\n";
+  s += "VmLib:\t   10532 kB\nVmPTE:\t      96 kB\nVmSwap:\t       0 kB\n";
+  s += "HugetlbPages:\t       0 kB\nCoreDumping:\t0\nThreads:\t10\n";
+  s += "SigQ:\t0/63455\nSigPnd:\t0000000000000000\nShdPnd:\t0000000000000000\n";
+  s += "SigBlk:\t0000000000000000\nSigIgn:\t0000000000001000\n";
+  s += "SigCgt:\t0000000180000000\nCapInh:\t0000000000000000\n";
+  s += "CapPrm:\t0000003fffffffff\nCapEff:\t0000003fffffffff\n";
+  s += "CapBnd:\t0000003fffffffff\nCapAmb:\t0000000000000000\n";
+  s += "NoNewPrivs:\t0\nSeccomp:\t0\nSpeculation_Store_Bypass:\tvulnerable\n";
+  s += "Cpus_allowed:\tff\nCpus_allowed_list:\t0-7\n";
+  s += "Mems_allowed:\t00000000,00000001\nMems_allowed_list:\t0\n";
+  s += "voluntary_ctxt_switches:\t150\nnonvoluntary_ctxt_switches:\t5\n";
+  return s;
+}
+
+std::string FakeStatm(uint32_t rss_kb) {
+  return "42786 " + std::to_string(rss_kb / 4) + " 2493 201 0 5001 0\n";
+}
+
+// A synthetic /proc tree with |num_processes| processes, each with
+// |threads_per_process| threads.
+class FakeProcTree {
+ public:
+  FakeProcTree(int32_t num_processes, int32_t threads_per_process)
+      : dir_(perfetto::base::TempDir::Create()) {
+    for (int32_t pid = 1; pid <= num_processes; pid++) {
+      std::string pid_dir = std::to_string(pid);
+      MakeDir(pid_dir);
+      WriteFile(pid_dir + "/status", FakeStatus(pid, pid));
+      WriteFile(pid_dir + "/statm", FakeStatm(12388));
+      WriteFile(pid_dir + "/cmdline", "/system/bin/proc_" + pid_dir +
+                                          std::string("\0--flag\0", 8));
+      MakeDir(pid_dir + "/task");
+      for (int32_t i = 0; i < threads_per_process; i++) {
+        int32_t tid = i == 0 ? pid : num_processes * (i + 1) + pid;
+        std::string tid_dir = pid_dir + "/task/" + std::to_string(tid);
+        MakeDir(tid_dir);
+        if (tid != pid) {
+          // Threads are also listed in the top-level /proc directory, but
+          // readdir() doesn't return them.
+          MakeDir(std::to_string(tid));
+          WriteFile(std::to_string(tid) + "/status", FakeStatus(tid, pid));
+        }
+      }
+    }
+  }
+
+  ~FakeProcTree() {
+    for (const std::string& path : files_)
+      unlink(path.c_str());
+    for (auto it = dirs_.rbegin(); it != dirs_.rend(); ++it)
+      rmdir(it->c_str());
+  }
+
+  const std::string& path() const { return dir_.path(); }
+
+  // Changes the RSS of process |pid|.
+  void SetRss(int32_t pid, uint32_t rss_kb) {
+    std::string pid_dir = dir_.path() + "/" + std::to_string(pid);
+    Overwrite(pid_dir + "/status", FakeStatus(pid, pid, rss_kb));
+    Overwrite(pid_dir + "/statm", FakeStatm(rss_kb));
+  }
+
+ private:
+  static void Overwrite(const std::string& path, const std::string& data) {
+    perfetto::base::ScopedFile fd =
+        perfetto::base::OpenFile(path, O_WRONLY | O_TRUNC);
+    PERFETTO_CHECK(fd);
+    PERFETTO_CHECK(perfetto::base::WriteAll(*fd, data.data(), data.size()) ==
+                   static_cast<ssize_t>(data.size()));
+  }
+
+  void MakeDir(const std::string& path) {
+    dirs_.push_back(dir_.path() + "/" + path);
+    PERFETTO_CHECK(mkdir(dirs_.back().c_str(), 0755) == 0);
+  }
+
+  void WriteFile(const std::string& path, const std::string& data) {
+    files_.push_back(dir_.path() + "/" + path);
+    perfetto::base::ScopedFile fd = perfetto::base::OpenFile(
+        files_.back(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    PERFETTO_CHECK(fd);
+    Overwrite(files_.back(), data);
+  }
+
+  perfetto::base::TempDir dir_;
+  std::vector<std::string> dirs_;
+  std::vector<std::string> files_;
+};
+
+// Discards the trace data like NullTraceWriter, but counts its size.
+class CountingTraceWriter : public perfetto::TraceWriter,
+                            public protozero::ScatteredStreamWriter::Delegate {
+ public:
+  explicit CountingTraceWriter(size_t* bytes_written)
+      : bytes_written_(bytes_written),
+        stream_(this),
+        cur_packet_(new perfetto::protos::pbzero::TracePacket()) {
+    cur_packet_->Finalize();
+  }
+
+  ~CountingTraceWriter() override { CountWrittenBytes(); }
+
+  TracePacketHandle NewTracePacket() override {
+    cur_packet_->Reset(&stream_);
+    return TracePacketHandle(cur_packet_.get());
+  }
+
+  void Flush(std::function<void()> callback) override {
+    CountWrittenBytes();
+    if (callback)
+      callback();
+  }
+
+  perfetto::WriterID writer_id() const override { return 0; }
+
+  protozero::ContiguousMemoryRange GetNewBuffer() override {
+    uint8_t* end = buf_ + sizeof(buf_);
+    if (count_start_)
+      *bytes_written_ += static_cast<size_t>(end - count_start_);
+    count_start_ = buf_;
+    return {buf_, end};
+  }
+
+ private:
+  void CountWrittenBytes() {
+    if (!count_start_)
+      return;
+    *bytes_written_ += static_cast<size_t>(stream_.write_ptr() - count_start_);
+    count_start_ = stream_.write_ptr();
+  }
+
+  size_t* const bytes_written_;
+  uint8_t buf_[4096];
+  uint8_t* count_start_ = nullptr;
+  protozero::ScatteredStreamWriter stream_;
+  std::unique_ptr<perfetto::protos::pbzero::TracePacket> cur_packet_;
+};
+
+// Runs delayed tasks without waiting, one batch at a time, so that each call
+// to RunPendingTasks() runs a single poll.
+class ImmediateTaskRunner : public perfetto::base::TaskRunner {
+ public:
+  void PostTask(std::function<void()> task) override {
+    tasks_.emplace_back(std::move(task));
+  }
+  void PostDelayedTask(std::function<void()> task, uint32_t) override {
+    tasks_.emplace_back(std::move(task));
+  }
+  void AddFileDescriptorWatch(int, std::function<void()>) override {
+    PERFETTO_CHECK(false);
+  }
+  void RemoveFileDescriptorWatch(int) override { PERFETTO_CHECK(false); }
+
+  void RunPendingTasks() {
+    std::vector<std::function<void()>> tasks;
+    tasks.swap(tasks_);
+    for (auto& task : tasks)
+      task();
+  }
+
+ private:
+  std::vector<std::function<void()>> tasks_;
+};
+
+class FakeProcDataSource : public ProcessStatsDataSource {
+ public:
+  FakeProcDataSource(perfetto::base::TaskRunner* task_runner,
+                     const DataSourceConfig& config,
+                     const std::string& proc_path,
+                     std::unique_ptr<perfetto::TraceWriter> writer =
+                         std::unique_ptr<perfetto::TraceWriter>(
+                             new perfetto::NullTraceWriter()))
+      : ProcessStatsDataSource(task_runner, 0, std::move(writer), config),
+        proc_path_(proc_path) {}
+
+  ScopedDir OpenProcDir() override {
+    return ScopedDir(opendir(proc_path_.c_str()));
+  }
+
+ private:
+  const std::string proc_path_;
+};
+
+}  // namespace
+
+// Full process tree dump (scan_all_processes_on_start) of a synthetic /proc
+// tree with state.range(0) processes of kThreadsPerProcess threads each,
+// recording thread names (i.e. reading the status of each thread).
+static void BM_ProcessStatsWriteAllProcesses(benchmark::State& state) {
+  FakeProcTree proc_tree(static_cast<int32_t>(state.range(0)),
+                         kThreadsPerProcess);
+  DataSourceConfig config;
+  config.mutable_process_stats_config()->set_record_thread_names(true);
+  perfetto::base::TestTaskRunner task_runner;
+  while (state.KeepRunning()) {
+    FakeProcDataSource data_source(&task_runner, config, proc_tree.path());
+    data_source.WriteAllProcesses();
+    task_runner.RunUntilIdle();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0) * kThreadsPerProcess);
+}
+BENCHMARK(BM_ProcessStatsWriteAllProcesses)->Arg(100)->Arg(1000);
+
+// Periodic memory counters poll (proc_stats_poll_ms) of a synthetic /proc
+// tree with state.range(0) processes, 1% of which change RSS between polls.
+// If state.range(1) is set, the delta mode (proc_stats_cache_ttl_ms) is
+// enabled.
+static void BM_ProcessStatsPoll(benchmark::State& state) {
+  const int32_t num_processes = static_cast<int32_t>(state.range(0));
+  FakeProcTree proc_tree(num_processes, /*threads_per_process=*/0);
+  DataSourceConfig config;
+  config.mutable_process_stats_config()->set_proc_stats_poll_ms(1000);
+  if (state.range(1))
+    config.mutable_process_stats_config()->set_proc_stats_cache_ttl_ms(
+        1000 * 3600);
+  ImmediateTaskRunner task_runner;
+  size_t bytes_written = 0;
+  FakeProcDataSource data_source(
+      &task_runner, config, proc_tree.path(),
+      std::unique_ptr<perfetto::TraceWriter>(
+          new CountingTraceWriter(&bytes_written)));
+  data_source.Start();
+  task_runner.RunPendingTasks();  // The first poll always dumps everything.
+  data_source.Flush(0, [] {});
+  bytes_written = 0;
+
+  int32_t next_pid_to_change = 1;
+  uint32_t rss_kb = 12388;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    rss_kb += 4;
+    for (int32_t i = 0; i < num_processes / 100; i++) {
+      proc_tree.SetRss(next_pid_to_change, rss_kb);
+      next_pid_to_change = next_pid_to_change % num_processes + 1;
+    }
+    state.ResumeTiming();
+    task_runner.RunPendingTasks();
+  }
+  data_source.Flush(0, [] {});
+  state.counters["bytes_per_poll"] = benchmark::Counter(
+      static_cast<double>(bytes_written) /
+      static_cast<double>(state.iterations()));
+}
+BENCHMARK(BM_ProcessStatsPoll)
+    ->Args({1000, 0})
+    ->Args({1000, 1})
+    ->Args({10000, 0})
+    ->Args({10000, 1})
+    ->Unit(benchmark::kMillisecond);
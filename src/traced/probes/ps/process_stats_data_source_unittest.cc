@@ -17,7 +17,14 @@
 #include "src/traced/probes/ps/process_stats_data_source.h"
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <map>
+
+#include "perfetto/base/file_utils.h"
+#include "perfetto/base/scoped_file.h"
 #include "perfetto/base/temp_file.h"
 #include "src/base/test/test_task_runner.h"
 #include "src/tracing/core/trace_writer_for_testing.h"
@@ -46,6 +53,35 @@ class TestProcessStatsDataSource : public ProcessStatsDataSource {
 
   MOCK_METHOD0(OpenProcDir, base::ScopedDir());
   MOCK_METHOD2(ReadProcPidFile, std::string(int32_t pid, const std::string&));
+
+  size_t ReadProcPidFile(int32_t pid,
+                         const char* file,
+                         char* buf,
+                         size_t buf_size) override {
+    std::string contents = ReadProcPidFile(pid, std::string(file));
+    size_t size = std::min(contents.size(), buf_size - 1);
+    memcpy(buf, contents.data(), size);
+    buf[size] = '\0';
+    return size;
+  }
+};
+
+// Reads the /proc files from a fake directory tree.
+class FakeProcProcessStatsDataSource : public ProcessStatsDataSource {
+ public:
+  FakeProcProcessStatsDataSource(base::TaskRunner* task_runner,
+                                 std::unique_ptr<TraceWriter> writer,
+                                 const DataSourceConfig& config,
+                                 const std::string& proc_path)
+      : ProcessStatsDataSource(task_runner, 0, std::move(writer), config),
+        proc_path_(proc_path) {}
+
+  base::ScopedDir OpenProcDir() override {
+    return base::ScopedDir(opendir(proc_path_.c_str()));
+  }
+
+ private:
+  const std::string proc_path_;
 };
 
 class ProcessStatsDataSourceTest : public ::testing::Test {
@@ -191,5 +227,284 @@ TEST_F(ProcessStatsDataSourceTest, MemCounters) {
     rmdir(path.c_str());
 }
 
+TEST_F(ProcessStatsDataSourceTest, MemCountersDeltaMode) {
+  DataSourceConfig cfg;
+  cfg.mutable_process_stats_config()->set_proc_stats_poll_ms(100);
+  cfg.mutable_process_stats_config()->set_proc_stats_cache_ttl_ms(300);
+  *(cfg.mutable_process_stats_config()->add_quirks()) =
+      perfetto::ProcessStatsConfig::DISABLE_ON_DEMAND;
+  auto data_source = GetProcessStatsDataSource(cfg);
+
+  auto fake_proc = base::TempDir::Create();
+  const int kPids[] = {1, 2, 3};
+  std::vector<std::string> dirs_to_delete;
+  for (int pid : kPids) {
+    char path[256];
+    sprintf(path, "%s/%d", fake_proc.path().c_str(), pid);
+    dirs_to_delete.push_back(path);
+    mkdir(path, 0755);
+  }
+
+  // Poll 0 dumps all the counters. Before poll 1, process 3 exits and the RSS
+  // of process 2 grows. Nothing changes in poll 2. Poll 3 dumps all the
+  // counters again, as the cache expires every 3 polls.
+  auto checkpoint = task_runner_.CreateCheckpoint("all_done");
+  int poll = -1;
+  EXPECT_CALL(*data_source, OpenProcDir())
+      .WillRepeatedly(Invoke([&fake_proc, &dirs_to_delete, &poll, checkpoint] {
+        if (++poll == 1)
+          rmdir(dirs_to_delete[2].c_str());
+        if (poll == 4) {
+          checkpoint();
+          return base::ScopedDir();
+        }
+        return base::ScopedDir(opendir(fake_proc.path().c_str()));
+      }));
+  auto rss_pages = [&poll](int32_t pid) {
+    return pid * 10 + (pid == 2 && poll >= 1 ? 1 : 0);
+  };
+  for (int pid : kPids) {
+    EXPECT_CALL(*data_source, ReadProcPidFile(pid, "statm"))
+        .WillRepeatedly(Invoke([rss_pages](int32_t p, const std::string&) {
+          char ret[64];
+          sprintf(ret, "%d %d 0 1 0 10 0\n", p * 100, rss_pages(p));
+          return std::string(ret);
+        }));
+    EXPECT_CALL(*data_source, ReadProcPidFile(pid, "status"))
+        .WillRepeatedly(Invoke([rss_pages](int32_t p, const std::string&) {
+          char ret[1024];
+          sprintf(ret, "Name:	pid_%d\nVmSize:	 %d kB\nVmRSS:\t%d  kB\n", p,
+                  p * 400, rss_pages(p) * 4);
+          return std::string(ret);
+        }));
+    EXPECT_CALL(*data_source, ReadProcPidFile(pid, "cmdline"))
+        .WillRepeatedly(Return(std::string("foo\0", 4)));
+  }
+
+  data_source->Start();
+  task_runner_.RunUntilCheckpoint("all_done");
+  data_source->Flush(1 /* FlushRequestId */, []() {});
+
+  std::unique_ptr<protos::TracePacket> packet = writer_raw_->ParseProto();
+  ASSERT_TRUE(packet);
+  ASSERT_TRUE(packet->has_process_stats());
+  const auto& ps_stats = packet->process_stats();
+  std::map<int32_t, std::vector<std::pair<uint64_t, uint64_t>>> samples;
+  for (const auto& proc_counters : ps_stats.mem_counters()) {
+    samples[proc_counters.pid()].emplace_back(proc_counters.vm_size_kb(),
+                                              proc_counters.vm_rss_kb());
+  }
+  using Sample = std::pair<uint64_t, uint64_t>;
+  EXPECT_THAT(samples[1], ElementsAreArray({Sample(400, 40), Sample(400, 40)}));
+  EXPECT_THAT(samples[2], ElementsAreArray({Sample(800, 80), Sample(0, 84),
+                                            Sample(800, 84)}));
+  EXPECT_THAT(samples[3], ElementsAreArray({Sample(1200, 120)}));
+  EXPECT_THAT(ps_stats.exited_pids(), ElementsAreArray({3}));
+
+  rmdir(dirs_to_delete[0].c_str());
+  rmdir(dirs_to_delete[1].c_str());
+}
+
+TEST_F(ProcessStatsDataSourceTest, DeltaModeUnreadableProcessExits) {
+  DataSourceConfig cfg;
+  cfg.mutable_process_stats_config()->set_proc_stats_poll_ms(100);
+  cfg.mutable_process_stats_config()->set_proc_stats_cache_ttl_ms(1000);
+  *(cfg.mutable_process_stats_config()->add_quirks()) =
+      perfetto::ProcessStatsConfig::DISABLE_ON_DEMAND;
+  auto data_source = GetProcessStatsDataSource(cfg);
+
+  auto fake_proc = base::TempDir::Create();
+  char path[256];
+  sprintf(path, "%s/2", fake_proc.path().c_str());
+  mkdir(path, 0755);
+
+  // In poll 1 the status of process 2 can't be read, as if it had exited
+  // after the readdir(). In poll 2 the pid is back, as if it had been reused,
+  // and all its counters are written again.
+  auto checkpoint = task_runner_.CreateCheckpoint("all_done");
+  int poll = -1;
+  EXPECT_CALL(*data_source, OpenProcDir())
+      .WillRepeatedly(Invoke([&fake_proc, &poll, checkpoint] {
+        if (++poll == 3) {
+          checkpoint();
+          return base::ScopedDir();
+        }
+        return base::ScopedDir(opendir(fake_proc.path().c_str()));
+      }));
+  EXPECT_CALL(*data_source, ReadProcPidFile(2, "statm"))
+      .WillRepeatedly(Invoke([&poll](int32_t, const std::string&) {
+        return "200 " + std::to_string(20 + poll) + " 0 1 0 10 0\n";
+      }));
+  EXPECT_CALL(*data_source, ReadProcPidFile(2, "status"))
+      .WillRepeatedly(Invoke([&poll](int32_t, const std::string&) {
+        if (poll == 1)
+          return std::string();
+        return std::string("Name:	pid_2\nVmSize:	 800 kB\n");
+      }));
+  EXPECT_CALL(*data_source, ReadProcPidFile(2, "cmdline"))
+      .WillRepeatedly(Return(std::string("foo\0", 4)));
+
+  data_source->Start();
+  task_runner_.RunUntilCheckpoint("all_done");
+  data_source->Flush(1 /* FlushRequestId */, []() {});
+
+  std::unique_ptr<protos::TracePacket> packet = writer_raw_->ParseProto();
+  ASSERT_TRUE(packet);
+  ASSERT_TRUE(packet->has_process_stats());
+  const auto& ps_stats = packet->process_stats();
+  std::vector<uint64_t> vm_sizes;
+  for (const auto& proc_counters : ps_stats.mem_counters())
+    vm_sizes.push_back(proc_counters.vm_size_kb());
+  EXPECT_THAT(vm_sizes, ElementsAreArray({800, 800}));
+  EXPECT_THAT(ps_stats.exited_pids(), ElementsAreArray({2}));
+
+  rmdir(path);
+}
+
+TEST_F(ProcessStatsDataSourceTest, DeltaModeDumpsChangedProcessesAgain) {
+  DataSourceConfig cfg;
+  cfg.mutable_process_stats_config()->set_proc_stats_poll_ms(100);
+  cfg.mutable_process_stats_config()->set_proc_stats_cache_ttl_ms(1000);
+  auto data_source = GetProcessStatsDataSource(cfg);
+
+  auto fake_proc = base::TempDir::Create();
+  const int kPids[] = {1, 2};
+  std::vector<std::string> dirs_to_delete;
+  for (int pid : kPids) {
+    char path[256];
+    sprintf(path, "%s/%d", fake_proc.path().c_str(), pid);
+    dirs_to_delete.push_back(path);
+    mkdir(path, 0755);
+  }
+
+  // Both processes are dumped by poll 0. Before poll 1, process 1 changes its
+  // cmdline and process 2 exits and its pid is reused.
+  auto checkpoint = task_runner_.CreateCheckpoint("all_done");
+  int poll = -1;
+  EXPECT_CALL(*data_source, OpenProcDir())
+      .WillRepeatedly(Invoke([&fake_proc, &poll, checkpoint] {
+        if (++poll == 2) {
+          checkpoint();
+          return base::ScopedDir();
+        }
+        return base::ScopedDir(opendir(fake_proc.path().c_str()));
+      }));
+  for (int pid : kPids) {
+    EXPECT_CALL(*data_source, ReadProcPidFile(pid, "statm"))
+        .WillRepeatedly(Invoke([&poll](int32_t p, const std::string&) {
+          char ret[64];
+          sprintf(ret, "%d %d 0 1 0 10 0\n", p * 100, p * 10 + poll);
+          return std::string(ret);
+        }));
+    EXPECT_CALL(*data_source, ReadProcPidFile(pid, "status"))
+        .WillRepeatedly(Invoke([&poll](int32_t p, const std::string&) {
+          char ret[1024];
+          sprintf(ret, "Name:	%s\nTgid:\t%d\nVmSize:	 %d kB\n",
+                  p == 2 && poll >= 1 ? "reused" : "orig", p, p * 400);
+          return std::string(ret);
+        }));
+    EXPECT_CALL(*data_source, ReadProcPidFile(pid, "cmdline"))
+        .WillRepeatedly(Invoke([&poll](int32_t p, const std::string&) {
+          if (p == 1 && poll >= 1)
+            return std::string("bar\0", 4);
+          return std::string("foo\0", 4);
+        }));
+  }
+
+  data_source->Start();
+  task_runner_.RunUntilCheckpoint("all_done");
+  data_source->Flush(1 /* FlushRequestId */, []() {});
+
+  // TracePacket fields are in a oneof, so only the process tree written last,
+  // by poll 1, is parsed.
+  std::unique_ptr<protos::TracePacket> packet = writer_raw_->ParseProto();
+  ASSERT_TRUE(packet);
+  ASSERT_TRUE(packet->has_process_tree());
+  std::map<int32_t, std::string> cmdlines;
+  for (const auto& process : packet->process_tree().processes())
+    cmdlines[process.pid()] = process.cmdline(0);
+  EXPECT_EQ(2u, cmdlines.size());
+  EXPECT_EQ("bar", cmdlines[1]);
+  EXPECT_EQ("foo", cmdlines[2]);
+
+  for (const std::string& dir : dirs_to_delete)
+    rmdir(dir.c_str());
+}
+
+TEST_F(ProcessStatsDataSourceTest, ScanFakeProcInChunks) {
+  // Populate a fake /proc/ directory with a process (10) with more threads
+  // than what a single task of WriteAllProcesses() handles and a second
+  // process (20) with one thread.
+  auto fake_proc = base::TempDir::Create();
+  std::vector<std::string> dirs_to_delete;
+  std::vector<std::string> files_to_delete;
+  auto make_dir = [&fake_proc, &dirs_to_delete](const std::string& path) {
+    dirs_to_delete.push_back(fake_proc.path() + "/" + path);
+    mkdir(dirs_to_delete.back().c_str(), 0755);
+  };
+  auto write_file = [&fake_proc, &files_to_delete](const std::string& path,
+                                                   const std::string& data) {
+    files_to_delete.push_back(fake_proc.path() + "/" + path);
+    base::ScopedFile fd = base::OpenFile(files_to_delete.back(),
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_TRUE(fd);
+    ASSERT_EQ(base::WriteAll(*fd, data.data(), data.size()),
+              static_cast<ssize_t>(data.size()));
+  };
+  const int32_t kNumThreads = ProcessStatsDataSource::kMaxScanEntriesPerTask;
+  for (int32_t pid : {10, 20}) {
+    make_dir(std::to_string(pid));
+    write_file(std::to_string(pid) + "/status",
+               "Name:\tproc_" + std::to_string(pid) +
+                   "\nUmask:\t0022\nState:\tS (sleeping)\nTgid:\t" +
+                   std::to_string(pid) + "\nNgid:\t0\nPid:\t" +
+                   std::to_string(pid) + "\nPPid:\t1\n");
+    write_file(std::to_string(pid) + "/cmdline",
+               std::string("proc_") + std::to_string(pid) + '\0' + "--arg" +
+                   '\0');
+    make_dir(std::to_string(pid) + "/task");
+    make_dir(std::to_string(pid) + "/task/" + std::to_string(pid));
+    int32_t num_threads = pid == 10 ? kNumThreads : 2;
+    for (int32_t i = 1; i <= num_threads; i++)
+      make_dir(std::to_string(pid) + "/task/" + std::to_string(pid * 1000 + i));
+  }
+
+  auto writer =
+      std::unique_ptr<TraceWriterForTesting>(new TraceWriterForTesting());
+  TraceWriterForTesting* writer_raw = writer.get();
+  FakeProcProcessStatsDataSource data_source(
+      &task_runner_, std::move(writer), DataSourceConfig(), fake_proc.path());
+
+  // The first chunk is written synchronously, the rest in a posted task.
+  data_source.WriteAllProcesses();
+  task_runner_.RunUntilIdle();
+
+  std::unique_ptr<protos::TracePacket> packet = writer_raw->ParseProto();
+  ASSERT_TRUE(packet->has_process_tree());
+  const auto& processes = packet->process_tree().processes();
+  ASSERT_EQ(processes.size(), 2);
+  EXPECT_EQ(processes.Get(0).pid() + processes.Get(1).pid(), 30);
+  for (const auto& process : processes) {
+    EXPECT_EQ(process.ppid(), 1);
+    EXPECT_THAT(process.cmdline(),
+                ElementsAreArray({"proc_" + std::to_string(process.pid()),
+                                  std::string("--arg")}));
+  }
+  const auto& threads = packet->process_tree().threads();
+  ASSERT_EQ(threads.size(), kNumThreads + 2);
+  std::set<int32_t> tids;
+  for (const auto& thread : threads) {
+    EXPECT_EQ(thread.tgid(), thread.tid() / 1000);
+    tids.insert(thread.tid());
+  }
+  EXPECT_EQ(tids.size(), static_cast<size_t>(kNumThreads + 2));
+
+  // Cleanup |fake_proc|. TempDir checks that the directory is empty.
+  for (const std::string& path : files_to_delete)
+    unlink(path.c_str());
+  for (auto it = dirs_to_delete.rbegin(); it != dirs_to_delete.rend(); ++it)
+    rmdir(it->c_str());
+}
+
 }  // namespace
 }  // namespace perfetto
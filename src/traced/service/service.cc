@@ -14,18 +14,54 @@
  * limitations under the License.
  */
 
-#include "perfetto/base/unix_task_runner.h"
+#include <getopt.h>
+#include <stdlib.h>
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/logging.h"
 #include "perfetto/base/watchdog.h"
 #include "perfetto/traced/traced.h"
 #include "perfetto/tracing/ipc/service_ipc_host.h"
 #include "src/tracing/ipc/default_socket.h"
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#include "perfetto/base/epoll_task_runner.h"
+#else
+#include "perfetto/base/unix_task_runner.h"
+#endif
+
 namespace perfetto {
 
-int __attribute__((visibility("default"))) ServiceMain(int, char**) {
+int __attribute__((visibility("default")))
+ServiceMain(int argc, char** argv) {
+  TracingService::InitOpts init_opts;
+  static struct option long_options[] = {
+      {"commit-threads", required_argument, nullptr, 'c'},
+      {nullptr, 0, nullptr, 0}};
+  int option_index;
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+    switch (c) {
+      case 'c':
+        init_opts.num_commit_threads =
+            static_cast<size_t>(strtoul(optarg, nullptr, 10));
+        break;
+      default:
+        PERFETTO_ELOG("Usage: %s [--commit-threads=N]", argv[0]);
+        return 1;
+    }
+  }
+
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // The service watches one socket per connected producer and consumer.
+  base::EpollTaskRunner task_runner;
+#else
   base::UnixTaskRunner task_runner;
+#endif
   std::unique_ptr<ServiceIPCHost> svc;
-  svc = ServiceIPCHost::CreateInstance(&task_runner);
+  svc = ServiceIPCHost::CreateInstance(&task_runner, init_opts);
 
   // When built as part of the Android tree, the two socket are created and
   // bonund by init and their fd number is passed in two env variables.
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/commit_thread.h"
+
+#include <utility>
+
+namespace perfetto {
+
+CommitThread::CommitThread() : thread_(&CommitThread::Run, this) {}
+
+CommitThread::~CommitThread() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  job_posted_.notify_one();
+  thread_.join();
+}
+
+void CommitThread::PostJob(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.emplace_back(std::move(job));
+  }
+  job_posted_.notify_one();
+}
+
+void CommitThread::WaitForIdle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return jobs_.empty() && !running_job_; });
+}
+
+bool CommitThread::IsIdle() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return jobs_.empty() && !running_job_;
+}
+
+void CommitThread::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    job_posted_.wait(lock, [this] { return quit_ || !jobs_.empty(); });
+    if (jobs_.empty())
+      return;  // |quit_| is set and all the jobs have run.
+    std::function<void()> job = std::move(jobs_.front());
+    jobs_.pop_front();
+    running_job_ = true;
+    lock.unlock();
+    job();
+    job = nullptr;  // Destroy what the job captured before signaling idle.
+    lock.lock();
+    running_job_ = false;
+    if (jobs_.empty())
+      idle_.notify_all();
+  }
+}
+
+}  // namespace perfetto
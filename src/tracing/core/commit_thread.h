@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_COMMIT_THREAD_H_
+#define SRC_TRACING_CORE_COMMIT_THREAD_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace perfetto {
+
+// A thread owned by the TracingServiceImpl that copies the chunks committed by
+// the producers sharded onto it into the trace buffers, see
+// TracingService::InitOpts::num_commit_threads.
+// Jobs run in the order in which they are posted. They must not block on the
+// service thread, but can post tasks back to it.
+class CommitThread {
+ public:
+  CommitThread();
+
+  // Runs the jobs still pending, then joins the thread.
+  ~CommitThread();
+
+  void PostJob(std::function<void()>);
+
+  // Blocks until all the jobs posted so far have run.
+  void WaitForIdle();
+
+  // Whether all the jobs posted so far have run. The service thread polls this
+  // rather than blocking before it reads the trace buffers.
+  bool IsIdle();
+
+ private:
+  CommitThread(const CommitThread&) = delete;
+  CommitThread& operator=(const CommitThread&) = delete;
+
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable job_posted_;
+  std::condition_variable idle_;
+
+  // --- Begin |mutex_|-protected members ---
+  std::deque<std::function<void()>> jobs_;
+  bool running_job_ = false;
+  bool quit_ = false;
+  // --- End |mutex_|-protected members ---
+
+  std::thread thread_;  // Keep last, Run() uses all the members above.
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_COMMIT_THREAD_H_
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/commit_thread.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace {
+
+TEST(CommitThreadTest, RunsJobsInOrder) {
+  std::vector<int> results;
+  CommitThread commit_thread;
+  for (int i = 0; i < 1000; i++)
+    commit_thread.PostJob([&results, i] { results.push_back(i); });
+  commit_thread.WaitForIdle();
+  ASSERT_EQ(1000u, results.size());
+  for (int i = 0; i < 1000; i++)
+    ASSERT_EQ(i, results[static_cast<size_t>(i)]);
+}
+
+TEST(CommitThreadTest, WaitForIdleWaitsForRunningJob) {
+  std::atomic<bool> job_started{false};
+  bool job_done = false;
+  CommitThread commit_thread;
+  commit_thread.PostJob([&job_started, &job_done] {
+    job_started = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    job_done = true;
+  });
+  while (!job_started)
+    std::this_thread::yield();
+  commit_thread.WaitForIdle();
+  EXPECT_TRUE(job_done);
+}
+
+TEST(CommitThreadTest, WaitForIdleWithoutJobs) {
+  CommitThread commit_thread;
+  commit_thread.WaitForIdle();
+  EXPECT_TRUE(commit_thread.IsIdle());
+}
+
+TEST(CommitThreadTest, IsIdle) {
+  std::mutex mutex;
+  std::unique_lock<std::mutex> lock(mutex);
+  CommitThread commit_thread;
+  commit_thread.PostJob([&mutex] { std::lock_guard<std::mutex> l(mutex); });
+  EXPECT_FALSE(commit_thread.IsIdle());
+  lock.unlock();
+  commit_thread.WaitForIdle();
+  EXPECT_TRUE(commit_thread.IsIdle());
+}
+
+TEST(CommitThreadTest, DestructorRunsPendingJobs) {
+  int num_jobs_run = 0;
+  {
+    CommitThread commit_thread;
+    for (int i = 0; i < 100; i++)
+      commit_thread.PostJob([&num_jobs_run] { num_jobs_run++; });
+  }
+  EXPECT_EQ(100, num_jobs_run);
+}
+
+TEST(CommitThreadTest, JobsCanOutliveCapturedState) {
+  // What a job captures is destroyed on the commit thread, before
+  // WaitForIdle() returns.
+  std::weak_ptr<int> weak_state;
+  CommitThread commit_thread;
+  {
+    std::shared_ptr<int> state(new int(42));
+    weak_state = state;
+    commit_thread.PostJob([state] { EXPECT_EQ(42, *state); });
+  }
+  commit_thread.WaitForIdle();
+  EXPECT_TRUE(weak_state.expired());
+}
+
+}  // namespace
+}  // namespace perfetto
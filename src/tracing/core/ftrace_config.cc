@@ -77,6 +77,12 @@ void FtraceConfig::FromProto(const perfetto::protos::FtraceConfig& proto) {
                 "size mismatch");
   drain_period_ms_ =
       static_cast<decltype(drain_period_ms_)>(proto.drain_period_ms());
+
+  kernel_filters_.clear();
+  for (const auto& field : proto.kernel_filters()) {
+    kernel_filters_.emplace_back();
+    kernel_filters_.back().FromProto(field);
+  }
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -111,6 +117,44 @@ void FtraceConfig::ToProto(perfetto::protos::FtraceConfig* proto) const {
                 "size mismatch");
   proto->set_drain_period_ms(
       static_cast<decltype(proto->drain_period_ms())>(drain_period_ms_));
+
+  for (const auto& it : kernel_filters_) {
+    auto* entry = proto->add_kernel_filters();
+    it.ToProto(entry);
+  }
+  *(proto->mutable_unknown_fields()) = unknown_fields_;
+}
+
+FtraceConfig::KernelFilter::KernelFilter() = default;
+FtraceConfig::KernelFilter::~KernelFilter() = default;
+FtraceConfig::KernelFilter::KernelFilter(const FtraceConfig::KernelFilter&) =
+    default;
+FtraceConfig::KernelFilter& FtraceConfig::KernelFilter::operator=(
+    const FtraceConfig::KernelFilter&) = default;
+FtraceConfig::KernelFilter::KernelFilter(
+    FtraceConfig::KernelFilter&&) noexcept = default;
+FtraceConfig::KernelFilter& FtraceConfig::KernelFilter::operator=(
+    FtraceConfig::KernelFilter&&) = default;
+
+void FtraceConfig::KernelFilter::FromProto(
+    const perfetto::protos::FtraceConfig_KernelFilter& proto) {
+  static_assert(sizeof(event_) == sizeof(proto.event()), "size mismatch");
+  event_ = static_cast<decltype(event_)>(proto.event());
+
+  static_assert(sizeof(filter_) == sizeof(proto.filter()), "size mismatch");
+  filter_ = static_cast<decltype(filter_)>(proto.filter());
+  unknown_fields_ = proto.unknown_fields();
+}
+
+void FtraceConfig::KernelFilter::ToProto(
+    perfetto::protos::FtraceConfig_KernelFilter* proto) const {
+  proto->Clear();
+
+  static_assert(sizeof(event_) == sizeof(proto->event()), "size mismatch");
+  proto->set_event(static_cast<decltype(proto->event())>(event_));
+
+  static_assert(sizeof(filter_) == sizeof(proto->filter()), "size mismatch");
+  proto->set_filter(static_cast<decltype(proto->filter())>(filter_));
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
@@ -67,6 +67,47 @@ void HeapprofdConfig::FromProto(
   all_ = static_cast<decltype(all_)>(proto.all());
 
   continuous_dump_config_.FromProto(proto.continuous_dump_config());
+
+  static_assert(sizeof(shmem_size_bytes_) == sizeof(proto.shmem_size_bytes()),
+                "size mismatch");
+  shmem_size_bytes_ =
+      static_cast<decltype(shmem_size_bytes_)>(proto.shmem_size_bytes());
+
+  static_assert(sizeof(block_client_) == sizeof(proto.block_client()),
+                "size mismatch");
+  block_client_ = static_cast<decltype(block_client_)>(proto.block_client());
+
+  static_assert(sizeof(frame_pointer_unwinding_) ==
+                    sizeof(proto.frame_pointer_unwinding()),
+                "size mismatch");
+  frame_pointer_unwinding_ = static_cast<decltype(frame_pointer_unwinding_)>(
+      proto.frame_pointer_unwinding());
+
+  static_assert(sizeof(unwinder_threads_) == sizeof(proto.unwinder_threads()),
+                "size mismatch");
+  unwinder_threads_ =
+      static_cast<decltype(unwinder_threads_)>(proto.unwinder_threads());
+
+  static_assert(
+      sizeof(bookkeeping_threads_) == sizeof(proto.bookkeeping_threads()),
+      "size mismatch");
+  bookkeeping_threads_ =
+      static_cast<decltype(bookkeeping_threads_)>(proto.bookkeeping_threads());
+
+  static_assert(sizeof(incremental_dumps_) == sizeof(proto.incremental_dumps()),
+                "size mismatch");
+  incremental_dumps_ =
+      static_cast<decltype(incremental_dumps_)>(proto.incremental_dumps());
+
+  static_assert(
+      sizeof(max_stack_size_bytes_) == sizeof(proto.max_stack_size_bytes()),
+      "size mismatch");
+  max_stack_size_bytes_ = static_cast<decltype(max_stack_size_bytes_)>(
+      proto.max_stack_size_bytes());
+
+  static_assert(sizeof(stack_deltas_) == sizeof(proto.stack_deltas()),
+                "size mismatch");
+  stack_deltas_ = static_cast<decltype(stack_deltas_)>(proto.stack_deltas());
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -96,6 +137,53 @@ void HeapprofdConfig::ToProto(perfetto::protos::HeapprofdConfig* proto) const {
   proto->set_all(static_cast<decltype(proto->all())>(all_));
 
   continuous_dump_config_.ToProto(proto->mutable_continuous_dump_config());
+
+  static_assert(sizeof(shmem_size_bytes_) == sizeof(proto->shmem_size_bytes()),
+                "size mismatch");
+  proto->set_shmem_size_bytes(
+      static_cast<decltype(proto->shmem_size_bytes())>(shmem_size_bytes_));
+
+  static_assert(sizeof(block_client_) == sizeof(proto->block_client()),
+                "size mismatch");
+  proto->set_block_client(
+      static_cast<decltype(proto->block_client())>(block_client_));
+
+  static_assert(sizeof(frame_pointer_unwinding_) ==
+                    sizeof(proto->frame_pointer_unwinding()),
+                "size mismatch");
+  proto->set_frame_pointer_unwinding(
+      static_cast<decltype(proto->frame_pointer_unwinding())>(
+          frame_pointer_unwinding_));
+
+  static_assert(sizeof(unwinder_threads_) == sizeof(proto->unwinder_threads()),
+                "size mismatch");
+  proto->set_unwinder_threads(
+      static_cast<decltype(proto->unwinder_threads())>(unwinder_threads_));
+
+  static_assert(
+      sizeof(bookkeeping_threads_) == sizeof(proto->bookkeeping_threads()),
+      "size mismatch");
+  proto->set_bookkeeping_threads(
+      static_cast<decltype(proto->bookkeeping_threads())>(
+          bookkeeping_threads_));
+
+  static_assert(
+      sizeof(incremental_dumps_) == sizeof(proto->incremental_dumps()),
+      "size mismatch");
+  proto->set_incremental_dumps(
+      static_cast<decltype(proto->incremental_dumps())>(incremental_dumps_));
+
+  static_assert(
+      sizeof(max_stack_size_bytes_) == sizeof(proto->max_stack_size_bytes()),
+      "size mismatch");
+  proto->set_max_stack_size_bytes(
+      static_cast<decltype(proto->max_stack_size_bytes())>(
+          max_stack_size_bytes_));
+
+  static_assert(sizeof(stack_deltas_) == sizeof(proto->stack_deltas()),
+                "size mismatch");
+  proto->set_stack_deltas(
+      static_cast<decltype(proto->stack_deltas())>(stack_deltas_));
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
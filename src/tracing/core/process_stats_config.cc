@@ -68,6 +68,12 @@ void ProcessStatsConfig::FromProto(
       "size mismatch");
   proc_stats_poll_ms_ =
       static_cast<decltype(proc_stats_poll_ms_)>(proto.proc_stats_poll_ms());
+
+  static_assert(sizeof(proc_stats_cache_ttl_ms_) ==
+                    sizeof(proto.proc_stats_cache_ttl_ms()),
+                "size mismatch");
+  proc_stats_cache_ttl_ms_ = static_cast<decltype(proc_stats_cache_ttl_ms_)>(
+      proto.proc_stats_cache_ttl_ms());
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -99,6 +105,13 @@ void ProcessStatsConfig::ToProto(
       "size mismatch");
   proto->set_proc_stats_poll_ms(
       static_cast<decltype(proto->proc_stats_poll_ms())>(proc_stats_poll_ms_));
+
+  static_assert(sizeof(proc_stats_cache_ttl_ms_) ==
+                    sizeof(proto->proc_stats_cache_ttl_ms()),
+                "size mismatch");
+  proto->set_proc_stats_cache_ttl_ms(
+      static_cast<decltype(proto->proc_stats_cache_ttl_ms())>(
+          proc_stats_cache_ttl_ms_));
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
@@ -21,6 +21,8 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "perfetto/base/file_utils.h"
+#include "perfetto/base/metatrace.h"
+#include "perfetto/base/pipe.h"
 #include "perfetto/base/temp_file.h"
 #include "perfetto/base/utils.h"
 #include "perfetto/tracing/core/consumer.h"
@@ -62,11 +64,14 @@ constexpr size_t kMaxShmSizeKb = TracingServiceImpl::kMaxShmSize / 1024;
 
 class TracingServiceImplTest : public testing::Test {
  public:
-  TracingServiceImplTest() {
+  TracingServiceImplTest() { InitService(TracingService::InitOpts()); }
+
+  void InitService(const TracingService::InitOpts& init_opts) {
     auto shm_factory =
         std::unique_ptr<SharedMemory::Factory>(new TestSharedMemory::Factory());
     svc.reset(static_cast<TracingServiceImpl*>(
-        TracingService::CreateInstance(std::move(shm_factory), &task_runner)
+        TracingService::CreateInstance(std::move(shm_factory), &task_runner,
+                                       init_opts)
             .release()));
     svc->min_write_period_ms_ = 1;
   }
@@ -491,6 +496,122 @@ TEST_F(TracingServiceImplTest, ExplicitFlush) {
                         Property(&protos::TestEvent::str, Eq("payload")))));
 }
 
+// The "perfetto.metatrace" data source makes the service emit the events of
+// PERFETTO_METATRACE, even without a producer for it.
+TEST_F(TracingServiceImplTest, EmitsMetatrace) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  trace_config.add_data_sources()->mutable_config()->set_name(
+      "perfetto.metatrace");
+  EXPECT_FALSE(base::metatrace::IsEnabled());
+  consumer->EnableTracing(trace_config);
+  EXPECT_TRUE(base::metatrace::IsEnabled());
+
+  { PERFETTO_METATRACE(PS_ON_PIDS, 42); }
+
+  consumer->DisableTracing();
+  consumer->WaitForTracingDisabled();
+  auto packets = consumer->ReadBuffers();
+  EXPECT_THAT(packets,
+              Contains(Property(&protos::TracePacket::perfetto_metatrace,
+                                Property(&protos::PerfettoMetatrace::arg,
+                                         Eq(42u)))));
+  consumer->FreeBuffers();
+  EXPECT_FALSE(base::metatrace::IsEnabled());
+}
+
+// The service doesn't write into pipes, as that could block it, but sends the
+// packets back instead.
+TEST_F(TracingServiceImplTest, ReadBuffersIntoPipeSendsPackets) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  trace_config.add_data_sources()->mutable_config()->set_name(
+      "perfetto.metatrace");
+  consumer->EnableTracing(trace_config);
+
+  { PERFETTO_METATRACE(PS_ON_PIDS, 42); }
+
+  consumer->DisableTracing();
+  consumer->WaitForTracingDisabled();
+  base::Pipe pipe = base::Pipe::Create(base::Pipe::kRdNonBlock);
+  auto packets = consumer->ReadBuffers(std::move(pipe.wr));
+  EXPECT_THAT(packets,
+              Contains(Property(&protos::TracePacket::perfetto_metatrace,
+                                Property(&protos::PerfettoMetatrace::arg,
+                                         Eq(42u)))));
+  char buf[1];
+  EXPECT_EQ(0, read(*pipe.rd, buf, sizeof(buf)));
+  consumer->FreeBuffers();
+}
+
+// Like ExplicitFlush, but the chunks of the two producers are copied on two
+// separate commit threads.
+TEST_F(TracingServiceImplTest, ExplicitFlushWithCommitThreads) {
+  TracingService::InitOpts init_opts;
+  init_opts.num_commit_threads = 2;
+  InitService(init_opts);
+
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer1 = CreateMockProducer();
+  producer1->Connect(svc.get(), "mock_producer1");
+  producer1->RegisterDataSource("data_source1");
+
+  std::unique_ptr<MockProducer> producer2 = CreateMockProducer();
+  producer2->Connect(svc.get(), "mock_producer2");
+  producer2->RegisterDataSource("data_source2");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  trace_config.add_data_sources()->mutable_config()->set_name("data_source1");
+  trace_config.add_data_sources()->mutable_config()->set_name("data_source2");
+
+  consumer->EnableTracing(trace_config);
+  producer1->WaitForTracingSetup();
+  producer1->WaitForDataSourceSetup("data_source1");
+  producer2->WaitForTracingSetup();
+  producer2->WaitForDataSourceSetup("data_source2");
+  producer1->WaitForDataSourceStart("data_source1");
+  producer2->WaitForDataSourceStart("data_source2");
+
+  std::unique_ptr<TraceWriter> writer1 =
+      producer1->CreateTraceWriter("data_source1");
+  std::unique_ptr<TraceWriter> writer2 =
+      producer2->CreateTraceWriter("data_source2");
+  for (int i = 0; i < 100; i++) {
+    writer1->NewTracePacket()->set_for_testing()->set_str("payload1");
+    writer2->NewTracePacket()->set_for_testing()->set_str("payload2");
+  }
+
+  auto flush_request = consumer->Flush();
+  producer1->WaitForFlush(writer1.get());
+  producer2->WaitForFlush(writer2.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  producer1->WaitForDataSourceStop("data_source1");
+  producer2->WaitForDataSourceStop("data_source2");
+  consumer->WaitForTracingDisabled();
+  auto packets = consumer->ReadBuffers();
+  size_t num_payload1 = 0;
+  size_t num_payload2 = 0;
+  for (const auto& packet : packets) {
+    if (packet.for_testing().str() == "payload1")
+      num_payload1++;
+    if (packet.for_testing().str() == "payload2")
+      num_payload2++;
+  }
+  EXPECT_EQ(100u, num_payload1);
+  EXPECT_EQ(100u, num_payload2);
+}
+
 TEST_F(TracingServiceImplTest, ImplicitFlushOnTimedTraces) {
   std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
   consumer->Connect(svc.get());
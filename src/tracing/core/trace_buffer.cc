@@ -16,6 +16,7 @@
 
 #include "src/tracing/core/trace_buffer.h"
 
+#include <algorithm>
 #include <limits>
 
 #include "perfetto/base/logging.h"
@@ -62,9 +63,10 @@ constexpr size_t TraceBuffer::ChunkRecord::kMaxSize;
 constexpr size_t TraceBuffer::InlineChunkHeaderSize = sizeof(ChunkRecord);
 
 // static
-std::unique_ptr<TraceBuffer> TraceBuffer::Create(size_t size_in_bytes) {
+std::unique_ptr<TraceBuffer> TraceBuffer::Create(size_t size_in_bytes,
+                                                 int alloc_flags) {
   std::unique_ptr<TraceBuffer> trace_buffer(new TraceBuffer());
-  if (!trace_buffer->Initialize(size_in_bytes))
+  if (!trace_buffer->Initialize(size_in_bytes, alloc_flags))
     return nullptr;
   return trace_buffer;
 }
@@ -78,13 +80,14 @@ TraceBuffer::TraceBuffer() {
 
 TraceBuffer::~TraceBuffer() = default;
 
-bool TraceBuffer::Initialize(size_t size) {
+bool TraceBuffer::Initialize(size_t size, int alloc_flags) {
   static_assert(
       base::kPageSize % sizeof(ChunkRecord) == 0,
       "sizeof(ChunkRecord) must be an integer divider of a page size");
   PERFETTO_CHECK(size % base::kPageSize == 0);
   data_ = base::PagedMemory::Allocate(
-      size, base::PagedMemory::kMayFail | base::PagedMemory::kDontCommit);
+      size, alloc_flags | base::PagedMemory::kMayFail |
+                base::PagedMemory::kDontCommit);
   if (!data_.IsValid()) {
     PERFETTO_ELOG("Trace buffer allocation failed (size: %zu)", size);
     return false;
@@ -113,6 +116,9 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   // up in a fragmented state where size_to_end() < sizeof(ChunkRecord).
   const size_t record_size =
       base::AlignUp<sizeof(ChunkRecord)>(size + sizeof(ChunkRecord));
+  std::unique_lock<std::mutex> lock(lock_, std::defer_lock);
+  if (concurrent_writers_)
+    lock.lock();
   if (PERFETTO_UNLIKELY(record_size > max_chunk_size_)) {
     stats_.abi_violations++;
     PERFETTO_DCHECK(suppress_sanity_dchecks_for_testing_);
@@ -125,6 +131,14 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   changed_since_last_read_ = true;
 #endif
 
+  // Other threads are still copying the payload of some of the chunks that are
+  // about to be overwritten. This can happen only if the buffer is very small
+  // compared to the chunks in flight.
+  while (PERFETTO_UNLIKELY(!writes_in_flight_.empty()) &&
+         OverlapsWritesInFlight(record_size)) {
+    write_completed_.wait(lock);
+  }
+
   // If there isn't enough room from the given write position. Write a padding
   // record to clear the end of the buffer and wrap back.
   const size_t cached_size_to_end = size_to_end();
@@ -183,8 +197,11 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   }
   TRACE_BUFFER_DLOG("  copying @ [%lu - %lu] %zu", wptr_ - begin(),
                     wptr_ - begin() + record_size, record_size);
-  WriteChunkRecord(record, src, size);
-  TRACE_BUFFER_DLOG("Chunk raw: %s", HexDump(wptr_, record_size).c_str());
+  // Only the header is written here, the payload is copied below, after
+  // releasing the lock.
+  WriteChunkRecord(record, nullptr, size);
+  const ChunkRecord* record_in_flight = GetChunkRecordAt(wptr_);
+  uint8_t* payload = wptr_ + sizeof(ChunkRecord);
   wptr_ += record_size;
   if (wptr_ >= end()) {
     PERFETTO_DCHECK(padding_size == 0);
@@ -217,6 +234,44 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
 
   if (padding_size)
     AddPaddingRecord(padding_size);
+
+  if (!concurrent_writers_) {
+    memcpy(payload, src, size);
+    TRACE_BUFFER_DLOG(
+        "Chunk raw: %s",
+        HexDump(payload - sizeof(ChunkRecord), record_size).c_str());
+    return;
+  }
+
+  writes_in_flight_.push_back(record_in_flight);
+  lock.unlock();
+  memcpy(payload, src, size);
+  TRACE_BUFFER_DLOG(
+      "Chunk raw: %s",
+      HexDump(payload - sizeof(ChunkRecord), record_size).c_str());
+  lock.lock();
+  auto it = std::find(writes_in_flight_.begin(), writes_in_flight_.end(),
+                      record_in_flight);
+  PERFETTO_DCHECK(it != writes_in_flight_.end());
+  *it = writes_in_flight_.back();
+  writes_in_flight_.pop_back();
+  lock.unlock();
+  write_completed_.notify_all();
+}
+
+bool TraceBuffer::OverlapsWritesInFlight(size_t record_size) const {
+  // The range cleared for a record is [wptr_, wptr_ + record_size), or
+  // [wptr_, end()) + [begin(), begin() + record_size) if it has to wrap. Any
+  // chunk that begins in that range is deleted.
+  const bool wraps = record_size > size_to_end();
+  for (const ChunkRecord* record : writes_in_flight_) {
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(record);
+    if (ptr >= wptr_ && (wraps || ptr < wptr_ + record_size))
+      return true;
+    if (wraps && ptr < begin() + record_size)
+      return true;
+  }
+  return false;
 }
 
 size_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
@@ -295,6 +350,9 @@ bool TraceBuffer::TryPatchChunkContents(ProducerID producer_id,
                                         const Patch* patches,
                                         size_t patches_size,
                                         bool other_patches_pending) {
+  std::unique_lock<std::mutex> lock(lock_, std::defer_lock);
+  if (concurrent_writers_)
+    lock.lock();
   ChunkMeta::Key key(producer_id, writer_id, chunk_id);
   auto it = index_.find(key);
   if (it == index_.end()) {
@@ -353,6 +411,12 @@ bool TraceBuffer::TryPatchChunkContents(ProducerID producer_id,
 }
 
 void TraceBuffer::BeginRead() {
+#if PERFETTO_DCHECK_IS_ON()
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    PERFETTO_DCHECK(writes_in_flight_.empty());
+  }
+#endif
   read_iter_ = GetReadIterForSequence(index_.begin());
 #if PERFETTO_DCHECK_IS_ON()
   changed_since_last_read_ = false;
@@ -21,9 +21,12 @@
 #include <string.h>
 
 #include <array>
+#include <condition_variable>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <tuple>
+#include <vector>
 
 #include "perfetto/base/logging.h"
 #include "perfetto/base/paged_memory.h"
@@ -108,6 +111,17 @@ class TracePacket;
 // that a chunk might have been lost (because of wrapping) by the time the OOB
 // IPC comes.
 //
+// Concurrent writers
+// ------------------
+// After set_concurrent_writers(true), CopyChunkUntrusted() and
+// TryPatchChunkContents() can be called concurrently from different threads
+// (see TracingService::InitOpts::num_commit_threads). The space for a chunk is
+// reserved under a lock, but its payload is copied outside of it, so the
+// memcpy()s of different chunks run in parallel. The caller has to guarantee
+// that the patches for a chunk are applied after the chunk itself has been
+// copied, and that reads don't overlap with writes. Otherwise, with a single
+// writing thread, no lock is taken.
+//
 // Reading from the buffer
 // -----------------------
 // This class supports one reader only (the consumer). Reads are NOT idempotent
@@ -151,8 +165,11 @@ class TraceBuffer {
     std::array<uint8_t, kSize> data;
   };
 
-  // Can return nullptr if the memory allocation fails.
-  static std::unique_ptr<TraceBuffer> Create(size_t size_in_bytes);
+  // Can return nullptr if the memory allocation fails. |alloc_flags| are
+  // base::PagedMemory::AllocationFlags, on top of the default lazy commit (e.g.
+  // kHugePages, kPopulate).
+  static std::unique_ptr<TraceBuffer> Create(size_t size_in_bytes,
+                                             int alloc_flags = 0);
 
   ~TraceBuffer();
 
@@ -185,6 +202,10 @@ class TraceBuffer {
                              size_t patches_size,
                              bool other_patches_pending);
 
+  // Whether CopyChunkUntrusted() and TryPatchChunkContents() can be called
+  // from more than one thread. Must be set before the first write.
+  void set_concurrent_writers(bool value) { concurrent_writers_ = value; }
+
   // To read the contents of the buffer the caller needs to:
   //   BeginRead()
   //   while (ReadNextTracePacket(packet_fragments)) { ... }
@@ -217,6 +238,7 @@ class TraceBuffer {
   //   P1, P5, P7, P4 (P4 cannot come after P5)
   bool ReadNextTracePacket(TracePacket*, uid_t* producer_uid);
 
+  // Like reads, must not overlap with writes.
   const Stats& stats() const { return stats_; }
   size_t size() const { return size_; }
 
@@ -410,7 +432,7 @@ class TraceBuffer {
   TraceBuffer(const TraceBuffer&) = delete;
   TraceBuffer& operator=(const TraceBuffer&) = delete;
 
-  bool Initialize(size_t size);
+  bool Initialize(size_t size, int alloc_flags);
 
   // Returns an object that allows to iterate over chunks in the |index_| that
   // have the same {ProducerID, WriterID} of
@@ -451,6 +473,11 @@ class TraceBuffer {
   // (60 - 42), the distance between chunk 5 and the end of the deletion range.
   size_t DeleteNextChunksFor(size_t bytes_to_clear);
 
+  // Returns true if making room for a record of |record_size| bytes at |wptr_|
+  // would overwrite a chunk whose payload is still being copied by another
+  // thread. Must be called with |lock_| held.
+  bool OverlapsWritesInFlight(size_t record_size) const;
+
   // Decodes the boundaries of the next packet (or a fragment) pointed by
   // ChunkMeta and pushes that into |TracePacket|. It also increments the
   // |num_fragments_read| counter.
@@ -475,7 +502,8 @@ class TraceBuffer {
 
   // |src| can be nullptr (in which case |size| must be ==
   // record.size - sizeof(ChunkRecord)), for the case of writing a padding
-  // record. |wptr_| is NOT advanced by this function, the caller must do that.
+  // record, or when the caller copies the payload itself. |wptr_| is NOT
+  // advanced by this function, the caller must do that.
   void WriteChunkRecord(const ChunkRecord& record,
                         const uint8_t* src,
                         size_t size) {
@@ -496,11 +524,8 @@ class TraceBuffer {
     // Deliberately not a *D*CHECK.
     PERFETTO_CHECK(wptr_ + sizeof(record) + size <= end());
     memcpy(wptr_, &record, sizeof(record));
-    if (PERFETTO_LIKELY(src)) {
+    if (src)
       memcpy(wptr_ + sizeof(record), src, size);
-    } else {
-      PERFETTO_DCHECK(size == record.size - sizeof(record));
-    }
     const size_t rounding_size = record.size - sizeof(record) - size;
     memset(wptr_ + sizeof(record) + size, 0, rounding_size);
   }
@@ -534,6 +559,18 @@ class TraceBuffer {
   // Statistics about buffer usage.
   Stats stats_;
 
+  // See set_concurrent_writers().
+  bool concurrent_writers_ = false;
+
+  // Held by writers for everything but the copy of the chunks' payload. Only
+  // used with |concurrent_writers_|.
+  std::mutex lock_;
+
+  // The records whose payload is being copied outside of |lock_|. Protected by
+  // |lock_|, signaled through |write_completed_| when an entry is removed.
+  std::vector<const ChunkRecord*> writes_in_flight_;
+  std::condition_variable write_completed_;
+
 #if PERFETTO_DCHECK_IS_ON()
   bool changed_since_last_read_ = false;
 #endif
@@ -17,8 +17,10 @@
 #include <string.h>
 
 #include <initializer_list>
+#include <map>
 #include <random>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "perfetto/protozero/proto_utils.h"
@@ -1196,6 +1198,69 @@ TEST_F(TraceBufferTest, Iterator_ManyStreamsWrapping) {
   ASSERT_TRUE(IteratorSeqEq(ProducerID(3), WriterID(1), {Neg(-1), 0, 1}));
 }
 
+// --------------------
+// Concurrent writers
+// --------------------
+
+// Each thread writes its own sequence, one packet per chunk, with a payload
+// that depends on the ChunkID so that torn copies are detected when reading.
+TEST_F(TraceBufferTest, ConcurrentWriters) {
+  const size_t kNumThreads = 4;
+  const ChunkID kNumChunks = 250;  // Fits in the char seed of the packets.
+  const size_t kPacketSize = 500;
+  for (size_t buf_size : {1024 * 1024, 16 * 1024}) {
+    ResetBuffer(buf_size);
+    trace_buffer()->set_concurrent_writers(true);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kNumThreads; t++) {
+      threads.emplace_back([this, t, kNumChunks, kPacketSize] {
+        ProducerID p = static_cast<ProducerID>(t + 1);
+        for (ChunkID c = 0; c < kNumChunks; c++) {
+          CreateChunk(p, 1, c)
+              .SetUID(p)
+              .AddPacket(kPacketSize, static_cast<char>(c))
+              .CopyIntoTraceBuffer();
+        }
+      });
+    }
+    for (std::thread& thread : threads)
+      thread.join();
+
+    // Chunks are overwritten in the order in which each thread wrote them, so
+    // every sequence has to end with its last chunk, without holes.
+    std::map<uint32_t, ChunkID> next_chunk;
+    trace_buffer()->BeginRead();
+    for (;;) {
+      uint32_t uid = 0;
+      std::vector<FakePacketFragment> packet = ReadPacket(&uid);
+      if (packet.empty())
+        break;
+      ASSERT_GE(uid, 1u);
+      ASSERT_LE(uid, kNumThreads);
+      ChunkID& c = next_chunk[uid];
+      if (buf_size < kNumThreads * kNumChunks * kPacketSize) {
+        while (c < kNumChunks &&
+               !(packet[0] == FakePacketFragment(kPacketSize,
+                                                  static_cast<char>(c)))) {
+          c++;
+        }
+      }
+      ASSERT_LT(c, kNumChunks);
+      ASSERT_THAT(packet, ElementsAre(FakePacketFragment(
+                              kPacketSize, static_cast<char>(c))));
+      c++;
+    }
+    // When wrapping, the sequences of the threads that finished first might
+    // have been overwritten entirely.
+    if (buf_size < kNumThreads * kNumChunks * kPacketSize)
+      ASSERT_FALSE(next_chunk.empty());
+    else
+      ASSERT_EQ(kNumThreads, next_chunk.size());
+    for (const auto& uid_and_next_chunk : next_chunk)
+      EXPECT_EQ(kNumChunks, uid_and_next_chunk.second);
+  }
+}
+
 // TODO(primiano): test stats().
 // TODO(primiano): test multiple streams interleaved.
 // TODO(primiano): more testing on packet merging.
@@ -194,6 +194,16 @@ void TraceConfig::BufferConfig::FromProto(
   static_assert(sizeof(fill_policy_) == sizeof(proto.fill_policy()),
                 "size mismatch");
   fill_policy_ = static_cast<decltype(fill_policy_)>(proto.fill_policy());
+
+  static_assert(sizeof(transparent_huge_pages_) ==
+                    sizeof(proto.transparent_huge_pages()),
+                "size mismatch");
+  transparent_huge_pages_ = static_cast<decltype(transparent_huge_pages_)>(
+      proto.transparent_huge_pages());
+
+  static_assert(sizeof(prefault_) == sizeof(proto.prefault()),
+                "size mismatch");
+  prefault_ = static_cast<decltype(prefault_)>(proto.prefault());
   unknown_fields_ = proto.unknown_fields();
 }
 
@@ -208,6 +218,17 @@ void TraceConfig::BufferConfig::ToProto(
                 "size mismatch");
   proto->set_fill_policy(
       static_cast<decltype(proto->fill_policy())>(fill_policy_));
+
+  static_assert(sizeof(transparent_huge_pages_) ==
+                    sizeof(proto->transparent_huge_pages()),
+                "size mismatch");
+  proto->set_transparent_huge_pages(
+      static_cast<decltype(proto->transparent_huge_pages())>(
+          transparent_huge_pages_));
+
+  static_assert(sizeof(prefault_) == sizeof(proto->prefault()),
+                "size mismatch");
+  proto->set_prefault(static_cast<decltype(proto->prefault())>(prefault_));
   *(proto->mutable_unknown_fields()) = unknown_fields_;
 }
 
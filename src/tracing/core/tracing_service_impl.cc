@@ -24,6 +24,7 @@
 #include <string.h>
 
 #if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #endif
@@ -32,6 +33,7 @@
 
 #include "perfetto/base/build_config.h"
 #include "perfetto/base/file_utils.h"
+#include "perfetto/base/metatrace.h"
 #include "perfetto/base/task_runner.h"
 #include "perfetto/base/utils.h"
 #include "perfetto/tracing/core/consumer.h"
@@ -41,6 +43,7 @@
 #include "perfetto/tracing/core/shared_memory_abi.h"
 #include "perfetto/tracing/core/trace_packet.h"
 #include "perfetto/tracing/core/trace_writer.h"
+#include "src/tracing/core/commit_thread.h"
 #include "src/tracing/core/packet_stream_validator.h"
 #include "src/tracing/core/shared_memory_arbiter_impl.h"
 #include "src/tracing/core/trace_buffer.h"
@@ -61,7 +64,10 @@ constexpr int kMaxBuffersPerConsumer = 128;
 constexpr base::TimeMillis kSnapshotsInterval(10 * 1000);
 constexpr int kDefaultWriteIntoFilePeriodMs = 5000;
 constexpr int kFlushTimeoutMs = 1000;
+constexpr uint32_t kReadBuffersRetryDelayMs = 10;
+constexpr uint32_t kCommitThreadsPollMs = 1;
 constexpr int kMaxConcurrentTracingSessions = 5;
+constexpr char kMetatraceDataSourceName[] = "perfetto.metatrace";
 
 constexpr uint64_t kMillisPerHour = 3600000;
 
@@ -99,6 +105,67 @@ uid_t geteuid() {
   return 0;
 }
 #endif  // PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+
+// Writes |packets| into |fd| as a sequence of root trace.proto |packet|
+// fields, pointing writev() directly at the packet slices. Stops before the
+// first packet that would make the total exceed |max_size|. Returns false if
+// |max_size| was reached or writev() failed.
+bool WritePacketsIntoFile(int fd,
+                          std::vector<TracePacket>* packets,
+                          uint64_t max_size,
+                          uint64_t* bytes_written) {
+  // When writing into a file, the file should look like a root trace.proto
+  // message. Each packet should be prepended with a proto preamble stating
+  // its field id (within trace.proto) and size. Hence the addition below.
+  size_t max_iovecs = packets->size();
+  for (const TracePacket& packet : *packets)
+    max_iovecs += packet.slices().size();
+
+  bool ok = true;
+  size_t num_iovecs = 0;
+  std::unique_ptr<struct iovec[]> iovecs(new struct iovec[max_iovecs]);
+  size_t num_iovecs_at_last_packet = 0;
+  uint64_t bytes_about_to_be_written = 0;
+  for (TracePacket& packet : *packets) {
+    std::tie(iovecs[num_iovecs].iov_base, iovecs[num_iovecs].iov_len) =
+        packet.GetProtoPreamble();
+    bytes_about_to_be_written += iovecs[num_iovecs].iov_len;
+    num_iovecs++;
+    for (const Slice& slice : packet.slices()) {
+      // writev() doesn't change the passed pointer. However, struct iovec
+      // take a non-const ptr because it's the same struct used by readv().
+      // Hence the const_cast here.
+      char* start = static_cast<char*>(const_cast<void*>(slice.start));
+      bytes_about_to_be_written += slice.size;
+      iovecs[num_iovecs++] = {start, slice.size};
+    }
+
+    if (bytes_about_to_be_written >= max_size) {
+      ok = false;
+      num_iovecs = num_iovecs_at_last_packet;
+      break;
+    }
+
+    num_iovecs_at_last_packet = num_iovecs;
+  }
+  PERFETTO_DCHECK(num_iovecs <= max_iovecs);
+
+  *bytes_written = 0;
+
+  // writev() can take at most IOV_MAX entries per call. Batch them.
+  constexpr size_t kIOVMax = IOV_MAX;
+  for (size_t i = 0; i < num_iovecs; i += kIOVMax) {
+    int iov_batch_size = static_cast<int>(std::min(num_iovecs - i, kIOVMax));
+    ssize_t wr_size = PERFETTO_EINTR(writev(fd, &iovecs[i], iov_batch_size));
+    if (wr_size <= 0) {
+      PERFETTO_PLOG("writev() failed");
+      return false;
+    }
+    *bytes_written += static_cast<size_t>(wr_size);
+  }
+  return ok;
+}
+
 }  // namespace
 
 // These constants instead are defined in the header because are used by tests.
@@ -111,19 +178,30 @@ constexpr uint8_t TracingServiceImpl::kSyncMarker[];
 std::unique_ptr<TracingService> TracingService::CreateInstance(
     std::unique_ptr<SharedMemory::Factory> shm_factory,
     base::TaskRunner* task_runner) {
+  return CreateInstance(std::move(shm_factory), task_runner, InitOpts());
+}
+
+// static
+std::unique_ptr<TracingService> TracingService::CreateInstance(
+    std::unique_ptr<SharedMemory::Factory> shm_factory,
+    base::TaskRunner* task_runner,
+    const InitOpts& init_opts) {
   return std::unique_ptr<TracingService>(
-      new TracingServiceImpl(std::move(shm_factory), task_runner));
+      new TracingServiceImpl(std::move(shm_factory), task_runner, init_opts));
 }
 
 TracingServiceImpl::TracingServiceImpl(
     std::unique_ptr<SharedMemory::Factory> shm_factory,
-    base::TaskRunner* task_runner)
+    base::TaskRunner* task_runner,
+    const InitOpts& init_opts)
     : task_runner_(task_runner),
       shm_factory_(std::move(shm_factory)),
       uid_(getuid()),
       buffer_ids_(kMaxTraceBufferID),
       weak_ptr_factory_(this) {
   PERFETTO_DCHECK(task_runner_);
+  for (size_t i = 0; i < init_opts.num_commit_threads; i++)
+    commit_threads_.emplace_back(new CommitThread());
 }
 
 TracingServiceImpl::~TracingServiceImpl() {
@@ -165,6 +243,19 @@ void TracingServiceImpl::DisconnectProducer(ProducerID id) {
   PERFETTO_DLOG("Producer %" PRIu16 " disconnected", id);
   PERFETTO_DCHECK(producers_.count(id));
 
+  // The commit thread might still be copying chunks out of the shared memory
+  // of the producer, which is unmapped as soon as this returns. The jobs that
+  // are held back have not started, they are just dropped.
+  CommitThread* commit_thread = GetCommitThread(id);
+  if (commit_thread)
+    commit_thread->WaitForIdle();
+  held_commit_jobs_.erase(
+      std::remove_if(held_commit_jobs_.begin(), held_commit_jobs_.end(),
+                     [id](const HeldCommitJob& held) {
+                       return held.producer_id == id;
+                     }),
+      held_commit_jobs_.end());
+
   for (auto it = data_sources_.begin(); it != data_sources_.end();) {
     auto next = it;
     next++;
@@ -318,14 +409,21 @@ bool TracingServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
     tracing_session->buffers_index.push_back(global_id);
     const size_t buf_size_bytes = buffer_cfg.size_kb() * 1024u;
     total_buf_size_kb += buffer_cfg.size_kb();
-    auto it_and_inserted =
-        buffers_.emplace(global_id, TraceBuffer::Create(buf_size_bytes));
+    int alloc_flags = 0;
+    if (buffer_cfg.transparent_huge_pages())
+      alloc_flags |= base::PagedMemory::kHugePages;
+    if (buffer_cfg.prefault())
+      alloc_flags |= base::PagedMemory::kPopulate;
+    auto it_and_inserted = buffers_.emplace(
+        global_id, TraceBuffer::Create(buf_size_bytes, alloc_flags));
     PERFETTO_DCHECK(it_and_inserted.second);  // buffers_.count(global_id) == 0.
     std::unique_ptr<TraceBuffer>& trace_buffer = it_and_inserted.first->second;
     if (!trace_buffer) {
       did_allocate_all_buffers = false;
       break;
     }
+    // With a single commit thread, it is the only one that writes.
+    trace_buffer->set_concurrent_writers(commit_threads_.size() > 1);
   }
 
   UpdateMemoryGuardrail();
@@ -346,6 +444,14 @@ bool TracingServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
 
   consumer->tracing_session_id_ = tsid;
 
+  for (const TraceConfig::DataSource& cfg_data_source : cfg.data_sources()) {
+    if (cfg_data_source.config().name() == kMetatraceDataSourceName) {
+      tracing_session->metatrace_enabled = true;
+      base::metatrace::Enable();
+      break;
+    }
+  }
+
   // Setup the data sources on the producers without starting them.
   for (const TraceConfig::DataSource& cfg_data_source : cfg.data_sources()) {
     // Scan all the registered data sources with a matching name.
@@ -616,7 +722,7 @@ void TracingServiceImpl::Flush(TracingSessionID tsid,
   }
 
   auto weak_this = weak_ptr_factory_.GetWeakPtr();
-  task_runner_->PostDelayedTask(
+  pending_flush.timeout_task_id = task_runner_->PostCancelableDelayedTask(
       [weak_this, tsid, flush_request_id] {
         if (weak_this)
           weak_this->OnFlushTimeout(tsid, flush_request_id);
@@ -635,6 +741,9 @@ void TracingServiceImpl::NotifyFlushDoneForProducer(
       PendingFlush& pending_flush = it->second;
       pending_flush.producers.erase(producer_id);
       if (pending_flush.producers.empty()) {
+        // Most flushes complete well within their timeout: drop it rather
+        // than keeping the task around until it fires for nothing.
+        task_runner_->CancelDelayedTask(pending_flush.timeout_task_id);
         task_runner_->PostTask(
             std::bind(std::move(pending_flush.callback), /*success=*/true));
         it = pending_flushes.erase(it);
@@ -652,7 +761,7 @@ void TracingServiceImpl::OnFlushTimeout(TracingSessionID tsid,
     return;
   auto it = tracing_session->pending_flushes.find(flush_request_id);
   if (it == tracing_session->pending_flushes.end())
-    return;  // Nominal case: flush was completed and acked on time.
+    return;  // Flush acked on time, with a task runner that can't cancel.
   auto callback = std::move(it->second.callback);
   tracing_session->pending_flushes.erase(it);
   callback(/*success=*/false);
@@ -723,6 +832,33 @@ void TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
     return;
   }
 
+  // Don't read the buffers faster than the consumer receives the packets,
+  // e.g. when the IPC channel of a remote consumer is congested. Until then
+  // the packets are better off in the trace buffers than in a send queue.
+  if (consumer && !consumer->read_buffers_file_ &&
+      !consumer->consumer_->IsReadyForTraceData()) {
+    PostReadBuffers(tsid, consumer, kReadBuffersRetryDelayMs);
+    return;
+  }
+
+  PERFETTO_METATRACE(TRACING_SERVICE_READ_BUFFERS, 0);
+
+  // The packets read below point into the buffers, which must not be written
+  // until they are consumed at the end of this function. If the commit threads
+  // are still copying chunks, come back once they are done.
+  if (!CommitThreadsIdle()) {
+    const bool has_consumer = consumer != nullptr;
+    base::WeakPtr<ConsumerEndpointImpl> weak_consumer;
+    if (consumer)
+      weak_consumer = consumer->GetWeakPtr();
+    RunWhenCommitThreadsIdle([this, tsid, has_consumer, weak_consumer] {
+      if (has_consumer && !weak_consumer)
+        return;
+      ReadBuffers(tsid, weak_consumer.get());
+    });
+    return;
+  }
+
   std::vector<TracePacket> packets;
   packets.reserve(1024);  // Just an educated guess to avoid trivial expansions.
 
@@ -734,15 +870,13 @@ void TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
     SnapshotStats(tracing_session, &packets);
   }
   MaybeEmitTraceConfig(tracing_session, &packets);
+  MaybeEmitMetatrace(tracing_session, &packets);
 
   size_t packets_bytes = 0;  // SUM(slice.size() for each slice in |packets|).
-  size_t total_slices = 0;   // SUM(#slices in |packets|).
 
   // Add up size for packets added by the Maybe* calls above.
-  for (const TracePacket& packet : packets) {
+  for (const TracePacket& packet : packets)
     packets_bytes += packet.size();
-    total_slices += packet.slices().size();
-  }
 
   // This is a rough threshold to determine how much to read from the buffer in
   // each task. This is to avoid executing a single huge sending task for too
@@ -752,12 +886,16 @@ void TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
   // responsiveness of the service. An extremely small value will cause one IPC
   // and one PostTask for each slice but will keep the service extremely
   // responsive. An extremely large value will batch the send for the full
-  // buffer in one large task, will hit the blocking send() once the socket
-  // buffers are full and hang the service for a bit (until the consumer
-  // catches up).
+  // buffer in one large task and queue all of it in the IPC channel at once.
   static constexpr size_t kApproxBytesPerTask = 32768;
   bool did_hit_threshold = false;
 
+  // Writing into a file passed by the consumer doesn't go through the IPC
+  // channel, so it can use much larger batches.
+  const bool read_into_file = consumer && consumer->read_buffers_file_;
+  const size_t bytes_per_task =
+      read_into_file ? kApproxBytesPerTask * 32 : kApproxBytesPerTask;
+
   // TODO(primiano): Extend the ReadBuffers API to allow reading only some
   // buffers, not all of them in one go.
   for (size_t buf_idx = 0;
@@ -802,8 +940,7 @@ void TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
 
       // Append the packet (inclusive of the trusted uid) to |packets|.
       packets_bytes += packet.size();
-      total_slices += packet.slices().size();
-      did_hit_threshold = packets_bytes >= kApproxBytesPerTask &&
+      did_hit_threshold = packets_bytes >= bytes_per_task &&
                           !tracing_session->write_into_file;
       packets.emplace_back(std::move(packet));
     }  // for(packets...)
@@ -816,59 +953,14 @@ void TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
     const uint64_t max_size = tracing_session->max_file_size_bytes
                                   ? tracing_session->max_file_size_bytes
                                   : std::numeric_limits<size_t>::max();
-
-    // When writing into a file, the file should look like a root trace.proto
-    // message. Each packet should be prepended with a proto preamble stating
-    // its field id (within trace.proto) and size. Hence the addition below.
-    const size_t max_iovecs = total_slices + packets.size();
-
-    size_t num_iovecs = 0;
-    bool stop_writing_into_file = tracing_session->write_period_ms == 0;
-    std::unique_ptr<struct iovec[]> iovecs(new struct iovec[max_iovecs]);
-    size_t num_iovecs_at_last_packet = 0;
-    uint64_t bytes_about_to_be_written = 0;
-    for (TracePacket& packet : packets) {
-      std::tie(iovecs[num_iovecs].iov_base, iovecs[num_iovecs].iov_len) =
-          packet.GetProtoPreamble();
-      bytes_about_to_be_written += iovecs[num_iovecs].iov_len;
-      num_iovecs++;
-      for (const Slice& slice : packet.slices()) {
-        // writev() doesn't change the passed pointer. However, struct iovec
-        // take a non-const ptr because it's the same struct used by readv().
-        // Hence the const_cast here.
-        char* start = static_cast<char*>(const_cast<void*>(slice.start));
-        bytes_about_to_be_written += slice.size;
-        iovecs[num_iovecs++] = {start, slice.size};
-      }
-
-      if (tracing_session->bytes_written_into_file +
-              bytes_about_to_be_written >=
-          max_size) {
-        stop_writing_into_file = true;
-        num_iovecs = num_iovecs_at_last_packet;
-        break;
-      }
-
-      num_iovecs_at_last_packet = num_iovecs;
-    }
-    PERFETTO_DCHECK(num_iovecs <= max_iovecs);
-    int fd = *tracing_session->write_into_file;
-
+    const uint64_t max_wr_size =
+        max_size - tracing_session->bytes_written_into_file;
     uint64_t total_wr_size = 0;
-
-    // writev() can take at most IOV_MAX entries per call. Batch them.
-    constexpr size_t kIOVMax = IOV_MAX;
-    for (size_t i = 0; i < num_iovecs; i += kIOVMax) {
-      int iov_batch_size = static_cast<int>(std::min(num_iovecs - i, kIOVMax));
-      ssize_t wr_size = PERFETTO_EINTR(writev(fd, &iovecs[i], iov_batch_size));
-      if (wr_size <= 0) {
-        PERFETTO_PLOG("writev() failed");
-        stop_writing_into_file = true;
-        break;
-      }
-      total_wr_size += static_cast<size_t>(wr_size);
+    bool stop_writing_into_file = tracing_session->write_period_ms == 0;
+    if (!WritePacketsIntoFile(*tracing_session->write_into_file, &packets,
+                              max_wr_size, &total_wr_size)) {
+      stop_writing_into_file = true;
     }
-
     tracing_session->bytes_written_into_file += total_wr_size;
 
     PERFETTO_DLOG("Draining into file, written: %" PRIu64 " KB, stop: %d",
@@ -891,21 +983,50 @@ void TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
     return;
   }  // if (tracing_session->write_into_file)
 
-  const bool has_more = did_hit_threshold;
+  bool has_more = did_hit_threshold;
+
+  // If the consumer passed a file descriptor to ReadBuffers(), write the
+  // packets straight into it rather than handing them to the consumer.
+  if (read_into_file) {
+    uint64_t wr_size = 0;
+    if (!WritePacketsIntoFile(*consumer->read_buffers_file_, &packets,
+                              std::numeric_limits<uint64_t>::max(),
+                              &wr_size)) {
+      has_more = false;
+    }
+    packets.clear();
+    if (!has_more)
+      consumer->read_buffers_file_.reset();
+  }
+
   if (has_more) {
-    auto weak_consumer = consumer->GetWeakPtr();
-    auto weak_this = weak_ptr_factory_.GetWeakPtr();
-    task_runner_->PostTask([weak_this, weak_consumer, tsid] {
-      if (!weak_this || !weak_consumer)
-        return;
-      weak_this->ReadBuffers(tsid, weak_consumer.get());
-    });
+    PostReadBuffers(tsid, consumer, /*delay_ms=*/0);
+    // When reading into a file, the consumer is notified only at the end.
+    if (read_into_file)
+      return;
   }
 
   // Keep this as tail call, just in case the consumer re-enters.
   consumer->consumer_->OnTraceData(std::move(packets), has_more);
 }
 
+void TracingServiceImpl::PostReadBuffers(TracingSessionID tsid,
+                                         ConsumerEndpointImpl* consumer,
+                                         uint32_t delay_ms) {
+  auto weak_consumer = consumer->GetWeakPtr();
+  auto weak_this = weak_ptr_factory_.GetWeakPtr();
+  auto task = [weak_this, weak_consumer, tsid] {
+    if (!weak_this || !weak_consumer)
+      return;
+    weak_this->ReadBuffers(tsid, weak_consumer.get());
+  };
+  if (delay_ms) {
+    task_runner_->PostDelayedTask(task, delay_ms);
+  } else {
+    task_runner_->PostTask(task);
+  }
+}
+
 void TracingServiceImpl::FreeBuffers(TracingSessionID tsid) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
   PERFETTO_DLOG("Freeing buffers for session %" PRIu64, tsid);
@@ -921,11 +1042,22 @@ void TracingServiceImpl::FreeBuffers(TracingSessionID tsid) {
     producer->OnFreeBuffers(tracing_session->buffers_index);
   }
 
+  // The commit threads might still have jobs that write into the buffers. The
+  // buffers are destroyed by whichever of them last runs a job posted after
+  // those, or right here without commit threads.
+  std::shared_ptr<std::vector<std::unique_ptr<TraceBuffer>>> freed_buffers(
+      new std::vector<std::unique_ptr<TraceBuffer>>());
   for (BufferID buffer_id : tracing_session->buffers_index) {
     buffer_ids_.Free(buffer_id);
     PERFETTO_DCHECK(buffers_.count(buffer_id) == 1);
-    buffers_.erase(buffer_id);
+    auto it = buffers_.find(buffer_id);
+    freed_buffers->push_back(std::move(it->second));
+    buffers_.erase(it);
   }
+  for (const auto& commit_thread : commit_threads_)
+    PostCommitJob(commit_thread.get(), 0, [freed_buffers] {});
+  if (tracing_session->metatrace_enabled)
+    base::metatrace::Disable();
   tracing_sessions_.erase(tsid);
   UpdateMemoryGuardrail();
 
@@ -1121,11 +1253,24 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
     const uint8_t* src,
     size_t size) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
+  TraceBuffer* buf =
+      GetTargetBufferForChunk(producer_id_trusted, writer_id, buffer_id);
+  if (!buf)
+    return;
+  buf->CopyChunkUntrusted(producer_id_trusted, producer_uid_trusted, writer_id,
+                          chunk_id, num_fragments, chunk_flags, src, size);
+}
+
+TraceBuffer* TracingServiceImpl::GetTargetBufferForChunk(
+    ProducerID producer_id_trusted,
+    WriterID writer_id,
+    BufferID buffer_id) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
 
   ProducerEndpointImpl* producer = GetProducer(producer_id_trusted);
   if (!producer) {
     PERFETTO_DFATAL("Producer not found.");
-    return;
+    return nullptr;
   }
 
   TraceBuffer* buf = GetBufferByID(buffer_id);
@@ -1133,7 +1278,7 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
     PERFETTO_DLOG("Could not find target buffer %" PRIu16
                   " for producer %" PRIu16,
                   buffer_id, producer_id_trusted);
-    return;
+    return nullptr;
   }
 
   // Verify that the producer is actually allowed to write into the target
@@ -1145,7 +1290,7 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
                   " tried to write into forbidden target buffer %" PRIu16,
                   producer_id_trusted, buffer_id);
     PERFETTO_DFATAL("Forbidden target buffer");
-    return;
+    return nullptr;
   }
 
   // If the writer was registered by the producer, it should only write into the
@@ -1159,11 +1304,9 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
                   writer_id, producer_id_trusted, *associated_buffer,
                   buffer_id);
     PERFETTO_DCHECK(false);
-    return;
+    return nullptr;
   }
-
-  buf->CopyChunkUntrusted(producer_id_trusted, producer_uid_trusted, writer_id,
-                          chunk_id, num_fragments, chunk_flags, src, size);
+  return buf;
 }
 
 void TracingServiceImpl::ApplyChunkPatches(
@@ -1172,44 +1315,64 @@ void TracingServiceImpl::ApplyChunkPatches(
   PERFETTO_DCHECK_THREAD(thread_checker_);
 
   for (const auto& chunk : chunks_to_patch) {
-    const ChunkID chunk_id = static_cast<ChunkID>(chunk.chunk_id());
-    const WriterID writer_id = static_cast<WriterID>(chunk.writer_id());
-    TraceBuffer* buf =
-        GetBufferByID(static_cast<BufferID>(chunk.target_buffer()));
-    static_assert(std::numeric_limits<ChunkID>::max() == kMaxChunkID,
-                  "Add a '|| chunk_id > kMaxChunkID' below if this fails");
-    if (!writer_id || writer_id > kMaxWriterID || !buf) {
-      PERFETTO_DLOG(
-          "Received invalid chunks_to_patch request from Producer: %" PRIu16
-          ", BufferID: %" PRIu32 " ChunkdID: %" PRIu32 " WriterID: %" PRIu16,
-          producer_id_trusted, chunk.target_buffer(), chunk_id, writer_id);
-      continue;
-    }
-    // Speculate on the fact that there are going to be a limited amount of
-    // patches per request, so we can allocate the |patches| array on the stack.
-    std::array<TraceBuffer::Patch, 1024> patches;  // Uninitialized.
-    if (chunk.patches().size() > patches.size()) {
-      PERFETTO_DFATAL("Too many patches (%zu) batched in the same request",
-                      patches.size());
-      continue;
-    }
+    TraceBuffer* buf = GetTargetBufferForPatch(producer_id_trusted, chunk);
+    if (buf)
+      PatchChunk(buf, producer_id_trusted, chunk);
+  }
+}
 
-    size_t i = 0;
-    for (const auto& patch : chunk.patches()) {
-      const std::string& patch_data = patch.data();
-      if (patch_data.size() != patches[i].data.size()) {
-        PERFETTO_DLOG("Received patch from producer: %" PRIu16
-                      " of unexpected size %zu",
-                      producer_id_trusted, patch_data.size());
-        continue;
-      }
-      patches[i].offset_untrusted = patch.offset();
-      memcpy(&patches[i].data[0], patch_data.data(), patches[i].data.size());
-      i++;
+TraceBuffer* TracingServiceImpl::GetTargetBufferForPatch(
+    ProducerID producer_id_trusted,
+    const CommitDataRequest::ChunkToPatch& chunk) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  const ChunkID chunk_id = static_cast<ChunkID>(chunk.chunk_id());
+  const WriterID writer_id = static_cast<WriterID>(chunk.writer_id());
+  TraceBuffer* buf =
+      GetBufferByID(static_cast<BufferID>(chunk.target_buffer()));
+  static_assert(std::numeric_limits<ChunkID>::max() == kMaxChunkID,
+                "Add a '|| chunk_id > kMaxChunkID' below if this fails");
+  if (!writer_id || writer_id > kMaxWriterID || !buf) {
+    PERFETTO_DLOG(
+        "Received invalid chunks_to_patch request from Producer: %" PRIu16
+        ", BufferID: %" PRIu32 " ChunkdID: %" PRIu32 " WriterID: %" PRIu16,
+        producer_id_trusted, chunk.target_buffer(), chunk_id, writer_id);
+    return nullptr;
+  }
+  return buf;
+}
+
+// static
+void TracingServiceImpl::PatchChunk(
+    TraceBuffer* buf,
+    ProducerID producer_id_trusted,
+    const CommitDataRequest::ChunkToPatch& chunk) {
+  const ChunkID chunk_id = static_cast<ChunkID>(chunk.chunk_id());
+  const WriterID writer_id = static_cast<WriterID>(chunk.writer_id());
+
+  // Speculate on the fact that there are going to be a limited amount of
+  // patches per request, so we can allocate the |patches| array on the stack.
+  std::array<TraceBuffer::Patch, 1024> patches;  // Uninitialized.
+  if (chunk.patches().size() > patches.size()) {
+    PERFETTO_DFATAL("Too many patches (%zu) batched in the same request",
+                    patches.size());
+    return;
+  }
+
+  size_t i = 0;
+  for (const auto& patch : chunk.patches()) {
+    const std::string& patch_data = patch.data();
+    if (patch_data.size() != patches[i].data.size()) {
+      PERFETTO_DLOG("Received patch from producer: %" PRIu16
+                    " of unexpected size %zu",
+                    producer_id_trusted, patch_data.size());
+      continue;
     }
-    buf->TryPatchChunkContents(producer_id_trusted, writer_id, chunk_id,
-                               &patches[0], i, chunk.has_more_patches());
+    patches[i].offset_untrusted = patch.offset();
+    memcpy(&patches[i].data[0], patch_data.data(), patches[i].data.size());
+    i++;
   }
+  buf->TryPatchChunkContents(producer_id_trusted, writer_id, chunk_id,
+                             &patches[0], i, chunk.has_more_patches());
 }
 
 TracingServiceImpl::TracingSession* TracingServiceImpl::GetTracingSession(
@@ -1238,6 +1401,80 @@ TraceBuffer* TracingServiceImpl::GetBufferByID(BufferID buffer_id) {
   return &*buf_iter->second;
 }
 
+CommitThread* TracingServiceImpl::GetCommitThread(ProducerID producer_id) {
+  if (commit_threads_.empty())
+    return nullptr;
+  return commit_threads_[producer_id % commit_threads_.size()].get();
+}
+
+void TracingServiceImpl::PostCommitJob(CommitThread* commit_thread,
+                                       ProducerID producer_id,
+                                       std::function<void()> job) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (hold_commit_jobs_) {
+    held_commit_jobs_.push_back({commit_thread, producer_id, std::move(job)});
+    return;
+  }
+  commit_thread->PostJob(std::move(job));
+}
+
+bool TracingServiceImpl::CommitThreadsIdle() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (running_idle_callbacks_)
+    return true;
+  if (hold_commit_jobs_)
+    return false;
+  for (const auto& commit_thread : commit_threads_) {
+    if (!commit_thread->IsIdle())
+      return false;
+  }
+  return true;
+}
+
+void TracingServiceImpl::RunWhenCommitThreadsIdle(
+    std::function<void()> callback) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (CommitThreadsIdle()) {
+    callback();
+    return;
+  }
+  idle_callbacks_.emplace_back(std::move(callback));
+  if (hold_commit_jobs_)
+    return;  // Already polling.
+  hold_commit_jobs_ = true;
+  PollCommitThreads();
+}
+
+void TracingServiceImpl::PollCommitThreads() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  for (const auto& commit_thread : commit_threads_) {
+    if (commit_thread->IsIdle())
+      continue;
+    auto weak_this = weak_ptr_factory_.GetWeakPtr();
+    task_runner_->PostDelayedTask(
+        [weak_this] {
+          if (weak_this)
+            weak_this->PollCommitThreads();
+        },
+        kCommitThreadsPollMs);
+    return;
+  }
+
+  // The callbacks can add more callbacks, which run right away.
+  running_idle_callbacks_ = true;
+  std::vector<std::function<void()>> callbacks;
+  callbacks.swap(idle_callbacks_);
+  for (std::function<void()>& callback : callbacks)
+    callback();
+  running_idle_callbacks_ = false;
+
+  hold_commit_jobs_ = false;
+  std::vector<HeldCommitJob> held_commit_jobs;
+  held_commit_jobs.swap(held_commit_jobs_);
+  for (HeldCommitJob& held : held_commit_jobs)
+    held.commit_thread->PostJob(std::move(held.job));
+}
+
 void TracingServiceImpl::UpdateMemoryGuardrail() {
 #if !PERFETTO_BUILDFLAG(PERFETTO_CHROMIUM_BUILD) && \
     !PERFETTO_BUILDFLAG(PERFETTO_OS_MACOSX)
@@ -1249,7 +1486,10 @@ void TracingServiceImpl::UpdateMemoryGuardrail() {
       total_buffer_bytes += id_to_producer.second->shared_memory()->size();
   }
 
-  // Sum up all the trace buffers.
+  // Sum up all the trace buffers. They are committed lazily, as they fill up,
+  // unless BufferConfig.prefault is set, so their full size is the upper bound
+  // of what they can take rather than what they take now. That holds also for
+  // huge pages, as the commit granularity grows but not the mapping size.
   for (const auto& id_to_buffer : buffers_) {
     total_buffer_bytes += id_to_buffer.second->size();
   }
@@ -1395,6 +1635,34 @@ void TracingServiceImpl::MaybeEmitTraceConfig(
   packets->back().AddSlice(std::move(slice));
 }
 
+void TracingServiceImpl::MaybeEmitMetatrace(TracingSession* tracing_session,
+                                            std::vector<TracePacket>* packets) {
+  if (!tracing_session->metatrace_enabled)
+    return;
+  // With more than one session, each event goes to the first that reads it.
+  std::vector<base::metatrace::Record> records;
+  uint64_t overruns = base::metatrace::ReadEvents(&records);
+  for (const base::metatrace::Record& record : records) {
+    protos::TrustedPacket packet;
+    packet.set_timestamp(record.timestamp_ns);
+    protos::PerfettoMetatrace* event = packet.mutable_perfetto_metatrace();
+    event->set_event_id(record.event_id);
+    event->set_event_duration_ns(record.duration_ns);
+    event->set_thread_id(record.thread_id);
+    if (record.arg)
+      event->set_arg(record.arg);
+    if (overruns) {
+      event->set_overruns(static_cast<uint32_t>(overruns));
+      overruns = 0;
+    }
+    packet.set_trusted_uid(static_cast<int32_t>(uid_));
+    Slice slice = Slice::Allocate(static_cast<size_t>(packet.ByteSize()));
+    PERFETTO_CHECK(packet.SerializeWithCachedSizesToArray(slice.own_data()));
+    packets->emplace_back();
+    packets->back().AddSlice(std::move(slice));
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // TracingServiceImpl::ConsumerEndpointImpl implementation
 ////////////////////////////////////////////////////////////////////////////////
@@ -1448,12 +1716,22 @@ void TracingServiceImpl::ConsumerEndpointImpl::DisableTracing() {
   service_->DisableTracing(tracing_session_id_);
 }
 
-void TracingServiceImpl::ConsumerEndpointImpl::ReadBuffers() {
+void TracingServiceImpl::ConsumerEndpointImpl::ReadBuffers(
+    base::ScopedFile fd) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
   if (!tracing_session_id_) {
     PERFETTO_LOG("Consumer called ReadBuffers() but tracing was not active");
     return;
   }
+  // The packets are written with blocking writev()s on the service thread,
+  // which a pipe or a socket that nobody drains would stall forever. Send them
+  // over IPC instead.
+  struct stat fd_stat;
+  if (fd && (fstat(*fd, &fd_stat) != 0 || !S_ISREG(fd_stat.st_mode))) {
+    PERFETTO_LOG("ReadBuffers() fd is not a regular file, sending the packets");
+    fd.reset();
+  }
+  read_buffers_file_ = std::move(fd);
   service_->ReadBuffers(tracing_session_id_, this);
 }
 
@@ -1551,6 +1829,15 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     return;
   }
   PERFETTO_DCHECK(shmem_abi_.is_valid());
+
+  PERFETTO_METATRACE(TRACING_SERVICE_COMMIT_DATA,
+                     req_untrusted.chunks_to_move().size());
+  CommitThread* commit_thread = service_->GetCommitThread(id_);
+  if (commit_thread) {
+    PostCommitDataJob(commit_thread, req_untrusted, std::move(callback));
+    return;
+  }
+
   for (const auto& entry : req_untrusted.chunks_to_move()) {
     const uint32_t page_idx = entry.page();
     if (page_idx >= shmem_abi_.num_pages())
@@ -1591,13 +1878,116 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     service_->NotifyFlushDoneForProducer(id_, req_untrusted.flush_request_id());
   }
 
-  // Keep this invocation last. ProducerIPCService::CommitData() relies on this
-  // callback being invoked within the same callstack and not posted. If this
-  // changes, the code there needs to be changed accordingly.
   if (callback)
     callback();
 }
 
+// Like the inline path of CommitData(), but the copies and patches happen on
+// |commit_thread|. The requests are validated here, on the service thread,
+// which owns the state needed for that. The flush notification and the
+// callback are posted back to the service thread once the chunks have been
+// copied, so that they are not observed before the data is in the buffers.
+void TracingServiceImpl::ProducerEndpointImpl::PostCommitDataJob(
+    CommitThread* commit_thread,
+    const CommitDataRequest& req_untrusted,
+    CommitDataCallback callback) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+
+  struct ChunkToCopy {
+    TraceBuffer* buf;
+    SharedMemoryABI::Chunk chunk;
+    WriterID writer_id;
+    ChunkID chunk_id;
+    uint16_t num_fragments;
+    uint8_t chunk_flags;
+  };
+  struct Job {
+    std::vector<ChunkToCopy> chunks_to_copy;
+    std::vector<std::pair<TraceBuffer*, CommitDataRequest::ChunkToPatch>>
+        chunks_to_patch;
+  };
+  // std::function<> requires copyable lambdas and SharedMemoryABI::Chunk is
+  // move-only.
+  std::shared_ptr<Job> job(new Job());
+
+  job->chunks_to_copy.reserve(req_untrusted.chunks_to_move().size());
+  for (const auto& entry : req_untrusted.chunks_to_move()) {
+    const uint32_t page_idx = entry.page();
+    if (page_idx >= shmem_abi_.num_pages())
+      continue;  // A buggy or malicious producer.
+
+    SharedMemoryABI::Chunk chunk =
+        shmem_abi_.TryAcquireChunkForReading(page_idx, entry.chunk());
+    if (!chunk.is_valid()) {
+      PERFETTO_DLOG("Asked to move chunk %d:%d, but it's not complete",
+                    entry.page(), entry.chunk());
+      continue;
+    }
+
+    // See the comments in CommitData() about the memory ordering.
+    BufferID buffer_id = static_cast<BufferID>(entry.target_buffer());
+    const SharedMemoryABI::ChunkHeader& chunk_header = *chunk.header();
+    WriterID writer_id = chunk_header.writer_id.load(std::memory_order_relaxed);
+    ChunkID chunk_id = chunk_header.chunk_id.load(std::memory_order_relaxed);
+    auto packets = chunk_header.packets.load(std::memory_order_relaxed);
+
+    TraceBuffer* buf =
+        service_->GetTargetBufferForChunk(id_, writer_id, buffer_id);
+    if (!buf) {
+      shmem_abi_.ReleaseChunkAsFree(std::move(chunk));
+      continue;
+    }
+    job->chunks_to_copy.push_back({buf, std::move(chunk), writer_id, chunk_id,
+                                   packets.count,
+                                   static_cast<uint8_t>(packets.flags)});
+  }  // for(chunks_to_move)
+
+  for (const auto& chunk : req_untrusted.chunks_to_patch()) {
+    TraceBuffer* buf = service_->GetTargetBufferForPatch(id_, chunk);
+    if (buf)
+      job->chunks_to_patch.emplace_back(buf, chunk);
+  }
+
+  // The shared memory and the buffers outlive the job: DisconnectProducer()
+  // waits for the commit thread, FreeBuffers() hands the buffers over to the
+  // commit threads.
+  SharedMemoryABI* shmem_abi = &shmem_abi_;
+  const ProducerID producer_id = id_;
+  const uid_t producer_uid = uid_;
+  const FlushRequestID flush_request_id = req_untrusted.flush_request_id();
+  base::TaskRunner* task_runner = task_runner_;
+  base::WeakPtr<ProducerEndpointImpl> weak_this =
+      weak_ptr_factory_.GetWeakPtr();
+  service_->PostCommitJob(commit_thread, id_, [job, shmem_abi, producer_id,
+                                              producer_uid, flush_request_id,
+                                              task_runner, weak_this,
+                                              callback] {
+    for (ChunkToCopy& entry : job->chunks_to_copy) {
+      entry.buf->CopyChunkUntrusted(
+          producer_id, producer_uid, entry.writer_id, entry.chunk_id,
+          entry.num_fragments, entry.chunk_flags, entry.chunk.payload_begin(),
+          entry.chunk.payload_size());
+      shmem_abi->ReleaseChunkAsFree(std::move(entry.chunk));
+    }
+    for (const auto& buf_and_chunk : job->chunks_to_patch) {
+      TracingServiceImpl::PatchChunk(buf_and_chunk.first, producer_id,
+                                     buf_and_chunk.second);
+    }
+    if (!flush_request_id && !callback)
+      return;
+    task_runner->PostTask([weak_this, flush_request_id, callback] {
+      if (!weak_this)
+        return;
+      if (flush_request_id) {
+        weak_this->service_->NotifyFlushDoneForProducer(weak_this->id_,
+                                                        flush_request_id);
+      }
+      if (callback)
+        callback();
+    });
+  });
+}
+
 void TracingServiceImpl::ProducerEndpointImpl::SetSharedMemory(
     std::unique_ptr<SharedMemory> shared_memory) {
   PERFETTO_DCHECK(!shared_memory_ && !shmem_abi_.is_valid());
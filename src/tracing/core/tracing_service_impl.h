@@ -21,10 +21,12 @@
 #include <map>
 #include <memory>
 #include <set>
+#include <vector>
 
 #include "perfetto/base/gtest_prod_util.h"
 #include "perfetto/base/logging.h"
 #include "perfetto/base/optional.h"
+#include "perfetto/base/task_runner.h"
 #include "perfetto/base/time.h"
 #include "perfetto/base/weak_ptr.h"
 #include "perfetto/tracing/core/basic_types.h"
@@ -37,10 +39,7 @@
 
 namespace perfetto {
 
-namespace base {
-class TaskRunner;
-}  // namespace base
-
+class CommitThread;
 class Consumer;
 class DataSourceConfig;
 class Producer;
@@ -109,6 +108,9 @@ class TracingServiceImpl : public TracingService {
     ProducerEndpointImpl(const ProducerEndpointImpl&) = delete;
     ProducerEndpointImpl& operator=(const ProducerEndpointImpl&) = delete;
     SharedMemoryArbiterImpl* GetOrCreateShmemArbiter();
+    void PostCommitDataJob(CommitThread*,
+                           const CommitDataRequest&,
+                           CommitDataCallback);
 
     ProducerID const id_;
     const uid_t uid_;
@@ -154,7 +156,7 @@ class TracingServiceImpl : public TracingService {
     void EnableTracing(const TraceConfig&, base::ScopedFile) override;
     void StartTracing() override;
     void DisableTracing() override;
-    void ReadBuffers() override;
+    void ReadBuffers(base::ScopedFile) override;
     void FreeBuffers() override;
     void Flush(uint32_t timeout_ms, FlushCallback) override;
 
@@ -167,12 +169,18 @@ class TracingServiceImpl : public TracingService {
     TracingServiceImpl* const service_;
     Consumer* const consumer_;
     TracingSessionID tracing_session_id_ = 0;
+
+    // The file passed to ReadBuffers(), if any, kept open until all the
+    // buffers have been written into it.
+    base::ScopedFile read_buffers_file_;
+
     PERFETTO_THREAD_CHECKER(thread_checker_)
     base::WeakPtrFactory<ConsumerEndpointImpl> weak_ptr_factory_;  // Keep last.
   };
 
-  explicit TracingServiceImpl(std::unique_ptr<SharedMemory::Factory>,
-                              base::TaskRunner*);
+  TracingServiceImpl(std::unique_ptr<SharedMemory::Factory>,
+                     base::TaskRunner*,
+                     const InitOpts& = InitOpts());
   ~TracingServiceImpl() override;
 
   // Called by ProducerEndpointImpl.
@@ -190,6 +198,19 @@ class TracingServiceImpl : public TracingService {
                                      size_t size);
   void ApplyChunkPatches(ProducerID,
                          const std::vector<CommitDataRequest::ChunkToPatch>&);
+
+  // Return the buffer into which the producer can copy the given chunk or apply
+  // the given patches, or nullptr if the request is invalid.
+  TraceBuffer* GetTargetBufferForChunk(ProducerID, WriterID, BufferID);
+  TraceBuffer* GetTargetBufferForPatch(ProducerID,
+                                       const CommitDataRequest::ChunkToPatch&);
+  static void PatchChunk(TraceBuffer*,
+                         ProducerID,
+                         const CommitDataRequest::ChunkToPatch&);
+
+  // Returns the thread that copies the chunks of the given producer, or nullptr
+  // if chunks are copied on the service thread.
+  CommitThread* GetCommitThread(ProducerID);
   void NotifyFlushDoneForProducer(ProducerID, FlushRequestID);
   void NotifyDataSourceStopped(ProducerID, const DataSourceInstanceID);
 
@@ -205,6 +226,9 @@ class TracingServiceImpl : public TracingService {
              ConsumerEndpoint::FlushCallback);
   void FlushAndDisableTracing(TracingSessionID);
   void ReadBuffers(TracingSessionID, ConsumerEndpointImpl*);
+  void PostReadBuffers(TracingSessionID,
+                       ConsumerEndpointImpl*,
+                       uint32_t delay_ms);
   void FreeBuffers(TracingSessionID);
 
   // Service implementation.
@@ -253,6 +277,8 @@ class TracingServiceImpl : public TracingService {
   struct PendingFlush {
     std::set<ProducerID> producers;
     ConsumerEndpoint::FlushCallback callback;
+    // The OnFlushTimeout() task, cancelled when all the producers ack.
+    base::TaskRunner::DelayedTaskId timeout_task_id = 0;
     explicit PendingFlush(decltype(callback) cb) : callback(std::move(cb)) {}
   };
 
@@ -310,6 +336,10 @@ class TracingServiceImpl : public TracingService {
     // Whether we mirrored the trace config back to the trace output yet.
     bool did_emit_config = false;
 
+    // Set if the config has the "perfetto.metatrace" data source. The service
+    // then emits its own PERFETTO_METATRACE events into the trace.
+    bool metatrace_enabled = false;
+
     State state = DISABLED;
 
     // This is set when the Consumer calls sets |write_into_file| == true in the
@@ -345,12 +375,28 @@ class TracingServiceImpl : public TracingService {
   void SnapshotClocks(std::vector<TracePacket>*);
   void SnapshotStats(TracingSession*, std::vector<TracePacket>*);
   void MaybeEmitTraceConfig(TracingSession*, std::vector<TracePacket>*);
+  void MaybeEmitMetatrace(TracingSession*, std::vector<TracePacket>*);
   void OnFlushTimeout(TracingSessionID, FlushRequestID);
   void OnDisableTracingTimeout(TracingSessionID);
   void DisableTracingNotifyConsumerAndFlushFile(TracingSession*);
   void PeriodicFlushTask(TracingSessionID, bool post_next_only);
   TraceBuffer* GetBufferByID(BufferID);
 
+  // Posts |job| to |commit_thread|, unless the commit jobs are being held back
+  // for RunWhenCommitThreadsIdle(). |producer_id| is the producer whose shared
+  // memory the job reads, or 0.
+  void PostCommitJob(CommitThread*, ProducerID, std::function<void()> job);
+
+  // Whether no commit thread can write into the trace buffers until the
+  // service thread posts more jobs.
+  bool CommitThreadsIdle();
+
+  // Runs |callback| once the commit threads have run all the jobs posted so
+  // far, without blocking the service thread: it polls them, and holds back
+  // the commit jobs posted in the meantime so that the threads get idle.
+  void RunWhenCommitThreadsIdle(std::function<void()> callback);
+  void PollCommitThreads();
+
   base::TaskRunner* const task_runner_;
   std::unique_ptr<SharedMemory::Factory> shm_factory_;
   ProducerID last_producer_id_ = 0;
@@ -375,6 +421,21 @@ class TracingServiceImpl : public TracingService {
   uint8_t sync_marker_packet_[32];  // Lazily initialized.
   size_t sync_marker_packet_size_ = 0;
 
+  // See TracingService::InitOpts::num_commit_threads. Declared after
+  // |buffers_|, so that the threads are joined before the buffers go away.
+  std::vector<std::unique_ptr<CommitThread>> commit_threads_;
+
+  // See RunWhenCommitThreadsIdle().
+  struct HeldCommitJob {
+    CommitThread* commit_thread;
+    ProducerID producer_id;
+    std::function<void()> job;
+  };
+  bool hold_commit_jobs_ = false;
+  bool running_idle_callbacks_ = false;
+  std::vector<HeldCommitJob> held_commit_jobs_;
+  std::vector<std::function<void()>> idle_callbacks_;
+
   PERFETTO_THREAD_CHECKER(thread_checker_)
 
   base::WeakPtrFactory<TracingServiceImpl>
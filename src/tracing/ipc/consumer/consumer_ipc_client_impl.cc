@@ -119,7 +119,7 @@ void ConsumerIPCClientImpl::DisableTracing() {
                                 std::move(async_response));
 }
 
-void ConsumerIPCClientImpl::ReadBuffers() {
+void ConsumerIPCClientImpl::ReadBuffers(base::ScopedFile fd) {
   if (!connected_) {
     PERFETTO_DLOG("Cannot ReadBuffers(), not connected to tracing service");
     return;
@@ -135,8 +135,11 @@ void ConsumerIPCClientImpl::ReadBuffers() {
       [this](ipc::AsyncResult<protos::ReadBuffersResponse> response) {
         OnReadBuffersResponse(std::move(response));
       });
-  consumer_port_.ReadBuffers(protos::ReadBuffersRequest(),
-                             std::move(async_response));
+  protos::ReadBuffersRequest req;
+  req.set_write_into_file(!!fd);
+
+  // As in EnableTracing(), the IPC layer dup()'s |fd| when sending the IPC.
+  consumer_port_.ReadBuffers(req, std::move(async_response), *fd);
 }
 
 void ConsumerIPCClientImpl::OnReadBuffersResponse(
@@ -62,7 +62,7 @@ class ConsumerIPCClientImpl : public TracingService::ConsumerEndpoint,
   void EnableTracing(const TraceConfig&, base::ScopedFile) override;
   void StartTracing() override;
   void DisableTracing() override;
-  void ReadBuffers() override;
+  void ReadBuffers(base::ScopedFile) override;
   void FreeBuffers() override;
   void Flush(uint32_t timeout_ms, FlushCallback) override;
 
@@ -31,6 +31,14 @@
 
 namespace perfetto {
 
+namespace {
+
+// The trace data is read from the buffers only while the replies to a remote
+// consumer that are still queued in the IPC channel are below this size.
+constexpr size_t kMaxQueuedTraceDataBytes = 16 * ipc::kIPCBufferSize;
+
+}  // namespace
+
 ConsumerIPCService::ConsumerIPCService(TracingService* core_service)
     : core_service_(core_service), weak_ptr_factory_(this) {}
 
@@ -42,7 +50,7 @@ ConsumerIPCService::GetConsumerForCurrentRequest() {
   PERFETTO_CHECK(ipc_client_id);
   auto it = consumers_.find(ipc_client_id);
   if (it == consumers_.end()) {
-    auto* remote_consumer = new RemoteConsumer();
+    auto* remote_consumer = new RemoteConsumer(this, ipc_client_id);
     consumers_[ipc_client_id].reset(remote_consumer);
     remote_consumer->service_endpoint =
         core_service_->ConnectConsumer(remote_consumer);
@@ -86,11 +94,19 @@ void ConsumerIPCService::DisableTracing(const protos::DisableTracingRequest&,
 }
 
 // Called by the IPC layer.
-void ConsumerIPCService::ReadBuffers(const protos::ReadBuffersRequest&,
+void ConsumerIPCService::ReadBuffers(const protos::ReadBuffersRequest& req,
                                      DeferredReadBuffersResponse resp) {
+  base::ScopedFile fd;
+  if (req.write_into_file()) {
+    fd = ipc::Service::TakeReceivedFD();
+    if (!fd) {
+      PERFETTO_DLOG("ReadBuffers() into file requested but no fd was passed");
+      return resp.Reject();
+    }
+  }
   RemoteConsumer* remote_consumer = GetConsumerForCurrentRequest();
   remote_consumer->read_buffers_response = std::move(resp);
-  remote_consumer->service_endpoint->ReadBuffers();
+  remote_consumer->service_endpoint->ReadBuffers(std::move(fd));
 }
 
 // Called by the IPC layer.
@@ -131,7 +147,11 @@ void ConsumerIPCService::OnFlushCallback(
 // RemoteConsumer methods
 ////////////////////////////////////////////////////////////////////////////////
 
-ConsumerIPCService::RemoteConsumer::RemoteConsumer() = default;
+ConsumerIPCService::RemoteConsumer::RemoteConsumer(
+    const ipc::Service* ipc_service,
+    ipc::ClientID client_id)
+    : ipc_service_(ipc_service), client_id_(client_id) {}
+
 ConsumerIPCService::RemoteConsumer::~RemoteConsumer() = default;
 
 // Invoked by the |core_service_| business logic after the ConnectConsumer()
@@ -149,6 +169,11 @@ void ConsumerIPCService::RemoteConsumer::OnTracingDisabled() {
   enable_tracing_response.Resolve(std::move(result));
 }
 
+bool ConsumerIPCService::RemoteConsumer::IsReadyForTraceData() {
+  return ipc_service_->GetClientSendQueueSize(client_id_) <
+         kMaxQueuedTraceDataBytes;
+}
+
 void ConsumerIPCService::RemoteConsumer::OnTraceData(
     std::vector<TracePacket> trace_packets,
     bool has_more) {
@@ -63,7 +63,7 @@ class ConsumerIPCService : public protos::ConsumerPort {
   // methods to the remote Consumer on the other side of the IPC channel.
   class RemoteConsumer : public Consumer {
    public:
-    RemoteConsumer();
+    RemoteConsumer(const ipc::Service*, ipc::ClientID);
     ~RemoteConsumer() override;
 
     // These methods are called by the |core_service_| business logic. There is
@@ -72,6 +72,7 @@ class ConsumerIPCService : public protos::ConsumerPort {
     void OnDisconnect() override;
     void OnTracingDisabled() override;
     void OnTraceData(std::vector<TracePacket>, bool has_more) override;
+    bool IsReadyForTraceData() override;
 
     // The interface obtained from the core service business logic through
     // TracingService::ConnectConsumer(this). This allows to invoke methods for
@@ -85,6 +86,10 @@ class ConsumerIPCService : public protos::ConsumerPort {
     // After EnableTracing() is invoked, this binds the async callback that
     // allows to send the OnTracingDisabled notification.
     DeferredEnableTracingResponse enable_tracing_response;
+
+   private:
+    const ipc::Service* const ipc_service_;
+    const ipc::ClientID client_id_;
   };
 
   // This has to be a container that doesn't invalidate iterators.
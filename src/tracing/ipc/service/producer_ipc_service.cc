@@ -18,6 +18,8 @@
 
 #include <inttypes.h>
 
+#include <memory>
+
 #include "perfetto/base/logging.h"
 #include "perfetto/base/task_runner.h"
 #include "perfetto/ipc/host.h"
@@ -200,13 +202,15 @@ void ProducerIPCService::CommitData(const protos::CommitDataRequest& proto_req,
   // context switches.
   std::function<void()> callback;
   if (resp.IsBound()) {
-    // Capturing |resp| by reference here speculates on the fact that
-    // CommitData() in tracing_service_impl.cc invokes the passed callback
-    // inline, without posting it. If that assumption changes this code needs to
-    // wrap the response in a shared_ptr (C+11 lambdas don't support move) and
-    // use a weak ptr in the caller.
-    callback = [&resp] {
-      resp.Resolve(ipc::AsyncResult<protos::CommitDataResponse>::Create());
+    // The service invokes the callback after this returns if it copies the
+    // chunks on a commit thread. The shared_ptr is because C++11 lambdas don't
+    // support move captures. If the producer disconnects in the meantime, the
+    // callback is dropped and the destructor of the Deferred rejects it.
+    std::shared_ptr<DeferredCommitDataResponse> shared_resp(
+        new DeferredCommitDataResponse(std::move(resp)));
+    callback = [shared_resp] {
+      shared_resp->Resolve(
+          ipc::AsyncResult<protos::CommitDataResponse>::Create());
     };
   }
   producer->service_endpoint->CommitData(req, callback);
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+
+#include "benchmark/benchmark.h"
+
+#include "perfetto/base/logging.h"
+#include "perfetto/base/unix_task_runner.h"
+#include "perfetto/ipc/client.h"
+#include "perfetto/ipc/host.h"
+#include "src/ipc/test/test_socket.h"
+
+#include "perfetto/ipc/producer_port.ipc.h"
+
+namespace {
+
+using perfetto::base::UnixTaskRunner;
+using perfetto::ipc::AsyncResult;
+using perfetto::ipc::Client;
+using perfetto::ipc::Deferred;
+using perfetto::ipc::Host;
+using perfetto::ipc::Service;
+using perfetto::ipc::ServiceProxy;
+using perfetto::protos::CommitDataRequest;
+using perfetto::protos::CommitDataResponse;
+using perfetto::protos::ProducerPortProxy;
+
+namespace protos = perfetto::protos;
+
+constexpr char kSockName[] = TEST_SOCK_NAME("commit_data_benchmark");
+
+// Acks all the CommitData() requests, as the service would do when the
+// producer asks to be notified (e.g. to complete a Flush()).
+class FakeProducerPort : public protos::ProducerPort {
+ public:
+  void CommitData(const CommitDataRequest&,
+                  DeferredCommitDataResponse response) override {
+    response.Resolve(AsyncResult<CommitDataResponse>::Create());
+  }
+
+  void InitializeConnection(const protos::InitializeConnectionRequest&,
+                            DeferredInitializeConnectionResponse) override {}
+  void RegisterDataSource(const protos::RegisterDataSourceRequest&,
+                          DeferredRegisterDataSourceResponse) override {}
+  void UnregisterDataSource(const protos::UnregisterDataSourceRequest&,
+                            DeferredUnregisterDataSourceResponse) override {}
+  void RegisterTraceWriter(const protos::RegisterTraceWriterRequest&,
+                           DeferredRegisterTraceWriterResponse) override {}
+  void UnregisterTraceWriter(const protos::UnregisterTraceWriterRequest&,
+                             DeferredUnregisterTraceWriterResponse) override {}
+  void NotifyDataSourceStopped(
+      const protos::NotifyDataSourceStoppedRequest&,
+      DeferredNotifyDataSourceStoppedResponse) override {}
+  void GetAsyncCommand(const protos::GetAsyncCommandRequest&,
+                       DeferredGetAsyncCommandResponse) override {}
+};
+
+class QuitOnConnect : public ServiceProxy::EventListener {
+ public:
+  explicit QuitOnConnect(UnixTaskRunner* task_runner)
+      : task_runner_(task_runner) {}
+  void OnConnect() override { task_runner_->Quit(); }
+  void OnDisconnect() override { PERFETTO_FATAL("Disconnected"); }
+
+ private:
+  UnixTaskRunner* const task_runner_;
+};
+
+}  // namespace
+
+// Measures the IPC round trip of a CommitData() request, from the producer
+// serializing it to the producer receiving the ack. Host and client share the
+// same thread, so this measures the CPU cost rather than the latency.
+static void BM_CommitDataRoundTrip(benchmark::State& state) {
+  DESTROY_TEST_SOCK(kSockName);
+  UnixTaskRunner task_runner;
+  std::unique_ptr<Host> host = Host::CreateInstance(kSockName, &task_runner);
+  PERFETTO_CHECK(host);
+  PERFETTO_CHECK(host->ExposeService(
+      std::unique_ptr<Service>(new FakeProducerPort())));
+
+  QuitOnConnect listener(&task_runner);
+  std::unique_ptr<Client> client =
+      Client::CreateInstance(kSockName, &task_runner);
+  ProducerPortProxy producer_port(&listener);
+  client->BindService(producer_port.GetWeakPtr());
+  task_runner.Run();
+
+  // A realistic request: a batch of chunks to move plus a few patches.
+  CommitDataRequest req;
+  const uint32_t num_chunks = static_cast<uint32_t>(state.range(0));
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    auto* chunk = req.add_chunks_to_move();
+    chunk->set_page(i / 4);
+    chunk->set_chunk(i % 4);
+    chunk->set_target_buffer(1);
+    if (i % 8)
+      continue;
+    auto* chunk_to_patch = req.add_chunks_to_patch();
+    chunk_to_patch->set_target_buffer(1);
+    chunk_to_patch->set_writer_id(i);
+    chunk_to_patch->set_chunk_id(i);
+    auto* patch = chunk_to_patch->add_patches();
+    patch->set_offset(i);
+    patch->set_data("\x01\x02\x03\x04");
+  }
+
+  uint64_t acks = 0;
+  while (state.KeepRunning()) {
+    Deferred<CommitDataResponse> response;
+    response.Bind([&acks, &task_runner](
+                      AsyncResult<CommitDataResponse> reply) {
+      PERFETTO_CHECK(reply.success());
+      acks++;
+      task_runner.Quit();
+    });
+    producer_port.CommitData(req, std::move(response));
+    task_runner.Run();
+  }
+  PERFETTO_CHECK(acks == static_cast<uint64_t>(state.iterations()));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          req.ByteSize());
+
+  client.reset();
+  host.reset();
+  DESTROY_TEST_SOCK(kSockName);
+}
+
+BENCHMARK(BM_CommitDataRoundTrip)
+    ->Unit(benchmark::kMicrosecond)
+    ->Arg(1)
+    ->Arg(16)
+    ->Arg(256);
@@ -92,7 +92,8 @@ MockConsumer::FlushRequest MockConsumer::Flush(uint32_t timeout_ms) {
   return FlushRequest(wait_for_flush_completion);
 }
 
-std::vector<protos::TracePacket> MockConsumer::ReadBuffers() {
+std::vector<protos::TracePacket> MockConsumer::ReadBuffers(
+    base::ScopedFile fd) {
   std::vector<protos::TracePacket> decoded_packets;
   static int i = 0;
   std::string checkpoint_name = "on_read_buffers_" + std::to_string(i++);
@@ -109,7 +110,7 @@ std::vector<protos::TracePacket> MockConsumer::ReadBuffers() {
             if (!has_more)
               on_read_buffers();
           }));
-  service_endpoint_->ReadBuffers();
+  service_endpoint_->ReadBuffers(std::move(fd));
   task_runner_->RunUntilCheckpoint(checkpoint_name);
   return decoded_packets;
 }
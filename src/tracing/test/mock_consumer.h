@@ -53,7 +53,8 @@ class MockConsumer : public Consumer {
   void FreeBuffers();
   void WaitForTracingDisabled(uint32_t timeout_ms = 3000);
   FlushRequest Flush(uint32_t timeout_ms = 10000);
-  std::vector<protos::TracePacket> ReadBuffers();
+  std::vector<protos::TracePacket> ReadBuffers(
+      base::ScopedFile = base::ScopedFile());
 
   TracingService::ConsumerEndpoint* endpoint() {
     return service_endpoint_.get();
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "perfetto/base/logging.h"
+#include "perfetto/base/paged_memory.h"
+#include "src/tracing/core/trace_buffer.h"
+
+namespace {
+
+using perfetto::ChunkID;
+using perfetto::ProducerID;
+using perfetto::TraceBuffer;
+using perfetto::WriterID;
+using perfetto::base::PagedMemory;
+
+constexpr size_t kBufferSize = 64 * 1024 * 1024;
+
+// The size of the chunks of the producers' shared memory buffers with the
+// default page layout, minus the header that CopyChunkUntrusted() adds back.
+constexpr size_t kChunkPayloadSize = 4096 - 16;
+
+// Copies |bytes| worth of chunks into |buf|.
+void CopyChunks(TraceBuffer* buf,
+                const std::vector<uint8_t>& chunk,
+                size_t bytes,
+                ChunkID* chunk_id) {
+  for (size_t copied = 0; copied < bytes; copied += chunk.size()) {
+    buf->CopyChunkUntrusted(ProducerID(1), 0 /* uid */, WriterID(1),
+                            (*chunk_id)++, 1 /* num_fragments */,
+                            0 /* chunk_flags */, chunk.data(), chunk.size());
+  }
+}
+
+// The args are the PagedMemory::AllocationFlags of the buffer.
+void AllocFlagsArgs(benchmark::internal::Benchmark* b) {
+  b->Arg(0);
+  b->Arg(PagedMemory::kHugePages);
+  b->Arg(PagedMemory::kPopulate);
+  b->Arg(PagedMemory::kHugePages | PagedMemory::kPopulate);
+}
+
+std::unique_ptr<TraceBuffer> CreateBuffer(benchmark::State& state) {
+  std::unique_ptr<TraceBuffer> buf =
+      TraceBuffer::Create(kBufferSize, static_cast<int>(state.range(0)));
+  PERFETTO_CHECK(buf);
+  return buf;
+}
+
+}  // namespace
+
+// The first pass over a fresh buffer, which takes the page faults unless the
+// buffer was prefaulted. The allocation is timed too, as that is where the
+// prefaulting moves the cost to.
+static void BM_TraceBuffer_FirstPass(benchmark::State& state) {
+  std::vector<uint8_t> chunk(kChunkPayloadSize, 'x');
+  ChunkID chunk_id = 0;
+  for (auto _ : state) {
+    std::unique_ptr<TraceBuffer> buf = CreateBuffer(state);
+    CopyChunks(buf.get(), chunk, kBufferSize, &chunk_id);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(kBufferSize));
+}
+BENCHMARK(BM_TraceBuffer_FirstPass)->Apply(AllocFlagsArgs);
+
+// The buffer wrapping over, i.e. the steady state of a ring buffer, where only
+// the TLB misses differ between the modes.
+static void BM_TraceBuffer_Wrapping(benchmark::State& state) {
+  std::vector<uint8_t> chunk(kChunkPayloadSize, 'x');
+  ChunkID chunk_id = 0;
+  std::unique_ptr<TraceBuffer> buf = CreateBuffer(state);
+  CopyChunks(buf.get(), chunk, kBufferSize, &chunk_id);
+  for (auto _ : state) {
+    CopyChunks(buf.get(), chunk, kBufferSize, &chunk_id);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(kBufferSize));
+}
+BENCHMARK(BM_TraceBuffer_Wrapping)->Apply(AllocFlagsArgs);
@@ -19,6 +19,7 @@
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "perfetto/base/pipe.h"
 #include "perfetto/base/temp_file.h"
 #include "perfetto/tracing/core/consumer.h"
 #include "perfetto/tracing/core/data_source_config.h"
@@ -388,6 +389,152 @@ TEST_F(TracingIntegrationTest, WriteIntoFile) {
   ASSERT_TRUE(saw_trace_stats);
 }
 
+TEST_F(TracingIntegrationTest, ReadBuffersIntoFile) {
+  // Start tracing.
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(4096 * 10);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("perfetto.test");
+  ds_config->set_target_buffer(0);
+  consumer_endpoint_->EnableTracing(trace_config);
+
+  BufferID global_buf_id = 0;
+  auto on_create_ds_instance =
+      task_runner_->CreateCheckpoint("on_create_ds_instance");
+  EXPECT_CALL(producer_, OnTracingSetup());
+  EXPECT_CALL(producer_, SetupDataSource(_, _));
+  EXPECT_CALL(producer_, StartDataSource(_, _))
+      .WillOnce(Invoke([on_create_ds_instance, &global_buf_id](
+                           DataSourceInstanceID, const DataSourceConfig& cfg) {
+        global_buf_id = static_cast<BufferID>(cfg.target_buffer());
+        on_create_ds_instance();
+      }));
+  task_runner_->RunUntilCheckpoint("on_create_ds_instance");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer_endpoint_->CreateTraceWriter(global_buf_id);
+  ASSERT_TRUE(writer);
+
+  const size_t kNumPackets = 10;
+  for (size_t i = 0; i < kNumPackets; i++) {
+    char buf[16];
+    sprintf(buf, "evt_%zu", i);
+    writer->NewTracePacket()->set_for_testing()->set_str(buf, strlen(buf));
+  }
+  auto on_data_committed = task_runner_->CreateCheckpoint("on_data_committed");
+  writer->Flush(on_data_committed);
+  task_runner_->RunUntilCheckpoint("on_data_committed");
+
+  // The packets are written into the file, the consumer should only be told
+  // that the read is complete.
+  base::TempFile tmp_file = base::TempFile::CreateUnlinked();
+  consumer_endpoint_->ReadBuffers(base::ScopedFile(dup(tmp_file.fd())));
+  auto all_packets_rx = task_runner_->CreateCheckpoint("all_packets_rx");
+  EXPECT_CALL(consumer_, OnTracePackets(_, false))
+      .WillOnce(Invoke([all_packets_rx](std::vector<TracePacket>* packets,
+                                        bool) {
+        EXPECT_TRUE(packets->empty());
+        all_packets_rx();
+      }));
+  task_runner_->RunUntilCheckpoint("all_packets_rx");
+
+  // Check that |tmp_file| contains a valid trace.proto message.
+  ASSERT_EQ(0, lseek(tmp_file.fd(), 0, SEEK_SET));
+  char tmp_buf[4096];
+  ssize_t rsize = read(tmp_file.fd(), tmp_buf, sizeof(tmp_buf));
+  ASSERT_GT(rsize, 0);
+  protos::Trace tmp_trace;
+  ASSERT_TRUE(tmp_trace.ParseFromArray(tmp_buf, static_cast<int>(rsize)));
+  size_t num_test_packet = 0;
+  bool saw_trace_stats = false;
+  for (int i = 0; i < tmp_trace.packet_size(); i++) {
+    const protos::TracePacket& packet = tmp_trace.packet(i);
+    if (packet.has_for_testing()) {
+      ASSERT_EQ("evt_" + std::to_string(num_test_packet++),
+                packet.for_testing().str());
+    } else if (packet.has_trace_stats()) {
+      saw_trace_stats = true;
+      CheckTraceStats(packet);
+    }
+  }
+  ASSERT_EQ(kNumPackets, num_test_packet);
+  ASSERT_TRUE(saw_trace_stats);
+
+  consumer_endpoint_->DisableTracing();
+  auto on_tracing_disabled =
+      task_runner_->CreateCheckpoint("on_tracing_disabled");
+  EXPECT_CALL(producer_, StopDataSource(_));
+  EXPECT_CALL(consumer_, OnTracingDisabled())
+      .WillOnce(Invoke(on_tracing_disabled));
+  task_runner_->RunUntilCheckpoint("on_tracing_disabled");
+}
+
+// Writing into anything but a regular file could block the service thread, so
+// the packets are sent over IPC instead, as if no file had been passed.
+TEST_F(TracingIntegrationTest, ReadBuffersIntoPipeSendsPackets) {
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(4096);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("perfetto.test");
+  ds_config->set_target_buffer(0);
+  consumer_endpoint_->EnableTracing(trace_config);
+
+  BufferID global_buf_id = 0;
+  auto on_create_ds_instance =
+      task_runner_->CreateCheckpoint("on_create_ds_instance");
+  EXPECT_CALL(producer_, OnTracingSetup());
+  EXPECT_CALL(producer_, SetupDataSource(_, _));
+  EXPECT_CALL(producer_, StartDataSource(_, _))
+      .WillOnce(Invoke([on_create_ds_instance, &global_buf_id](
+                           DataSourceInstanceID, const DataSourceConfig& cfg) {
+        global_buf_id = static_cast<BufferID>(cfg.target_buffer());
+        on_create_ds_instance();
+      }));
+  task_runner_->RunUntilCheckpoint("on_create_ds_instance");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer_endpoint_->CreateTraceWriter(global_buf_id);
+  ASSERT_TRUE(writer);
+  writer->NewTracePacket()->set_for_testing()->set_str("evt");
+  auto on_data_committed = task_runner_->CreateCheckpoint("on_data_committed");
+  writer->Flush(on_data_committed);
+  task_runner_->RunUntilCheckpoint("on_data_committed");
+
+  base::Pipe pipe = base::Pipe::Create(base::Pipe::kRdNonBlock);
+  consumer_endpoint_->ReadBuffers(std::move(pipe.wr));
+  auto all_packets_rx = task_runner_->CreateCheckpoint("all_packets_rx");
+  size_t num_test_packets = 0;
+  EXPECT_CALL(consumer_, OnTracePackets(_, _))
+      .WillRepeatedly(Invoke([&num_test_packets, all_packets_rx](
+                                 std::vector<TracePacket>* packets,
+                                 bool has_more) {
+        for (auto& packet : *packets) {
+          protos::TracePacket proto;
+          ASSERT_TRUE(packet.Decode(&proto));
+          if (proto.has_for_testing()) {
+            EXPECT_EQ("evt", proto.for_testing().str());
+            num_test_packets++;
+          }
+        }
+        if (!has_more)
+          all_packets_rx();
+      }));
+  task_runner_->RunUntilCheckpoint("all_packets_rx");
+  EXPECT_EQ(1u, num_test_packets);
+
+  // The write end of the pipe has been closed without writing anything.
+  char buf[1];
+  EXPECT_EQ(0, read(*pipe.rd, buf, sizeof(buf)));
+
+  consumer_endpoint_->DisableTracing();
+  auto on_tracing_disabled =
+      task_runner_->CreateCheckpoint("on_tracing_disabled");
+  EXPECT_CALL(producer_, StopDataSource(_));
+  EXPECT_CALL(consumer_, OnTracingDisabled())
+      .WillOnce(Invoke(on_tracing_disabled));
+  task_runner_->RunUntilCheckpoint("on_tracing_disabled");
+}
+
 // TODO(primiano): add tests to cover:
 // - unknown fields preserved end-to-end.
 // - >1 data source.
@@ -13,9 +13,15 @@
 // limitations under the License.
 
 #include <gtest/gtest.h>
+#include <unistd.h>
 #include <random>
+#include <string>
+#include <vector>
 
 #include "benchmark/benchmark.h"
+#include "perfetto/base/logging.h"
+#include "perfetto/base/scoped_file.h"
+#include "perfetto/base/temp_file.h"
 #include "perfetto/base/time.h"
 #include "perfetto/traced/traced.h"
 #include "perfetto/tracing/core/trace_config.h"
@@ -110,7 +116,9 @@ void BenchmarkProducer(benchmark::State& state) {
   }
 }
 
-static void BenchmarkConsumer(benchmark::State& state) {
+// If |read_into_file| is true, the buffers are read into a file passed to
+// ReadBuffers() rather than streamed back over the consumer socket.
+static void BenchmarkConsumer(benchmark::State& state, bool read_into_file) {
   base::TestTaskRunner task_runner;
 
   TestHelper helper(&task_runner);
@@ -154,6 +162,15 @@ static void BenchmarkConsumer(benchmark::State& state) {
       static_cast<uint64_t>(base::GetThreadCPUTimeNs().count());
   uint64_t read_time_taken_ns = 0;
 
+  base::TempFile trace_file = base::TempFile::CreateUnlinked();
+  auto read_data = [&helper, &trace_file, read_into_file](uint32_t count) {
+    if (!read_into_file)
+      return helper.ReadData(count);
+    PERFETTO_CHECK(ftruncate(trace_file.fd(), 0) == 0);
+    PERFETTO_CHECK(lseek(trace_file.fd(), 0, SEEK_SET) == 0);
+    helper.ReadDataIntoFile(base::ScopedFile(dup(trace_file.fd())), count);
+  };
+
   uint64_t iterations = 0;
   uint32_t counter = 0;
   for (auto _ : state) {
@@ -168,7 +185,7 @@ static void BenchmarkConsumer(benchmark::State& state) {
 
       // Then time how long it takes to read back the data.
       int64_t start = base::GetWallTimeNs().count();
-      helper.ReadData(counter);
+      read_data(counter);
       helper.WaitForReadData(counter++);
       read_time_taken_ns +=
           static_cast<uint64_t>(base::GetWallTimeNs().count() - start);
@@ -183,7 +200,7 @@ static void BenchmarkConsumer(benchmark::State& state) {
         task_runner.RunUntilCheckpoint(batch_cname);
 
         int64_t start = base::GetWallTimeNs().count();
-        helper.ReadData(counter);
+        read_data(counter);
         helper.WaitForReadData(counter++);
         read_time_taken_ns +=
             static_cast<uint64_t>(base::GetWallTimeNs().count() - start);
@@ -207,6 +224,72 @@ static void BenchmarkConsumer(benchmark::State& state) {
                          read_time_taken_ns);
 }
 
+// Several producers, each on a thread of its own, saturate the service at the
+// same time. state.range(0) is the number of producers and state.range(1) the
+// number of commit threads of the service.
+static void BenchmarkProducers(benchmark::State& state) {
+  base::TestTaskRunner task_runner;
+
+  TestHelper helper(&task_runner);
+  TracingService::InitOpts init_opts;
+  init_opts.num_commit_threads = static_cast<size_t>(state.range(1));
+  helper.StartServiceIfRequired(init_opts);
+
+  size_t num_producers = static_cast<size_t>(state.range(0));
+  std::vector<FakeProducer*> producers;
+  for (size_t i = 0; i < num_producers; i++)
+    producers.push_back(helper.ConnectAdditionalFakeProducer(i));
+  helper.ConnectConsumer();
+  helper.WaitForConsumerConnect();
+
+  static constexpr uint32_t kMessageBytes = 512;
+  uint32_t message_count = IsBenchmarkFunctionalOnly() ? 256 : 16 * 1024;
+
+  // All the producers register the same data source, so each of them gets an
+  // instance of it.
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(4096);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("android.perfetto.FakeProducer");
+  ds_config->set_target_buffer(0);
+  ds_config->mutable_for_testing()->set_seed(42);
+  ds_config->mutable_for_testing()->set_message_count(message_count);
+  ds_config->mutable_for_testing()->set_message_size(kMessageBytes);
+  ds_config->mutable_for_testing()->set_max_messages_per_second(0);
+
+  helper.StartTracing(trace_config);
+  for (size_t i = 0; i < num_producers; i++)
+    helper.WaitForAdditionalProducerEnabled(i);
+
+  uint64_t wall_start_ns = static_cast<uint64_t>(base::GetWallTimeNs().count());
+  uint64_t service_start_ns = helper.service_thread()->GetThreadCPUTimeNs();
+  uint32_t iterations = 0;
+  for (auto _ : state) {
+    std::vector<std::string> checkpoints;
+    for (FakeProducer* producer : producers) {
+      checkpoints.push_back("produced.and.committed." +
+                            std::to_string(checkpoints.size()) + "." +
+                            std::to_string(iterations));
+      auto on_produced_and_committed =
+          task_runner.CreateCheckpoint(checkpoints.back());
+      producer->ProduceEventBatch(helper.WrapTask(on_produced_and_committed));
+    }
+    for (const std::string& checkpoint : checkpoints)
+      task_runner.RunUntilCheckpoint(checkpoint, 30000);
+    iterations++;
+  }
+  uint64_t service_ns =
+      helper.service_thread()->GetThreadCPUTimeNs() - service_start_ns;
+  uint64_t wall_ns =
+      static_cast<uint64_t>(base::GetWallTimeNs().count()) - wall_start_ns;
+
+  // Only the CPU time of the main thread of the service, the one that serves
+  // the IPCs, is accounted here. The commit threads are not.
+  state.counters["Ser CPU"] = benchmark::Counter(100.0 * service_ns / wall_ns);
+  state.SetBytesProcessed(iterations * num_producers * kMessageBytes *
+                          message_count);
+}
+
 void SaturateCpuProducerArgs(benchmark::internal::Benchmark* b) {
   int min_message_count = 16;
   int max_message_count = IsBenchmarkFunctionalOnly() ? 1024 : 1024 * 1024;
@@ -219,6 +302,17 @@ void SaturateCpuProducerArgs(benchmark::internal::Benchmark* b) {
   }
 }
 
+void SaturateCpuProducersArgs(benchmark::internal::Benchmark* b) {
+  int max_producers = IsBenchmarkFunctionalOnly() ? 2 : 8;
+  int max_commit_threads = IsBenchmarkFunctionalOnly() ? 2 : 4;
+  for (int producers = 1; producers <= max_producers; producers *= 2) {
+    for (int threads = 0; threads <= max_commit_threads;
+         threads = threads ? threads * 2 : 1) {
+      b->Args({producers, threads});
+    }
+  }
+}
+
 void ConstantRateProducerArgs(benchmark::internal::Benchmark* b) {
   int message_count = IsBenchmarkFunctionalOnly() ? 2 * 1024 : 128 * 1024;
   int min_speed = IsBenchmarkFunctionalOnly() ? 64 : 8;
@@ -266,8 +360,17 @@ BENCHMARK(BM_EndToEnd_Producer_ConstantRate)
     ->UseRealTime()
     ->Apply(ConstantRateProducerArgs);
 
+static void BM_EndToEnd_Producers_SaturateCpu(benchmark::State& state) {
+  BenchmarkProducers(state);
+}
+
+BENCHMARK(BM_EndToEnd_Producers_SaturateCpu)
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime()
+    ->Apply(SaturateCpuProducersArgs);
+
 static void BM_EndToEnd_Consumer_SaturateCpu(benchmark::State& state) {
-  BenchmarkConsumer(state);
+  BenchmarkConsumer(state, /*read_into_file=*/false);
 }
 
 BENCHMARK(BM_EndToEnd_Consumer_SaturateCpu)
@@ -276,7 +379,7 @@ BENCHMARK(BM_EndToEnd_Consumer_SaturateCpu)
     ->Apply(SaturateCpuConsumerArgs);
 
 static void BM_EndToEnd_Consumer_ConstantRate(benchmark::State& state) {
-  BenchmarkConsumer(state);
+  BenchmarkConsumer(state, /*read_into_file=*/false);
 }
 
 BENCHMARK(BM_EndToEnd_Consumer_ConstantRate)
@@ -284,4 +387,14 @@ BENCHMARK(BM_EndToEnd_Consumer_ConstantRate)
     ->UseRealTime()
     ->Apply(ConstantRateConsumerArgs);
 
+static void BM_EndToEnd_Consumer_SaturateCpu_IntoFile(
+    benchmark::State& state) {
+  BenchmarkConsumer(state, /*read_into_file=*/true);
+}
+
+BENCHMARK(BM_EndToEnd_Consumer_SaturateCpu_IntoFile)
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime()
+    ->Apply(SaturateCpuConsumerArgs);
+
 }  // namespace perfetto
@@ -27,12 +27,16 @@ namespace perfetto {
 class ServiceDelegate : public ThreadDelegate {
  public:
   ServiceDelegate(const std::string& producer_socket,
-                  const std::string& consumer_socket)
-      : producer_socket_(producer_socket), consumer_socket_(consumer_socket) {}
+                  const std::string& consumer_socket,
+                  const TracingService::InitOpts& init_opts =
+                      TracingService::InitOpts())
+      : producer_socket_(producer_socket),
+        consumer_socket_(consumer_socket),
+        init_opts_(init_opts) {}
   ~ServiceDelegate() override = default;
 
   void Initialize(base::TaskRunner* task_runner) override {
-    svc_ = ServiceIPCHost::CreateInstance(task_runner);
+    svc_ = ServiceIPCHost::CreateInstance(task_runner, init_opts_);
     unlink(producer_socket_.c_str());
     unlink(consumer_socket_.c_str());
     svc_->Start(producer_socket_.c_str(), consumer_socket_.c_str());
@@ -41,6 +45,7 @@ class ServiceDelegate : public ThreadDelegate {
  private:
   std::string producer_socket_;
   std::string consumer_socket_;
+  TracingService::InitOpts init_opts_;
   std::unique_ptr<ServiceIPCHost> svc_;
 };
 
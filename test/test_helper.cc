@@ -17,6 +17,7 @@
 #include "test/test_helper.h"
 
 #include "gtest/gtest.h"
+#include "perfetto/base/utils.h"
 #include "perfetto/traced/traced.h"
 #include "perfetto/tracing/core/trace_packet.h"
 #include "test/task_runner_thread_delegates.h"
@@ -74,10 +75,13 @@ void TestHelper::OnTraceData(std::vector<TracePacket> packets, bool has_more) {
   }
 }
 
-void TestHelper::StartServiceIfRequired() {
+void TestHelper::StartServiceIfRequired(
+    const TracingService::InitOpts& init_opts) {
 #if PERFETTO_BUILDFLAG(PERFETTO_START_DAEMONS)
-  service_thread_.Start(std::unique_ptr<ServiceDelegate>(
-      new ServiceDelegate(TEST_PRODUCER_SOCK_NAME, TEST_CONSUMER_SOCK_NAME)));
+  service_thread_.Start(std::unique_ptr<ServiceDelegate>(new ServiceDelegate(
+      TEST_PRODUCER_SOCK_NAME, TEST_CONSUMER_SOCK_NAME, init_opts)));
+#else
+  base::ignore_result(init_opts);
 #endif
 }
 
@@ -91,6 +95,19 @@ FakeProducer* TestHelper::ConnectFakeProducer() {
   return producer_delegate_cached->producer();
 }
 
+FakeProducer* TestHelper::ConnectAdditionalFakeProducer(size_t index) {
+  std::string checkpoint = "producer.enabled." + std::to_string(index);
+  std::unique_ptr<FakeProducerDelegate> producer_delegate(
+      new FakeProducerDelegate(
+          TEST_PRODUCER_SOCK_NAME,
+          WrapTask(task_runner_->CreateCheckpoint(checkpoint))));
+  FakeProducerDelegate* producer_delegate_cached = producer_delegate.get();
+  additional_producer_threads_.emplace_back(
+      new TaskRunnerThread("perfetto.prd"));
+  additional_producer_threads_.back()->Start(std::move(producer_delegate));
+  return producer_delegate_cached->producer();
+}
+
 void TestHelper::ConnectConsumer() {
   on_connect_callback_ = task_runner_->CreateCheckpoint("consumer.connected");
   endpoint_ =
@@ -120,6 +137,12 @@ void TestHelper::ReadData(uint32_t read_count) {
   endpoint_->ReadBuffers();
 }
 
+void TestHelper::ReadDataIntoFile(base::ScopedFile fd, uint32_t read_count) {
+  on_packets_finished_callback_ = task_runner_->CreateCheckpoint(
+      "readback.complete." + std::to_string(read_count));
+  endpoint_->ReadBuffers(std::move(fd));
+}
+
 void TestHelper::WaitForConsumerConnect() {
   task_runner_->RunUntilCheckpoint("consumer.connected");
 }
@@ -128,6 +151,11 @@ void TestHelper::WaitForProducerEnabled() {
   task_runner_->RunUntilCheckpoint("producer.enabled");
 }
 
+void TestHelper::WaitForAdditionalProducerEnabled(size_t index) {
+  task_runner_->RunUntilCheckpoint("producer.enabled." +
+                                   std::to_string(index));
+}
+
 void TestHelper::WaitForTracingDisabled(uint32_t timeout_ms) {
   task_runner_->RunUntilCheckpoint("stop.tracing", timeout_ms);
 }
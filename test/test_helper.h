@@ -17,9 +17,11 @@
 #ifndef TEST_TEST_HELPER_H_
 #define TEST_TEST_HELPER_H_
 
+#include "perfetto/base/scoped_file.h"
 #include "perfetto/tracing/core/consumer.h"
 #include "perfetto/tracing/core/trace_config.h"
 #include "perfetto/tracing/core/trace_packet.h"
+#include "perfetto/tracing/core/tracing_service.h"
 #include "perfetto/tracing/ipc/consumer_ipc_client.h"
 #include "src/base/test/test_task_runner.h"
 #include "test/fake_producer.h"
@@ -39,16 +41,23 @@ class TestHelper : public Consumer {
   void OnTracingDisabled() override;
   void OnTraceData(std::vector<TracePacket> packets, bool has_more) override;
 
-  void StartServiceIfRequired();
+  void StartServiceIfRequired(
+      const TracingService::InitOpts& = TracingService::InitOpts());
   FakeProducer* ConnectFakeProducer();
+
+  // Connects one more FakeProducer, on a thread of its own. Unlike the one
+  // above, its checkpoint is "producer.enabled.<index>".
+  FakeProducer* ConnectAdditionalFakeProducer(size_t index);
   void ConnectConsumer();
   void StartTracing(const TraceConfig& config);
   void DisableTracing();
   void FlushAndWait(uint32_t timeout_ms);
   void ReadData(uint32_t read_count = 0);
+  void ReadDataIntoFile(base::ScopedFile, uint32_t read_count = 0);
 
   void WaitForConsumerConnect();
   void WaitForProducerEnabled();
+  void WaitForAdditionalProducerEnabled(size_t index);
   void WaitForTracingDisabled(uint32_t timeout_ms = 5000);
   void WaitForReadData(uint32_t read_count = 0);
 
@@ -69,6 +78,7 @@ class TestHelper : public Consumer {
 
   TaskRunnerThread service_thread_;
   TaskRunnerThread producer_thread_;
+  std::vector<std::unique_ptr<TaskRunnerThread>> additional_producer_threads_;
   std::unique_ptr<TracingService::ConsumerEndpoint> endpoint_;  // Keep last.
 };
 
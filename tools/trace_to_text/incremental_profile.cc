@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tools/trace_to_text/incremental_profile.h"
+
+#include <inttypes.h>
+
+#include "perfetto/base/logging.h"
+
+namespace perfetto {
+namespace trace_to_text {
+
+using ::perfetto::protos::ProfilePacket;
+
+ProfilePacket ReconstructIncrementalDump(const ProfilePacket& packet,
+                                         IncrementalSequence* sequence) {
+  if (packet.incremental_index() != sequence->next_index) {
+    PERFETTO_ELOG("Missing incremental dumps %" PRIu64 " to %" PRIu64
+                  " of sequence %" PRIu64 ". The profiles will be incomplete.",
+                  sequence->next_index,
+                  static_cast<uint64_t>(packet.incremental_index()) - 1,
+                  static_cast<uint64_t>(packet.incremental_sequence_id()));
+  }
+  sequence->next_index = packet.incremental_index() + 1;
+
+  ProfilePacket& interned = sequence->interned;
+  for (const ProfilePacket::InternedString& interned_string : packet.strings())
+    *interned.add_strings() = interned_string;
+  for (const ProfilePacket::Mapping& mapping : packet.mappings())
+    *interned.add_mappings() = mapping;
+  for (const ProfilePacket::Frame& frame : packet.frames())
+    *interned.add_frames() = frame;
+  for (const ProfilePacket::Callstack& callstack : packet.callstacks())
+    *interned.add_callstacks() = callstack;
+
+  ProfilePacket full_packet = interned;
+  for (const ProfilePacket::ProcessHeapSamples& samples :
+       packet.process_dumps()) {
+    auto& process_samples = sequence->samples[samples.pid()];
+    if (!samples.incremental())
+      process_samples.clear();
+    for (const ProfilePacket::HeapSample& sample : samples.samples())
+      process_samples[sample.callstack_id()] = sample;
+
+    ProfilePacket::ProcessHeapSamples* full_samples =
+        full_packet.add_process_dumps();
+    full_samples->set_pid(samples.pid());
+    for (const auto& callstack_and_sample : process_samples)
+      *full_samples->add_samples() = callstack_and_sample.second;
+  }
+  return full_packet;
+}
+
+}  // namespace trace_to_text
+}  // namespace perfetto
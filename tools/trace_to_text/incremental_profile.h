@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TOOLS_TRACE_TO_TEXT_INCREMENTAL_PROFILE_H_
+#define TOOLS_TRACE_TO_TEXT_INCREMENTAL_PROFILE_H_
+
+#include <stdint.h>
+
+#include <map>
+
+#include "perfetto/trace/profiling/profile_packet.pb.h"
+
+namespace perfetto {
+namespace trace_to_text {
+
+// The packets of a sequence of incremental dumps so far. See
+// ProfilePacket.incremental_sequence_id.
+struct IncrementalSequence {
+  uint64_t next_index = 0;
+  // The strings, mappings, frames and callstacks of all the packets.
+  protos::ProfilePacket interned;
+  // pid -> callstack id -> latest sample.
+  std::map<uint64_t, std::map<uint64_t, protos::ProfilePacket::HeapSample>>
+      samples;
+};
+
+// Returns the packet with all the interned data and samples of the dump,
+// as if it were not incremental. |packet| is the next one of |sequence|.
+protos::ProfilePacket ReconstructIncrementalDump(
+    const protos::ProfilePacket& packet,
+    IncrementalSequence* sequence);
+
+}  // namespace trace_to_text
+}  // namespace perfetto
+
+#endif  // TOOLS_TRACE_TO_TEXT_INCREMENTAL_PROFILE_H_
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tools/trace_to_text/incremental_profile.h"
+
+#include "gtest/gtest.h"
+
+namespace perfetto {
+namespace trace_to_text {
+namespace {
+
+using ::perfetto::protos::ProfilePacket;
+
+void AddSample(ProfilePacket::ProcessHeapSamples* samples,
+               uint64_t callstack_id,
+               uint64_t allocated) {
+  ProfilePacket::HeapSample* sample = samples->add_samples();
+  sample->set_callstack_id(callstack_id);
+  sample->set_cumulative_allocated(allocated);
+}
+
+// callstack id -> cumulative_allocated of the samples of |pid| in |packet|.
+std::map<uint64_t, uint64_t> GetSamples(const ProfilePacket& packet,
+                                        uint64_t pid) {
+  std::map<uint64_t, uint64_t> result;
+  for (const ProfilePacket::ProcessHeapSamples& samples :
+       packet.process_dumps()) {
+    if (samples.pid() != pid)
+      continue;
+    for (const ProfilePacket::HeapSample& sample : samples.samples())
+      result[sample.callstack_id()] = sample.cumulative_allocated();
+  }
+  return result;
+}
+
+TEST(IncrementalProfileTest, ReconstructIncrementalDump) {
+  IncrementalSequence sequence;
+
+  ProfilePacket first;
+  first.set_incremental_sequence_id(1);
+  first.set_incremental_index(0);
+  ProfilePacket::InternedString* str = first.add_strings();
+  str->set_id(1);
+  str->set_str("malloc");
+  first.add_callstacks()->set_id(1);
+  first.add_callstacks()->set_id(2);
+  ProfilePacket::ProcessHeapSamples* samples = first.add_process_dumps();
+  samples->set_pid(10);
+  AddSample(samples, 1, 10);
+  AddSample(samples, 2, 20);
+
+  ProfilePacket full = ReconstructIncrementalDump(first, &sequence);
+  EXPECT_EQ(full.strings_size(), 1);
+  EXPECT_EQ(full.callstacks_size(), 2);
+  EXPECT_EQ(GetSamples(full, 10),
+            (std::map<uint64_t, uint64_t>{{1, 10}, {2, 20}}));
+
+  // Only the changed callstacks of pid 10, and a new process.
+  ProfilePacket second;
+  second.set_incremental_sequence_id(1);
+  second.set_incremental_index(1);
+  second.add_callstacks()->set_id(3);
+  samples = second.add_process_dumps();
+  samples->set_pid(10);
+  samples->set_incremental(true);
+  AddSample(samples, 2, 25);
+  AddSample(samples, 3, 5);
+  samples = second.add_process_dumps();
+  samples->set_pid(11);
+  AddSample(samples, 1, 7);
+
+  full = ReconstructIncrementalDump(second, &sequence);
+  EXPECT_EQ(full.strings_size(), 1);
+  EXPECT_EQ(full.strings(0).str(), "malloc");
+  EXPECT_EQ(full.callstacks_size(), 3);
+  EXPECT_EQ(GetSamples(full, 10),
+            (std::map<uint64_t, uint64_t>{{1, 10}, {2, 25}, {3, 5}}));
+  EXPECT_EQ(GetSamples(full, 11), (std::map<uint64_t, uint64_t>{{1, 7}}));
+
+  // A full dump of pid 10 replaces its previous samples.
+  ProfilePacket third;
+  third.set_incremental_sequence_id(1);
+  third.set_incremental_index(2);
+  samples = third.add_process_dumps();
+  samples->set_pid(10);
+  AddSample(samples, 3, 6);
+
+  full = ReconstructIncrementalDump(third, &sequence);
+  EXPECT_EQ(full.callstacks_size(), 3);
+  EXPECT_EQ(GetSamples(full, 10), (std::map<uint64_t, uint64_t>{{3, 6}}));
+  EXPECT_EQ(sequence.next_index, 3u);
+}
+
+}  // namespace
+}  // namespace trace_to_text
+}  // namespace perfetto
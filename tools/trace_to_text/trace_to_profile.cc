@@ -23,6 +23,7 @@
 #include <set>
 #include <vector>
 
+#include "tools/trace_to_text/incremental_profile.h"
 #include "tools/trace_to_text/utils.h"
 
 #include "perfetto/base/file_utils.h"
@@ -178,13 +179,23 @@ void DumpProfilePacket(const ProfilePacket& packet,
 int TraceToProfile(std::istream* input, std::ostream* output) {
   std::string temp_dir = GetTemp() + "/heap_profile-XXXXXXX";
   size_t itr = 0;
+  std::map<uint64_t, IncrementalSequence> incremental_sequences;
   PERFETTO_CHECK(mkdtemp(&temp_dir[0]));
-  ForEachPacketInTrace(input, [&temp_dir,
-                               &itr](const protos::TracePacket& packet) {
+  ForEachPacketInTrace(input, [&temp_dir, &itr, &incremental_sequences](
+                                  const protos::TracePacket& packet) {
     if (!packet.has_profile_packet())
       return;
-    DumpProfilePacket(packet.profile_packet(),
-                      temp_dir + "/heap_dump." + std::to_string(++itr) + ".");
+    const ProfilePacket& profile_packet = packet.profile_packet();
+    std::string file_prefix =
+        temp_dir + "/heap_dump." + std::to_string(++itr) + ".";
+    if (!profile_packet.has_incremental_sequence_id()) {
+      DumpProfilePacket(profile_packet, file_prefix);
+      return;
+    }
+    IncrementalSequence* sequence =
+        &incremental_sequences[profile_packet.incremental_sequence_id()];
+    DumpProfilePacket(ReconstructIncrementalDump(profile_packet, sequence),
+                      file_prefix);
   });
 
   *output << "Wrote profiles to " << temp_dir << std::endl;